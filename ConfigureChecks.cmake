@@ -17,6 +17,8 @@ include(CheckLibraryExists)
 # Currently only looks for headers that set a define that is actually use.
 check_include_files(arpa/inet.h HAVE_ARPA_INET_H)
 check_include_files(arpa/nameser_compat.h HAVE_ARPA_NAMESER_COMPAT_H)
+check_include_files(linux/io_uring.h HAVE_LINUX_IO_URING_H)
+check_include_files(linux/tls.h HAVE_LINUX_TLS_H)
 check_include_files(netinet/in.h HAVE_NETINET_IN_H)
 check_include_files(netinet/in_systm.h HAVE_NETINET_IN_SYSTM_H)
 
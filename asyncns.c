@@ -29,11 +29,13 @@
 #include <signal.h>
 #include <unistd.h>
 #include <sys/select.h>
+#include <time.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <netinet/in.h>
@@ -57,10 +59,26 @@
 
 #include "asyncns.h"
 
-#define MAX_WORKERS 16
-#define MAX_QUERIES 256
 #define BUFSIZE (10240)
 
+/* Query ids carry their slot in the query table in the low bits */
+#define QUERY_SLOT_BITS 20
+#define MAX_QUERIES (1U << QUERY_SLOT_BITS)
+#define QUERY_SLOT_MASK (MAX_QUERIES - 1)
+#define INITIAL_QUERIES 256
+
+/* Requests in flight per worker, the rest wait in the backlog */
+#define REQUESTS_PER_WORKER 2
+
+/* A worker idle for this long offers to retire */
+#define WORKER_IDLE_SEC 10
+
+/* Size of one result slot in the shared arena */
+#define ARENA_SLOT_SIZE 2048
+
+/* Marks the first node of a result list that lives in the arena */
+#define AI_ARENA 0x40000000
+
 typedef enum {
     REQUEST_ADDRINFO,
     RESPONSE_ADDRINFO,
@@ -70,7 +88,9 @@ typedef enum {
     REQUEST_RES_SEARCH,
     RESPONSE_RES,
     REQUEST_TERMINATE,
-    RESPONSE_DIED
+    RESPONSE_DIED,
+    RESPONSE_IDLE,
+    RESPONSE_RETIRED
 } query_type_t;
 
 enum {
@@ -81,23 +101,71 @@ enum {
     MESSAGE_FD_MAX = 4
 };
 
-struct asyncns {
-    int fds[4];
+typedef struct rheader {
+    query_type_t type;
+    unsigned id;
+    size_t length;
+} rheader_t;
+
+/* Results can be passed in memory shared with the workers instead of
+ * over the socket. The arena is mapped before any worker starts, so it
+ * is at the same address in forked workers, and a worker builds the
+ * addrinfo list in place. The parent hands that list out as it is, and
+ * asyncns_freeaddrinfo() puts the slot back. */
+typedef struct asyncns_arena {
+    volatile int n_held; /* Slots in use plus one for the session */
+    volatile int orphaned;
+    size_t size;
+    unsigned n_slots;
+} asyncns_arena_t;
+
+enum {
+    SLOT_FREE = 0,
+    SLOT_REQUEST,
+    SLOT_RESULT
+};
+
+typedef struct arena_slot {
+    asyncns_arena_t *arena;
+    volatile int state;
+    unsigned index;
+    /* Followed by the addrinfo list up to ARENA_SLOT_SIZE */
+} arena_slot_t;
+
+#define ARENA_HEADER_SIZE ((sizeof(asyncns_arena_t) + 15) & ~(size_t) 15)
+#define ARENA_DATA_OFFSET ((sizeof(arena_slot_t) + 15) & ~(size_t) 15)
 
+typedef struct asyncns_worker {
 #ifndef HAVE_PTHREAD
-    pid_t workers[MAX_WORKERS];
+    pid_t pid;
 #else
-    pthread_t workers[MAX_WORKERS];
+    pthread_t thread;
 #endif
-    unsigned valid_workers;
+    int running;
+} asyncns_worker_t;
+
+struct asyncns {
+    int fds[4];
+
+    asyncns_worker_t *workers;
+    unsigned min_workers, max_workers;
+    unsigned valid_workers, retiring_workers;
 
-    unsigned current_id, current_index;
-    asyncns_query_t* queries[MAX_QUERIES];
+    unsigned current_id;
+    asyncns_query_t **queries;
+    unsigned n_slots;
+    unsigned *free_slots;
+    unsigned n_free;
 
     asyncns_query_t *done_head, *done_tail;
+    asyncns_query_t *backlog_head, *backlog_tail;
 
     int n_queries;
+    int n_sent, n_backlog;
     int dead;
+
+    asyncns_arena_t *arena;
+    unsigned arena_cursor;
 };
 
 struct asyncns_query {
@@ -106,6 +174,9 @@ struct asyncns_query {
     unsigned id;
     query_type_t type;
     asyncns_query_t *done_next, *done_prev;
+    asyncns_query_t *backlog_next, *backlog_prev;
+    rheader_t *request;
+    int arena_slot;
     int ret;
     int _errno;
     int _h_errno;
@@ -114,12 +185,6 @@ struct asyncns_query {
     void *userdata;
 };
 
-typedef struct rheader {
-    query_type_t type;
-    unsigned id;
-    size_t length;
-} rheader_t;
-
 typedef struct addrinfo_request {
     struct rheader header;
     int hints_is_null;
@@ -128,6 +193,7 @@ typedef struct addrinfo_request {
     int ai_socktype;
     int ai_protocol;
     size_t node_len, service_len;
+    int arena_slot;
 } addrinfo_request_t;
 
 typedef struct addrinfo_response {
@@ -135,6 +201,8 @@ typedef struct addrinfo_response {
     int ret;
     int _errno;
     int _h_errno;
+    int arena_slot;
+    int in_arena;
     /* followed by addrinfo_serialization[] */
 } addrinfo_response_t;
 
@@ -378,18 +446,52 @@ static int fd_cloexec(int fd) {
     return fcntl(fd, F_SETFD, v | FD_CLOEXEC);
 }
 
-static int send_died(int out_fd) {
+static int send_status(int out_fd, query_type_t type, unsigned index) {
     rheader_t rh;
     assert(out_fd > 0);
 
     memset(&rh, 0, sizeof(rh));
-    rh.type = RESPONSE_DIED;
-    rh.id = 0;
+    rh.type = type;
+    rh.id = index;
     rh.length = sizeof(rh);
 
     return send(out_fd, &rh, rh.length, 0);
 }
 
+static int send_died(int out_fd) {
+    return send_status(out_fd, RESPONSE_DIED, 0);
+}
+
+/* Waits for the next request. Returns 0 on a timeout, sending
+ * RESPONSE_IDLE once when the worker has been idle for long enough. */
+static int wait_request(int in_fd, int out_fd, unsigned index, int timeout_usec, time_t *last_request, int *idle_sent) {
+    fd_set fds;
+    struct timeval tv;
+    int r;
+
+    tv.tv_sec = timeout_usec / 1000000;
+    tv.tv_usec = timeout_usec % 1000000;
+
+    FD_ZERO(&fds);
+    FD_SET(in_fd, &fds);
+
+    if ((r = select(in_fd+1, &fds, NULL, NULL, &tv)) < 0)
+        return errno == EINTR ? 0 : -1;
+
+    if (r > 0) {
+        *last_request = time(NULL);
+        *idle_sent = 0;
+        return 1;
+    }
+
+    if (!*idle_sent && time(NULL) - *last_request >= WORKER_IDLE_SEC) {
+        send_status(out_fd, RESPONSE_IDLE, index);
+        *idle_sent = 1;
+    }
+
+    return 0;
+}
+
 static void *serialize_addrinfo(void *p, const struct addrinfo *ai, size_t *length, size_t maxlength) {
     addrinfo_serialization_t s;
     size_t cnl, l;
@@ -421,7 +523,109 @@ static void *serialize_addrinfo(void *p, const struct addrinfo *ai, size_t *leng
     return (uint8_t*) p + l;
 }
 
-static int send_addrinfo_reply(int out_fd, unsigned id, int ret, struct addrinfo *ai, int _errno, int _h_errno) {
+static asyncns_arena_t *arena_new(unsigned n_slots) {
+    asyncns_arena_t *arena;
+    size_t size;
+    unsigned i;
+
+    size = ARENA_HEADER_SIZE + (size_t) n_slots * ARENA_SLOT_SIZE;
+
+    if ((arena = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+        return NULL;
+
+    arena->n_held = 1;
+    arena->size = size;
+    arena->n_slots = n_slots;
+
+    for (i = 0; i < n_slots; i++) {
+        arena_slot_t *slot = (arena_slot_t*) ((uint8_t*) arena + ARENA_HEADER_SIZE + (size_t) i * ARENA_SLOT_SIZE);
+
+        slot->arena = arena;
+        slot->index = i;
+    }
+
+    return arena;
+}
+
+static arena_slot_t *arena_get_slot(asyncns_arena_t *arena, int i) {
+    assert(arena);
+    assert(i >= 0 && (unsigned) i < arena->n_slots);
+
+    return (arena_slot_t*) ((uint8_t*) arena + ARENA_HEADER_SIZE + (size_t) i * ARENA_SLOT_SIZE);
+}
+
+static void arena_unref(asyncns_arena_t *arena) {
+    if (__sync_sub_and_fetch(&arena->n_held, 1) == 0)
+        munmap(arena, arena->size);
+}
+
+/* May be called from any thread, through asyncns_freeaddrinfo() */
+static void arena_release(arena_slot_t *slot) {
+    __sync_lock_release(&slot->state);
+    arena_unref(slot->arena);
+}
+
+static int arena_acquire(asyncns_t *asyncns) {
+    unsigned n;
+
+    if (!asyncns->arena)
+        return -1;
+
+    for (n = 0; n < asyncns->arena->n_slots; n++) {
+        unsigned i = asyncns->arena_cursor++ % asyncns->arena->n_slots;
+        arena_slot_t *slot = arena_get_slot(asyncns->arena, i);
+
+        if (slot->state == SLOT_FREE &&
+            __sync_bool_compare_and_swap(&slot->state, SLOT_FREE, SLOT_REQUEST)) {
+            __sync_add_and_fetch(&asyncns->arena->n_held, 1);
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Builds the result list in the slot, fails if it doesn't fit */
+static int arena_store_addrinfo(arena_slot_t *slot, const struct addrinfo *ai) {
+    uint8_t *p = (uint8_t*) slot + ARENA_DATA_OFFSET;
+    uint8_t *end = (uint8_t*) slot + ARENA_SLOT_SIZE;
+    struct addrinfo *prev = NULL;
+    const struct addrinfo *k;
+
+    for (k = ai; k; k = k->ai_next) {
+        struct addrinfo *n = (struct addrinfo*) p;
+        size_t cnl, l;
+
+        cnl = (k->ai_canonname ? strlen(k->ai_canonname)+1 : 0);
+        l = (sizeof(struct addrinfo) + k->ai_addrlen + cnl + 15) & ~(size_t) 15;
+
+        if (p + l > end)
+            return -1;
+
+        *n = *k;
+        n->ai_addr = (struct sockaddr*) (p + sizeof(struct addrinfo));
+        memcpy(n->ai_addr, k->ai_addr, k->ai_addrlen);
+        n->ai_canonname = NULL;
+        n->ai_next = NULL;
+
+        if (k->ai_canonname) {
+            n->ai_canonname = (char*) p + sizeof(struct addrinfo) + k->ai_addrlen;
+            strcpy(n->ai_canonname, k->ai_canonname);
+        }
+
+        if (prev)
+            prev->ai_next = n;
+        else
+            n->ai_flags |= AI_ARENA;
+
+        prev = n;
+        p += l;
+    }
+
+    return prev ? 0 : -1;
+}
+
+static int send_addrinfo_reply(int out_fd, unsigned id, int ret, struct addrinfo *ai, int _errno, int _h_errno, asyncns_arena_t *arena, int arena_slot) {
     addrinfo_response_t data[BUFSIZE/sizeof(addrinfo_response_t) + 1];
     addrinfo_response_t *resp = data;
     assert(out_fd >= 0);
@@ -433,6 +637,25 @@ static int send_addrinfo_reply(int out_fd, unsigned id, int ret, struct addrinfo
     resp->ret = ret;
     resp->_errno = _errno;
     resp->_h_errno = _h_errno;
+    resp->arena_slot = arena_slot;
+
+    if (arena && arena_slot >= 0) {
+        arena_slot_t *slot = arena_get_slot(arena, arena_slot);
+
+#ifdef HAVE_PTHREAD
+        /* The session is gone, nobody will read the answer */
+        if (arena->orphaned) {
+            arena_release(slot);
+            arena_slot = resp->arena_slot = -1;
+        }
+#endif
+
+        if (arena_slot >= 0 && ret == 0 && ai && arena_store_addrinfo(slot, ai) == 0) {
+            resp->in_arena = 1;
+            freeaddrinfo(ai);
+            ai = NULL;
+        }
+    }
 
     if (ret == 0 && ai) {
         void *p = data + 1;
@@ -450,7 +673,16 @@ static int send_addrinfo_reply(int out_fd, unsigned id, int ret, struct addrinfo
     if (ai)
         freeaddrinfo(ai);
 
-    return send(out_fd, resp, resp->header.length, 0);
+    if (send(out_fd, resp, resp->header.length, 0) < 0) {
+#ifdef HAVE_PTHREAD
+        /* The session closed the socket, the answer won't be read */
+        if (arena && arena_slot >= 0)
+            arena_release(arena_get_slot(arena, arena_slot));
+#endif
+        return -1;
+    }
+
+    return 0;
 }
 
 static int send_nameinfo_reply(int out_fd, unsigned id, int ret, const char *host, const char *serv, int _errno, int _h_errno) {
@@ -506,7 +738,7 @@ static int send_res_reply(int out_fd, unsigned id, const unsigned char *answer,
     return send(out_fd, resp, resp->header.length, 0);
 }
 
-static int handle_request(int out_fd, const rheader_t *req, size_t length) {
+static int handle_request(int out_fd, const rheader_t *req, size_t length, asyncns_arena_t *arena) {
     assert(out_fd >= 0);
     assert(req);
     assert(length >= sizeof(rheader_t));
@@ -536,7 +768,7 @@ static int handle_request(int out_fd, const rheader_t *req, size_t length) {
                               &result);
 
             /* send_addrinfo_reply() frees result */
-            return send_addrinfo_reply(out_fd, req->id, ret, result, errno, h_errno);
+            return send_addrinfo_reply(out_fd, req->id, ret, result, errno, h_errno, arena, ai_req->arena_slot);
         }
 
         case REQUEST_NAMEINFO: {
@@ -594,10 +826,13 @@ static int handle_request(int out_fd, const rheader_t *req, size_t length) {
 
 #ifndef HAVE_PTHREAD
 
-static int process_worker(int in_fd, int out_fd) {
+static int process_worker(int in_fd, int out_fd, unsigned index, asyncns_arena_t *arena) {
     int have_death_sig = 0;
     int good_fds[3];
     int ret = 1;
+    int retired = 0;
+    time_t last_request = time(NULL);
+    int idle_sent = 0;
 
     const int ignore_sigs[] = {
         SIGINT,
@@ -660,26 +895,22 @@ static int process_worker(int in_fd, int out_fd) {
         have_death_sig = 1;
 #endif
 
-    if (!have_death_sig)
-        fd_nonblock(in_fd);
+    /* Other workers may pick up a request we were woken for */
+    fd_nonblock(in_fd);
 
     while (getppid() > 1) { /* if the parent PID is 1 our parent process died. */
         rheader_t buf[BUFSIZE/sizeof(rheader_t) + 1];
         ssize_t length;
+        int r;
 
-        if (!have_death_sig) {
-            fd_set fds;
-            struct timeval tv = { 0, 500000 };
-
-            FD_ZERO(&fds);
-            FD_SET(in_fd, &fds);
+        if ((r = wait_request(in_fd, out_fd, index, have_death_sig ? WORKER_IDLE_SEC * 1000000 : 500000, &last_request, &idle_sent)) < 0)
+            break;
 
-            if (select(in_fd+1, &fds, NULL, NULL, &tv) < 0)
-                break;
+        if (getppid() == 1)
+            break;
 
-            if (getppid() == 1)
-                break;
-        }
+        if (r == 0)
+            continue;
 
         if ((length = recv(in_fd, buf, sizeof(buf), 0)) <= 0) {
 
@@ -689,7 +920,12 @@ static int process_worker(int in_fd, int out_fd) {
             break;
         }
 
-        if (handle_request(out_fd, buf, (size_t) length) < 0)
+        if (buf->type == REQUEST_TERMINATE) {
+            retired = 1;
+            break;
+        }
+
+        if (handle_request(out_fd, buf, (size_t) length, arena) < 0)
             break;
     }
 
@@ -697,20 +933,36 @@ static int process_worker(int in_fd, int out_fd) {
 
 fail:
 
-    send_died(out_fd);
+    if (retired)
+        send_status(out_fd, RESPONSE_RETIRED, index);
+    else
+        send_died(out_fd);
 
     return ret;
 }
 
 #else
 
+typedef struct thread_args {
+    int fds[MESSAGE_FD_MAX];
+    unsigned index;
+    asyncns_arena_t *arena;
+} thread_args_t;
+
 static void* thread_worker(void *p) {
     sigset_t fullset;
-    int *fds = p;
+    thread_args_t *args = p;
     int in_fd, out_fd;
-
-    in_fd = fds[REQUEST_RECV_FD];
-    out_fd = fds[RESPONSE_SEND_FD];
+    unsigned index;
+    asyncns_arena_t *arena;
+    int retired = 0;
+    time_t last_request = time(NULL);
+    int idle_sent = 0;
+
+    in_fd = args->fds[REQUEST_RECV_FD];
+    out_fd = args->fds[RESPONSE_SEND_FD];
+    index = args->index;
+    arena = args->arena;
     free(p);
 
     /* No signals in this thread please */
@@ -720,41 +972,151 @@ static void* thread_worker(void *p) {
     for (;;) {
         rheader_t buf[BUFSIZE/sizeof(rheader_t) + 1];
         ssize_t length;
+        int r;
 
-        if ((length = recv(in_fd, buf, sizeof(buf), 0)) <= 0)
+        if ((r = wait_request(in_fd, out_fd, index, WORKER_IDLE_SEC * 1000000, &last_request, &idle_sent)) < 0)
             break;
 
-        if (handle_request(out_fd, buf, (size_t) length) < 0)
+        if (r == 0)
+            continue;
+
+        /* The request may have been taken by another worker */
+        if ((length = recv(in_fd, buf, sizeof(buf), MSG_DONTWAIT)) <= 0) {
+
+            if (length < 0 && errno == EAGAIN)
+                continue;
+
+            break;
+        }
+
+        if (buf->type == REQUEST_TERMINATE) {
+            retired = 1;
+            break;
+        }
+
+        if (handle_request(out_fd, buf, (size_t) length, arena) < 0)
             break;
     }
 
-    send_died(out_fd);
+    if (retired)
+        send_status(out_fd, RESPONSE_RETIRED, index);
+    else
+        send_died(out_fd);
 
     return NULL;
 }
 
 #endif
 
+static int start_worker(asyncns_t *asyncns) {
+    unsigned i;
+
+    assert(asyncns);
+    assert(asyncns->valid_workers < asyncns->max_workers);
+
+    for (i = 0; i < asyncns->max_workers; i++)
+        if (!asyncns->workers[i].running)
+            break;
+
+    assert(i < asyncns->max_workers);
+
+#ifndef HAVE_PTHREAD
+    if ((asyncns->workers[i].pid = fork()) < 0)
+        return -1;
+    else if (asyncns->workers[i].pid == 0) {
+        int ret;
+
+        close(asyncns->fds[REQUEST_SEND_FD]);
+        close(asyncns->fds[RESPONSE_RECV_FD]);
+        ret = process_worker(asyncns->fds[REQUEST_RECV_FD], asyncns->fds[RESPONSE_SEND_FD], i, asyncns->arena);
+        close(asyncns->fds[REQUEST_RECV_FD]);
+        close(asyncns->fds[RESPONSE_SEND_FD]);
+        _exit(ret);
+    }
+#else
+    {
+        thread_args_t *args;
+        int r;
+
+        /* We need to copy this array because otherwise we might have
+         * a small chance of a race where the thread accesses fds when
+         * *asyncns is already dead */
+
+        if (!(args = malloc(sizeof(thread_args_t)))) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        memcpy(args->fds, asyncns->fds, sizeof(asyncns->fds));
+        args->index = i;
+        args->arena = asyncns->arena;
+
+        if ((r = pthread_create(&asyncns->workers[i].thread, NULL, thread_worker, args)) != 0) {
+            free(args);
+            errno = r;
+            return -1;
+        }
+    }
+#endif
+
+    asyncns->workers[i].running = 1;
+    asyncns->valid_workers++;
+
+    return 0;
+}
+
+static void reap_worker(asyncns_t *asyncns, unsigned i) {
+    assert(asyncns);
+
+    if (i >= asyncns->max_workers || !asyncns->workers[i].running)
+        return;
+
+#ifndef HAVE_PTHREAD
+    waitpid(asyncns->workers[i].pid, NULL, 0);
+#else
+    pthread_join(asyncns->workers[i].thread, NULL);
+#endif
+
+    asyncns->workers[i].running = 0;
+    asyncns->valid_workers--;
+
+    if (asyncns->retiring_workers > 0)
+        asyncns->retiring_workers--;
+}
+
 asyncns_t* asyncns_new(unsigned n_proc) {
+    return asyncns_new_scaling(n_proc, n_proc);
+}
+
+asyncns_t* asyncns_new_scaling(unsigned min_workers, unsigned max_workers) {
+    return asyncns_new_with_arena(min_workers, max_workers, 0);
+}
+
+asyncns_t* asyncns_new_with_arena(unsigned min_workers, unsigned max_workers, unsigned arena_slots) {
     asyncns_t *asyncns = NULL;
     int i;
-    assert(n_proc >= 1);
+    assert(min_workers >= 1);
 
-    if (n_proc > MAX_WORKERS)
-        n_proc = MAX_WORKERS;
+    if (max_workers < min_workers)
+        max_workers = min_workers;
 
     if (!(asyncns = malloc(sizeof(asyncns_t)))) {
         errno = ENOMEM;
         goto fail;
     }
 
-    asyncns->dead = 0;
-    asyncns->valid_workers = 0;
+    memset(asyncns, 0, sizeof(asyncns_t));
+
+    asyncns->min_workers = min_workers;
+    asyncns->max_workers = max_workers;
 
     for (i = 0; i < MESSAGE_FD_MAX; i++)
         asyncns->fds[i] = -1;
 
-    memset(asyncns->queries, 0, sizeof(asyncns->queries));
+    if (!(asyncns->workers = calloc(max_workers, sizeof(asyncns_worker_t)))) {
+        errno = ENOMEM;
+        goto fail;
+    }
 
     if (socketpair(PF_UNIX, SOCK_DGRAM, 0, asyncns->fds) < 0 ||
         socketpair(PF_UNIX, SOCK_DGRAM, 0, asyncns->fds+2) < 0)
@@ -763,54 +1125,22 @@ asyncns_t* asyncns_new(unsigned n_proc) {
     for (i = 0; i < MESSAGE_FD_MAX; i++)
         fd_cloexec(asyncns->fds[i]);
 
-    for (asyncns->valid_workers = 0; asyncns->valid_workers < n_proc; asyncns->valid_workers++) {
-
-#ifndef HAVE_PTHREAD
-        if ((asyncns->workers[asyncns->valid_workers] = fork()) < 0)
-            goto fail;
-        else if (asyncns->workers[asyncns->valid_workers] == 0) {
-            int ret;
-
-            close(asyncns->fds[REQUEST_SEND_FD]);
-            close(asyncns->fds[RESPONSE_RECV_FD]);
-            ret = process_worker(asyncns->fds[REQUEST_RECV_FD], asyncns->fds[RESPONSE_SEND_FD]);
-            close(asyncns->fds[REQUEST_RECV_FD]);
-            close(asyncns->fds[RESPONSE_SEND_FD]);
-            _exit(ret);
-        }
-#else
-
-        int *fds, r;
-
-        /* We need to copy this array because otherwise we might have
-         * a small chance of a race where the thread accesses fds when
-         * *asyncns is already dead */
+    if (arena_slots > 0 && !(asyncns->arena = arena_new(arena_slots)))
+        goto fail;
 
-        if (!(fds = malloc(sizeof(asyncns->fds)))) {
-            errno = ENOMEM;
+    while (asyncns->valid_workers < min_workers)
+        if (start_worker(asyncns) < 0)
             goto fail;
-        }
-
-        memcpy(fds, asyncns->fds, sizeof(asyncns->fds));
-
-        if ((r = pthread_create(&asyncns->workers[asyncns->valid_workers], NULL, thread_worker, fds)) != 0) {
-            free(fds);
-            errno = r;
-            goto fail;
-        }
-#endif
-    }
 
 #ifndef HAVE_PTHREAD
-    close(asyncns->fds[REQUEST_RECV_FD]);
-    close(asyncns->fds[RESPONSE_SEND_FD]);
-    asyncns->fds[REQUEST_RECV_FD] = asyncns->fds[RESPONSE_SEND_FD] = -1;
+    /* Workers forked later need the other ends too */
+    if (min_workers == max_workers) {
+        close(asyncns->fds[REQUEST_RECV_FD]);
+        close(asyncns->fds[RESPONSE_SEND_FD]);
+        asyncns->fds[REQUEST_RECV_FD] = asyncns->fds[RESPONSE_SEND_FD] = -1;
+    }
 #endif
 
-    asyncns->current_index = asyncns->current_id = 0;
-    asyncns->done_head = asyncns->done_tail = NULL;
-    asyncns->n_queries = 0;
-
     fd_nonblock(asyncns->fds[RESPONSE_RECV_FD]);
 
     return asyncns;
@@ -829,6 +1159,11 @@ void asyncns_free(asyncns_t *asyncns) {
 
     assert(asyncns);
 
+    /* Before the sockets go, so that a worker either sees it or fails
+     * to send its answer, and releases the slot in both cases */
+    if (asyncns->arena)
+        asyncns->arena->orphaned = 1;
+
     if (asyncns->fds[REQUEST_SEND_FD] >= 0) {
         rheader_t req;
 
@@ -848,12 +1183,14 @@ void asyncns_free(asyncns_t *asyncns) {
             close(asyncns->fds[i]);
 
     /* Now terminate them forcibly */
-    for (p = 0; p < asyncns->valid_workers; p++) {
+    for (p = 0; p < asyncns->max_workers && asyncns->workers; p++) {
+        if (!asyncns->workers[p].running)
+            continue;
 #ifndef HAVE_PTHREAD
-        kill(asyncns->workers[p], SIGTERM);
-        waitpid(asyncns->workers[p], NULL, 0);
+        kill(asyncns->workers[p].pid, SIGTERM);
+        waitpid(asyncns->workers[p].pid, NULL, 0);
 #else
-        pthread_detach(asyncns->workers[p]);
+        pthread_detach(asyncns->workers[p].thread);
 
         /* We don't join the thread here because there is no clean way
            to cancel a running lookup if one should be active. So it
@@ -863,10 +1200,28 @@ void asyncns_free(asyncns_t *asyncns) {
 #endif
     }
 
-    for (p = 0; p < MAX_QUERIES; p++)
+    for (p = 0; p < asyncns->n_slots; p++)
         if (asyncns->queries[p])
             asyncns_cancel(asyncns, asyncns->queries[p]);
 
+    if (asyncns->arena) {
+#ifndef HAVE_PTHREAD
+        /* The workers are gone, so no answer is coming for these */
+        for (p = 0; p < asyncns->arena->n_slots; p++) {
+            arena_slot_t *slot = arena_get_slot(asyncns->arena, p);
+
+            if (slot->state == SLOT_REQUEST)
+                arena_release(slot);
+        }
+#endif
+
+        /* Results still held by the caller keep it mapped */
+        arena_unref(asyncns->arena);
+    }
+
+    free(asyncns->workers);
+    free(asyncns->queries);
+    free(asyncns->free_slots);
     free(asyncns);
 
     errno = saved_errno;
@@ -880,9 +1235,10 @@ int asyncns_fd(asyncns_t *asyncns) {
 
 static asyncns_query_t *lookup_query(asyncns_t *asyncns, unsigned id) {
     asyncns_query_t *q;
+    unsigned slot = id & QUERY_SLOT_MASK;
     assert(asyncns);
 
-    if ((q = asyncns->queries[id % MAX_QUERIES]))
+    if (slot < asyncns->n_slots && (q = asyncns->queries[slot]))
         if (q->id == id)
             return q;
 
@@ -905,6 +1261,114 @@ static void complete_query(asyncns_t *asyncns, asyncns_query_t *q) {
     q->done_next = NULL;
 }
 
+static int request_window(asyncns_t *asyncns) {
+    return (int) (asyncns->valid_workers * REQUESTS_PER_WORKER);
+}
+
+static void backlog_remove(asyncns_t *asyncns, asyncns_query_t *q) {
+    if (q->backlog_prev)
+        q->backlog_prev->backlog_next = q->backlog_next;
+    else
+        asyncns->backlog_head = q->backlog_next;
+
+    if (q->backlog_next)
+        q->backlog_next->backlog_prev = q->backlog_prev;
+    else
+        asyncns->backlog_tail = q->backlog_prev;
+
+    q->backlog_next = q->backlog_prev = NULL;
+    asyncns->n_backlog--;
+}
+
+/* Sends the request right away while few are in flight, otherwise keeps
+ * it until a worker is free. Not sending everything at once keeps the
+ * request socket from filling up and blocking the caller. */
+static int submit_request(asyncns_t *asyncns, asyncns_query_t *q, const rheader_t *req) {
+    assert(asyncns);
+    assert(q);
+    assert(req);
+
+    /* Scale up while there are more requests than workers */
+    if (asyncns->n_sent + asyncns->n_backlog >= (int) (asyncns->valid_workers - asyncns->retiring_workers) &&
+        asyncns->valid_workers < asyncns->max_workers &&
+        asyncns->fds[REQUEST_RECV_FD] >= 0)
+        start_worker(asyncns);
+
+    if (!asyncns->backlog_head && asyncns->n_sent < request_window(asyncns)) {
+        if (send(asyncns->fds[REQUEST_SEND_FD], req, req->length, 0) < 0)
+            return -1;
+
+        asyncns->n_sent++;
+        return 0;
+    }
+
+    if (!(q->request = malloc(req->length))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memcpy(q->request, req, req->length);
+
+    if ((q->backlog_prev = asyncns->backlog_tail))
+        asyncns->backlog_tail->backlog_next = q;
+    else
+        asyncns->backlog_head = q;
+
+    asyncns->backlog_tail = q;
+    q->backlog_next = NULL;
+    asyncns->n_backlog++;
+
+    return 0;
+}
+
+static void flush_backlog(asyncns_t *asyncns) {
+    asyncns_query_t *q;
+    assert(asyncns);
+
+    while ((q = asyncns->backlog_head) && asyncns->n_sent < request_window(asyncns)) {
+        backlog_remove(asyncns, q);
+
+        if (send(asyncns->fds[REQUEST_SEND_FD], q->request, q->request->length, 0) < 0) {
+            q->ret = (q->type == REQUEST_RES_QUERY || q->type == REQUEST_RES_SEARCH) ? -1 : EAI_SYSTEM;
+            q->_errno = errno;
+
+            if (q->arena_slot >= 0) {
+                arena_release(arena_get_slot(asyncns->arena, q->arena_slot));
+                q->arena_slot = -1;
+            }
+
+            complete_query(asyncns, q);
+        } else
+            asyncns->n_sent++;
+
+        free(q->request);
+        q->request = NULL;
+    }
+}
+
+/* With nothing in flight every worker is idle, so all the extra ones
+ * are retired at once. Whichever worker picks up a termination packet
+ * retires. */
+static void retire_workers(asyncns_t *asyncns) {
+    rheader_t req;
+    assert(asyncns);
+
+    if (asyncns->n_sent + asyncns->n_backlog > 0)
+        return;
+
+    memset(&req, 0, sizeof(req));
+    req.type = REQUEST_TERMINATE;
+    req.length = sizeof(req);
+    req.id = 0;
+
+    while (asyncns->valid_workers - asyncns->retiring_workers > asyncns->min_workers) {
+        if (send(asyncns->fds[REQUEST_SEND_FD], &req, req.length, 0) < 0)
+            break;
+
+        asyncns->retiring_workers++;
+    }
+}
+
 static void *unserialize_addrinfo(void *p, struct addrinfo **ret_ai, size_t *length) {
     addrinfo_serialization_t s;
     size_t l;
@@ -972,8 +1436,31 @@ static int handle_response(asyncns_t *asyncns, rheader_t *resp, size_t length) {
         return 0;
     }
 
-    if (!(q = lookup_query(asyncns, resp->id)))
+    if (resp->type == RESPONSE_IDLE) {
+        retire_workers(asyncns);
+        return 0;
+    }
+
+    if (resp->type == RESPONSE_RETIRED) {
+        reap_worker(asyncns, resp->id);
         return 0;
+    }
+
+    /* Anything else answers a request, cancelled or not */
+    if (asyncns->n_sent > 0)
+        asyncns->n_sent--;
+
+    flush_backlog(asyncns);
+
+    if (!(q = lookup_query(asyncns, resp->id))) {
+        const addrinfo_response_t *ai_resp = (addrinfo_response_t*) resp;
+
+        /* Cancelled, the slot was kept for the worker until now */
+        if (resp->type == RESPONSE_ADDRINFO && ai_resp->arena_slot >= 0 && asyncns->arena)
+            arena_release(arena_get_slot(asyncns->arena, ai_resp->arena_slot));
+
+        return 0;
+    }
 
     switch (resp->type) {
         case RESPONSE_ADDRINFO: {
@@ -988,6 +1475,19 @@ static int handle_response(asyncns_t *asyncns, rheader_t *resp, size_t length) {
             q->ret = ai_resp->ret;
             q->_errno = ai_resp->_errno;
             q->_h_errno = ai_resp->_h_errno;
+
+            if (ai_resp->arena_slot >= 0 && asyncns->arena) {
+                arena_slot_t *slot = arena_get_slot(asyncns->arena, ai_resp->arena_slot);
+
+                if (ai_resp->in_arena) {
+                    /* Owned by the result list from now on */
+                    slot->state = SLOT_RESULT;
+                    q->addrinfo = (struct addrinfo*) ((uint8_t*) slot + ARENA_DATA_OFFSET);
+                } else
+                    arena_release(slot);
+            }
+
+            q->arena_slot = -1;
             l = length - sizeof(addrinfo_response_t);
             p = (uint8_t*) resp + sizeof(addrinfo_response_t);
 
@@ -1101,35 +1601,64 @@ int asyncns_wait(asyncns_t *asyncns, int block) {
     }
 }
 
+/* Doubles the query table, the new slots go on the free list */
+static int grow_queries(asyncns_t *asyncns) {
+    asyncns_query_t **queries;
+    unsigned *free_slots;
+    unsigned n, i;
+
+    assert(asyncns);
+
+    if (asyncns->n_slots >= MAX_QUERIES)
+        return -1;
+
+    n = asyncns->n_slots ? asyncns->n_slots * 2 : INITIAL_QUERIES;
+
+    if (!(queries = realloc(asyncns->queries, n * sizeof(asyncns_query_t*))))
+        return -1;
+    asyncns->queries = queries;
+
+    if (!(free_slots = realloc(asyncns->free_slots, n * sizeof(unsigned))))
+        return -1;
+    asyncns->free_slots = free_slots;
+
+    memset(queries + asyncns->n_slots, 0, (n - asyncns->n_slots) * sizeof(asyncns_query_t*));
+
+    /* Lowest slots are handed out first */
+    for (i = n; i > asyncns->n_slots; i--)
+        free_slots[asyncns->n_free++] = i - 1;
+
+    asyncns->n_slots = n;
+
+    return 0;
+}
+
 static asyncns_query_t *alloc_query(asyncns_t *asyncns) {
     asyncns_query_t *q;
+    unsigned slot;
     assert(asyncns);
 
-    if (asyncns->n_queries >= MAX_QUERIES) {
+    if (asyncns->n_free == 0 && grow_queries(asyncns) < 0) {
         errno = ENOMEM;
         return NULL;
     }
 
-    while (asyncns->queries[asyncns->current_index]) {
-
-        asyncns->current_index++;
-        asyncns->current_id++;
-
-        while (asyncns->current_index >= MAX_QUERIES)
-            asyncns->current_index -= MAX_QUERIES;
-    }
-
-    if (!(q = asyncns->queries[asyncns->current_index] = malloc(sizeof(asyncns_query_t)))) {
+    if (!(q = malloc(sizeof(asyncns_query_t)))) {
         errno = ENOMEM;
         return NULL;
     }
 
+    slot = asyncns->free_slots[--asyncns->n_free];
+    asyncns->queries[slot] = q;
     asyncns->n_queries++;
 
     q->asyncns = asyncns;
     q->done = 0;
-    q->id = asyncns->current_id;
+    q->id = (asyncns->current_id++ << QUERY_SLOT_BITS) | slot;
     q->done_next = q->done_prev = NULL;
+    q->backlog_next = q->backlog_prev = NULL;
+    q->request = NULL;
+    q->arena_slot = -1;
     q->ret = 0;
     q->_errno = 0;
     q->_h_errno = 0;
@@ -1182,12 +1711,21 @@ asyncns_query_t* asyncns_getaddrinfo(asyncns_t *asyncns, const char *node, const
     if (service)
         strcpy((char*) req + sizeof(addrinfo_request_t) + req->node_len, service);
 
-    if (send(asyncns->fds[REQUEST_SEND_FD], req, req->header.length, 0) < 0)
+    /* Falls back to passing the result over the socket when all slots
+     * are taken */
+    req->arena_slot = q->arena_slot = arena_acquire(asyncns);
+
+    if (submit_request(asyncns, q, &req->header) < 0)
         goto fail;
 
     return q;
 
 fail:
+    if (q && q->arena_slot >= 0 && !q->request) {
+        arena_release(arena_get_slot(asyncns->arena, q->arena_slot));
+        q->arena_slot = -1;
+    }
+
     if (q)
         asyncns_cancel(asyncns, q);
 
@@ -1260,7 +1798,7 @@ asyncns_query_t* asyncns_getnameinfo(asyncns_t *asyncns, const struct sockaddr *
 
     memcpy((uint8_t*) req + sizeof(nameinfo_request_t), sa, salen);
 
-    if (send(asyncns->fds[REQUEST_SEND_FD], req, req->header.length, 0) < 0)
+    if (submit_request(asyncns, q, &req->header) < 0)
         goto fail;
 
     return q;
@@ -1346,7 +1884,7 @@ static asyncns_query_t * asyncns_res(asyncns_t *asyncns, query_type_t qtype, con
 
     strcpy((char*) req + sizeof(res_request_t), dname);
 
-    if (send(asyncns->fds[REQUEST_SEND_FD], req, req->header.length, 0) < 0)
+    if (submit_request(asyncns, q, &req->header) < 0)
         goto fail;
 
     return q;
@@ -1409,8 +1947,18 @@ int asyncns_getnqueries(asyncns_t *asyncns) {
     return asyncns->n_queries;
 }
 
+int asyncns_getnworkers(asyncns_t *asyncns) {
+    assert(asyncns);
+    return asyncns->valid_workers;
+}
+
+int asyncns_getqueuedepth(asyncns_t *asyncns) {
+    assert(asyncns);
+    return asyncns->n_sent + asyncns->n_backlog;
+}
+
 void asyncns_cancel(asyncns_t *asyncns, asyncns_query_t* q) {
-    int i;
+    unsigned i;
     int saved_errno = errno;
 
     assert(asyncns);
@@ -1431,9 +1979,19 @@ void asyncns_cancel(asyncns_t *asyncns, asyncns_query_t* q) {
             asyncns->done_tail = q->done_prev;
     }
 
-    i = q->id % MAX_QUERIES;
+    if (q->request) {
+        backlog_remove(asyncns, q);
+        free(q->request);
+
+        /* Never sent, so no worker will touch the slot */
+        if (q->arena_slot >= 0)
+            arena_release(arena_get_slot(asyncns->arena, q->arena_slot));
+    }
+
+    i = q->id & QUERY_SLOT_MASK;
     assert(asyncns->queries[i] == q);
     asyncns->queries[i] = NULL;
+    asyncns->free_slots[asyncns->n_free++] = i;
 
     asyncns_freeaddrinfo(q->addrinfo);
     free(q->host);
@@ -1448,9 +2006,22 @@ void asyncns_cancel(asyncns_t *asyncns, asyncns_query_t* q) {
 void asyncns_freeaddrinfo(struct addrinfo *ai) {
     int saved_errno = errno;
 
+    /* Lists may have been joined, an arena list runs up to the first
+     * node outside its slot. */
     while (ai) {
         struct addrinfo *next = ai->ai_next;
 
+        if (ai->ai_flags & AI_ARENA) {
+            uint8_t *slot = (uint8_t*) ai - ARENA_DATA_OFFSET;
+
+            while (next && (uint8_t*) next > slot && (uint8_t*) next < slot + ARENA_SLOT_SIZE)
+                next = next->ai_next;
+
+            arena_release((arena_slot_t*) slot);
+            ai = next;
+            continue;
+        }
+
         free(ai->ai_addr);
         free(ai->ai_canonname);
         free(ai);
@@ -56,6 +56,19 @@ typedef struct asyncns_query asyncns_query_t;
 /** Allocate a new libasyncns session with n_proc worker processes/threads */
 asyncns_t* asyncns_new(unsigned n_proc);
 
+/** Allocate a new libasyncns session that starts min_workers worker
+ * processes/threads and adds more, up to max_workers, while queries
+ * are queued. Workers idle for a while are retired again down to
+ * min_workers. */
+asyncns_t* asyncns_new_scaling(unsigned min_workers, unsigned max_workers);
+
+/** Like asyncns_new_scaling() but with arena_slots result slots in
+ * memory shared with the workers. getaddrinfo() results that fit a slot
+ * are built there by the worker and handed out without being copied
+ * through the socket. Such results may outlive the session and have to
+ * be freed with asyncns_freeaddrinfo() like any other. */
+asyncns_t* asyncns_new_with_arena(unsigned min_workers, unsigned max_workers, unsigned arena_slots);
+
 /** Free a libasyncns session. This destroys all attached
  * asyncns_query_t objects automatically */
 void asyncns_free(asyncns_t *asyncns);
@@ -133,6 +146,13 @@ asyncns_query_t* asyncns_getnext(asyncns_t *asyncns);
  * this session */
 int asyncns_getnqueries(asyncns_t *asyncns);
 
+/** Return the number of queries sent to the workers or waiting to be
+ * sent that have not been answered yet */
+int asyncns_getqueuedepth(asyncns_t *asyncns);
+
+/** Return the number of running worker processes/threads */
+int asyncns_getnworkers(asyncns_t *asyncns);
+
 /** Cancel a currently running query. q is is destroyed by this call
  * and may not be used any futher. */
 void asyncns_cancel(asyncns_t *asyncns, asyncns_query_t* q);
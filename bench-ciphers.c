@@ -0,0 +1,147 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Measures bulk record encryption throughput for the AEAD ciphers that the
+ * TLS suites in LM_SECURE_CHANNEL_PRIORITY_AUTO are built on.
+ *
+ * Usage: bench-ciphers [megabytes]
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+#include "lm-misc.h"
+
+#define RECORD_SIZE 16384
+
+static const struct {
+    const gchar               *suite;
+    gnutls_cipher_algorithm_t  cipher;
+} suites[] = {
+    { "TLS_AES_128_GCM_SHA256",       GNUTLS_CIPHER_AES_128_GCM },
+    { "TLS_AES_256_GCM_SHA384",       GNUTLS_CIPHER_AES_256_GCM },
+    { "TLS_CHACHA20_POLY1305_SHA256", GNUTLS_CIPHER_CHACHA20_POLY1305 }
+};
+
+static gdouble
+bench_cipher (gnutls_cipher_algorithm_t cipher, gsize total)
+{
+    gnutls_aead_cipher_hd_t  handle;
+    gnutls_datum_t           key;
+    guchar                   key_data[32];
+    guchar                   nonce[12];
+    guchar                   aad[13];
+    guchar                  *plain;
+    guchar                  *encrypted;
+    gsize                    encrypted_len;
+    gsize                    done = 0;
+    guint64                  seq = 0;
+    GTimer                  *timer;
+    gdouble                  elapsed;
+    int                      ret = 0;
+
+    gnutls_rnd (GNUTLS_RND_NONCE, key_data, sizeof (key_data));
+    key.data = key_data;
+    key.size = gnutls_cipher_get_key_size (cipher);
+
+    if (gnutls_aead_cipher_init (&handle, cipher, &key) < 0) {
+        return -1;
+    }
+
+    plain     = g_malloc0 (RECORD_SIZE);
+    encrypted = g_malloc0 (RECORD_SIZE + 64);
+    memset (nonce, 0, sizeof (nonce));
+    memset (aad, 0, sizeof (aad));
+
+    timer = g_timer_new ();
+
+    while (done < total) {
+        /* Per record nonce, like the TLS record layer */
+        memcpy (nonce + sizeof (nonce) - sizeof (seq), &seq, sizeof (seq));
+        seq++;
+
+        encrypted_len = RECORD_SIZE + 64;
+        ret = gnutls_aead_cipher_encrypt (handle,
+                                          nonce, sizeof (nonce),
+                                          aad, sizeof (aad),
+                                          gnutls_cipher_get_tag_size (cipher),
+                                          plain, RECORD_SIZE,
+                                          encrypted, &encrypted_len);
+        if (ret < 0) {
+            g_printerr ("Encryption failed: %s\n", gnutls_strerror (ret));
+            break;
+        }
+        done += RECORD_SIZE;
+    }
+
+    elapsed = g_timer_elapsed (timer, NULL);
+
+    g_timer_destroy (timer);
+    g_free (plain);
+    g_free (encrypted);
+    gnutls_aead_cipher_deinit (handle);
+
+    if (ret < 0) {
+        /* A number for a partial run would be meaningless */
+        exit (1);
+    }
+
+    return (done / (1024.0 * 1024.0)) / elapsed;
+}
+
+int
+main (int argc, char **argv)
+{
+    gsize megabytes = 256;
+    guint i;
+
+    if (argc > 1) {
+        megabytes = atoi (argv[1]);
+    }
+
+    gnutls_global_init ();
+
+    g_print ("AES acceleration: %s\n", lm_misc_cpu_has_aes () ? "yes" : "no");
+    g_print ("Auto priority prefers: %s\n",
+             lm_misc_cpu_has_aes () ? "AES-GCM" : "ChaCha20-Poly1305");
+    g_print ("Encrypting %lu MB in %d byte records\n\n",
+             (gulong) megabytes, RECORD_SIZE);
+
+    for (i = 0; i < G_N_ELEMENTS (suites); i++) {
+        gdouble mb_per_sec;
+
+        mb_per_sec = bench_cipher (suites[i].cipher, megabytes * 1024 * 1024);
+        if (mb_per_sec < 0) {
+            g_print ("%-30s unsupported\n", suites[i].suite);
+        } else {
+            g_print ("%-30s %10.1f MB/s\n", suites[i].suite, mb_per_sec);
+        }
+    }
+
+    gnutls_global_deinit ();
+
+    return 0;
+}
+
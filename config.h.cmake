@@ -4,6 +4,12 @@
 /* Define to 1 if you have the <arpa/nameser_compat.h> header file. */
 #cmakedefine HAVE_ARPA_NAMESER_COMPAT_H 1
 
+/* Define to 1 if you have the <linux/io_uring.h> header file. */
+#cmakedefine HAVE_LINUX_IO_URING_H 1
+
+/* Define to 1 if you have the <linux/tls.h> header file. */
+#cmakedefine HAVE_LINUX_TLS_H 1
+
 /* Define to 1 if you have the <netinet/in.h> header file. */
 #cmakedefine HAVE_NETINET_IN_H 1
 
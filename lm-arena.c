@@ -0,0 +1,284 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Bump allocation out of fixed blocks with a free list per size class.
+ * Nothing is given back to the heap until the arena goes, which is what
+ * keeps connections from fragmenting it or contending for its locks.
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "lm-arena.h"
+
+#define ARENA_BLOCK_SIZE 8192
+#define ARENA_ALIGN      16
+/* Larger allocations go to the heap */
+#define ARENA_MAX_SIZE   1024
+#define ARENA_N_CLASSES  (ARENA_MAX_SIZE / ARENA_ALIGN)
+
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(gsize) (ARENA_ALIGN - 1))
+
+typedef struct ArenaBlock ArenaBlock;
+struct ArenaBlock {
+    ArenaBlock *next;
+};
+
+/* Freed memory of one size class, linked through itself */
+typedef struct ArenaFree ArenaFree;
+struct ArenaFree {
+    ArenaFree *next;
+};
+
+struct LmArena {
+    gint          ref_count;
+
+    ArenaBlock   *blocks;
+    guchar       *pos;
+    guchar       *end;
+
+    ArenaFree    *free_lists[ARENA_N_CLASSES];
+
+    LmArenaStats  stats;
+};
+
+G_LOCK_DEFINE_STATIC (totals);
+static LmArenaStats totals;
+static guint        n_live;
+
+GType
+lm_arena_get_type (void)
+{
+    static GType type;
+
+    if (type == 0) {
+        type = g_boxed_type_register_static (g_intern_static_string ("LmArena"),
+                                             (GBoxedCopyFunc) lm_arena_ref,
+                                             (GBoxedFreeFunc) lm_arena_unref);
+    }
+
+    return type;
+}
+
+LmArena *
+lm_arena_new (void)
+{
+    LmArena *arena;
+
+    arena = g_slice_new0 (LmArena);
+    arena->ref_count = 1;
+
+    G_LOCK (totals);
+    n_live++;
+    G_UNLOCK (totals);
+
+    return arena;
+}
+
+static void
+arena_add_block (LmArena *arena)
+{
+    ArenaBlock *block;
+
+    block = g_malloc (ARENA_BLOCK_SIZE);
+    block->next = arena->blocks;
+    arena->blocks = block;
+
+    arena->pos = (guchar *) block + ARENA_ROUND (sizeof (ArenaBlock));
+    arena->end = (guchar *) block + ARENA_BLOCK_SIZE;
+
+    arena->stats.n_blocks++;
+    arena->stats.bytes_reserved += ARENA_BLOCK_SIZE;
+}
+
+gpointer
+lm_arena_alloc (LmArena *arena, gsize size)
+{
+    ArenaFree *mem;
+    guint      class;
+
+    if (!arena) {
+        return g_slice_alloc (size);
+    }
+
+    size = ARENA_ROUND (MAX (size, 1));
+
+    arena->stats.n_allocs++;
+
+    if (size > ARENA_MAX_SIZE) {
+        arena->stats.n_oversized++;
+        return g_malloc (size);
+    }
+
+    arena->stats.bytes_in_use += size;
+    arena->stats.peak_bytes = MAX (arena->stats.peak_bytes,
+                                   arena->stats.bytes_in_use);
+
+    class = size / ARENA_ALIGN - 1;
+    mem = arena->free_lists[class];
+    if (mem) {
+        arena->free_lists[class] = mem->next;
+        arena->stats.n_reused++;
+        return mem;
+    }
+
+    if (arena->pos + size > arena->end) {
+        /* The rest of the block is left unused */
+        arena_add_block (arena);
+    }
+
+    mem = (ArenaFree *) arena->pos;
+    arena->pos += size;
+
+    return mem;
+}
+
+gpointer
+lm_arena_alloc0 (LmArena *arena, gsize size)
+{
+    gpointer mem;
+
+    mem = lm_arena_alloc (arena, size);
+    memset (mem, 0, size);
+
+    return mem;
+}
+
+void
+lm_arena_free (LmArena *arena, gsize size, gpointer mem)
+{
+    ArenaFree *free_mem = mem;
+    guint      class;
+
+    if (!mem) {
+        return;
+    }
+
+    if (!arena) {
+        g_slice_free1 (size, mem);
+        return;
+    }
+
+    size = ARENA_ROUND (MAX (size, 1));
+
+    arena->stats.n_frees++;
+
+    if (size > ARENA_MAX_SIZE) {
+        g_free (mem);
+        return;
+    }
+
+    arena->stats.bytes_in_use -= size;
+
+    class = size / ARENA_ALIGN - 1;
+    free_mem->next = arena->free_lists[class];
+    arena->free_lists[class] = free_mem;
+}
+
+void
+lm_arena_get_stats (LmArena *arena, LmArenaStats *stats)
+{
+    g_return_if_fail (arena != NULL);
+    g_return_if_fail (stats != NULL);
+
+    *stats = arena->stats;
+}
+
+void
+lm_arena_get_total_stats (LmArenaStats *stats, guint *live)
+{
+    g_return_if_fail (stats != NULL);
+
+    G_LOCK (totals);
+    *stats = totals;
+    if (live) {
+        *live = n_live;
+    }
+    G_UNLOCK (totals);
+}
+
+gchar *
+lm_arena_dump_stats (void)
+{
+    LmArenaStats stats;
+    guint        live;
+
+    lm_arena_get_total_stats (&stats, &live);
+
+    return g_strdup_printf ("arenas: %u live\n"
+                            "allocs: %" G_GUINT64_FORMAT
+                            " (%" G_GUINT64_FORMAT " reused, %"
+                            G_GUINT64_FORMAT " oversized), frees: %"
+                            G_GUINT64_FORMAT "\n"
+                            "blocks: %u, %" G_GSIZE_FORMAT " bytes reserved, "
+                            "%" G_GSIZE_FORMAT " bytes peak in one arena\n"
+                            "%" G_GSIZE_FORMAT " bytes freed with their arena\n",
+                            live,
+                            stats.n_allocs, stats.n_reused,
+                            stats.n_oversized, stats.n_frees,
+                            stats.n_blocks, stats.bytes_reserved,
+                            stats.peak_bytes, stats.bytes_in_use);
+}
+
+static void
+arena_free (LmArena *arena)
+{
+    ArenaBlock *block;
+
+    G_LOCK (totals);
+    totals.n_allocs       += arena->stats.n_allocs;
+    totals.n_reused       += arena->stats.n_reused;
+    totals.n_oversized    += arena->stats.n_oversized;
+    totals.n_frees        += arena->stats.n_frees;
+    totals.bytes_in_use   += arena->stats.bytes_in_use;
+    totals.peak_bytes      = MAX (totals.peak_bytes, arena->stats.peak_bytes);
+    totals.bytes_reserved += arena->stats.bytes_reserved;
+    totals.n_blocks       += arena->stats.n_blocks;
+    n_live--;
+    G_UNLOCK (totals);
+
+    while ((block = arena->blocks)) {
+        arena->blocks = block->next;
+        g_free (block);
+    }
+
+    g_slice_free (LmArena, arena);
+}
+
+LmArena *
+lm_arena_ref (LmArena *arena)
+{
+    g_return_val_if_fail (arena != NULL, NULL);
+
+    g_atomic_int_inc (&arena->ref_count);
+
+    return arena;
+}
+
+void
+lm_arena_unref (LmArena *arena)
+{
+    g_return_if_fail (arena != NULL);
+
+    if (g_atomic_int_dec_and_test (&arena->ref_count)) {
+        arena_free (arena);
+    }
+}
@@ -0,0 +1,83 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_ARENA_H__
+#define __LM_ARENA_H__
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define LM_TYPE_ARENA (lm_arena_get_type ())
+
+/* Memory that belongs to one connection and is given back in one go when
+ * the last reference goes. Passed to the LmSocket at construction with
+ * the "arena" property, channels stacked on it use the same one. Small
+ * allocations are carved out of blocks and freed ones are kept for reuse
+ * within the arena, larger ones pass through to the heap.
+ *
+ * Only the io_uring backend allocates from it, for its socket state and
+ * the receive and send buffers. The poll backend leaves it empty: its
+ * GIOChannel and reactor sources are allocated by GLib and the reactor,
+ * and the result iterator belongs to the LmSocketAddress, which the
+ * caller may keep after the connection is gone.
+ *
+ * Allocating is not thread safe, an arena is used from the loop of its
+ * connection. Passing NULL for arena uses g_slice.
+ */
+typedef struct LmArena LmArena;
+
+typedef struct {
+    guint64 n_allocs;
+    guint64 n_reused;       /* Served from freed memory */
+    guint64 n_oversized;    /* Passed through to the heap */
+    guint64 n_frees;
+    gsize   bytes_in_use;   /* In the totals, what was left at the end */
+    gsize   peak_bytes;
+    gsize   bytes_reserved; /* In blocks */
+    guint   n_blocks;
+} LmArenaStats;
+
+GType     lm_arena_get_type        (void);
+LmArena * lm_arena_new             (void);
+
+gpointer  lm_arena_alloc           (LmArena      *arena,
+                                    gsize         size);
+gpointer  lm_arena_alloc0          (LmArena      *arena,
+                                    gsize         size);
+/* size has to be the one allocated with */
+void      lm_arena_free            (LmArena      *arena,
+                                    gsize         size,
+                                    gpointer      mem);
+void      lm_arena_get_stats       (LmArena      *arena,
+                                    LmArenaStats *stats);
+/* Summed over the arenas freed so far, n_live is the number still around */
+void      lm_arena_get_total_stats (LmArenaStats *stats,
+                                    guint        *n_live);
+/* Human readable totals, free with g_free() */
+gchar *   lm_arena_dump_stats      (void);
+
+/* Ref counting */
+LmArena * lm_arena_ref             (LmArena      *arena);
+void      lm_arena_unref           (LmArena      *arena);
+
+G_END_DECLS
+
+#endif /* __LM_ARENA_H__ */
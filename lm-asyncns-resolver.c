@@ -40,32 +40,89 @@
 
 #define GET_PRIV(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), LM_TYPE_ASYNCNS_RESOLVER, LmAsyncnsResolverPriv))
 
+#define DEFAULT_MIN_WORKERS 1
+#define DEFAULT_MAX_WORKERS 16
+
+/* Results passed in shared memory rather than over the socket */
+#define ARENA_SLOTS         1024
+
+/* Workers of a context are stopped once no resolver has used them for
+ * this long.
+ */
+#define SHARED_IDLE_TIMEOUT_SEC 30
+
 enum {
     RESOLVE_TYPE_HOST,
     RESOLVE_TYPE_SRV
 };
 
+/* The asyncns workers shared by all lookups on one main context */
+typedef struct {
+    GMainContext *context;
+    asyncns_t    *asyncns_ctx;
+    GIOChannel   *resolv_channel;
+    GSource      *watch_resolv;
+
+    /* Protected by the shared_contexts lock */
+    guint         ref_count;
+    GSource      *idle_source;
+    gboolean      dead;
+
+    /* Resolvers with a query in flight */
+    GList        *resolvers;
+
+    /* Copied from asyncns_ctx on the context's thread, read with atomic
+     * operations by lm_asyncns_resolver_get_stats.
+     */
+    gint          queue_depth;
+    gint          n_workers;
+} AsyncnsShared;
+
 typedef struct LmAsyncnsResolverPriv LmAsyncnsResolverPriv;
 struct LmAsyncnsResolverPriv {
-    GSource     *watch_resolv;
+    AsyncnsShared   *shared;
+    GList           *shared_link;
     asyncns_query_t *resolv_query;
-    asyncns_t   *asyncns_ctx;
-    GIOChannel  *resolv_channel;
+
+    /* The separate IPv4 query of incremental lookups, resolv_query then
+     * asks for IPv6 only.
+     */
+    asyncns_query_t *resolv_query_a;
+    gboolean         got_results;
+
+    /* Duplicates of the above sent when the lookup is slow */
+    asyncns_query_t *hedge_query;
+    asyncns_query_t *hedge_query_a;
+    GSource         *hedge_source;
+    gboolean         hedged;
+    gint64           start_time;
 
     gint         resolve_type;
 
     LmSocketAddress *sa;
+    gchar           *srv;
 };
 
 static void     asyncns_resolver_finalize      (GObject          *object);
 static void     asyncns_resolver_cleanup       (LmResolver       *resolver);
-static void     asyncns_resolver_host_done     (LmResolver       *resolver);
-static void     asyncns_resolver_srv_done      (LmResolver       *resolver);
+static void     asyncns_resolver_finished      (LmResolver       *resolver,
+                                                LmResolverResult  result);
+static void     asyncns_resolver_host_done     (LmResolver       *resolver,
+                                                asyncns_query_t  *query);
+static void     asyncns_resolver_srv_done      (LmResolver       *resolver,
+                                                asyncns_query_t  *query);
 static void     asyncns_resolver_lookup_host   (LmResolver       *resolver,
                                                 LmSocketAddress  *sa);
 static void     asyncns_resolver_lookup_srv    (LmResolver       *resolver,
                                                 const gchar      *srv);
 static void     asyncns_resolver_cancel        (LmResolver       *resolver);
+static void     asyncns_shared_release         (AsyncnsShared    *shared);
+static void     asyncns_shared_update_stats    (AsyncnsShared    *shared);
+
+G_LOCK_DEFINE_STATIC (shared_contexts);
+static GHashTable *shared_contexts;
+static guint       min_workers = DEFAULT_MIN_WORKERS;
+static guint       max_workers = DEFAULT_MAX_WORKERS;
 
 G_DEFINE_TYPE (LmAsyncnsResolver, lm_asyncns_resolver, LM_TYPE_RESOLVER)
 
@@ -109,19 +166,38 @@ asyncns_resolver_cleanup (LmResolver *resolver)
 {
     LmAsyncnsResolverPriv *priv = GET_PRIV (resolver);
 
-    if (priv->resolv_channel != NULL) {
-        g_io_channel_unref (priv->resolv_channel);
-        priv->resolv_channel = NULL;
-    }
- 
-    if (priv->watch_resolv) {
-        g_source_destroy (priv->watch_resolv);
-        priv->watch_resolv = NULL;
+    if (priv->shared) {
+        if (priv->resolv_query) {
+            asyncns_cancel (priv->shared->asyncns_ctx, priv->resolv_query);
+        }
+
+        if (priv->resolv_query_a) {
+            asyncns_cancel (priv->shared->asyncns_ctx, priv->resolv_query_a);
+        }
+
+        if (priv->hedge_query) {
+            asyncns_cancel (priv->shared->asyncns_ctx, priv->hedge_query);
+        }
+
+        if (priv->hedge_query_a) {
+            asyncns_cancel (priv->shared->asyncns_ctx, priv->hedge_query_a);
+        }
+
+        if (priv->shared_link) {
+            priv->shared->resolvers = 
+                g_list_delete_link (priv->shared->resolvers, 
+                                    priv->shared_link);
+            priv->shared_link = NULL;
+        }
+
+        asyncns_shared_update_stats (priv->shared);
+        asyncns_shared_release (priv->shared);
+        priv->shared = NULL;
     }
 
-    if (priv->asyncns_ctx) {
-        asyncns_free (priv->asyncns_ctx);
-        priv->asyncns_ctx = NULL;
+    if (priv->hedge_source) {
+        g_source_destroy (priv->hedge_source);
+        priv->hedge_source = NULL;
     }
 
     if (priv->sa) {
@@ -129,38 +205,250 @@ asyncns_resolver_cleanup (LmResolver *resolver)
         priv->sa = NULL;
     }
 
+    g_free (priv->srv);
+    priv->srv = NULL;
+
     priv->resolv_query = NULL;
+    priv->resolv_query_a = NULL;
+    priv->hedge_query = NULL;
+    priv->hedge_query_a = NULL;
 }
 
-typedef gboolean  (* LmAsyncnsResolverCallback) (LmResolver *resolver);
+static void
+asyncns_shared_free (AsyncnsShared *shared)
+{
+    if (shared->resolv_channel != NULL) {
+        g_io_channel_unref (shared->resolv_channel);
+    }
+ 
+    if (shared->watch_resolv) {
+        g_source_destroy (shared->watch_resolv);
+    }
 
-static gboolean
-asyncns_resolver_io_cb (GSource      *source,
-                        GIOCondition  condition,
-                        LmResolver   *resolver)
+    if (shared->idle_source) {
+        g_source_destroy (shared->idle_source);
+    }
+
+    if (shared->asyncns_ctx) {
+        asyncns_free (shared->asyncns_ctx);
+    }
+
+    if (shared->context) {
+        g_main_context_unref (shared->context);
+    }
+
+    g_free (shared);
+}
+
+static void
+asyncns_shared_update_stats (AsyncnsShared *shared)
 {
-    LmAsyncnsResolverPriv *priv = GET_PRIV (resolver);
+    g_atomic_int_set (&shared->queue_depth,
+                      asyncns_getqueuedepth (shared->asyncns_ctx));
+    g_atomic_int_set (&shared->n_workers,
+                      asyncns_getnworkers (shared->asyncns_ctx));
+}
 
-    asyncns_wait (priv->asyncns_ctx, FALSE);
+static gboolean
+asyncns_shared_idle_cb (AsyncnsShared *shared)
+{
+    G_LOCK (shared_contexts);
 
-    if (!asyncns_isdone (priv->asyncns_ctx, priv->resolv_query)) {
-        return TRUE;
+    /* Superseded if the workers were used again in the meantime */
+    if (shared->ref_count > 0 ||
+        shared->idle_source != g_main_current_source ()) {
+        G_UNLOCK (shared_contexts);
+        return FALSE;
     }
 
-    switch (priv->resolve_type) {
-        case RESOLVE_TYPE_HOST:
-            asyncns_resolver_host_done (resolver);
-            break;
-        case RESOLVE_TYPE_SRV:
-            asyncns_resolver_srv_done (resolver);
-            break;
-        default:
-            g_assert_not_reached ();
-    };
+    g_hash_table_remove (shared_contexts, shared->context);
+    shared->idle_source = NULL;
+
+    G_UNLOCK (shared_contexts);
+
+    asyncns_shared_free (shared);
 
     return FALSE;
 }
 
+/* Drops the reference a resolver got from asyncns_shared_get */
+static void
+asyncns_shared_release (AsyncnsShared *shared)
+{
+    gboolean free_now = FALSE;
+
+    G_LOCK (shared_contexts);
+
+    if (--shared->ref_count == 0) {
+        if (shared->dead) {
+            free_now = TRUE;
+        } else {
+            shared->idle_source = 
+                lm_misc_add_timeout (shared->context,
+                                     SHARED_IDLE_TIMEOUT_SEC * 1000,
+                                     (GSourceFunc) asyncns_shared_idle_cb,
+                                     shared);
+        }
+    }
+
+    G_UNLOCK (shared_contexts);
+
+    if (free_now) {
+        asyncns_shared_free (shared);
+    }
+}
+
+/* The workers are gone, fail everything that was waiting on them. The
+ * next lookup on the context starts new workers.
+ */
+static void
+asyncns_shared_died (AsyncnsShared *shared)
+{
+    GList    *resolvers;
+    GList    *l;
+    gboolean  unused;
+
+    g_warning ("asyncns workers died");
+
+    G_LOCK (shared_contexts);
+    g_hash_table_remove (shared_contexts, shared->context);
+    shared->dead = TRUE;
+
+    if (shared->idle_source) {
+        g_source_destroy (shared->idle_source);
+        shared->idle_source = NULL;
+    }
+
+    unused = shared->ref_count == 0;
+    G_UNLOCK (shared_contexts);
+
+    /* Not from the watch callback itself */
+    shared->watch_resolv = NULL;
+
+    resolvers = shared->resolvers;
+    shared->resolvers = NULL;
+
+    for (l = resolvers; l; l = l->next) {
+        LmAsyncnsResolverPriv *priv = GET_PRIV (l->data);
+
+        priv->shared = NULL;
+        priv->shared_link = NULL;
+        priv->resolv_query = NULL;
+        priv->resolv_query_a = NULL;
+        priv->hedge_query = NULL;
+        priv->hedge_query_a = NULL;
+    }
+
+    /* The last one frees it */
+    for (l = resolvers; l; l = l->next) {
+        asyncns_shared_release (shared);
+    }
+
+    if (unused) {
+        asyncns_shared_free (shared);
+    }
+
+    for (l = resolvers; l; l = l->next) {
+        asyncns_resolver_finished (LM_RESOLVER (l->data), 
+                                   LM_RESOLVER_RESULT_FAILED);
+    }
+
+    g_list_free (resolvers);
+}
+
+static gboolean
+asyncns_resolver_io_cb (GSource       *source,
+                        GIOCondition   condition,
+                        AsyncnsShared *shared)
+{
+    asyncns_query_t *query;
+
+    if (asyncns_wait (shared->asyncns_ctx, FALSE) < 0) {
+        asyncns_shared_died (shared);
+        return FALSE;
+    }
+
+    /* Finishing a resolver removes its query from the done list */
+    while ((query = asyncns_getnext (shared->asyncns_ctx))) {
+        LmResolver            *resolver;
+        LmAsyncnsResolverPriv *priv;
+
+        resolver = asyncns_getuserdata (shared->asyncns_ctx, query);
+        priv = GET_PRIV (resolver);
+
+        switch (priv->resolve_type) {
+            case RESOLVE_TYPE_HOST:
+                asyncns_resolver_host_done (resolver, query);
+                break;
+            case RESOLVE_TYPE_SRV:
+                asyncns_resolver_srv_done (resolver, query);
+                break;
+            default:
+                g_assert_not_reached ();
+        };
+    }
+
+    asyncns_shared_update_stats (shared);
+
+    return TRUE;
+}
+
+static AsyncnsShared *
+asyncns_shared_get (GMainContext *context)
+{
+    AsyncnsShared *shared;
+
+    G_LOCK (shared_contexts);
+
+    if (!shared_contexts) {
+        shared_contexts = g_hash_table_new (g_direct_hash, g_direct_equal);
+    }
+
+    shared = g_hash_table_lookup (shared_contexts, context);
+    if (shared) {
+        shared->ref_count++;
+
+        if (shared->idle_source) {
+            g_source_destroy (shared->idle_source);
+            shared->idle_source = NULL;
+        }
+
+        G_UNLOCK (shared_contexts);
+        return shared;
+    }
+
+    shared = g_new0 (AsyncnsShared, 1);
+    shared->ref_count = 1;
+
+    shared->asyncns_ctx = asyncns_new_with_arena (min_workers, max_workers,
+                                                  ARENA_SLOTS);
+    if (shared->asyncns_ctx == NULL) {
+        G_UNLOCK (shared_contexts);
+        g_warning ("can't initialise libasyncns");
+        g_free (shared);
+        return NULL;
+    }
+
+    /* Keeps the address from being reused for another context */
+    shared->context = context ? g_main_context_ref (context) : NULL;
+
+    shared->resolv_channel =
+        g_io_channel_unix_new (asyncns_fd (shared->asyncns_ctx));
+
+    shared->watch_resolv = 
+        lm_misc_add_io_watch (context,
+                              shared->resolv_channel,
+                              G_IO_IN,
+                              (GIOFunc) asyncns_resolver_io_cb,
+                              shared);
+
+    g_hash_table_insert (shared_contexts, context, shared);
+
+    G_UNLOCK (shared_contexts);
+
+    return shared;
+}
+
 static gboolean
 asyncns_resolver_prep (LmResolver *resolver, int resolve_type)
 {
@@ -168,31 +456,158 @@ asyncns_resolver_prep (LmResolver *resolver, int resolve_type)
     GMainContext          *context;
 
     /* Each LmResolver can only be used once */
-    g_return_val_if_fail (priv->asyncns_ctx == NULL, FALSE);
+    g_return_val_if_fail (priv->shared == NULL, FALSE);
 
     priv->resolve_type = resolve_type;
+    priv->start_time   = g_get_monotonic_time ();
 
-    priv->asyncns_ctx = asyncns_new (1);
-    if (priv->asyncns_ctx == NULL) {
-        g_warning ("can't initialise libasyncns");
+    g_object_get (resolver, "context", &context, NULL);
+
+    priv->shared = asyncns_shared_get (context);
+    if (priv->shared == NULL) {
         return FALSE;
     }
 
-    priv->resolv_channel =
-        g_io_channel_unix_new (asyncns_fd (priv->asyncns_ctx));
+    return TRUE;
+}
 
-    g_object_get (resolver, "context", &context, NULL);
-        
-    priv->watch_resolv = 
-        lm_misc_add_io_watch (context,
-                              priv->resolv_channel,
-                              G_IO_IN,
-                              (GIOFunc) asyncns_resolver_io_cb,
-                              resolver);
+static asyncns_query_t *
+asyncns_resolver_send_host_query (LmResolver *resolver, int family)
+{
+    LmAsyncnsResolverPriv *priv = GET_PRIV (resolver);
+    struct addrinfo        req;
+
+    memset (&req, 0, sizeof(req));
+    req.ai_family   = family;
+    req.ai_socktype = SOCK_STREAM;
+    req.ai_protocol = IPPROTO_TCP;
+
+    return asyncns_getaddrinfo (priv->shared->asyncns_ctx,
+                                lm_socket_address_get_host (priv->sa),
+                                NULL,
+                                &req);
+}
+
+/* The lookup is slower than most, ask again on another worker. The first
+ * answer is used and the other copy cancelled, a failure only counts once
+ * both copies have failed.
+ */
+static gboolean
+asyncns_resolver_hedge_cb (LmResolver *resolver)
+{
+    LmAsyncnsResolverPriv *priv = GET_PRIV (resolver);
+    asyncns_t             *ctx = priv->shared->asyncns_ctx;
+
+    priv->hedge_source = NULL;
+
+    if (priv->resolve_type == RESOLVE_TYPE_SRV) {
+        priv->hedge_query = asyncns_res_query (ctx, priv->srv, C_IN, T_SRV);
+    } else {
+        if (priv->resolv_query) {
+            priv->hedge_query = 
+                asyncns_resolver_send_host_query (resolver, 
+                                                  _lm_resolver_get_incremental (resolver) ?
+                                                  AF_INET6 : AF_UNSPEC);
+        }
+
+        if (priv->resolv_query_a) {
+            priv->hedge_query_a = 
+                asyncns_resolver_send_host_query (resolver, AF_INET);
+        }
+    }
+
+    if (priv->hedge_query) {
+        asyncns_setuserdata (ctx, priv->hedge_query, resolver);
+        priv->hedged = TRUE;
+    }
+
+    if (priv->hedge_query_a) {
+        asyncns_setuserdata (ctx, priv->hedge_query_a, resolver);
+        priv->hedged = TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Forgets about query. A success cancels the copy of it still in flight,
+ * a failure is ignored while the copy may still answer. Returns TRUE if
+ * the answer of query is to be used.
+ */
+static gboolean
+asyncns_resolver_take_query (LmResolver      *resolver,
+                             asyncns_query_t *query,
+                             gboolean         failed)
+{
+    LmAsyncnsResolverPriv  *priv = GET_PRIV (resolver);
+    asyncns_query_t       **first;
+    asyncns_query_t       **hedge;
+    asyncns_query_t        *other;
+
+    if (query == priv->resolv_query_a || query == priv->hedge_query_a) {
+        first = &priv->resolv_query_a;
+        hedge = &priv->hedge_query_a;
+    } else {
+        first = &priv->resolv_query;
+        hedge = &priv->hedge_query;
+    }
+
+    other = query == *first ? *hedge : *first;
+    *first = *hedge = NULL;
+
+    if (other && failed) {
+        /* Wait for the other copy */
+        *first = other;
+        return FALSE;
+    }
+
+    if (other) {
+        asyncns_cancel (priv->shared->asyncns_ctx, other);
+    }
 
     return TRUE;
 }
 
+/* Called with the queries issued, NULL if that failed */
+static void
+asyncns_resolver_query_sent (LmResolver *resolver)
+{
+    LmAsyncnsResolverPriv *priv = GET_PRIV (resolver);
+    GMainContext          *context;
+    guint                  delay;
+
+    if (priv->resolv_query == NULL && priv->resolv_query_a == NULL) {
+        g_warning ("Failed to queue asyncns query");
+        asyncns_resolver_finished (resolver, LM_RESOLVER_RESULT_FAILED);
+        return;
+    }
+
+    if (priv->resolv_query) {
+        asyncns_setuserdata (priv->shared->asyncns_ctx, priv->resolv_query, 
+                             resolver);
+    }
+
+    if (priv->resolv_query_a) {
+        asyncns_setuserdata (priv->shared->asyncns_ctx, priv->resolv_query_a,
+                             resolver);
+    }
+
+    priv->shared->resolvers = g_list_prepend (priv->shared->resolvers,
+                                              resolver);
+    priv->shared_link = priv->shared->resolvers;
+
+    asyncns_shared_update_stats (priv->shared);
+
+    delay = _lm_resolver_get_hedge_delay ();
+    if (delay > 0) {
+        g_object_get (resolver, "context", &context, NULL);
+
+        priv->hedge_source = 
+            lm_misc_add_timeout (context, delay,
+                                 (GSourceFunc) asyncns_resolver_hedge_cb,
+                                 resolver);
+    }
+}
+
 static void
 asyncns_resolver_finished (LmResolver *resolver, LmResolverResult result) 
 {
@@ -200,6 +615,12 @@ asyncns_resolver_finished (LmResolver *resolver, LmResolverResult result)
 
     priv = GET_PRIV (resolver);
 
+    if (result != LM_RESOLVER_RESULT_CANCELLED && priv->start_time) {
+        _lm_resolver_record_latency (g_get_monotonic_time () - 
+                                     priv->start_time,
+                                     priv->hedged);
+    }
+
     g_signal_emit_by_name (resolver, "finished", result, priv->sa);
 
     asyncns_resolver_cleanup (resolver);
@@ -209,16 +630,46 @@ asyncns_resolver_finished (LmResolver *resolver, LmResolverResult result)
 }
 
 static void
-asyncns_resolver_host_done (LmResolver *resolver)
+asyncns_resolver_host_done (LmResolver *resolver, asyncns_query_t *query)
 {
     LmAsyncnsResolverPriv *priv = GET_PRIV (resolver);
     struct addrinfo       *ans;
     int                    err;
     LmResolverResult       result;
 
-    err = asyncns_getaddrinfo_done (priv->asyncns_ctx, 
-                                    priv->resolv_query, &ans);
-    priv->resolv_query = NULL;
+    err = asyncns_getaddrinfo_done (priv->shared->asyncns_ctx, query, &ans);
+
+    if (!asyncns_resolver_take_query (resolver, query, err != 0)) {
+        return;
+    }
+
+    if (err) {
+        _lm_resolver_set_error (resolver, _lm_resolver_error_from_gai (err));
+    }
+
+    if (_lm_resolver_get_incremental (resolver)) {
+        if (!err) {
+            priv->got_results = TRUE;
+
+            /* A handler may cancel the lookup once it has connected */
+            g_object_ref (resolver);
+            _lm_resolver_add_results (resolver, priv->sa, ans);
+            if (priv->shared == NULL) {
+                g_object_unref (resolver);
+                return;
+            }
+            g_object_unref (resolver);
+        }
+
+        if (priv->resolv_query || priv->resolv_query_a) {
+            return;
+        }
+
+        asyncns_resolver_finished (resolver, priv->got_results ?
+                                   LM_RESOLVER_RESULT_OK :
+                                   LM_RESOLVER_RESULT_FAILED);
+        return;
+    }
 
     if (err) {
         result = LM_RESOLVER_RESULT_FAILED;
@@ -231,20 +682,27 @@ asyncns_resolver_host_done (LmResolver *resolver)
 }
 
 static void
-asyncns_resolver_srv_done (LmResolver *resolver)
+asyncns_resolver_srv_done (LmResolver *resolver, asyncns_query_t *query)
 {
     LmAsyncnsResolverPriv *priv = GET_PRIV (resolver);
-    unsigned char         *srv_ans;
+    unsigned char         *srv_ans = NULL;
     int                    srv_len;
+    int                    herr;
     LmResolverResult       result;
 
-    srv_len = asyncns_res_done (priv->asyncns_ctx, 
-                                priv->resolv_query, &srv_ans);
+    srv_len = asyncns_res_done (priv->shared->asyncns_ctx, 
+                                query, &srv_ans);
+    herr = h_errno;
 
-    priv->resolv_query = NULL;
+    if (!asyncns_resolver_take_query (resolver, query, srv_len <= 0)) {
+        asyncns_freeanswer (srv_ans);
+        return;
+    }
 
     if (srv_len <= 0) {
         result = LM_RESOLVER_RESULT_FAILED;
+        _lm_resolver_set_error (resolver, 
+                                _lm_resolver_error_from_herrno (herr));
         g_warning ("Failed to read srv request results");
     } else {
         gchar    *new_server;
@@ -258,11 +716,14 @@ asyncns_resolver_srv_done (LmResolver *resolver)
             priv->sa = lm_socket_address_new (new_server, new_port);
         } else {
             result = LM_RESOLVER_RESULT_FAILED;
+            _lm_resolver_set_error (resolver, LM_RESOLVER_ERROR_NO_DATA);
         }
 
         g_free (new_server);
     }
 
+    asyncns_freeanswer (srv_ans);
+
     asyncns_resolver_finished (resolver, result);
 }
 
@@ -270,7 +731,7 @@ static void
 asyncns_resolver_lookup_host (LmResolver *resolver, LmSocketAddress *sa)
 {
     LmAsyncnsResolverPriv *priv;
-    struct addrinfo        req;
+    int                    family = AF_UNSPEC;
 
     g_return_if_fail (LM_IS_ASYNCNS_RESOLVER (resolver));
     g_return_if_fail (sa != NULL);
@@ -283,15 +744,18 @@ asyncns_resolver_lookup_host (LmResolver *resolver, LmSocketAddress *sa)
         return;
     }
 
-    memset (&req, 0, sizeof(req));
-    req.ai_family   = AF_UNSPEC;
-    req.ai_socktype = SOCK_STREAM;
-    req.ai_protocol = IPPROTO_TCP;
+    if (_lm_resolver_get_incremental (resolver)) {
+        /* IPv6 and IPv4 separately so that whichever answers first can
+         * be tried while the other is still outstanding.
+         */
+        priv->resolv_query_a = 
+            asyncns_resolver_send_host_query (resolver, AF_INET);
+        family = AF_INET6;
+    }
 
-    priv->resolv_query = asyncns_getaddrinfo (priv->asyncns_ctx,
-                                              lm_socket_address_get_host (sa),
-                                              NULL,
-                                              &req);
+    priv->resolv_query = asyncns_resolver_send_host_query (resolver, family);
+
+    asyncns_resolver_query_sent (resolver);
 }
 
 static void
@@ -309,23 +773,59 @@ asyncns_resolver_lookup_srv (LmResolver *resolver, const gchar *srv)
         return;
     }
 
-    priv->resolv_query = asyncns_res_query (priv->asyncns_ctx, 
+    /* Kept for a hedged query */
+    priv->srv = g_strdup (srv);
+
+    priv->resolv_query = asyncns_res_query (priv->shared->asyncns_ctx, 
                                             srv, C_IN, T_SRV);
+
+    asyncns_resolver_query_sent (resolver);
 }
 
 static void
 asyncns_resolver_cancel (LmResolver *resolver)
 {
-    LmAsyncnsResolverPriv *priv;
-
     g_return_if_fail (LM_IS_ASYNCNS_RESOLVER (resolver));
 
-    priv = GET_PRIV (resolver);
+    /* Cleanup cancels the query */
+    asyncns_resolver_finished (resolver, LM_RESOLVER_RESULT_CANCELLED);
+}
 
-    if (priv->asyncns_ctx && priv->resolv_query) {
-        asyncns_cancel (priv->asyncns_ctx, priv->resolv_query);
-        priv->resolv_query = NULL;
+void
+lm_asyncns_resolver_set_workers (guint min, guint max)
+{
+    g_return_if_fail (min > 0);
+    g_return_if_fail (max >= min);
+
+    G_LOCK (shared_contexts);
+    min_workers = min;
+    max_workers = max;
+    G_UNLOCK (shared_contexts);
+}
+
+void
+lm_asyncns_resolver_get_stats (guint *queue_depth, guint *n_workers)
+{
+    GHashTableIter  iter;
+    AsyncnsShared  *shared;
+    guint           depth = 0;
+    guint           workers = 0;
+
+    G_LOCK (shared_contexts);
+    if (shared_contexts) {
+        g_hash_table_iter_init (&iter, shared_contexts);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &shared)) {
+            depth   += g_atomic_int_get (&shared->queue_depth);
+            workers += g_atomic_int_get (&shared->n_workers);
+        }
     }
+    G_UNLOCK (shared_contexts);
 
-    asyncns_resolver_finished (resolver, LM_RESOLVER_RESULT_CANCELLED);
+    if (queue_depth) {
+        *queue_depth = depth;
+    }
+
+    if (n_workers) {
+        *n_workers = workers;
+    }
 }
@@ -45,7 +45,18 @@ struct LmAsyncnsResolverClass {
     LmResolverClass parent_class;
 };
 
-GType   lm_asyncns_resolver_get_type  (void);
+GType   lm_asyncns_resolver_get_type    (void);
+
+/* Lookups on a main context share one set of asyncns workers which grows
+ * from min_workers to max_workers with the number of queued lookups.
+ * Applies to contexts used for the first time afterwards.
+ */
+void    lm_asyncns_resolver_set_workers (guint  min_workers,
+                                         guint  max_workers);
+
+/* Lookups not answered yet and running workers, over all contexts */
+void    lm_asyncns_resolver_get_stats   (guint *queue_depth,
+                                         guint *n_workers);
 
 G_END_DECLS
 
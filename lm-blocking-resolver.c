@@ -139,6 +139,8 @@ blocking_resolver_idle_lookup_host (LmBlockingResolver *resolver)
         g_warning ("Error while looking up '%s': %d\n", 
                    lm_socket_address_get_host (priv->sa), err);
        
+        _lm_resolver_set_error (LM_RESOLVER (resolver),
+                                _lm_resolver_error_from_gai (err));
         result = LM_RESOLVER_RESULT_FAILED;
     } else {
         g_print ("Found result for %s\n", lm_socket_address_get_host (priv->sa));
@@ -168,9 +170,19 @@ blocking_resolver_idle_lookup_srv (LmBlockingResolver *resolver)
     res_init ();
 
     len = res_query (priv->srv, C_IN, T_SRV, srv_ans, SRV_LEN);
+    if (len <= 0) {
+        _lm_resolver_set_error (LM_RESOLVER (resolver),
+                                _lm_resolver_error_from_herrno (h_errno));
+        parse_result = FALSE;
+    } else {
+        parse_result = _lm_resolver_parse_srv_response (srv_ans, len, 
+                                                        &new_server, &new_port);
+        if (!parse_result) {
+            _lm_resolver_set_error (LM_RESOLVER (resolver),
+                                    LM_RESOLVER_ERROR_NO_DATA);
+        }
+    }
 
-    parse_result = _lm_resolver_parse_srv_response (srv_ans, len, 
-                                              &new_server, &new_port);
     if (parse_result == FALSE) {
         g_print ("Error while parsing srv response in %s\n", 
                  G_STRFUNC);
@@ -0,0 +1,628 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Answers repeated lookups from memory. Lookups that went to a backend
+ * are stored for as long as their records live, popular names are
+ * resolved again shortly before they expire so that they never have to
+ * wait for the network.
+ */
+
+#include <config.h>
+
+#include "lm-misc.h"
+
+#include "lm-cached-resolver.h"
+
+#define GET_PRIV(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), LM_TYPE_CACHED_RESOLVER, LmCachedResolverPriv))
+
+#define CACHE_MAX_ENTRIES   1024
+/* Seconds, for backends that don't know the TTL */
+#define CACHE_DEFAULT_TTL   300
+/* Refresh with a tenth of the TTL left, but no later than 2s before */
+#define CACHE_REFRESH_AHEAD 10
+#define CACHE_MIN_AHEAD     2
+/* Milliseconds, when too many refreshes are running */
+#define CACHE_RETRY_DELAY   1000
+/* Seconds, for what an incremental lookup had found when it was
+ * cancelled. The rest is looked up again soon.
+ */
+#define CACHE_PARTIAL_TTL   30
+
+#define DEFAULT_PREFETCH_THRESHOLD 3
+#define DEFAULT_PREFETCH_MAX       4
+
+typedef struct {
+    gchar           *name;
+    gboolean         is_srv;
+
+    LmSocketAddress *results;
+    gchar           *server;
+    guint            port;
+
+    gint64           expires;
+    gint64           last_used;
+
+    /* Lookups since the entry was stored */
+    guint            hits;
+
+    GMainContext    *context;
+    GSource         *refresh_source;
+
+    /* Held by the table and by the refresh source, which may be
+     * dispatched on another thread while the entry is removed.
+     */
+    gint             ref_count;
+} CacheEntry;
+
+/* A backend lookup whose result goes into the cache */
+typedef struct {
+    gchar           *name;
+    gboolean         is_srv;
+    gboolean         refresh;
+    GMainContext    *context;
+} CacheRequest;
+
+typedef struct LmCachedResolverPriv LmCachedResolverPriv;
+struct LmCachedResolverPriv {
+    LmSocketAddress *sa;
+    GSource         *idle_source;
+};
+
+static void     cached_resolver_finalize (GObject          *object);
+static void     cached_resolver_cancel   (LmResolver       *resolver);
+static gboolean cache_refresh_cb         (CacheEntry       *entry);
+static void     cache_entry_unref        (CacheEntry       *entry);
+
+G_LOCK_DEFINE_STATIC (cache);
+static GHashTable *host_cache;
+static GHashTable *srv_cache;
+static gboolean    cache_enabled      = TRUE;
+static guint       prefetch_threshold = DEFAULT_PREFETCH_THRESHOLD;
+static guint       prefetch_max       = DEFAULT_PREFETCH_MAX;
+static guint       prefetch_in_flight;
+
+G_DEFINE_TYPE (LmCachedResolver, lm_cached_resolver, LM_TYPE_RESOLVER)
+
+static void
+lm_cached_resolver_class_init (LmCachedResolverClass *class)
+{
+    GObjectClass    *object_class   = G_OBJECT_CLASS (class);
+    LmResolverClass *resolver_class = LM_RESOLVER_CLASS (class);
+
+    object_class->finalize = cached_resolver_finalize;
+
+    resolver_class->cancel = cached_resolver_cancel;
+
+    g_type_class_add_private (object_class, sizeof (LmCachedResolverPriv));
+}
+
+static void
+lm_cached_resolver_init (LmCachedResolver *cached_resolver)
+{
+    LmCachedResolverPriv *priv;
+
+    priv = GET_PRIV (cached_resolver);
+}
+
+static void
+cached_resolver_cleanup (LmResolver *resolver)
+{
+    LmCachedResolverPriv *priv = GET_PRIV (resolver);
+
+    if (priv->idle_source) {
+        g_source_destroy (priv->idle_source);
+        priv->idle_source = NULL;
+    }
+
+    if (priv->sa) {
+        lm_socket_address_unref (priv->sa);
+        priv->sa = NULL;
+    }
+}
+
+static void
+cached_resolver_finalize (GObject *object)
+{
+    cached_resolver_cleanup (LM_RESOLVER (object));
+
+    (G_OBJECT_CLASS (lm_cached_resolver_parent_class)->finalize) (object);
+}
+
+static void
+cached_resolver_finished (LmResolver *resolver, LmResolverResult result)
+{
+    LmCachedResolverPriv *priv = GET_PRIV (resolver);
+
+    g_signal_emit_by_name (resolver, "finished", result, priv->sa);
+
+    cached_resolver_cleanup (resolver);
+
+    /* The initial reference is owned by LmResolver itself */
+    g_object_unref (resolver);
+}
+
+static gboolean
+cached_resolver_idle_cb (LmResolver *resolver)
+{
+    LmCachedResolverPriv *priv = GET_PRIV (resolver);
+
+    priv->idle_source = NULL;
+
+    cached_resolver_finished (resolver, LM_RESOLVER_RESULT_OK);
+
+    return FALSE;
+}
+
+static void
+cached_resolver_cancel (LmResolver *resolver)
+{
+    g_return_if_fail (LM_IS_CACHED_RESOLVER (resolver));
+
+    cached_resolver_finished (resolver, LM_RESOLVER_RESULT_CANCELLED);
+}
+
+/* Results can't be delivered before the caller connected to the
+ * finished signal.
+ */
+static LmResolver *
+cached_resolver_new (GMainContext *context, LmSocketAddress *sa)
+{
+    LmResolver           *resolver;
+    LmCachedResolverPriv *priv;
+
+    resolver = g_object_new (LM_TYPE_CACHED_RESOLVER, 
+                             "context", context, 
+                             NULL);
+
+    priv = GET_PRIV (resolver);
+    priv->sa = lm_socket_address_ref (sa);
+    priv->idle_source = lm_misc_add_idle (context,
+                                          (GSourceFunc) cached_resolver_idle_cb,
+                                          resolver);
+
+    return resolver;
+}
+
+/* -- Cache -- */
+
+static void
+cache_entry_clear (CacheEntry *entry)
+{
+    if (entry->refresh_source) {
+        g_source_destroy (entry->refresh_source);
+        entry->refresh_source = NULL;
+    }
+
+    if (entry->results) {
+        lm_socket_address_unref (entry->results);
+        entry->results = NULL;
+    }
+
+    g_free (entry->server);
+    entry->server = NULL;
+}
+
+static CacheEntry *
+cache_entry_ref (CacheEntry *entry)
+{
+    g_atomic_int_inc (&entry->ref_count);
+
+    return entry;
+}
+
+static void
+cache_entry_unref (CacheEntry *entry)
+{
+    if (!g_atomic_int_dec_and_test (&entry->ref_count)) {
+        return;
+    }
+
+    if (entry->context) {
+        g_main_context_unref (entry->context);
+    }
+
+    g_free (entry->name);
+    g_free (entry);
+}
+
+/* Called with the cache lock held, when the table drops the entry */
+static void
+cache_entry_remove (CacheEntry *entry)
+{
+    cache_entry_clear (entry);
+    cache_entry_unref (entry);
+}
+
+/* Called with the cache lock held */
+static void
+cache_entry_add_refresh (CacheEntry *entry, guint interval)
+{
+    GSource *source;
+
+    source = g_timeout_source_new (interval);
+    g_source_set_callback (source, (GSourceFunc) cache_refresh_cb,
+                           cache_entry_ref (entry),
+                           (GDestroyNotify) cache_entry_unref);
+    g_source_attach (source, entry->context);
+    g_source_unref (source);
+
+    entry->refresh_source = source;
+}
+
+static gboolean
+cache_entry_expired (gpointer key, CacheEntry *entry, gint64 *now)
+{
+    return entry->expires <= *now;
+}
+
+/* Called with the cache lock held */
+static GHashTable *
+cache_get_table (gboolean is_srv)
+{
+    GHashTable **table = is_srv ? &srv_cache : &host_cache;
+
+    if (!*table) {
+        *table = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, 
+                                        (GDestroyNotify) cache_entry_remove);
+    }
+
+    return *table;
+}
+
+/* Called with the cache lock held, counts the lookup */
+static CacheEntry *
+cache_lookup (const gchar *name, gboolean is_srv)
+{
+    GHashTable *table = cache_get_table (is_srv);
+    CacheEntry *entry;
+
+    entry = g_hash_table_lookup (table, name);
+    if (!entry) {
+        return NULL;
+    }
+
+    if (entry->expires <= g_get_monotonic_time ()) {
+        g_hash_table_remove (table, name);
+        return NULL;
+    }
+
+    entry->hits++;
+    entry->last_used = g_get_monotonic_time ();
+
+    return entry;
+}
+
+/* Called with the cache lock held, drops the expired entries or else the
+ * least recently used one.
+ */
+static void
+cache_make_room (GHashTable *table, gint64 now)
+{
+    GHashTableIter  iter;
+    CacheEntry     *entry;
+    CacheEntry     *lru = NULL;
+
+    g_hash_table_foreach_remove (table, 
+                                 (GHRFunc) cache_entry_expired, 
+                                 &now);
+    if (g_hash_table_size (table) < CACHE_MAX_ENTRIES) {
+        return;
+    }
+
+    g_hash_table_iter_init (&iter, table);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry)) {
+        if (!lru || entry->last_used < lru->last_used) {
+            lru = entry;
+        }
+    }
+
+    g_hash_table_remove (table, lru->name);
+}
+
+/* Called with the cache lock held */
+static void
+cache_entry_arm (CacheEntry *entry, guint ttl)
+{
+    guint ahead;
+
+    if (prefetch_threshold == 0) {
+        return;
+    }
+
+    ahead = MAX (ttl * CACHE_REFRESH_AHEAD / 100, CACHE_MIN_AHEAD);
+    if (ahead >= ttl) {
+        return;
+    }
+
+    cache_entry_add_refresh (entry, (ttl - ahead) * 1000);
+}
+
+/* Called with the cache lock held */
+static void
+cache_store (CacheRequest    *request,
+             LmSocketAddress *sa,
+             guint            ttl)
+{
+    GHashTable *table = cache_get_table (request->is_srv);
+    CacheEntry *entry;
+    gint64      now = g_get_monotonic_time ();
+
+    if (!cache_enabled) {
+        return;
+    }
+
+    if (!request->is_srv && !lm_socket_address_is_resolved (sa)) {
+        return;
+    }
+
+    if (ttl == 0) {
+        ttl = CACHE_DEFAULT_TTL;
+    }
+
+    entry = g_hash_table_lookup (table, request->name);
+    if (entry) {
+        cache_entry_clear (entry);
+    } else {
+        if (g_hash_table_size (table) >= CACHE_MAX_ENTRIES) {
+            cache_make_room (table, now);
+        }
+
+        entry = g_new0 (CacheEntry, 1);
+        entry->ref_count = 1;
+        entry->name   = g_strdup (request->name);
+        entry->is_srv = request->is_srv;
+        if (request->context) {
+            entry->context = g_main_context_ref (request->context);
+        }
+
+        g_hash_table_insert (table, entry->name, entry);
+    }
+
+    if (request->is_srv) {
+        entry->server = g_strdup (lm_socket_address_get_host (sa));
+        entry->port   = lm_socket_address_get_port (sa);
+    } else {
+        entry->results = lm_socket_address_copy (sa);
+    }
+
+    entry->expires   = now + (gint64) ttl * G_USEC_PER_SEC;
+    entry->last_used = now;
+
+    /* A refresh starts counting anew, a lookup counts itself */
+    if (request->refresh) {
+        entry->hits = 0;
+    } else {
+        entry->hits++;
+    }
+
+    cache_entry_arm (entry, ttl);
+}
+
+static void
+cache_request_free (CacheRequest *request)
+{
+    if (request->context) {
+        g_main_context_unref (request->context);
+    }
+
+    g_free (request->name);
+    g_free (request);
+}
+
+static CacheRequest *
+cache_request_new (const gchar  *name, 
+                   gboolean      is_srv, 
+                   gboolean      refresh,
+                   GMainContext *context)
+{
+    CacheRequest *request;
+
+    request = g_new0 (CacheRequest, 1);
+    request->name    = g_strdup (name);
+    request->is_srv  = is_srv;
+    request->refresh = refresh;
+    if (context) {
+        request->context = g_main_context_ref (context);
+    }
+
+    return request;
+}
+
+static void
+cache_finished_cb (LmResolver       *resolver,
+                   LmResolverResult  result,
+                   LmSocketAddress  *sa,
+                   CacheRequest     *request)
+{
+    guint ttl = _lm_resolver_get_ttl (resolver);
+
+    G_LOCK (cache);
+
+    if (request->refresh) {
+        prefetch_in_flight--;
+    }
+
+    if (result == LM_RESOLVER_RESULT_OK && sa) {
+        cache_store (request, sa, ttl);
+    } else if (result == LM_RESOLVER_RESULT_CANCELLED && sa &&
+               !request->is_srv && _lm_resolver_get_incremental (resolver)) {
+        /* LmSocket cancels once it has connected, keep what came in */
+        cache_store (request, sa, 
+                     ttl > 0 ? MIN (ttl, CACHE_PARTIAL_TTL) : CACHE_PARTIAL_TTL);
+    }
+
+    G_UNLOCK (cache);
+
+    cache_request_free (request);
+}
+
+/* The entry expires soon, look it up again if it was popular */
+static gboolean
+cache_refresh_cb (CacheEntry *entry)
+{
+    CacheRequest *request;
+
+    G_LOCK (cache);
+
+    /* Removed or stored again while this was waiting for the lock */
+    if (entry->refresh_source != g_main_current_source ()) {
+        G_UNLOCK (cache);
+        return FALSE;
+    }
+
+    entry->refresh_source = NULL;
+
+    if (entry->hits < prefetch_threshold || prefetch_threshold == 0) {
+        G_UNLOCK (cache);
+        return FALSE;
+    }
+
+    if (prefetch_in_flight >= prefetch_max) {
+        gint64 left = entry->expires - g_get_monotonic_time ();
+
+        if (left > CACHE_RETRY_DELAY * 1000) {
+            cache_entry_add_refresh (entry, CACHE_RETRY_DELAY);
+        }
+
+        G_UNLOCK (cache);
+        return FALSE;
+    }
+
+    prefetch_in_flight++;
+
+    request = cache_request_new (entry->name, entry->is_srv, TRUE,
+                                 entry->context);
+
+    G_UNLOCK (cache);
+
+    /* The result comes back through cache_finished_cb() */
+    _lm_resolver_lookup_uncached (request->context,
+                                  request->name,
+                                  request->is_srv,
+                                  G_CALLBACK (cache_finished_cb),
+                                  request);
+
+    return FALSE;
+}
+
+/* -- Public API -- */
+
+void
+lm_cached_resolver_set_enabled (gboolean enabled)
+{
+    G_LOCK (cache);
+
+    cache_enabled = enabled;
+
+    if (!enabled) {
+        if (host_cache) {
+            g_hash_table_remove_all (host_cache);
+        }
+
+        if (srv_cache) {
+            g_hash_table_remove_all (srv_cache);
+        }
+    }
+
+    G_UNLOCK (cache);
+}
+
+void
+lm_cached_resolver_set_prefetch (guint threshold, guint max_in_flight)
+{
+    G_LOCK (cache);
+    prefetch_threshold = threshold;
+    prefetch_max       = max_in_flight;
+    G_UNLOCK (cache);
+}
+
+LmResolver *
+_lm_cached_resolver_lookup_host (GMainContext    *context,
+                                 LmSocketAddress *sa)
+{
+    CacheEntry *entry = NULL;
+
+    G_LOCK (cache);
+
+    if (cache_enabled) {
+        entry = cache_lookup (lm_socket_address_get_host (sa), FALSE);
+        if (entry) {
+            lm_socket_address_copy_results (sa, entry->results);
+        }
+    }
+
+    G_UNLOCK (cache);
+
+    if (!entry) {
+        return NULL;
+    }
+
+    return cached_resolver_new (context, sa);
+}
+
+LmResolver *
+_lm_cached_resolver_lookup_srv (GMainContext *context, const gchar *srv)
+{
+    CacheEntry      *entry;
+    LmSocketAddress *sa = NULL;
+    LmResolver      *resolver;
+
+    G_LOCK (cache);
+
+    if (cache_enabled) {
+        entry = cache_lookup (srv, TRUE);
+        if (entry) {
+            sa = lm_socket_address_new (entry->server, entry->port);
+        }
+    }
+
+    G_UNLOCK (cache);
+
+    if (!sa) {
+        return NULL;
+    }
+
+    resolver = cached_resolver_new (context, sa);
+    lm_socket_address_unref (sa);
+
+    return resolver;
+}
+
+void
+_lm_cached_resolver_watch (LmResolver   *resolver,
+                           GMainContext *context,
+                           const gchar  *name,
+                           gboolean      is_srv)
+{
+    gboolean enabled;
+
+    G_LOCK (cache);
+    enabled = cache_enabled;
+    G_UNLOCK (cache);
+
+    if (!enabled) {
+        return;
+    }
+
+    g_signal_connect (resolver, "finished",
+                      G_CALLBACK (cache_finished_cb),
+                      cache_request_new (name, is_srv, FALSE, context));
+}
+
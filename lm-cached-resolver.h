@@ -0,0 +1,76 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_CACHED_RESOLVER_H__
+#define __LM_CACHED_RESOLVER_H__
+
+#include <glib-object.h>
+
+#include "lm-resolver.h" 
+
+G_BEGIN_DECLS
+
+#define LM_TYPE_CACHED_RESOLVER            (lm_cached_resolver_get_type ())
+#define LM_CACHED_RESOLVER(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), LM_TYPE_CACHED_RESOLVER, LmCachedResolver))
+#define LM_CACHED_RESOLVER_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), LM_TYPE_CACHED_RESOLVER, LmCachedResolverClass))
+#define LM_IS_CACHED_RESOLVER(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), LM_TYPE_CACHED_RESOLVER))
+#define LM_IS_CACHED_RESOLVER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), LM_TYPE_CACHED_RESOLVER))
+#define LM_CACHED_RESOLVER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), LM_TYPE_CACHED_RESOLVER, LmCachedResolverClass))
+
+typedef struct LmCachedResolver      LmCachedResolver;
+typedef struct LmCachedResolverClass LmCachedResolverClass;
+
+struct LmCachedResolver {
+    LmResolver parent;
+};
+
+struct LmCachedResolverClass {
+    LmResolverClass parent_class;
+};
+
+GType        lm_cached_resolver_get_type     (void);
+
+/* Host and SRV lookups are answered from memory for as long as their
+ * records live. Enabled by default.
+ */
+void         lm_cached_resolver_set_enabled  (gboolean          enabled);
+
+/* Names looked up at least threshold times while cached are resolved
+ * again shortly before they expire, at most max_in_flight at once. A
+ * threshold of 0 turns this off. Defaults to 3 and 4.
+ */
+void         lm_cached_resolver_set_prefetch (guint             threshold,
+                                              guint             max_in_flight);
+
+/* Used by LmResolver. The lookups return NULL if the name isn't cached,
+ * watch stores the result of a lookup that went to a backend.
+ */
+LmResolver * _lm_cached_resolver_lookup_host (GMainContext     *context,
+                                              LmSocketAddress  *sa);
+LmResolver * _lm_cached_resolver_lookup_srv  (GMainContext     *context,
+                                              const gchar      *srv);
+void         _lm_cached_resolver_watch       (LmResolver       *resolver,
+                                              GMainContext     *context,
+                                              const gchar      *name,
+                                              gboolean          is_srv);
+
+G_END_DECLS
+
+#endif /* __LM_CACHED_RESOLVER_H__ */
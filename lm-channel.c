@@ -21,6 +21,7 @@
 #include <config.h>
 
 #include "lm-marshal.h"
+#include "lm-gmain-reactor.h"
 #include "lm-channel.h"
 
 #define GET_PRIV(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), LM_TYPE_CHANNEL, LmChannelPriv))
@@ -28,6 +29,8 @@
 typedef struct LmChannelPriv LmChannelPriv;
 struct LmChannelPriv {
     GMainContext *context;
+    LmReactor    *reactor;
+    LmArena      *arena;
 
     LmChannel    *inner;
     LmChannel    *outer;
@@ -60,6 +63,8 @@ G_DEFINE_ABSTRACT_TYPE (LmChannel, lm_channel, G_TYPE_OBJECT)
 enum {
     PROP_0,
     PROP_CONTEXT,
+    PROP_REACTOR,
+    PROP_ARENA,
     PROP_INNER_CHANNEL,
     PROP_OUTER_CHANNEL
 };
@@ -75,6 +80,9 @@ enum {
 
 static guint signals[LAST_SIGNAL] = { 0 };
 
+/* Guards creating the default reactor */
+G_LOCK_DEFINE_STATIC (reactor);
+
 static void
 lm_channel_class_init (LmChannelClass *channel_class)
 {
@@ -95,6 +103,20 @@ lm_channel_class_init (LmChannelClass *channel_class)
                                   G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
     g_object_class_install_property (object_class, PROP_CONTEXT, pspec);
 
+    pspec = g_param_spec_object ("reactor",
+                                 "Reactor",
+                                 "Event loop to run this channel, defaults to one on the context",
+                                 LM_TYPE_REACTOR,
+                                 G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_property (object_class, PROP_REACTOR, pspec);
+
+    pspec = g_param_spec_boxed ("arena",
+                                "Arena",
+                                "Memory for the connection, defaults to that of the inner channel",
+                                LM_TYPE_ARENA,
+                                G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_property (object_class, PROP_ARENA, pspec);
+
     pspec = g_param_spec_object ("inner-channel",
                                  "Inner channel",
                                  "Channel encapsulated by this channel",
@@ -178,6 +200,14 @@ channel_finalize (GObject *object)
 
     priv = GET_PRIV (object);
 
+    if (priv->reactor) {
+        g_object_unref (priv->reactor);
+    }
+
+    if (priv->arena) {
+        lm_arena_unref (priv->arena);
+    }
+
     (G_OBJECT_CLASS (lm_channel_parent_class)->finalize) (object);
 }
 
@@ -195,6 +225,12 @@ channel_get_property (GObject    *object,
         case PROP_CONTEXT:
             g_value_set_pointer (value, priv->context);
             break;
+        case PROP_REACTOR:
+            g_value_set_object (value, lm_channel_get_reactor (LM_CHANNEL (object)));
+            break;
+        case PROP_ARENA:
+            g_value_set_boxed (value, lm_channel_get_arena (LM_CHANNEL (object)));
+            break;
         case PROP_INNER_CHANNEL:
             g_value_set_object (value, priv->inner);
             break;
@@ -225,6 +261,15 @@ channel_set_property (GObject      *object,
                 priv->context = g_main_context_ref (context);
             }
             break;
+        case PROP_REACTOR:
+            priv->reactor = g_value_dup_object (value);
+            break;
+        case PROP_ARENA:
+            if (priv->arena) {
+                lm_arena_unref (priv->arena);
+            }
+            priv->arena = g_value_dup_boxed (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
             break;
@@ -400,6 +445,59 @@ lm_channel_set_inner (LmChannel *channel, LmChannel *inner)
                       channel);
 }
 
+/* The reactor given at construction, otherwise that of the inner channel
+ * or one on the channel's context.
+ */
+LmReactor *
+lm_channel_get_reactor (LmChannel *channel)
+{
+    LmChannelPriv *priv;
+    LmReactor     *reactor;
+
+    g_return_val_if_fail (LM_IS_CHANNEL (channel), NULL);
+
+    priv = GET_PRIV (channel);
+
+    if (!priv->reactor && priv->inner) {
+        reactor = g_object_ref (lm_channel_get_reactor (priv->inner));
+    } else {
+        reactor = NULL;
+    }
+
+    /* Workers hand their results back through it */
+    G_LOCK (reactor);
+    if (!priv->reactor) {
+        priv->reactor = reactor ? reactor : lm_gmain_reactor_new (priv->context);
+        reactor = NULL;
+    }
+    G_UNLOCK (reactor);
+
+    if (reactor) {
+        g_object_unref (reactor);
+    }
+
+    return priv->reactor;
+}
+
+/* The arena set on the channel, otherwise that of the inner channel.
+ * NULL if there is none.
+ */
+LmArena *
+lm_channel_get_arena (LmChannel *channel)
+{
+    LmChannelPriv *priv;
+
+    g_return_val_if_fail (LM_IS_CHANNEL (channel), NULL);
+
+    priv = GET_PRIV (channel);
+
+    if (!priv->arena && priv->inner) {
+        return lm_channel_get_arena (priv->inner);
+    }
+
+    return priv->arena;
+}
+
 LmChannel *
 lm_channel_get_outer (LmChannel *channel)
 {
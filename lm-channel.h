@@ -32,6 +32,9 @@
 
 #include <glib-object.h>
 
+#include "lm-arena.h"
+#include "lm-reactor.h"
+
 G_BEGIN_DECLS
 
 #define LM_TYPE_CHANNEL            (lm_channel_get_type ())
@@ -95,6 +98,9 @@ GIOStatus      lm_channel_write             (LmChannel *channel,
 
 void           lm_channel_close             (LmChannel *channel);
 
+LmReactor *    lm_channel_get_reactor       (LmChannel *channel);
+LmArena *      lm_channel_get_arena         (LmChannel *channel);
+
 LmChannel *    lm_channel_get_inner         (LmChannel *channel);
 void           lm_channel_set_inner         (LmChannel *channel,
                                              LmChannel *inner);
@@ -0,0 +1,252 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Remembers how connecting to each remote IP went. Connect times are kept
+ * as a smoothed average like the TCP RTT estimate, failures as a score
+ * that halves every DESTINATION_FAILURE_HALF_LIFE seconds and is cleared
+ * by the next successful connect.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "lm-destination-history.h"
+
+#define DESTINATION_MAX_ENTRIES       1024
+#define DESTINATION_RTT_MAX_AGE       (30 * 60) /* Seconds */
+#define DESTINATION_FAILURE_HALF_LIFE 300       /* Seconds */
+/* Scores below this count as no failure at all */
+#define DESTINATION_FAILURE_FORGOTTEN 0.1
+
+typedef struct {
+    gint64  srtt;          /* Microseconds, 0 if none */
+    gint64  last_connect;
+    gdouble failures;
+    gint64  last_failure;
+} Destination;
+
+/* Textual address to Destination */
+G_LOCK_DEFINE_STATIC (history);
+static GHashTable *history;
+static gboolean    history_enabled = TRUE;
+
+static gboolean
+destination_get_key (const struct sockaddr *addr, gchar *buf, gsize len)
+{
+    const void *ip;
+
+    if (addr->sa_family == AF_INET6) {
+        ip = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+    } 
+    else if (addr->sa_family == AF_INET) {
+        ip = &((const struct sockaddr_in *) addr)->sin_addr;
+    } else {
+        return FALSE;
+    }
+
+    return inet_ntop (addr->sa_family, ip, buf, len) != NULL;
+}
+
+/* Halves every half-life and linearly in between, saves pulling in libm */
+static gdouble
+destination_decay (gdouble value, gint64 age)
+{
+    const gint64 half_life = DESTINATION_FAILURE_HALF_LIFE * G_USEC_PER_SEC;
+
+    while (age >= half_life && value >= DESTINATION_FAILURE_FORGOTTEN) {
+        value /= 2;
+        age   -= half_life;
+    }
+
+    value *= 1.0 - 0.5 * (gdouble) age / half_life;
+    if (value < DESTINATION_FAILURE_FORGOTTEN) {
+        return 0;
+    }
+
+    return value;
+}
+
+static gboolean
+destination_rtt_is_stale (Destination *dest, gint64 now)
+{
+    return now - dest->last_connect > 
+        (gint64) DESTINATION_RTT_MAX_AGE * G_USEC_PER_SEC;
+}
+
+static gboolean
+destination_is_forgotten (gpointer key, Destination *dest, gint64 *now)
+{
+    return (dest->srtt == 0 || destination_rtt_is_stale (dest, *now)) &&
+        destination_decay (dest->failures, *now - dest->last_failure) == 0;
+}
+
+/* Called with the lock held */
+static Destination *
+destination_get (const struct sockaddr *addr, gboolean create)
+{
+    gchar        key[INET6_ADDRSTRLEN];
+    Destination *dest;
+
+    if (!history_enabled || !destination_get_key (addr, key, sizeof (key))) {
+        return NULL;
+    }
+
+    if (!history) {
+        if (!create) {
+            return NULL;
+        }
+
+        history = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, g_free);
+    }
+
+    dest = g_hash_table_lookup (history, key);
+    if (dest || !create) {
+        return dest;
+    }
+
+    if (g_hash_table_size (history) >= DESTINATION_MAX_ENTRIES) {
+        gint64 now = g_get_monotonic_time ();
+
+        g_hash_table_foreach_remove (history,
+                                     (GHRFunc) destination_is_forgotten,
+                                     &now);
+        if (g_hash_table_size (history) >= DESTINATION_MAX_ENTRIES) {
+            return NULL;
+        }
+    }
+
+    dest = g_new0 (Destination, 1);
+    g_hash_table_insert (history, g_strdup (key), dest);
+
+    return dest;
+}
+
+void
+lm_destination_history_set_enabled (gboolean enabled)
+{
+    G_LOCK (history);
+
+    history_enabled = enabled;
+
+    G_UNLOCK (history);
+
+    if (!enabled) {
+        lm_destination_history_clear ();
+    }
+}
+
+void
+lm_destination_history_clear (void)
+{
+    G_LOCK (history);
+
+    if (history) {
+        g_hash_table_remove_all (history);
+    }
+
+    G_UNLOCK (history);
+}
+
+void
+_lm_destination_history_record_connect (const struct sockaddr *addr,
+                                        gint64                 rtt)
+{
+    Destination *dest;
+    gint64       now;
+
+    g_return_if_fail (addr != NULL);
+
+    now = g_get_monotonic_time ();
+    rtt = MAX (rtt, 1);
+
+    G_LOCK (history);
+
+    dest = destination_get (addr, TRUE);
+    if (dest) {
+        if (dest->srtt == 0 || destination_rtt_is_stale (dest, now)) {
+            dest->srtt = rtt;
+        } else {
+            dest->srtt += (rtt - dest->srtt) / 8;
+        }
+
+        dest->last_connect = now;
+        dest->failures     = 0;
+    }
+
+    G_UNLOCK (history);
+}
+
+void
+_lm_destination_history_record_failure (const struct sockaddr *addr)
+{
+    Destination *dest;
+    gint64       now;
+
+    g_return_if_fail (addr != NULL);
+
+    now = g_get_monotonic_time ();
+
+    G_LOCK (history);
+
+    dest = destination_get (addr, TRUE);
+    if (dest) {
+        dest->failures = destination_decay (dest->failures,
+                                            now - dest->last_failure) + 1;
+        dest->last_failure = now;
+    }
+
+    G_UNLOCK (history);
+}
+
+gboolean
+_lm_destination_history_get (const struct sockaddr *addr,
+                             gint64                *rtt,
+                             gdouble               *penalty)
+{
+    Destination *dest;
+    gint64       now;
+
+    g_return_val_if_fail (addr != NULL, FALSE);
+
+    now = g_get_monotonic_time ();
+
+    *rtt     = 0;
+    *penalty = 0;
+
+    G_LOCK (history);
+
+    dest = destination_get (addr, FALSE);
+    if (dest) {
+        if (!destination_rtt_is_stale (dest, now)) {
+            *rtt = dest->srtt;
+        }
+
+        *penalty = destination_decay (dest->failures, 
+                                      now - dest->last_failure);
+    }
+
+    G_UNLOCK (history);
+
+    return dest != NULL;
+}
@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_DESTINATION_HISTORY_H__
+#define __LM_DESTINATION_HISTORY_H__
+
+#include <glib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+G_BEGIN_DECLS
+
+/* Process-wide connect history per remote IP, shared by all sockets. Used
+ * to order the results of an LmSocketAddress before connecting.
+ */
+
+/* Enabled by default */
+void     lm_destination_history_set_enabled      (gboolean               enabled);
+void     lm_destination_history_clear            (void);
+
+void     _lm_destination_history_record_connect (const struct sockaddr *addr,
+                                                  gint64                 rtt);
+void     _lm_destination_history_record_failure  (const struct sockaddr *addr);
+
+/* Fills in the smoothed connect time in microseconds, 0 if unknown or
+ * stale, and the failure penalty, which decays over time. Returns FALSE if
+ * nothing is known about addr.
+ */
+gboolean _lm_destination_history_get             (const struct sockaddr *addr,
+                                                  gint64                *rtt,
+                                                  gdouble               *penalty);
+
+G_END_DECLS
+
+#endif /* __LM_DESTINATION_HISTORY_H__ */
@@ -0,0 +1,1670 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * DNS stub resolver that talks to the nameservers directly from the
+ * GMainContext of the resolver. Every query is sent to all configured
+ * nameservers at once and the first usable answer wins. Truncated answers
+ * are retried over TCP to the server that sent them.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+/* Needed on Mac OS X */
+#if HAVE_ARPA_NAMESER_COMPAT_H
+#include <arpa/nameser_compat.h>
+#endif
+
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include "lm-marshal.h"
+#include "lm-misc.h"
+#include "lm-sock.h"
+#include "lm-dns-resolver.h"
+
+#define RESOLV_CONF_FILE      "/etc/resolv.conf"
+
+#define DNS_PORT              53
+#define DNS_MAX_SERVERS       3
+#define DNS_DEFAULT_TIMEOUT   5
+#define DNS_DEFAULT_ATTEMPTS  2
+#define DNS_UDP_PACKET        4096
+#define DNS_MAX_SEARCH        6
+#define DNS_MAX_NAME          256
+#define DNS_DEFAULT_NDOTS     1
+/* Longest CNAME chain followed in an answer */
+#define DNS_MAX_CNAMES        8
+
+#define GET_PRIV(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), LM_TYPE_DNS_RESOLVER, LmDnsResolverPriv))
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+} DnsServer;
+
+typedef struct {
+    DnsServer servers[DNS_MAX_SERVERS];
+    guint     n_servers;
+    guint     timeout;
+    guint     attempts;
+
+    /* Names with fewer dots than ndots go through the search list first */
+    gchar     search[DNS_MAX_SEARCH][DNS_MAX_NAME];
+    guint     n_search;
+    guint     ndots;
+} DnsConfig;
+
+typedef struct {
+    LmDnsResolver *resolver;
+
+    guint16        type;
+    guint16        id;
+    guchar        *packet;
+    gsize          packet_len;
+
+    guint          attempts;
+    guint          failures;
+    gboolean       done;
+
+    /* Addresses handed out by an incremental lookup */
+    gboolean       delivered;
+
+    /* Answers are routed to the query by id */
+    gboolean       registered;
+
+    /* NULL if the query failed */
+    guchar        *answer;
+    gsize          answer_len;
+
+    /* TCP fallback after a truncated answer */
+    LmSocketHandle tcp_fd;
+    GIOChannel    *tcp_channel;
+    GSource       *tcp_watch;
+    GByteArray    *tcp_buf;
+} DnsQuery;
+
+typedef struct {
+    LmSocketHandle  fd;
+    GIOChannel     *channel;
+    GSource        *watch;
+} DnsSocket;
+
+/* The UDP sockets are shared by all resolvers on a main context, answers
+ * are matched to their query by id and question.
+ */
+typedef struct {
+    GMainContext   *context;
+    guint           ref_count;
+
+    DnsSocket       udp4;
+    DnsSocket       udp6;
+
+    /* Query id to DnsQuery */
+    GHashTable     *queries;
+} DnsShared;
+
+typedef struct LmDnsResolverPriv LmDnsResolverPriv;
+struct LmDnsResolverPriv {
+    DnsConfig        config;
+
+    DnsShared       *shared;
+
+    GSource         *timeout_source;
+    GSource         *idle_source;
+
+    /* Early resend when the lookup is slower than most */
+    GSource         *hedge_source;
+    gboolean         hedged;
+    gint64           start_time;
+
+    /* AAAA and A for host lookups, SRV for service lookups */
+    DnsQuery        *queries[2];
+    guint            n_queries;
+
+    /* The name with the search domains, in the order they are tried */
+    gchar          **names;
+    guint            name_index;
+
+    LmSocketAddress *sa;
+    gboolean         is_srv;
+};
+
+G_LOCK_DEFINE_STATIC (dns_config);
+static DnsConfig dns_config;
+static time_t    dns_config_mtime = -1;
+static gboolean  dns_config_override = FALSE;
+
+G_LOCK_DEFINE_STATIC (dns_shared);
+static GHashTable *dns_shared_table = NULL;
+
+static void     dns_resolver_finalize    (GObject          *object);
+static void     dns_resolver_lookup_host (LmResolver       *resolver,
+                                          LmSocketAddress  *sa);
+static void     dns_resolver_lookup_srv  (LmResolver       *resolver,
+                                          const gchar      *srv);
+static void     dns_resolver_cancel      (LmResolver       *resolver);
+static void     dns_resolver_cleanup     (LmDnsResolver    *resolver);
+static gboolean dns_resolver_check_done  (LmDnsResolver    *resolver);
+static gboolean dns_shared_add_query     (DnsShared        *shared,
+                                          DnsQuery         *query);
+static void     dns_shared_remove_query  (DnsShared        *shared,
+                                          DnsQuery         *query);
+
+G_DEFINE_TYPE (LmDnsResolver, lm_dns_resolver, LM_TYPE_RESOLVER)
+
+static void
+lm_dns_resolver_class_init (LmDnsResolverClass *class)
+{
+    GObjectClass    *object_class   = G_OBJECT_CLASS (class);
+    LmResolverClass *resolver_class = LM_RESOLVER_CLASS (class);
+
+    object_class->finalize = dns_resolver_finalize;
+
+    resolver_class->lookup_host = dns_resolver_lookup_host;
+    resolver_class->lookup_srv  = dns_resolver_lookup_srv;
+    resolver_class->cancel      = dns_resolver_cancel;
+
+    g_type_class_add_private (object_class, sizeof (LmDnsResolverPriv));
+}
+
+static void
+lm_dns_resolver_init (LmDnsResolver *dns_resolver)
+{
+}
+
+static void
+dns_resolver_finalize (GObject *object)
+{
+    dns_resolver_cleanup (LM_DNS_RESOLVER (object));
+
+    (G_OBJECT_CLASS (lm_dns_resolver_parent_class)->finalize) (object);
+}
+
+/* -- Configuration -- */
+
+static gboolean
+dns_parse_server (const gchar *str, DnsServer *server)
+{
+    gchar       *host;
+    const gchar *port_str = NULL;
+    guint        port = DNS_PORT;
+    gboolean     ret = TRUE;
+
+    memset (server, 0, sizeof (DnsServer));
+
+    if (str[0] == '[') {
+        const gchar *end = strchr (str, ']');
+
+        if (!end) {
+            return FALSE;
+        }
+        host = g_strndup (str + 1, end - str - 1);
+        if (end[1] == ':') {
+            port_str = end + 2;
+        }
+    } else if (strchr (str, ':') && strchr (str, ':') == strrchr (str, ':')) {
+        /* A single colon, IPv4 address and port */
+        const gchar *colon = strchr (str, ':');
+
+        host = g_strndup (str, colon - str);
+        port_str = colon + 1;
+    } else {
+        host = g_strdup (str);
+    }
+
+    if (port_str) {
+        port = atoi (port_str);
+        if (port == 0 || port > 65535) {
+            g_free (host);
+            return FALSE;
+        }
+    }
+
+    if (strchr (host, ':')) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &server->addr;
+
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port   = htons (port);
+        ret = inet_pton (AF_INET6, host, &sin6->sin6_addr) == 1;
+        server->addr_len = sizeof (struct sockaddr_in6);
+    } else {
+        struct sockaddr_in *sin = (struct sockaddr_in *) &server->addr;
+
+        sin->sin_family = AF_INET;
+        sin->sin_port   = htons (port);
+        ret = inet_pton (AF_INET, host, &sin->sin_addr) == 1;
+        server->addr_len = sizeof (struct sockaddr_in);
+    }
+
+    g_free (host);
+
+    return ret;
+}
+
+static void
+dns_config_load_resolv_conf (DnsConfig *config)
+{
+    gchar  *contents;
+    gchar **lines;
+    guint   i;
+
+    memset (config, 0, sizeof (DnsConfig));
+    config->timeout  = DNS_DEFAULT_TIMEOUT;
+    config->attempts = DNS_DEFAULT_ATTEMPTS;
+    config->ndots    = DNS_DEFAULT_NDOTS;
+
+    if (!g_file_get_contents (RESOLV_CONF_FILE, &contents, NULL, NULL)) {
+        return;
+    }
+
+    lines = g_strsplit (contents, "\n", -1);
+    g_free (contents);
+
+    for (i = 0; lines[i]; i++) {
+        gchar **words;
+
+        words = g_strsplit_set (g_strstrip (lines[i]), " \t", -1);
+
+        if (g_strcmp0 (words[0], "nameserver") == 0 && words[1] &&
+            config->n_servers < DNS_MAX_SERVERS) {
+            if (dns_parse_server (words[1], &config->servers[config->n_servers])) {
+                config->n_servers++;
+            }
+        } else if (g_strcmp0 (words[0], "search") == 0 ||
+                   g_strcmp0 (words[0], "domain") == 0) {
+            guint j;
+
+            /* The last of them wins, domain only has one */
+            config->n_search = 0;
+            for (j = 1; words[j] && config->n_search < DNS_MAX_SEARCH; j++) {
+                if (words[j][0] == '\0' || 
+                    strlen (words[j]) >= DNS_MAX_NAME) {
+                    continue;
+                }
+                g_strlcpy (config->search[config->n_search++], words[j],
+                           DNS_MAX_NAME);
+                if (words[0][0] == 'd') {
+                    break;
+                }
+            }
+        } else if (g_strcmp0 (words[0], "options") == 0) {
+            guint j;
+
+            for (j = 1; words[j]; j++) {
+                if (g_str_has_prefix (words[j], "ndots:")) {
+                    config->ndots = CLAMP (atoi (words[j] + 6), 0, 15);
+                } else if (g_str_has_prefix (words[j], "timeout:")) {
+                    config->timeout = CLAMP (atoi (words[j] + 8), 1, 30);
+                } else if (g_str_has_prefix (words[j], "attempts:")) {
+                    config->attempts = CLAMP (atoi (words[j] + 9), 1, 5);
+                }
+            }
+        }
+
+        g_strfreev (words);
+    }
+
+    g_strfreev (lines);
+}
+
+static void
+dns_config_get (DnsConfig *config)
+{
+    G_LOCK (dns_config);
+
+    if (!dns_config_override) {
+        struct stat st;
+
+        if (stat (RESOLV_CONF_FILE, &st) != 0) {
+            st.st_mtime = 0;
+        }
+
+        if (st.st_mtime != dns_config_mtime) {
+            dns_config_load_resolv_conf (&dns_config);
+            dns_config_mtime = st.st_mtime;
+        }
+    }
+
+    *config = dns_config;
+
+    G_UNLOCK (dns_config);
+}
+
+/* The names to try for name, like res_search() does */
+static gchar **
+dns_config_expand_name (DnsConfig *config, const gchar *name)
+{
+    GPtrArray   *names;
+    const gchar *p;
+    guint        dots = 0;
+    guint        i;
+
+    names = g_ptr_array_new ();
+
+    for (p = name; *p; p++) {
+        if (*p == '.') {
+            dots++;
+        }
+    }
+
+    if (p > name && p[-1] == '.') {
+        /* Fully qualified */
+        g_ptr_array_add (names, g_strdup (name));
+    } else {
+        if (dots >= config->ndots) {
+            g_ptr_array_add (names, g_strdup (name));
+        }
+
+        for (i = 0; i < config->n_search; i++) {
+            g_ptr_array_add (names, 
+                             g_strconcat (name, ".", config->search[i], NULL));
+        }
+
+        if (dots < config->ndots) {
+            g_ptr_array_add (names, g_strdup (name));
+        }
+    }
+
+    g_ptr_array_add (names, NULL);
+
+    return (gchar **) g_ptr_array_free (names, FALSE);
+}
+
+gboolean
+lm_dns_resolver_set_nameservers (const gchar **nameservers)
+{
+    DnsConfig config;
+    guint     i;
+
+    if (!nameservers) {
+        G_LOCK (dns_config);
+        dns_config_override = FALSE;
+        dns_config_mtime = -1;
+        G_UNLOCK (dns_config);
+
+        return TRUE;
+    }
+
+    memset (&config, 0, sizeof (DnsConfig));
+    config.timeout  = DNS_DEFAULT_TIMEOUT;
+    config.attempts = DNS_DEFAULT_ATTEMPTS;
+    config.ndots    = DNS_DEFAULT_NDOTS;
+
+    for (i = 0; nameservers[i] && config.n_servers < DNS_MAX_SERVERS; i++) {
+        if (!dns_parse_server (nameservers[i], &config.servers[config.n_servers])) {
+            g_warning ("Invalid nameserver '%s'", nameservers[i]);
+            return FALSE;
+        }
+        config.n_servers++;
+    }
+
+    G_LOCK (dns_config);
+    dns_config = config;
+    dns_config_override = TRUE;
+    G_UNLOCK (dns_config);
+
+    return TRUE;
+}
+
+/* -- Packets -- */
+
+static gboolean
+dns_query_build (DnsQuery *query, const gchar *name)
+{
+    GByteArray  *packet;
+    gchar      **labels;
+    guint8       header[HFIXEDSZ];
+    guint8       tail[QFIXEDSZ];
+    guint        i;
+
+    packet = g_byte_array_new ();
+
+    memset (header, 0, sizeof (header));
+    header[0] = query->id >> 8;
+    header[1] = query->id & 0xff;
+    header[2] = 0x01; /* Recursion desired */
+    header[5] = 1;    /* One question */
+    g_byte_array_append (packet, header, sizeof (header));
+
+    labels = g_strsplit (name, ".", -1);
+    for (i = 0; labels[i]; i++) {
+        guint8 len = strlen (labels[i]);
+
+        if (len == 0) {
+            /* Trailing dot */
+            continue;
+        }
+        if (strlen (labels[i]) > 63) {
+            g_strfreev (labels);
+            g_byte_array_free (packet, TRUE);
+            return FALSE;
+        }
+
+        g_byte_array_append (packet, &len, 1);
+        g_byte_array_append (packet, (guint8 *) labels[i], len);
+    }
+    g_strfreev (labels);
+
+    tail[0] = 0;
+    g_byte_array_append (packet, tail, 1);
+
+    tail[0] = query->type >> 8;
+    tail[1] = query->type & 0xff;
+    tail[2] = 0;
+    tail[3] = C_IN;
+    g_byte_array_append (packet, tail, QFIXEDSZ);
+
+    if (packet->len > HFIXEDSZ + MAXCDNAME + QFIXEDSZ) {
+        g_byte_array_free (packet, TRUE);
+        return FALSE;
+    }
+
+    query->packet_len = packet->len;
+    query->packet = g_byte_array_free (packet, FALSE);
+
+    return TRUE;
+}
+
+/* The answer has to be for our id and repeat our question */
+static gboolean
+dns_query_matches (DnsQuery *query, const guchar *buf, gsize len)
+{
+    gsize i;
+
+    if (len < query->packet_len) {
+        return FALSE;
+    }
+
+    if (((buf[0] << 8) | buf[1]) != query->id) {
+        return FALSE;
+    }
+
+    /* QR bit */
+    if (!(buf[2] & 0x80)) {
+        return FALSE;
+    }
+
+    for (i = HFIXEDSZ; i < query->packet_len; i++) {
+        if (g_ascii_tolower (buf[i]) != g_ascii_tolower (query->packet[i])) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+typedef struct {
+    gchar         owner[MAXDNAME];
+    guint         type;
+    guint         ttl;
+    const guchar *rdata;
+    guint         rdlen;
+} DnsRecord;
+
+/* Expands the name of the first question and moves pos past the
+ * question section.
+ */
+static gboolean
+dns_parse_question (const guchar  *buf,
+                    gsize          len,
+                    const guchar **pos,
+                    gchar         *qname)
+{
+    const guchar *end = buf + len;
+    guint         qdcount = (buf[4] << 8) | buf[5];
+    gint          n;
+
+    *pos = buf + HFIXEDSZ;
+
+    if (qdcount == 0) {
+        return FALSE;
+    }
+
+    if (dn_expand (buf, end, *pos, qname, MAXDNAME) < 0) {
+        return FALSE;
+    }
+
+    while (qdcount-- > 0) {
+        n = dn_skipname (*pos, end);
+        if (n < 0 || end - *pos < n + QFIXEDSZ) {
+            return FALSE;
+        }
+        *pos += n + QFIXEDSZ;
+    }
+
+    return TRUE;
+}
+
+/* Reads the resource record at pos and moves past it */
+static gboolean
+dns_parse_record (const guchar  *buf,
+                  gsize          len,
+                  const guchar **pos,
+                  DnsRecord     *rr)
+{
+    const guchar *end = buf + len;
+    const guchar *p = *pos;
+    gint          n;
+
+    n = dn_expand (buf, end, p, rr->owner, MAXDNAME);
+    if (n < 0 || end - p < n + RRFIXEDSZ) {
+        return FALSE;
+    }
+    p += n;
+
+    rr->type  = (p[0] << 8) | p[1];
+    rr->ttl   = ((guint) p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+    rr->rdlen = (p[8] << 8) | p[9];
+    p += RRFIXEDSZ;
+
+    if ((gsize) (end - p) < rr->rdlen) {
+        return FALSE;
+    }
+
+    rr->rdata = p;
+    *pos = p + rr->rdlen;
+
+    return TRUE;
+}
+
+/* Appends the A or AAAA records of the answer section to list, ttl is
+ * lowered to the shortest lived of them. Only records of the question
+ * name or of the CNAME chain starting there count, a server can't slip
+ * in addresses for other names.
+ */
+static struct addrinfo *
+dns_parse_addresses (const guchar    *buf,
+                     gsize            len,
+                     struct addrinfo *list,
+                     guint           *ttl)
+{
+    const guchar    *answers;
+    const guchar    *pos;
+    struct addrinfo *last = list;
+    gchar            chain[DNS_MAX_CNAMES + 1][MAXDNAME];
+    guint            n_chain = 1;
+    guint            ancount;
+    guint            i;
+    gboolean         grew;
+    DnsRecord        rr;
+
+    ancount = (buf[6] << 8) | buf[7];
+
+    while (last && last->ai_next) {
+        last = last->ai_next;
+    }
+
+    if (!dns_parse_question (buf, len, &answers, chain[0])) {
+        return list;
+    }
+
+    /* The CNAMEs may come in any order */
+    do {
+        grew = FALSE;
+        pos  = answers;
+
+        for (i = 0; i < ancount && dns_parse_record (buf, len, &pos, &rr); i++) {
+            if (rr.type != T_CNAME ||
+                g_ascii_strcasecmp (rr.owner, chain[n_chain - 1]) != 0) {
+                continue;
+            }
+
+            if (dn_expand (buf, buf + len, rr.rdata, 
+                           chain[n_chain], MAXDNAME) >= 0) {
+                n_chain++;
+                grew = TRUE;
+            }
+            break;
+        }
+    } while (grew && n_chain <= DNS_MAX_CNAMES);
+
+    pos = answers;
+    for (i = 0; i < ancount && dns_parse_record (buf, len, &pos, &rr); i++) {
+        struct addrinfo *ai = NULL;
+        guint            j;
+
+        for (j = 0; j < n_chain; j++) {
+            if (g_ascii_strcasecmp (rr.owner, chain[j]) == 0) {
+                break;
+            }
+        }
+        if (j == n_chain) {
+            continue;
+        }
+
+        if (rr.type == T_A && rr.rdlen == 4) {
+            ai = _lm_resolver_new_addrinfo (AF_INET, rr.rdata);
+        } else if (rr.type == T_AAAA && rr.rdlen == 16) {
+            ai = _lm_resolver_new_addrinfo (AF_INET6, rr.rdata);
+        }
+
+        if (ai) {
+            if (*ttl == 0 || rr.ttl < *ttl) {
+                *ttl = rr.ttl;
+            }
+
+            if (last) {
+                last->ai_next = ai;
+            } else {
+                list = ai;
+            }
+            last = ai;
+        }
+    }
+
+    return list;
+}
+
+/* -- Queries -- */
+
+static DnsQuery *
+dns_query_new (LmDnsResolver *resolver, guint16 type, const gchar *name)
+{
+    LmDnsResolverPriv *priv = GET_PRIV (resolver);
+    DnsQuery          *query;
+
+    query = g_slice_new0 (DnsQuery);
+    query->resolver = resolver;
+    query->type     = type;
+    query->tcp_fd   = -1;
+
+    if (!dns_shared_add_query (priv->shared, query)) {
+        g_warning ("Too many DNS queries in flight");
+        query->done = TRUE;
+    } else if (!dns_query_build (query, name)) {
+        g_warning ("Invalid name for DNS lookup: %s", name);
+        query->done = TRUE;
+    }
+
+    return query;
+}
+
+static void
+dns_query_stop_tcp (DnsQuery *query)
+{
+    if (query->tcp_watch) {
+        g_source_destroy (query->tcp_watch);
+        query->tcp_watch = NULL;
+    }
+
+    if (query->tcp_channel) {
+        g_io_channel_unref (query->tcp_channel);
+        query->tcp_channel = NULL;
+    }
+
+    if (query->tcp_fd >= 0) {
+        _lm_sock_close (query->tcp_fd);
+        query->tcp_fd = -1;
+    }
+
+    if (query->tcp_buf) {
+        g_byte_array_free (query->tcp_buf, TRUE);
+        query->tcp_buf = NULL;
+    }
+}
+
+static void
+dns_query_free (DnsQuery *query)
+{
+    LmDnsResolverPriv *priv = GET_PRIV (query->resolver);
+
+    if (query->registered) {
+        dns_shared_remove_query (priv->shared, query);
+    }
+
+    dns_query_stop_tcp (query);
+
+    g_free (query->packet);
+    g_free (query->answer);
+
+    g_slice_free (DnsQuery, query);
+}
+
+static void
+dns_query_finish (DnsQuery *query, const guchar *answer, gsize len)
+{
+    /* The answer may live in the TCP buffer */
+    if (answer) {
+        query->answer     = g_malloc (len);
+        query->answer_len = len;
+        memcpy (query->answer, answer, len);
+    }
+
+    query->done = TRUE;
+    dns_query_stop_tcp (query);
+}
+
+/* Returns TRUE if the resolver finished */
+static gboolean
+dns_query_handle_answer (DnsQuery     *query,
+                         const guchar *buf,
+                         gsize         len)
+{
+    LmDnsResolverPriv *priv = GET_PRIV (query->resolver);
+    guint              rcode = buf[3] & 0x0f;
+
+    if (rcode == NOERROR || rcode == NXDOMAIN) {
+        if (rcode == NXDOMAIN) {
+            _lm_resolver_set_error (LM_RESOLVER (query->resolver),
+                                    LM_RESOLVER_ERROR_NOT_FOUND);
+        }
+        dns_query_finish (query, rcode == NOERROR ? buf : NULL, len);
+    } else {
+        /* SERVFAIL, REFUSED, ... Another server might do better */
+        query->failures++;
+        if (query->failures >= priv->config.n_servers) {
+            _lm_resolver_set_error (LM_RESOLVER (query->resolver),
+                                    LM_RESOLVER_ERROR_TEMPORARY);
+            dns_query_finish (query, NULL, 0);
+        }
+    }
+
+    return dns_resolver_check_done (query->resolver);
+}
+
+static DnsSocket *
+dns_shared_get_socket (DnsShared *shared, int family)
+{
+    return family == AF_INET6 ? &shared->udp6 : &shared->udp4;
+}
+
+static void
+dns_query_transmit (DnsQuery *query)
+{
+    LmDnsResolverPriv *priv = GET_PRIV (query->resolver);
+    guint              i;
+
+    /* Race all the servers */
+    for (i = 0; i < priv->config.n_servers; i++) {
+        DnsServer *server = &priv->config.servers[i];
+        DnsSocket *sock;
+
+        sock = dns_shared_get_socket (priv->shared, server->addr.ss_family);
+        if (sock->fd < 0) {
+            continue;
+        }
+
+        sendto (sock->fd, query->packet, query->packet_len, 0,
+                (struct sockaddr *) &server->addr, server->addr_len);
+    }
+}
+
+static void
+dns_query_send (DnsQuery *query)
+{
+    query->attempts++;
+
+    dns_query_transmit (query);
+}
+
+static gboolean
+dns_query_tcp_in_cb (GIOChannel   *source,
+                     GIOCondition  condition,
+                     DnsQuery     *query)
+{
+    guchar  buf[DNS_UDP_PACKET];
+    guchar *answer;
+    gssize  len;
+    gsize   answer_len;
+
+    len = recv (query->tcp_fd, buf, sizeof (buf), 0);
+    if (len < 0 && _lm_sock_is_blocking_error (errno)) {
+        return TRUE;
+    }
+
+    if (len <= 0) {
+        query->tcp_watch = NULL;
+        dns_query_finish (query, NULL, 0);
+        dns_resolver_check_done (query->resolver);
+        return FALSE;
+    }
+
+    g_byte_array_append (query->tcp_buf, buf, len);
+
+    if (query->tcp_buf->len < 2) {
+        return TRUE;
+    }
+
+    answer_len = (query->tcp_buf->data[0] << 8) | query->tcp_buf->data[1];
+    if (query->tcp_buf->len < answer_len + 2) {
+        return TRUE;
+    }
+
+    query->tcp_watch = NULL;
+    answer = query->tcp_buf->data + 2;
+
+    /* Only one server is asked over TCP so its answer is final */
+    if (answer_len < HFIXEDSZ ||
+        !dns_query_matches (query, answer, answer_len) ||
+        (answer[3] & 0x0f) != NOERROR) {
+        dns_query_finish (query, NULL, 0);
+    } else {
+        dns_query_finish (query, answer, answer_len);
+    }
+
+    dns_resolver_check_done (query->resolver);
+
+    return FALSE;
+}
+
+static gboolean
+dns_query_tcp_out_cb (GIOChannel   *source,
+                      GIOCondition  condition,
+                      DnsQuery     *query)
+{
+    GMainContext      *context;
+    guchar            *buf;
+    gssize             sent;
+    int                err = 0;
+    socklen_t          err_len = sizeof (err);
+
+    _lm_sock_get_error (query->tcp_fd, &err, &err_len);
+
+    buf = g_malloc (query->packet_len + 2);
+    buf[0] = query->packet_len >> 8;
+    buf[1] = query->packet_len & 0xff;
+    memcpy (buf + 2, query->packet, query->packet_len);
+
+    /* Small enough to always fit in the send buffer of a new socket */
+    sent = err ? -1 : send (query->tcp_fd, buf, query->packet_len + 2, 0);
+    g_free (buf);
+
+    query->tcp_watch = NULL;
+
+    if (sent != (gssize) query->packet_len + 2) {
+        dns_query_finish (query, NULL, 0);
+        dns_resolver_check_done (query->resolver);
+        return FALSE;
+    }
+
+    g_object_get (query->resolver, "context", &context, NULL);
+
+    query->tcp_buf = g_byte_array_new ();
+    query->tcp_watch = lm_misc_add_io_watch (context,
+                                             query->tcp_channel,
+                                             G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                             (GIOFunc) dns_query_tcp_in_cb,
+                                             query);
+
+    return FALSE;
+}
+
+static gboolean
+dns_query_start_tcp (DnsQuery *query, DnsServer *server)
+{
+    GMainContext *context;
+
+    if (query->tcp_fd >= 0) {
+        /* Already on its way */
+        return TRUE;
+    }
+
+    query->tcp_fd = socket (server->addr.ss_family, SOCK_STREAM, 0);
+    if (!_LM_SOCK_VALID (query->tcp_fd)) {
+        query->tcp_fd = -1;
+        return FALSE;
+    }
+
+    _lm_sock_set_blocking (query->tcp_fd, FALSE);
+
+    if (connect (query->tcp_fd, (struct sockaddr *) &server->addr,
+                 server->addr_len) < 0 &&
+        !_lm_sock_is_blocking_error (_lm_sock_get_last_error ())) {
+        dns_query_stop_tcp (query);
+        return FALSE;
+    }
+
+    g_object_get (query->resolver, "context", &context, NULL);
+
+    /* The retransmit timer now counts towards the TCP attempt */
+    query->attempts = 0;
+
+    query->tcp_channel = g_io_channel_unix_new (query->tcp_fd);
+    query->tcp_watch = lm_misc_add_io_watch (context,
+                                             query->tcp_channel,
+                                             G_IO_OUT | G_IO_ERR,
+                                             (GIOFunc) dns_query_tcp_out_cb,
+                                             query);
+
+    return TRUE;
+}
+
+/* -- Resolver -- */
+
+static DnsServer *
+dns_resolver_find_server (LmDnsResolver         *resolver,
+                          struct sockaddr_storage *from,
+                          socklen_t              from_len)
+{
+    LmDnsResolverPriv *priv = GET_PRIV (resolver);
+    guint              i;
+
+    for (i = 0; i < priv->config.n_servers; i++) {
+        DnsServer *server = &priv->config.servers[i];
+
+        if (server->addr_len == from_len &&
+            memcmp (&server->addr, from, from_len) == 0) {
+            return server;
+        }
+    }
+
+    return NULL;
+}
+
+/* -- Shared sockets -- */
+
+static DnsShared *
+dns_shared_get (GMainContext *context)
+{
+    DnsShared *shared;
+
+    G_LOCK (dns_shared);
+
+    if (!dns_shared_table) {
+        dns_shared_table = g_hash_table_new (g_direct_hash, g_direct_equal);
+    }
+
+    shared = g_hash_table_lookup (dns_shared_table, context);
+    if (!shared) {
+        shared = g_slice_new0 (DnsShared);
+        shared->context = context ? g_main_context_ref (context) : NULL;
+        shared->udp4.fd = -1;
+        shared->udp6.fd = -1;
+        shared->queries = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+        g_hash_table_insert (dns_shared_table, context, shared);
+    }
+
+    shared->ref_count++;
+
+    G_UNLOCK (dns_shared);
+
+    return shared;
+}
+
+static void
+dns_shared_ref (DnsShared *shared)
+{
+    G_LOCK (dns_shared);
+    shared->ref_count++;
+    G_UNLOCK (dns_shared);
+}
+
+static void
+dns_shared_close_socket (DnsSocket *sock)
+{
+    if (sock->watch) {
+        g_source_destroy (sock->watch);
+        sock->watch = NULL;
+    }
+
+    if (sock->channel) {
+        g_io_channel_unref (sock->channel);
+        sock->channel = NULL;
+    }
+
+    if (sock->fd >= 0) {
+        _lm_sock_close (sock->fd);
+        sock->fd = -1;
+    }
+}
+
+static void
+dns_shared_unref (DnsShared *shared)
+{
+    G_LOCK (dns_shared);
+
+    shared->ref_count--;
+    if (shared->ref_count > 0) {
+        G_UNLOCK (dns_shared);
+        return;
+    }
+
+    g_hash_table_remove (dns_shared_table, shared->context);
+
+    G_UNLOCK (dns_shared);
+
+    dns_shared_close_socket (&shared->udp4);
+    dns_shared_close_socket (&shared->udp6);
+
+    g_hash_table_destroy (shared->queries);
+
+    if (shared->context) {
+        g_main_context_unref (shared->context);
+    }
+
+    g_slice_free (DnsShared, shared);
+}
+
+/* Picks an id that no other query on the sockets uses */
+static gboolean
+dns_shared_add_query (DnsShared *shared, DnsQuery *query)
+{
+    gboolean added = FALSE;
+
+    G_LOCK (dns_shared);
+
+    if (g_hash_table_size (shared->queries) < G_MAXUINT16) {
+        do {
+            query->id = g_random_int_range (0, 65536);
+        } while (g_hash_table_lookup (shared->queries,
+                                      GUINT_TO_POINTER (query->id)));
+
+        g_hash_table_insert (shared->queries,
+                             GUINT_TO_POINTER (query->id), query);
+        query->registered = TRUE;
+        added = TRUE;
+    }
+
+    G_UNLOCK (dns_shared);
+
+    return added;
+}
+
+static void
+dns_shared_remove_query (DnsShared *shared, DnsQuery *query)
+{
+    G_LOCK (dns_shared);
+    g_hash_table_remove (shared->queries, GUINT_TO_POINTER (query->id));
+    G_UNLOCK (dns_shared);
+
+    query->registered = FALSE;
+}
+
+static DnsQuery *
+dns_shared_lookup_query (DnsShared *shared, guint16 id)
+{
+    DnsQuery *query;
+
+    G_LOCK (dns_shared);
+    query = g_hash_table_lookup (shared->queries, GUINT_TO_POINTER (id));
+    G_UNLOCK (dns_shared);
+
+    return query;
+}
+
+static gboolean
+dns_shared_udp_in_cb (GIOChannel   *source,
+                      GIOCondition  condition,
+                      DnsShared    *shared)
+{
+    guchar buf[DNS_UDP_PACKET];
+    int    fd = g_io_channel_unix_get_fd (source);
+
+    /* The last resolver may finish while we read */
+    dns_shared_ref (shared);
+
+    while (shared->ref_count > 1) {
+        struct sockaddr_storage  from;
+        socklen_t                from_len = sizeof (from);
+        LmDnsResolver           *resolver;
+        DnsServer               *server;
+        DnsQuery                *query;
+        gssize                   len;
+
+        len = recvfrom (fd, buf, sizeof (buf), 0,
+                        (struct sockaddr *) &from, &from_len);
+        if (len < 0) {
+            break;
+        }
+
+        if (len < HFIXEDSZ) {
+            continue;
+        }
+
+        query = dns_shared_lookup_query (shared, (buf[0] << 8) | buf[1]);
+        if (!query || query->done) {
+            continue;
+        }
+
+        resolver = query->resolver;
+
+        /* Only answers from the servers we asked count, and an id can
+         * be reused by a later query so the question has to match too.
+         */
+        server = dns_resolver_find_server (resolver, &from, from_len);
+        if (!server || !dns_query_matches (query, buf, len)) {
+            continue;
+        }
+
+        if (buf[2] & 0x02) {
+            /* Truncated, ask the same server over TCP */
+            if (!dns_query_start_tcp (query, server)) {
+                dns_query_finish (query, NULL, 0);
+                dns_resolver_check_done (resolver);
+            }
+        } else if (query->tcp_fd < 0) {
+            dns_query_handle_answer (query, buf, len);
+        }
+    }
+
+    dns_shared_unref (shared);
+
+    return TRUE;
+}
+
+static gboolean
+dns_shared_open_socket (DnsShared *shared, int family)
+{
+    DnsSocket *sock = dns_shared_get_socket (shared, family);
+    gboolean   opened = TRUE;
+
+    G_LOCK (dns_shared);
+
+    if (sock->fd >= 0) {
+        G_UNLOCK (dns_shared);
+        return TRUE;
+    }
+
+    sock->fd = socket (family, SOCK_DGRAM, 0);
+    if (_LM_SOCK_VALID (sock->fd)) {
+        _lm_sock_set_blocking (sock->fd, FALSE);
+
+        sock->channel = g_io_channel_unix_new (sock->fd);
+        sock->watch = lm_misc_add_io_watch (shared->context,
+                                            sock->channel,
+                                            G_IO_IN,
+                                            (GIOFunc) dns_shared_udp_in_cb,
+                                            shared);
+    } else {
+        sock->fd = -1;
+        opened = FALSE;
+    }
+
+    G_UNLOCK (dns_shared);
+
+    return opened;
+}
+
+static void
+dns_resolver_cleanup (LmDnsResolver *resolver)
+{
+    LmDnsResolverPriv *priv = GET_PRIV (resolver);
+    guint              i;
+
+    if (priv->timeout_source) {
+        g_source_destroy (priv->timeout_source);
+        priv->timeout_source = NULL;
+    }
+
+    if (priv->idle_source) {
+        g_source_destroy (priv->idle_source);
+        priv->idle_source = NULL;
+    }
+
+    if (priv->hedge_source) {
+        g_source_destroy (priv->hedge_source);
+        priv->hedge_source = NULL;
+    }
+
+    for (i = 0; i < priv->n_queries; i++) {
+        dns_query_free (priv->queries[i]);
+    }
+    priv->n_queries = 0;
+
+    if (priv->shared) {
+        dns_shared_unref (priv->shared);
+        priv->shared = NULL;
+    }
+
+    g_strfreev (priv->names);
+    priv->names = NULL;
+
+    if (priv->sa) {
+        lm_socket_address_unref (priv->sa);
+        priv->sa = NULL;
+    }
+}
+
+static void
+dns_resolver_finished (LmDnsResolver *resolver, LmResolverResult result)
+{
+    LmDnsResolverPriv *priv = GET_PRIV (resolver);
+
+    if (result != LM_RESOLVER_RESULT_CANCELLED && priv->n_queries > 0) {
+        _lm_resolver_record_latency (g_get_monotonic_time () -
+                                     priv->start_time,
+                                     priv->hedged);
+    }
+
+    g_signal_emit_by_name (resolver, "finished", result, priv->sa);
+
+    dns_resolver_cleanup (resolver);
+
+    /* The initial reference is owned by LmResolver itself */
+    g_object_unref (resolver);
+}
+
+/* Answered without the records asked for, unless something else failed */
+static void
+dns_resolver_set_no_data (LmDnsResolver *resolver)
+{
+    if (lm_resolver_get_error (LM_RESOLVER (resolver)) == 
+        LM_RESOLVER_ERROR_NONE) {
+        _lm_resolver_set_error (LM_RESOLVER (resolver), 
+                                LM_RESOLVER_ERROR_NO_DATA);
+    }
+}
+
+static LmResolverResult
+dns_resolver_host_result (LmDnsResolver *resolver)
+{
+    LmDnsResolverPriv *priv = GET_PRIV (resolver);
+    struct addrinfo   *list = NULL;
+    guint              ttl = 0;
+    guint              i;
+
+    if (priv->n_queries == 0 ||
+        _lm_resolver_get_incremental (LM_RESOLVER (resolver))) {
+        /* Address literal, or the addresses were added as they came */
+        if (lm_socket_address_is_resolved (priv->sa)) {
+            return LM_RESOLVER_RESULT_OK;
+        }
+
+        dns_resolver_set_no_data (resolver);
+        return LM_RESOLVER_RESULT_FAILED;
+    }
+
+    for (i = 0; i < priv->n_queries; i++) {
+        DnsQuery *query = priv->queries[i];
+
+        if (query->answer) {
+            list = dns_parse_addresses (query->answer, query->answer_len, 
+                                        list, &ttl);
+        }
+    }
+
+    if (!list) {
+        dns_resolver_set_no_data (resolver);
+        return LM_RESOLVER_RESULT_FAILED;
+    }
+
+    lm_socket_address_set_results (priv->sa, list);
+    _lm_resolver_set_ttl (LM_RESOLVER (resolver), ttl);
+
+    return LM_RESOLVER_RESULT_OK;
+}
+
+static LmResolverResult
+dns_resolver_srv_result (LmDnsResolver *resolver)
+{
+    LmDnsResolverPriv *priv = GET_PRIV (resolver);
+    DnsQuery          *query = priv->queries[0];
+    gchar             *new_server = NULL;
+    guint              new_port;
+
+    if (!query->answer ||
+        !_lm_resolver_parse_srv_response (query->answer, query->answer_len,
+                                          &new_server, &new_port)) {
+        dns_resolver_set_no_data (resolver);
+        return LM_RESOLVER_RESULT_FAILED;
+    }
+
+    priv->sa = lm_socket_address_new (new_server, new_port);
+    g_free (new_server);
+
+    return LM_RESOLVER_RESULT_OK;
+}
+
+/* Adds the addresses of each answered query of an incremental lookup,
+ * returns TRUE if a handler finished the resolver meanwhile.
+ */
+static gboolean
+dns_resolver_add_answers (LmDnsResolver *resolver)
+{
+    LmDnsResolverPriv *priv = GET_PRIV (resolver);
+    guint              i;
+
+    for (i = 0; i < priv->n_queries; i++) {
+        DnsQuery        *query = priv->queries[i];
+        struct addrinfo *list;
+        guint            ttl = 0;
+        gboolean         finished;
+
+        if (!query->done || query->delivered) {
+            continue;
+        }
+        query->delivered = TRUE;
+
+        if (!query->answer) {
+            continue;
+        }
+
+        list = dns_parse_addresses (query->answer, query->answer_len, NULL,
+                                    &ttl);
+        if (!list) {
+            continue;
+        }
+
+        _lm_resolver_set_ttl (LM_RESOLVER (resolver), ttl);
+
+        /* Cleanup drops sa if the lookup gets cancelled */
+        g_object_ref (resolver);
+        _lm_resolver_add_results (LM_RESOLVER (resolver), priv->sa, list);
+        finished = priv->sa == NULL;
+        g_object_unref (resolver);
+
+        if (finished) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* Queries for the current name, AAAA and A or SRV */
+static void
+dns_resolver_add_queries (LmDnsResolver *resolver)
+{
+    LmDnsResolverPriv *priv = GET_PRIV (resolver);
+    const gchar       *name = priv->names[priv->name_index];
+
+    if (priv->is_srv) {
+        priv->queries[priv->n_queries++] = 
+            dns_query_new (resolver, T_SRV, name);
+    } else {
+        priv->queries[priv->n_queries++] = 
+            dns_query_new (resolver, T_AAAA, name);
+        priv->queries[priv->n_queries++] = 
+            dns_query_new (resolver, T_A, name);
+    }
+}
+
+/* Moves on to the next name from the search list if the current one
+ * doesn't exist or has no records, returns TRUE if it did.
+ */
+static gboolean
+dns_resolver_try_next_name (LmDnsResolver *resolver)
+{
+    LmDnsResolverPriv *priv = GET_PRIV (resolver);
+    LmResolverError    error;
+    gboolean           sent = FALSE;
+    guint              i;
+
+    error = lm_resolver_get_error (LM_RESOLVER (resolver));
+    if (error != LM_RESOLVER_ERROR_NOT_FOUND &&
+        error != LM_RESOLVER_ERROR_NO_DATA) {
+        return FALSE;
+    }
+
+    if (!priv->names || !priv->names[priv->name_index + 1]) {
+        return FALSE;
+    }
+
+    /* Names that can't be put in a query are skipped */
+    do {
+        for (i = 0; i < priv->n_queries; i++) {
+            dns_query_free (priv->queries[i]);
+        }
+        priv->n_queries = 0;
+
+        priv->name_index++;
+        dns_resolver_add_queries (resolver);
+
+        for (i = 0; i < priv->n_queries; i++) {
+            if (!priv->queries[i]->done) {
+                dns_query_send (priv->queries[i]);
+                sent = TRUE;
+            }
+        }
+    } while (!sent && priv->names[priv->name_index + 1]);
+
+    if (sent) {
+        _lm_resolver_set_error (LM_RESOLVER (resolver), 
+                                LM_RESOLVER_ERROR_NONE);
+    }
+
+    return sent;
+}
+
+/* Finishes the resolver once all queries are done, returns TRUE if it did */
+static gboolean
+dns_resolver_check_done (LmDnsResolver *resolver)
+{
+    LmDnsResolverPriv *priv = GET_PRIV (resolver);
+    LmResolverResult   result;
+    guint              i;
+
+    if (!priv->is_srv &&
+        _lm_resolver_get_incremental (LM_RESOLVER (resolver)) &&
+        dns_resolver_add_answers (resolver)) {
+        return TRUE;
+    }
+
+    for (i = 0; i < priv->n_queries; i++) {
+        if (!priv->queries[i]->done) {
+            return FALSE;
+        }
+    }
+
+    if (priv->is_srv) {
+        result = dns_resolver_srv_result (resolver);
+    } else {
+        result = dns_resolver_host_result (resolver);
+    }
+
+    if (result == LM_RESOLVER_RESULT_FAILED && 
+        dns_resolver_try_next_name (resolver)) {
+        return FALSE;
+    }
+
+    dns_resolver_finished (resolver, result);
+
+    return TRUE;
+}
+
+static gboolean
+dns_resolver_timeout_cb (LmDnsResolver *resolver)
+{
+    LmDnsResolverPriv *priv = GET_PRIV (resolver);
+    guint              i;
+
+    for (i = 0; i < priv->n_queries; i++) {
+        DnsQuery *query = priv->queries[i];
+
+        if (query->done) {
+            continue;
+        }
+
+        if (query->attempts >= priv->config.attempts) {
+            _lm_resolver_set_error (LM_RESOLVER (resolver),
+                                    LM_RESOLVER_ERROR_TIMEOUT);
+            dns_query_finish (query, NULL, 0);
+        } else if (query->tcp_fd >= 0) {
+            query->attempts++;
+        } else {
+            dns_query_send (query);
+        }
+    }
+
+    if (dns_resolver_check_done (resolver)) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Doesn't count as an attempt, the retransmit timer stays as it is */
+static gboolean
+dns_resolver_hedge_cb (LmDnsResolver *resolver)
+{
+    LmDnsResolverPriv *priv = GET_PRIV (resolver);
+    guint              i;
+
+    priv->hedge_source = NULL;
+
+    for (i = 0; i < priv->n_queries; i++) {
+        DnsQuery *query = priv->queries[i];
+
+        if (!query->done && query->tcp_fd < 0) {
+            dns_query_transmit (query);
+            priv->hedged = TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static gboolean
+dns_resolver_idle_done_cb (LmDnsResolver *resolver)
+{
+    LmDnsResolverPriv *priv = GET_PRIV (resolver);
+
+    priv->idle_source = NULL;
+
+    dns_resolver_check_done (resolver);
+
+    return FALSE;
+}
+
+static void
+dns_resolver_start (LmDnsResolver *resolver, const gchar *name)
+{
+    LmDnsResolverPriv *priv = GET_PRIV (resolver);
+    GMainContext      *context;
+    gboolean           have_socket = FALSE;
+    guint              hedge_delay;
+    guint              i;
+
+    g_object_get (resolver, "context", &context, NULL);
+
+    priv->start_time = g_get_monotonic_time ();
+
+    dns_config_get (&priv->config);
+
+    if (!priv->shared) {
+        priv->shared = dns_shared_get (context);
+    }
+
+    priv->names = dns_config_expand_name (&priv->config, name);
+    dns_resolver_add_queries (resolver);
+
+    for (i = 0; i < priv->config.n_servers; i++) {
+        int family = priv->config.servers[i].addr.ss_family;
+
+        if (dns_shared_open_socket (priv->shared, family)) {
+            have_socket = TRUE;
+        }
+    }
+
+    if (!have_socket) {
+        g_warning ("No usable nameservers");
+        for (i = 0; i < priv->n_queries; i++) {
+            dns_query_finish (priv->queries[i], NULL, 0);
+        }
+    } else {
+        for (i = 0; i < priv->n_queries; i++) {
+            if (!priv->queries[i]->done) {
+                dns_query_send (priv->queries[i]);
+            }
+        }
+
+        priv->timeout_source =
+            lm_misc_add_timeout (context,
+                                 priv->config.timeout * 1000,
+                                 (GSourceFunc) dns_resolver_timeout_cb,
+                                 resolver);
+
+        hedge_delay = _lm_resolver_get_hedge_delay ();
+        if (hedge_delay > 0 && hedge_delay < priv->config.timeout * 1000) {
+            priv->hedge_source =
+                lm_misc_add_timeout (context,
+                                     hedge_delay,
+                                     (GSourceFunc) dns_resolver_hedge_cb,
+                                     resolver);
+        }
+    }
+
+    /* Results can't be delivered before the caller connected to the
+     * finished signal.
+     */
+    priv->idle_source = lm_misc_add_idle (context,
+                                          (GSourceFunc) dns_resolver_idle_done_cb,
+                                          resolver);
+}
+
+static void
+dns_resolver_lookup_host (LmResolver *resolver, LmSocketAddress *sa)
+{
+    LmDnsResolverPriv *priv;
+    const gchar       *host;
+    GMainContext      *context;
+    guchar             addr[16];
+
+    g_return_if_fail (LM_IS_DNS_RESOLVER (resolver));
+    g_return_if_fail (sa != NULL);
+
+    priv = GET_PRIV (resolver);
+    priv->sa = lm_socket_address_ref (sa);
+
+    host = lm_socket_address_get_host (sa);
+
+    /* Address literals need no lookup */
+    if (inet_pton (AF_INET, host, addr) == 1 ||
+        inet_pton (AF_INET6, host, addr) == 1) {
+        int family = strchr (host, ':') ? AF_INET6 : AF_INET;
+
+        lm_socket_address_set_results (sa,
+                                       _lm_resolver_new_addrinfo (family, addr));
+
+        g_object_get (resolver, "context", &context, NULL);
+        priv->idle_source = lm_misc_add_idle (context,
+                                              (GSourceFunc) dns_resolver_idle_done_cb,
+                                              resolver);
+        return;
+    }
+
+    dns_resolver_start (LM_DNS_RESOLVER (resolver), host);
+}
+
+static void
+dns_resolver_lookup_srv (LmResolver *resolver, const gchar *srv)
+{
+    LmDnsResolverPriv *priv;
+
+    g_return_if_fail (LM_IS_DNS_RESOLVER (resolver));
+    g_return_if_fail (srv != NULL);
+
+    priv = GET_PRIV (resolver);
+    priv->is_srv = TRUE;
+
+    dns_resolver_start (LM_DNS_RESOLVER (resolver), srv);
+}
+
+static void
+dns_resolver_cancel (LmResolver *resolver)
+{
+    g_return_if_fail (LM_IS_DNS_RESOLVER (resolver));
+
+    dns_resolver_finished (LM_DNS_RESOLVER (resolver),
+                           LM_RESOLVER_RESULT_CANCELLED);
+}
+
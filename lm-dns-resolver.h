@@ -0,0 +1,59 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_DNS_RESOLVER_H__
+#define __LM_DNS_RESOLVER_H__
+
+#include <glib-object.h>
+
+#include "lm-resolver.h" 
+
+G_BEGIN_DECLS
+
+#define LM_TYPE_DNS_RESOLVER            (lm_dns_resolver_get_type ())
+#define LM_DNS_RESOLVER(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), LM_TYPE_DNS_RESOLVER, LmDnsResolver))
+#define LM_DNS_RESOLVER_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), LM_TYPE_DNS_RESOLVER, LmDnsResolverClass))
+#define LM_IS_DNS_RESOLVER(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), LM_TYPE_DNS_RESOLVER))
+#define LM_IS_DNS_RESOLVER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), LM_TYPE_DNS_RESOLVER))
+#define LM_DNS_RESOLVER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), LM_TYPE_DNS_RESOLVER, LmDnsResolverClass))
+
+typedef struct LmDnsResolver      LmDnsResolver;
+typedef struct LmDnsResolverClass LmDnsResolverClass;
+
+struct LmDnsResolver {
+    LmResolver parent;
+};
+
+struct LmDnsResolverClass {
+    LmResolverClass parent_class;
+};
+
+GType    lm_dns_resolver_get_type        (void);
+
+/* Replaces the nameservers from /etc/resolv.conf, each given as "address",
+ * "address:port" or "[address]:port". NULL goes back to resolv.conf. The
+ * search list and ndots of resolv.conf don't apply to these servers.
+ */
+gboolean lm_dns_resolver_set_nameservers (const gchar **nameservers);
+
+G_END_DECLS
+
+#endif /* __LM_DNS_RESOLVER_H__ */
+
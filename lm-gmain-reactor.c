@@ -0,0 +1,311 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* The default reactor, sources are GSources attached to a GMainContext */
+
+#include <config.h>
+
+#include "lm-gmain-reactor.h"
+
+#define GET_PRIV(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), LM_TYPE_GMAIN_REACTOR, LmGMainReactorPriv))
+
+typedef struct LmGMainReactorPriv LmGMainReactorPriv;
+struct LmGMainReactorPriv {
+    GMainContext *context;
+};
+
+/* What an LmReactorSource is here. Changing the condition of an fd watch
+ * replaces its GSource, the struct lives until the last one is gone.
+ */
+struct LmReactorSource {
+    LmReactor       *reactor;
+    GSource         *source;
+    guint            n_sources;
+
+    /* Fd watches */
+    GIOChannel      *channel;
+    int              fd;
+    LmReactorFdFunc  fd_func;
+
+    GSourceFunc      func;
+    gpointer         user_data;
+};
+
+static void     gmain_reactor_finalize     (GObject           *object);
+static void     gmain_reactor_get_property (GObject           *object,
+                                            guint              param_id,
+                                            GValue            *value,
+                                            GParamSpec        *pspec);
+static void     gmain_reactor_set_property (GObject           *object,
+                                            guint              param_id,
+                                            const GValue      *value,
+                                            GParamSpec        *pspec);
+static LmReactorSource *
+gmain_reactor_add_fd                       (LmReactor         *reactor,
+                                            int                fd,
+                                            GIOCondition       condition,
+                                            LmReactorFdFunc    func,
+                                            gpointer           user_data);
+static void     gmain_reactor_modify_fd    (LmReactor         *reactor,
+                                            LmReactorSource   *source,
+                                            GIOCondition       condition);
+static LmReactorSource *
+gmain_reactor_add_timeout                  (LmReactor         *reactor,
+                                            guint              interval,
+                                            GSourceFunc        func,
+                                            gpointer           user_data);
+static LmReactorSource *
+gmain_reactor_add_defer                    (LmReactor         *reactor,
+                                            GSourceFunc        func,
+                                            gpointer           user_data);
+static void     gmain_reactor_remove       (LmReactor         *reactor,
+                                            LmReactorSource   *source);
+
+G_DEFINE_TYPE (LmGMainReactor, lm_gmain_reactor, LM_TYPE_REACTOR)
+
+enum {
+    PROP_0,
+    PROP_CONTEXT
+};
+
+static void
+lm_gmain_reactor_class_init (LmGMainReactorClass *class)
+{
+    GObjectClass   *object_class  = G_OBJECT_CLASS (class);
+    LmReactorClass *reactor_class = LM_REACTOR_CLASS (class);
+
+    object_class->finalize     = gmain_reactor_finalize;
+    object_class->get_property = gmain_reactor_get_property;
+    object_class->set_property = gmain_reactor_set_property;
+
+    reactor_class->add_fd      = gmain_reactor_add_fd;
+    reactor_class->modify_fd   = gmain_reactor_modify_fd;
+    reactor_class->add_timeout = gmain_reactor_add_timeout;
+    reactor_class->add_defer   = gmain_reactor_add_defer;
+    reactor_class->remove      = gmain_reactor_remove;
+
+    g_object_class_install_property (object_class,
+                                     PROP_CONTEXT,
+                                     g_param_spec_pointer ("context",
+                                                           "Context",
+                                                           "GMainContext the sources are attached to",
+                                                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_type_class_add_private (object_class, sizeof (LmGMainReactorPriv));
+}
+
+static void
+lm_gmain_reactor_init (LmGMainReactor *reactor)
+{
+}
+
+static void
+gmain_reactor_finalize (GObject *object)
+{
+    LmGMainReactorPriv *priv = GET_PRIV (object);
+
+    if (priv->context) {
+        g_main_context_unref (priv->context);
+    }
+
+    (G_OBJECT_CLASS (lm_gmain_reactor_parent_class)->finalize) (object);
+}
+
+static void
+gmain_reactor_get_property (GObject    *object,
+                            guint       param_id,
+                            GValue     *value,
+                            GParamSpec *pspec)
+{
+    LmGMainReactorPriv *priv = GET_PRIV (object);
+
+    switch (param_id) {
+        case PROP_CONTEXT:
+            g_value_set_pointer (value, priv->context);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
+            break;
+    };
+}
+
+static void
+gmain_reactor_set_property (GObject      *object,
+                            guint         param_id,
+                            const GValue *value,
+                            GParamSpec   *pspec)
+{
+    LmGMainReactorPriv *priv = GET_PRIV (object);
+    GMainContext       *context;
+
+    switch (param_id) {
+        case PROP_CONTEXT:
+            context = g_value_get_pointer (value);
+            if (context) {
+                priv->context = g_main_context_ref (context);
+            }
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
+            break;
+    };
+}
+
+static void
+gmain_reactor_source_unref (LmReactorSource *source)
+{
+    if (--source->n_sources > 0) {
+        return;
+    }
+
+    if (source->channel) {
+        g_io_channel_unref (source->channel);
+    }
+
+    g_slice_free (LmReactorSource, source);
+}
+
+static LmReactorSource *
+gmain_reactor_source_new (LmReactor *reactor)
+{
+    LmReactorSource *source;
+
+    source = g_slice_new0 (LmReactorSource);
+    source->reactor = reactor;
+
+    return source;
+}
+
+static void
+gmain_reactor_attach (LmReactorSource *source,
+                      GSource         *gsource,
+                      GSourceFunc      func)
+{
+    LmGMainReactorPriv *priv = GET_PRIV (source->reactor);
+
+    source->source = gsource;
+    source->n_sources++;
+
+    g_source_set_callback (gsource, func, source,
+                           (GDestroyNotify) gmain_reactor_source_unref);
+    g_source_attach (gsource, priv->context);
+    g_source_unref (gsource);
+}
+
+static gboolean
+gmain_reactor_io_cb (GIOChannel      *channel,
+                     GIOCondition     condition,
+                     LmReactorSource *source)
+{
+    return source->fd_func (source->reactor, source->fd, condition,
+                            source->user_data);
+}
+
+static gboolean
+gmain_reactor_source_cb (LmReactorSource *source)
+{
+    return source->func (source->user_data);
+}
+
+static LmReactorSource *
+gmain_reactor_add_fd (LmReactor       *reactor,
+                      int              fd,
+                      GIOCondition     condition,
+                      LmReactorFdFunc  func,
+                      gpointer         user_data)
+{
+    LmReactorSource *source;
+
+    source = gmain_reactor_source_new (reactor);
+    source->channel   = g_io_channel_unix_new (fd);
+    source->fd        = fd;
+    source->fd_func   = func;
+    source->user_data = user_data;
+
+    gmain_reactor_attach (source, 
+                          g_io_create_watch (source->channel, condition),
+                          (GSourceFunc) gmain_reactor_io_cb);
+
+    return source;
+}
+
+static void
+gmain_reactor_modify_fd (LmReactor       *reactor,
+                         LmReactorSource *source,
+                         GIOCondition     condition)
+{
+    GSource *old_source = source->source;
+
+    g_return_if_fail (source->channel != NULL);
+
+    /* Keeps the struct alive while the old GSource goes */
+    gmain_reactor_attach (source, 
+                          g_io_create_watch (source->channel, condition),
+                          (GSourceFunc) gmain_reactor_io_cb);
+
+    g_source_destroy (old_source);
+}
+
+static LmReactorSource *
+gmain_reactor_add_timeout (LmReactor   *reactor,
+                           guint        interval,
+                           GSourceFunc  func,
+                           gpointer     user_data)
+{
+    LmReactorSource *source;
+
+    source = gmain_reactor_source_new (reactor);
+    source->func      = func;
+    source->user_data = user_data;
+
+    gmain_reactor_attach (source, g_timeout_source_new (interval),
+                          (GSourceFunc) gmain_reactor_source_cb);
+
+    return source;
+}
+
+static LmReactorSource *
+gmain_reactor_add_defer (LmReactor   *reactor,
+                         GSourceFunc  func,
+                         gpointer     user_data)
+{
+    LmReactorSource *source;
+
+    source = gmain_reactor_source_new (reactor);
+    source->func      = func;
+    source->user_data = user_data;
+
+    gmain_reactor_attach (source, g_idle_source_new (),
+                          (GSourceFunc) gmain_reactor_source_cb);
+
+    return source;
+}
+
+static void
+gmain_reactor_remove (LmReactor *reactor, LmReactorSource *source)
+{
+    g_source_destroy (source->source);
+}
+
+LmReactor *
+lm_gmain_reactor_new (GMainContext *context)
+{
+    return g_object_new (LM_TYPE_GMAIN_REACTOR, "context", context, NULL);
+}
@@ -20,27 +20,169 @@
 
 #include <config.h>
 
+#include <gnutls/abstract.h>
+#include <gnutls/crypto.h>
 #include <gnutls/x509.h>
+#include <errno.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_TLS_H
+#include <linux/tls.h>
+#include <netinet/tcp.h>
+#endif
 
 #include "lm-marshal.h"
+#include "lm-misc.h"
 #include "lm-secure-channel.h"
 #include "lm-gnutls-channel.h"
+#include "lm-socket.h"
+#include "lm-trust-store.h"
 
 #define GET_PRIV(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), LM_TYPE_GNUTLS_CHANNEL, LmGnuTLSChannelPriv))
 
 #define CA_PEM_FILE "/etc/ssl/certs/ca-certificates.crt"
 
+/* Precompiled with lm-trust-store-compile, used instead of CA_PEM_FILE
+ * when present.
+ */
+#define CA_STORE_FILE "/var/cache/lm-transport/ca-certificates.lmts"
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+/* Dynamic record sizing: start out with records that fit in a single TCP
+ * segment so the peer can decrypt as soon as each packet arrives, and move
+ * to full sized records once the connection is busy with a bulk transfer.
+ */
+#define RECORD_SIZE_SMALL         1400
+#define RECORD_SIZE_LARGE         16384
+#define RECORD_RAMP_UP_BYTES      (1024 * 1024)
+#define RECORD_IDLE_RESET_USEC    (1 * G_USEC_PER_SEC)
+
+/* Pins may carry the digest name used by HPKP style pin sets */
+#define PIN_PREFIX_SHA256         "sha256/"
+
+/* Used for LM_SECURE_CHANNEL_PRIORITY_AUTO. Without AES instructions
+ * ChaCha20-Poly1305 is several times cheaper than AES-GCM.
+ */
+#define PRIORITY_AES_FIRST \
+    "NORMAL:-CIPHER-ALL:+AES-128-GCM:+AES-256-GCM:+CHACHA20-POLY1305:+AES-128-CBC:+AES-256-CBC"
+#define PRIORITY_CHACHA_FIRST \
+    "NORMAL:-CIPHER-ALL:+CHACHA20-POLY1305:+AES-128-GCM:+AES-256-GCM:+AES-128-CBC:+AES-256-CBC"
+
+/* Successful certificate verifications are remembered per (leaf certificate,
+ * host) so that repeated handshakes to the same server skip the X.509 work.
+ */
+#define VERIFY_CACHE_MAX_ENTRIES  256
+#define VERIFY_CACHE_TTL_SEC      (10 * 60)
+
+G_LOCK_DEFINE_STATIC (verify_cache);
+static GHashTable *verify_cache = NULL;
+static time_t      verify_cache_trust_mtime = 0;
+
+/* Handshakes that are run off the main loop share a bounded pool of worker
+ * threads. The worker never touches the inner channel, the channel's loop
+ * moves the records between it and the handshake_in/handshake_out queues.
+ */
+#define HANDSHAKE_POOL_MAX_THREADS 4
+
+G_LOCK_DEFINE_STATIC (handshake_pool);
+static GThreadPool *handshake_pool = NULL;
+
+/* Reopened when lm-trust-store-compile replaces the file */
+G_LOCK_DEFINE_STATIC (trust_store);
+static LmTrustStore *trust_store = NULL;
+static time_t        trust_store_mtime = 0;
+static ino_t         trust_store_ino = 0;
+
+/* Session data of the last connection to each host, used to resume the
+ * session (and send 0-RTT early data) when reconnecting.
+ */
+#define SESSION_CACHE_MAX_ENTRIES 256
+#define SESSION_CACHE_TTL_SEC     (60 * 60)
+
+typedef struct {
+    gnutls_datum_t data;
+    time_t         expires;
+} SessionCacheEntry;
+
+G_LOCK_DEFINE_STATIC (session_cache);
+static GHashTable *session_cache = NULL;
+
+/* Server mode: the certificate and key are loaded once and shared by all
+ * server channels, as is the session ticket master key. GnuTLS derives
+ * the keys that encrypt tickets from it and rotates those by itself, each
+ * accepting the tickets of the previous one, so tickets stay valid for
+ * TICKET_KEY_LIFETIME_SEC without a timer here.
+ */
+#define TICKET_KEY_LIFETIME_SEC   (60 * 60)
+
+G_LOCK_DEFINE_STATIC (server_creds);
+static gnutls_certificate_credentials_t server_xcred = NULL;
+static gnutls_datum_t                   ticket_key = { NULL, 0 };
+
 typedef struct LmGnuTLSChannelPriv LmGnuTLSChannelPriv;
 struct LmGnuTLSChannelPriv {
     gnutls_session                 gnutls_session;
     gnutls_certificate_credentials gnutls_xcred;
+    /* CA_PEM_FILE is in gnutls_xcred, loaded when there is no store */
+    gboolean                       ca_pem_loaded;
 
     gboolean                       is_encrypted;
+    gboolean                       server_mode;
+    guint                          cert_problems;
+
+    /* Threaded handshake, only the members after io_mutex are shared with
+     * the worker and they are protected by it.
+     */
+    gboolean                       handshaking;
+    gchar                         *handshake_host;
+    LmSecureChannelHandshakeResult handshake_result;
+    LmReactor                     *handshake_reactor;
+    gulong                         inner_readable_id;
+    gulong                         inner_writeable_id;
+    gulong                         inner_closed_id;
+    gboolean                       worker_io;
+    GMutex                         io_mutex;
+    GCond                          io_cond;
+    GByteArray                    *handshake_in;
+    GByteArray                    *handshake_out;
+    gboolean                       handshake_in_closed;
+    gboolean                       handshake_cancelled;
+    gboolean                       flush_queued;
+
+    /* 0-RTT early data */
+    gboolean                       early_data_enabled;
+    gboolean                       session_restored;
+    GByteArray                    *early_data;
+
+    /* False start: writes made during a threaded handshake */
+    gboolean                       false_start;
+    GByteArray                    *pending_writes;
+
+    /* Dynamic record sizing */
+    gboolean                       dynamic_records;
+    gsize                          record_size;
+    gsize                          bytes_since_idle;
+    gint64                         last_write_time;
+
+    /* Session imported from another process, the kernel protects the
+     * records on the inner socket.
+     */
+    gboolean                       kernel_tls;
 };
 
 static void       gnutls_channel_finalize      (GObject           *object);
 static void       gnutls_channel_init_gnutls   (LmGnuTLSChannel   *channel);
+static void
+gnutls_channel_verify_cache_trust_loaded       (const gchar       *trust_file);
+static LmTrustStore *
+gnutls_channel_get_trust_store                 (void);
 static void       gnutls_channel_deinit_gnutls (LmGnuTLSChannel   *channel);
 static GIOStatus  gnutls_channel_read          (LmChannel         *channel,
                                                 gchar             *buf,
@@ -53,9 +195,21 @@ static GIOStatus  gnutls_channel_write         (LmChannel         *channel,
                                                 gsize            *bytes_written,
                                                 GError           **error);
 static void       gnutls_channel_close         (LmChannel         *channel);
+static void       gnutls_channel_store_session (LmGnuTLSChannel   *channel);
+static gsize      gnutls_channel_get_record_size (LmGnuTLSChannel *channel);
+static void       gnutls_channel_record_written  (LmGnuTLSChannel *channel,
+                                                  gsize            count);
 static void
 gnutls_channel_start_handshake                 (LmSecureChannel   *channel,
                                                 const gchar       *host);
+static void       gnutls_channel_handshake_worker (LmGnuTLSChannel *channel,
+                                                   gpointer         user_data);
+static void       gnutls_channel_write_early_data (LmSecureChannel *channel,
+                                                   const gchar     *buf,
+                                                   gssize           count);
+static gboolean
+gnutls_channel_set_server_credentials          (const gchar       *cert_file,
+                                                const gchar       *key_file);
 static ssize_t    gnutls_channel_pull_func     (LmGnuTLSChannel   *channel,
                                                 void              *buf,
                                                 size_t             count);
@@ -78,7 +232,10 @@ lm_gnutls_channel_class_init (LmGnuTLSChannelClass *class)
     channel_class->write   = gnutls_channel_write;
     channel_class->close   = gnutls_channel_close;
 
-    secure_ch_class->start_handshake = gnutls_channel_start_handshake;
+    secure_ch_class->start_handshake  = gnutls_channel_start_handshake;
+    secure_ch_class->write_early_data = gnutls_channel_write_early_data;
+    secure_ch_class->set_server_credentials = 
+        gnutls_channel_set_server_credentials;
 
     g_type_class_add_private (object_class, sizeof (LmGnuTLSChannelPriv));
 }
@@ -91,6 +248,15 @@ lm_gnutls_channel_init (LmGnuTLSChannel *gnutls_channel)
     priv = GET_PRIV (gnutls_channel);
 
     priv->is_encrypted = FALSE;
+    priv->handshaking  = FALSE;
+
+    g_mutex_init (&priv->io_mutex);
+    g_cond_init (&priv->io_cond);
+
+    priv->early_data     = g_byte_array_new ();
+    priv->pending_writes = g_byte_array_new ();
+    priv->handshake_in   = g_byte_array_new ();
+    priv->handshake_out  = g_byte_array_new ();
 
     gnutls_channel_init_gnutls (gnutls_channel);
 }
@@ -104,6 +270,14 @@ gnutls_channel_finalize (GObject *object)
 
     gnutls_channel_deinit_gnutls (LM_GNUTLS_CHANNEL (object));
 
+    g_free (priv->handshake_host);
+    g_byte_array_free (priv->early_data, TRUE);
+    g_byte_array_free (priv->pending_writes, TRUE);
+    g_byte_array_free (priv->handshake_in, TRUE);
+    g_byte_array_free (priv->handshake_out, TRUE);
+    g_mutex_clear (&priv->io_mutex);
+    g_cond_clear (&priv->io_cond);
+
     (G_OBJECT_CLASS (lm_gnutls_channel_parent_class)->finalize) (object);
 }
 
@@ -116,9 +290,71 @@ gnutls_channel_init_gnutls (LmGnuTLSChannel *channel)
     /*       Only call once ensure thread safety */
     gnutls_global_init ();
     gnutls_certificate_allocate_credentials (&priv->gnutls_xcred);
-    gnutls_certificate_set_x509_trust_file(priv->gnutls_xcred,
-                                           CA_PEM_FILE,
-                                           GNUTLS_X509_FMT_PEM);
+
+    /* The CAs come from the trust store, or from CA_PEM_FILE when there
+     * is none at verification time, see gnutls_channel_verify_peer.
+     */
+}
+
+static void
+gnutls_channel_load_ca_pem (LmGnuTLSChannel *channel)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+
+    if (priv->ca_pem_loaded) {
+        return;
+    }
+
+    gnutls_certificate_set_x509_trust_file (priv->gnutls_xcred,
+                                            CA_PEM_FILE,
+                                            GNUTLS_X509_FMT_PEM);
+    priv->ca_pem_loaded = TRUE;
+
+    gnutls_channel_verify_cache_trust_loaded (CA_PEM_FILE);
+}
+
+/* Returns a reference to the trust store or NULL if there is none */
+static LmTrustStore *
+gnutls_channel_get_trust_store (void)
+{
+    LmTrustStore *store = NULL;
+    gboolean      reloaded = FALSE;
+    struct stat   st;
+
+    if (stat (CA_STORE_FILE, &st) != 0) {
+        st.st_mtime = 0;
+        st.st_ino   = 0;
+    }
+
+    G_LOCK (trust_store);
+
+    if (st.st_mtime != trust_store_mtime || st.st_ino != trust_store_ino) {
+        /* Verifications still running hold on to the old store */
+        if (trust_store) {
+            lm_trust_store_unref (trust_store);
+            trust_store = NULL;
+        }
+
+        if (st.st_ino != 0) {
+            trust_store = lm_trust_store_open (CA_STORE_FILE);
+        }
+
+        trust_store_mtime = st.st_mtime;
+        trust_store_ino   = st.st_ino;
+        reloaded = TRUE;
+    }
+
+    if (trust_store) {
+        store = lm_trust_store_ref (trust_store);
+    }
+
+    G_UNLOCK (trust_store);
+
+    if (reloaded && store) {
+        gnutls_channel_verify_cache_trust_loaded (CA_STORE_FILE);
+    }
+
+    return store;
 }
 
 static void
@@ -146,7 +382,13 @@ gnutls_channel_read (LmChannel  *channel,
 
     priv = GET_PRIV (channel);
 
-    if (!priv->is_encrypted) {
+    if (priv->handshaking) {
+        /* The handshake worker owns the inner channel until it is done */
+        *bytes_read = 0;
+        return G_IO_STATUS_AGAIN;
+    }
+
+    if (!priv->is_encrypted || priv->kernel_tls) {
         /* Until we are encrypted, use read from inner channel */
         return lm_channel_read (lm_channel_get_inner (channel),
                                 buf, count, bytes_read, error);
@@ -177,6 +419,44 @@ gnutls_channel_read (LmChannel  *channel,
     return status;
 }
 
+static gsize
+gnutls_channel_get_record_size (LmGnuTLSChannel *channel)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+    gint64               now;
+
+    if (!priv->dynamic_records) {
+        return RECORD_SIZE_LARGE;
+    }
+
+    now = g_get_monotonic_time ();
+
+    if (now - priv->last_write_time > RECORD_IDLE_RESET_USEC) {
+        /* Connection has been idle, go back to small records */
+        priv->record_size      = RECORD_SIZE_SMALL;
+        priv->bytes_since_idle = 0;
+    }
+
+    priv->last_write_time = now;
+
+    return priv->record_size;
+}
+
+static void
+gnutls_channel_record_written (LmGnuTLSChannel *channel, gsize count)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+
+    if (!priv->dynamic_records || priv->record_size == RECORD_SIZE_LARGE) {
+        return;
+    }
+
+    priv->bytes_since_idle += count;
+    if (priv->bytes_since_idle >= RECORD_RAMP_UP_BYTES) {
+        priv->record_size = RECORD_SIZE_LARGE;
+    }
+}
+
 static GIOStatus
 gnutls_channel_write (LmChannel    *channel,
                       const gchar  *buf,
@@ -185,26 +465,65 @@ gnutls_channel_write (LmChannel    *channel,
                       GError      **error)
 {
     LmGnuTLSChannelPriv *priv;
+    gsize                record_size;
+    ssize_t              ret = 0;
 
     g_return_val_if_fail (LM_IS_GNUTLS_CHANNEL (channel),
                           G_IO_STATUS_ERROR);
 
     priv = GET_PRIV (channel);
 
-    if (!priv->is_encrypted) {
+    if (priv->handshaking) {
+        if (!priv->false_start) {
+            *bytes_written = 0;
+            return G_IO_STATUS_AGAIN;
+        }
+
+        /* Sent as soon as our Finished is out and the peer is verified */
+        if (count < 0) {
+            count = strlen (buf);
+        }
+        g_byte_array_append (priv->pending_writes, (const guint8 *) buf, count);
+        *bytes_written = count;
+
+        return G_IO_STATUS_NORMAL;
+    }
+
+    if (!priv->is_encrypted || priv->kernel_tls) {
         /* Until we are encrypted, use write from inner channel */
         return lm_channel_write (lm_channel_get_inner (channel),
                                  buf, count, bytes_written, error);
     }
 
-    do {
-        g_print ("SEND\n");
-        *bytes_written = gnutls_record_send (priv->gnutls_session, buf, count);
-        g_print ("SEND done\n");
-    } while (*bytes_written == GNUTLS_E_INTERRUPTED ||
-             *bytes_written == GNUTLS_E_AGAIN);
+    if (count < 0) {
+        count = strlen (buf);
+    }
+
+    *bytes_written = 0;
+    record_size = gnutls_channel_get_record_size (LM_GNUTLS_CHANNEL (channel));
+
+    /* Each call to gnutls_record_send produces one record so split the
+     * buffer up according to the current record size.
+     */
+    while (*bytes_written < (gsize) count) {
+        gsize chunk = MIN (record_size, count - *bytes_written);
 
-    if (*bytes_written >= 0) {
+        do {
+            g_print ("SEND\n");
+            ret = gnutls_record_send (priv->gnutls_session,
+                                      buf + *bytes_written, chunk);
+            g_print ("SEND done\n");
+        } while (ret == GNUTLS_E_INTERRUPTED || ret == GNUTLS_E_AGAIN);
+
+        if (ret < 0) {
+            break;
+        }
+
+        *bytes_written += ret;
+        gnutls_channel_record_written (LM_GNUTLS_CHANNEL (channel), ret);
+    }
+
+    if (ret >= 0 || *bytes_written > 0) {
         return G_IO_STATUS_NORMAL;
     } else { /* Error */
         /* TODO: Set error */
@@ -220,10 +539,28 @@ gnutls_channel_close (LmChannel *channel)
     g_return_if_fail (LM_IS_GNUTLS_CHANNEL (channel));
 
     priv = GET_PRIV (channel);
+
+    if (priv->handshaking) {
+        /* Fails the worker's next read or write */
+        g_mutex_lock (&priv->io_mutex);
+        priv->handshake_cancelled = TRUE;
+        g_cond_signal (&priv->io_cond);
+        g_mutex_unlock (&priv->io_mutex);
+    }
+
+    if (priv->kernel_tls) {
+        /* Nothing left in GnuTLS, the peer doesn't get a close_notify */
+        priv->kernel_tls   = FALSE;
+        priv->is_encrypted = FALSE;
+    }
    
     if (priv->is_encrypted) {
+        /* Session tickets arrive after the handshake, save it again now */
+        gnutls_channel_store_session (LM_GNUTLS_CHANNEL (channel));
+
         gnutls_bye (priv->gnutls_session, GNUTLS_SHUT_RDWR);
         gnutls_deinit (priv->gnutls_session);
+        priv->is_encrypted = FALSE;
     }
         
     lm_channel_close (lm_channel_get_inner (channel));
@@ -233,7 +570,11 @@ static gboolean
 gnutls_channel_request_user_cert_feedback (LmGnuTLSChannel *channel,
                                            LmSSLStatus      status)
 {
-    LmSSLResponse response;
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+    LmSSLResponse        response;
+
+    /* Verifications with problems are never cached */
+    priv->cert_problems++;
 
     /* TODO: Implement */
 #if 0
@@ -254,217 +595,1469 @@ gnutls_channel_request_user_cert_feedback (LmGnuTLSChannel *channel,
 
 }
 
-static gboolean
-gnutls_channel_verify_certificate (LmGnuTLSChannel *channel, 
-                                   const gchar     *server)
+static void
+gnutls_channel_verify_cache_trust_loaded (const gchar *trust_file)
 {
-    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
-	unsigned int         status;
-	int                  rc;
+    struct stat st;
 
-	/* This verification function uses the trusted CAs in the credentials
-	 * structure. So you must have installed one or more CA certificates.
-	 */
-	rc = gnutls_certificate_verify_peers2 (priv->gnutls_session, &status);
+    if (stat (trust_file, &st) != 0) {
+        st.st_mtime = 0;
+    }
 
-    if (rc == GNUTLS_E_NO_CERTIFICATE_FOUND) {
-        if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_NO_CERT_FOUND)) {
-            return FALSE;
-		}
-	}
+    G_LOCK (verify_cache);
 
-	if (rc != 0) {
-        if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_GENERIC_ERROR)) {
-            return FALSE;
-        }
-	}
+    /* A changed trust store invalidates everything verified against the
+     * previous one.
+     */
+    if (verify_cache && st.st_mtime != verify_cache_trust_mtime) {
+        g_hash_table_remove_all (verify_cache);
+    }
+    verify_cache_trust_mtime = st.st_mtime;
 
-	if (rc == GNUTLS_E_NO_CERTIFICATE_FOUND) {
-        if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_NO_CERT_FOUND)) {
-			return FALSE;
-		}
-	}
-	
-	if (status & GNUTLS_CERT_INVALID
-        || status & GNUTLS_CERT_REVOKED) {
-		if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_UNTRUSTED_CERT)) {
-            return FALSE;
-		}
-	}
-	
-    if (gnutls_certificate_expiration_time_peers (priv->gnutls_session) < time (0)) {
-		if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_CERT_EXPIRED)) {
-			return FALSE;
-		}
-	}
-	
-	if (gnutls_certificate_activation_time_peers (priv->gnutls_session) > time (0)) {
-		if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_CERT_NOT_ACTIVATED)) {
-			return FALSE;
-		}
-	}
-	
-	if (gnutls_certificate_type_get (priv->gnutls_session) == GNUTLS_CRT_X509) {
-		const gnutls_datum *cert_list;
-        guint               cert_list_size;
-		size_t              digest_size;
-		gnutls_x509_crt     cert;
-        gchar              *expected_fingerprint;
-        gchar               fingerprint[20];
-		
-		cert_list = gnutls_certificate_get_peers (priv->gnutls_session,
-                                                  &cert_list_size);
-        if (cert_list == NULL) {
-            /* Signal ssl func */
-            if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_NO_CERT_FOUND)) {
-				return FALSE;
-			}
-		}
+    G_UNLOCK (verify_cache);
+}
 
-		gnutls_x509_crt_init (&cert);
+static gchar *
+gnutls_channel_verify_cache_key (const gnutls_datum_t *cert,
+                                 const gchar          *server)
+{
+    guchar   digest[32];
+    size_t   digest_size = sizeof (digest);
+    GString *key;
+    gsize    i;
+
+    if (gnutls_fingerprint (GNUTLS_DIG_SHA256, cert,
+                            digest, &digest_size) < 0) {
+        return NULL;
+    }
 
-        if (gnutls_x509_crt_import (cert, &cert_list[0],
-                                    GNUTLS_X509_FMT_DER) != 0) {
-            if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_NO_CERT_FOUND)) {
-				return FALSE;
-			}
-		}
+    key = g_string_sized_new (digest_size * 2 + strlen (server) + 2);
+    for (i = 0; i < digest_size; i++) {
+        g_string_append_printf (key, "%02x", digest[i]);
+    }
+    g_string_append_c (key, '/');
+    g_string_append (key, server);
 
-		if (!gnutls_x509_crt_check_hostname (cert, server)) {
-			if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_CERT_HOSTNAME_MISMATCH)) {
-				return FALSE;
-			}
-		}
+    return g_string_free (key, FALSE);
+}
 
-		gnutls_x509_crt_deinit (cert);
+static gboolean
+gnutls_channel_verify_cache_lookup (const gchar *key)
+{
+    time_t  *expires;
+    gboolean found = FALSE;
 
-        digest_size = sizeof (fingerprint);
-        g_object_get (channel, 
-                      "expected_fingerprint", &expected_fingerprint, NULL);
+    G_LOCK (verify_cache);
 
-		if (gnutls_fingerprint (GNUTLS_DIG_MD5, &cert_list[0],
-                                fingerprint,
-                                &digest_size) >= 0) {
-            if (expected_fingerprint &&
-                memcmp (expected_fingerprint, 
-                        fingerprint,
-                        digest_size) &&
-                !gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_CERT_FINGERPRINT_MISMATCH)) {
-                g_free (expected_fingerprint);
-                return FALSE;
-            }
-        } 
-        else if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_GENERIC_ERROR)) {
-            g_free (expected_fingerprint);
-            return FALSE; 
-        } 
+    if (verify_cache) {
+        expires = g_hash_table_lookup (verify_cache, key);
+        if (expires && *expires > time (NULL)) {
+            found = TRUE;
+        } else if (expires) {
+            g_hash_table_remove (verify_cache, key);
+        }
+    }
 
-        g_free (expected_fingerprint);
-        g_object_set (channel, "fingerprint", fingerprint, NULL);
-	}
+    G_UNLOCK (verify_cache);
 
-	return TRUE;
+    return found;
+}
+
+static gboolean
+verify_cache_entry_expired (gpointer key, time_t *expires, time_t *now)
+{
+    return *expires <= *now;
 }
 
 static void
-gnutls_channel_start_handshake (LmSecureChannel *channel, 
-                                const gchar     *host)
+gnutls_channel_verify_cache_insert (const gchar *key, time_t cert_expires)
 {
-    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
-    int                  ret;
-    gboolean             auth_ok = TRUE;
-    
-    const int cert_type_priority[] =
-        { GNUTLS_CRT_X509, GNUTLS_CRT_OPENPGP, 0 };
-    const int compression_priority[] =
-    { GNUTLS_COMP_DEFLATE, GNUTLS_COMP_NULL, 0 };
+    time_t *expires;
+    time_t  now = time (NULL);
 
-    gnutls_init (&priv->gnutls_session, GNUTLS_CLIENT);
-    gnutls_set_default_priority (priv->gnutls_session);
-    gnutls_certificate_type_set_priority (priv->gnutls_session,
-                                          cert_type_priority);
-    gnutls_compression_set_priority (priv->gnutls_session,
-                                     compression_priority);
-    gnutls_credentials_set (priv->gnutls_session,
-                            GNUTLS_CRD_CERTIFICATE,
-                            priv->gnutls_xcred);
+    G_LOCK (verify_cache);
 
-    gnutls_transport_set_ptr (priv->gnutls_session,
-                              (gnutls_transport_ptr_t)(glong) channel);
+    if (!verify_cache) {
+        verify_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, g_free);
+    }
 
-    gnutls_transport_set_push_function (priv->gnutls_session,
-                                        (gnutls_push_func) gnutls_channel_push_func);
-    gnutls_transport_set_pull_function (priv->gnutls_session,
-                                        (gnutls_pull_func) gnutls_channel_pull_func);
+    if (g_hash_table_size (verify_cache) >= VERIFY_CACHE_MAX_ENTRIES) {
+        g_hash_table_foreach_remove (verify_cache,
+                                     (GHRFunc) verify_cache_entry_expired,
+                                     &now);
+    }
+
+    if (g_hash_table_size (verify_cache) >= VERIFY_CACHE_MAX_ENTRIES) {
+        GHashTableIter  iter;
+        gpointer        entry_key;
+        time_t         *entry_expires;
+        gpointer        oldest_key = NULL;
+        time_t          oldest = 0;
+
+        /* Still full of live entries, the one expiring first goes */
+        g_hash_table_iter_init (&iter, verify_cache);
+        while (g_hash_table_iter_next (&iter, &entry_key, 
+                                       (gpointer *) &entry_expires)) {
+            if (!oldest_key || *entry_expires < oldest) {
+                oldest_key = entry_key;
+                oldest     = *entry_expires;
+            }
+        }
 
-    /* TODO: Should be done asynchronously, look at async gnutls branch */
-    ret = gnutls_handshake (priv->gnutls_session);
-    if (ret >= 0) {
-        auth_ok = gnutls_channel_verify_certificate (LM_GNUTLS_CHANNEL (channel),
-                                                     host);
+        g_hash_table_remove (verify_cache, oldest_key);
     }
 
-    if (ret < 0 || !auth_ok) {
-        /* TODO: Signal through handshake result signal */
-#if 0
+    expires  = g_new (time_t, 1);
+    *expires = MIN (now + VERIFY_CACHE_TTL_SEC, cert_expires);
 
-        char *errmsg;
+    g_hash_table_insert (verify_cache, g_strdup (key), expires);
 
-        if (!auth_ok) {
-            errmsg = "authentication error";
-        } else {
-            errmsg = "handshake failed";
+    G_UNLOCK (verify_cache);
+}
+
+/* Like gnutls_certificate_verify_peers2 but against the trust store, only
+ * the certificates that issued something in the peer chain get parsed.
+ */
+static int
+gnutls_channel_verify_peers_with_store (LmGnuTLSChannel *channel,
+                                        LmTrustStore    *store,
+                                        unsigned int    *status)
+{
+    LmGnuTLSChannelPriv      *priv = GET_PRIV (channel);
+    const gnutls_datum_t     *peers;
+    unsigned int              n_peers;
+    gnutls_x509_crt_t        *certs;
+    gnutls_x509_trust_list_t  list;
+    unsigned int              n_certs = 0;
+    int                       rc = 0;
+
+    *status = 0;
+
+    peers = gnutls_certificate_get_peers (priv->gnutls_session, &n_peers);
+    if (!peers || n_peers == 0) {
+        return GNUTLS_E_NO_CERTIFICATE_FOUND;
+    }
+
+    certs = g_new0 (gnutls_x509_crt_t, n_peers);
+    gnutls_x509_trust_list_init (&list, 0);
+
+    for (n_certs = 0; n_certs < n_peers; n_certs++) {
+        gnutls_x509_crt_init (&certs[n_certs]);
+
+        rc = gnutls_x509_crt_import (certs[n_certs], &peers[n_certs],
+                                     GNUTLS_X509_FMT_DER);
+        if (rc != 0) {
+            gnutls_x509_crt_deinit (certs[n_certs]);
+            break;
         }
 
-        g_set_error (error, 
-                     LM_ERROR, LM_ERROR_CONNECTION_OPEN,
-                     "*** GNUTLS %s: %s",
-                     errmsg, gnutls_strerror (ret));                    
-#endif
+        lm_trust_store_add_issuers (store, list, certs[n_certs]);
     }
 
-    g_print ("HANDSHAKE\n");
-    priv->is_encrypted = TRUE;
+    if (rc == 0) {
+        rc = gnutls_x509_trust_list_verify_crt (list, certs, n_certs,
+                                                0, status, NULL);
+    }
+
+    /* Also frees the CA certificates added from the store */
+    gnutls_x509_trust_list_deinit (list, 1);
+
+    while (n_certs > 0) {
+        gnutls_x509_crt_deinit (certs[--n_certs]);
+    }
+    g_free (certs);
+
+    return rc;
 }
 
-static ssize_t
-gnutls_channel_pull_func (LmGnuTLSChannel *channel,
-                          void            *buf,
-                          size_t           count)
+static gboolean
+gnutls_channel_verify_peer_identity (LmGnuTLSChannel      *channel,
+                                     const gnutls_datum_t *cert_list,
+                                     const gchar          *server);
+
+static gboolean
+gnutls_channel_verify_peer (LmGnuTLSChannel      *channel,
+                            const gnutls_datum_t *cert_list,
+                            const gchar          *server)
 {
-    GIOStatus  status;
-    gsize      bytes_read;
-    ssize_t    ret_val;
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+    LmTrustStore        *store;
+    unsigned int         status;
+    int                  rc;
+
+    store = gnutls_channel_get_trust_store ();
+    if (store) {
+        rc = gnutls_channel_verify_peers_with_store (channel, store, &status);
+        lm_trust_store_unref (store);
+    } else {
+        /* This verification function uses the trusted CAs in the credentials
+         * structure. The store may have been removed since the channel was
+         * set up, so the bundle is loaded here.
+         */
+        gnutls_channel_load_ca_pem (channel);
+        rc = gnutls_certificate_verify_peers2 (priv->gnutls_session, &status);
+    }
 
-    status = lm_channel_read (lm_channel_get_inner (LM_CHANNEL (channel)), 
-                              buf, count, &bytes_read, NULL);
+    if (rc == GNUTLS_E_NO_CERTIFICATE_FOUND) {
+        if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_NO_CERT_FOUND)) {
+            return FALSE;
+        }
+    }
 
-    /* errno should be set by underlying LmSocket so no need to reset it here */
-    switch (status) {
-        case G_IO_STATUS_NORMAL:
-            ret_val = bytes_read;
-            break;
+    if (rc != 0) {
+        if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_GENERIC_ERROR)) {
+            return FALSE;
+        }
+    }
 
-        case G_IO_STATUS_EOF:
-            ret_val = 0;
-            break;
-        case G_IO_STATUS_AGAIN:
-        case G_IO_STATUS_ERROR:
-            ret_val = -1;
-            break;
-    } 
+    if (rc == GNUTLS_E_NO_CERTIFICATE_FOUND) {
+        if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_NO_CERT_FOUND)) {
+            return FALSE;
+        }
+    }
 
-    return ret_val;
+    if (status & GNUTLS_CERT_INVALID
+        || status & GNUTLS_CERT_REVOKED) {
+        if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_UNTRUSTED_CERT)) {
+            return FALSE;
+        }
+    }
+
+    return gnutls_channel_verify_peer_identity (channel, cert_list, server);
 }
 
-static ssize_t 
-gnutls_channel_push_func (LmGnuTLSChannel *channel,
-                          const void      *buf,
-                          size_t           count)
+/* The checks that don't involve the CAs, done for pinned keys too */
+static gboolean
+gnutls_channel_verify_peer_identity (LmGnuTLSChannel      *channel,
+                                     const gnutls_datum_t *cert_list,
+                                     const gchar          *server)
 {
-    GIOStatus  status;
-    gsize      bytes_written;
-    ssize_t    ret_val;
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+
+    if (gnutls_certificate_expiration_time_peers (priv->gnutls_session) < time (0)) {
+        if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_CERT_EXPIRED)) {
+            return FALSE;
+        }
+    }
+
+    if (gnutls_certificate_activation_time_peers (priv->gnutls_session) > time (0)) {
+        if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_CERT_NOT_ACTIVATED)) {
+            return FALSE;
+        }
+    }
+
+    if (cert_list) {
+        gnutls_x509_crt cert;
+
+        gnutls_x509_crt_init (&cert);
+
+        if (gnutls_x509_crt_import (cert, &cert_list[0],
+                                    GNUTLS_X509_FMT_DER) != 0) {
+            if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_NO_CERT_FOUND)) {
+                gnutls_x509_crt_deinit (cert);
+                return FALSE;
+            }
+        }
+
+        if (!gnutls_x509_crt_check_hostname (cert, server)) {
+            if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_CERT_HOSTNAME_MISMATCH)) {
+                gnutls_x509_crt_deinit (cert);
+                return FALSE;
+            }
+        }
+
+        gnutls_x509_crt_deinit (cert);
+    }
+
+    return TRUE;
+}
+
+/* The base64 encoded SHA-256 digest of the SubjectPublicKeyInfo of crt */
+static gchar *
+gnutls_channel_get_pin (gnutls_x509_crt_t crt)
+{
+    gnutls_pubkey_t    pubkey;
+    gnutls_datum_t     spki = { NULL, 0 };
+    guchar             digest[32];
+    gchar             *encoded = NULL;
+
+    if (gnutls_pubkey_init (&pubkey) < 0) {
+        return NULL;
+    }
+
+    if (gnutls_pubkey_import_x509 (pubkey, crt, 0) >= 0 &&
+        gnutls_pubkey_export2 (pubkey, GNUTLS_X509_FMT_DER, &spki) >= 0) {
+        if (gnutls_hash_fast (GNUTLS_DIG_SHA256,
+                              spki.data, spki.size, digest) >= 0) {
+            encoded = g_base64_encode (digest, sizeof (digest));
+        }
+        gnutls_free (spki.data);
+    }
+
+    gnutls_pubkey_deinit (pubkey);
+
+    return encoded;
+}
+
+static gboolean
+gnutls_channel_pin_listed (const gchar *encoded, gchar **pins)
+{
+    gint i;
+
+    for (i = 0; pins[i]; i++) {
+        const gchar *pin = pins[i];
+
+        if (g_str_has_prefix (pin, PIN_PREFIX_SHA256)) {
+            pin += strlen (PIN_PREFIX_SHA256);
+        }
+
+        if (strcmp (pin, encoded) == 0) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* TRUE if the n certificates below issuer in the chain are signed by it,
+ * its validity is left to the pin.
+ */
+static gboolean
+gnutls_channel_chain_issued_by (gnutls_x509_crt_t    *crts,
+                                guint                 n,
+                                const gnutls_datum_t *issuer)
+{
+    gnutls_x509_trust_list_t list;
+    gnutls_x509_crt_t        ca;
+    unsigned int             status = GNUTLS_CERT_INVALID;
+
+    if (gnutls_x509_trust_list_init (&list, 0) < 0) {
+        return FALSE;
+    }
+
+    if (gnutls_x509_crt_init (&ca) >= 0) {
+        if (gnutls_x509_crt_import (ca, issuer, GNUTLS_X509_FMT_DER) >= 0 &&
+            gnutls_x509_trust_list_add_cas (list, &ca, 1, 0) == 1) {
+            /* Owned by the list now */
+            gnutls_x509_trust_list_verify_crt (list, crts, n,
+                                               GNUTLS_VERIFY_DISABLE_TIME_CHECKS |
+                                               GNUTLS_VERIFY_DISABLE_TRUSTED_TIME_CHECKS,
+                                               &status, NULL);
+        } else {
+            gnutls_x509_crt_deinit (ca);
+        }
+    }
+
+    gnutls_x509_trust_list_deinit (list, 1);
+
+    return status == 0;
+}
+
+/* Returns TRUE if a certificate in the peer chain matches one of the pins.
+ * A pin on an intermediate or root only counts if the certificates below
+ * it in the chain are signed by it.
+ */
+static gboolean
+gnutls_channel_check_pins (const gnutls_datum_t  *cert_list,
+                           guint                  cert_list_size,
+                           gchar                **pins)
+{
+    gnutls_x509_crt_t *crts;
+    guint              n_crts = 0;
+    guint              i;
+    gboolean           matched = FALSE;
+
+    crts = g_new0 (gnutls_x509_crt_t, cert_list_size);
+
+    for (i = 0; i < cert_list_size && !matched; i++) {
+        gchar *pin;
+
+        if (gnutls_x509_crt_init (&crts[i]) < 0) {
+            break;
+        }
+        n_crts++;
+
+        if (gnutls_x509_crt_import (crts[i], &cert_list[i],
+                                    GNUTLS_X509_FMT_DER) < 0) {
+            break;
+        }
+
+        pin = gnutls_channel_get_pin (crts[i]);
+        if (pin && gnutls_channel_pin_listed (pin, pins)) {
+            matched = i == 0 ||
+                gnutls_channel_chain_issued_by (crts, i, &cert_list[i]);
+        }
+        g_free (pin);
+    }
+
+    for (i = 0; i < n_crts; i++) {
+        gnutls_x509_crt_deinit (crts[i]);
+    }
+    g_free (crts);
+
+    return matched;
+}
+
+static gboolean
+gnutls_channel_verify_certificate (LmGnuTLSChannel *channel, 
+                                   const gchar     *server)
+{
+    LmGnuTLSChannelPriv  *priv = GET_PRIV (channel);
+    const gnutls_datum_t *cert_list = NULL;
+    guint                 cert_list_size = 0;
+    gchar                *cache_key = NULL;
+    gchar               **pins = NULL;
+    gboolean              pinned = FALSE;
+    gboolean              is_x509;
+
+    priv->cert_problems = 0;
+
+    is_x509 = gnutls_certificate_type_get (priv->gnutls_session) == GNUTLS_CRT_X509;
+    if (is_x509) {
+        cert_list = gnutls_certificate_get_peers (priv->gnutls_session,
+                                                  &cert_list_size);
+        if (cert_list == NULL) {
+            /* Signal ssl func */
+            if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_NO_CERT_FOUND)) {
+                return FALSE;
+            }
+        }
+    }
+
+    if (cert_list) {
+        g_object_get (channel, "pins", &pins, NULL);
+    }
+
+    if (pins && pins[0]) {
+        /* The key is pinned, a match makes CA validation unnecessary */
+        pinned = gnutls_channel_check_pins (cert_list, cert_list_size, pins);
+        if (!pinned &&
+            !gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_CERT_FINGERPRINT_MISMATCH)) {
+            g_strfreev (pins);
+            return FALSE;
+        }
+    }
+
+    g_strfreev (pins);
+
+    if (pinned &&
+        !gnutls_channel_verify_peer_identity (channel, cert_list, server)) {
+        return FALSE;
+    }
+
+    if (cert_list && !pinned) {
+        cache_key = gnutls_channel_verify_cache_key (&cert_list[0], server);
+    }
+
+    if (!pinned &&
+        (!cache_key || !gnutls_channel_verify_cache_lookup (cache_key))) {
+        if (!gnutls_channel_verify_peer (channel, cert_list, server)) {
+            g_free (cache_key);
+            return FALSE;
+        }
+
+        if (cache_key && priv->cert_problems == 0) {
+            gnutls_channel_verify_cache_insert (cache_key,
+                                                gnutls_certificate_expiration_time_peers (priv->gnutls_session));
+        }
+    }
+
+    g_free (cache_key);
+
+    if (cert_list) {
+        size_t              digest_size;
+        gchar              *expected_fingerprint;
+        gchar               fingerprint[20];
+
+        digest_size = sizeof (fingerprint);
+        g_object_get (channel, 
+                      "expected_fingerprint", &expected_fingerprint, NULL);
+
+        if (gnutls_fingerprint (GNUTLS_DIG_MD5, &cert_list[0],
+                                fingerprint,
+                                &digest_size) >= 0) {
+            if (expected_fingerprint &&
+                memcmp (expected_fingerprint, 
+                        fingerprint,
+                        digest_size) &&
+                !gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_CERT_FINGERPRINT_MISMATCH)) {
+                g_free (expected_fingerprint);
+                return FALSE;
+            }
+        } 
+        else if (!gnutls_channel_request_user_cert_feedback (channel, LM_SSL_STATUS_GENERIC_ERROR)) {
+            g_free (expected_fingerprint);
+            return FALSE; 
+        } 
+
+        g_free (expected_fingerprint);
+        g_object_set (channel, "fingerprint", fingerprint, NULL);
+    }
+
+    return TRUE;
+}
+
+static void
+session_cache_entry_free (SessionCacheEntry *entry)
+{
+    gnutls_free (entry->data.data);
+    g_free (entry);
+}
+
+static gboolean
+session_cache_entry_expired (gpointer           key,
+                             SessionCacheEntry *entry,
+                             time_t            *now)
+{
+    return entry->expires <= *now;
+}
+
+/* Called with the session_cache lock held */
+static void
+session_cache_make_room (time_t now)
+{
+    GHashTableIter     iter;
+    gpointer           key;
+    SessionCacheEntry *entry;
+    gpointer           oldest_key = NULL;
+    time_t             oldest = 0;
+
+    if (g_hash_table_size (session_cache) < SESSION_CACHE_MAX_ENTRIES) {
+        return;
+    }
+
+    g_hash_table_foreach_remove (session_cache,
+                                 (GHRFunc) session_cache_entry_expired, &now);
+
+    if (g_hash_table_size (session_cache) < SESSION_CACHE_MAX_ENTRIES) {
+        return;
+    }
+
+    /* All entries share the TTL, the one expiring first is the oldest */
+    g_hash_table_iter_init (&iter, session_cache);
+    while (g_hash_table_iter_next (&iter, &key, (gpointer *) &entry)) {
+        if (!oldest_key || entry->expires < oldest) {
+            oldest_key = key;
+            oldest     = entry->expires;
+        }
+    }
+
+    g_hash_table_remove (session_cache, oldest_key);
+}
+
+static void
+gnutls_channel_store_session (LmGnuTLSChannel *channel)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+    SessionCacheEntry   *entry;
+    time_t               now = time (NULL);
+
+    if (priv->server_mode || !priv->handshake_host) {
+        return;
+    }
+
+    entry = g_new0 (SessionCacheEntry, 1);
+    if (gnutls_session_get_data2 (priv->gnutls_session, &entry->data) < 0) {
+        g_free (entry);
+        return;
+    }
+    entry->expires = now + SESSION_CACHE_TTL_SEC;
+
+    G_LOCK (session_cache);
+
+    if (!session_cache) {
+        session_cache = 
+            g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                   (GDestroyNotify) session_cache_entry_free);
+    }
+
+    if (!g_hash_table_lookup (session_cache, priv->handshake_host)) {
+        session_cache_make_room (now);
+    }
+
+    g_hash_table_replace (session_cache,
+                          g_strdup (priv->handshake_host), entry);
+
+    G_UNLOCK (session_cache);
+}
+
+static void
+gnutls_channel_restore_session (LmGnuTLSChannel *channel)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+    SessionCacheEntry   *entry = NULL;
+
+    if (!priv->handshake_host) {
+        return;
+    }
+
+    G_LOCK (session_cache);
+
+    if (session_cache) {
+        entry = g_hash_table_lookup (session_cache, priv->handshake_host);
+    }
+
+    if (entry && entry->expires <= time (NULL)) {
+        g_hash_table_remove (session_cache, priv->handshake_host);
+        entry = NULL;
+    }
+
+    if (entry) {
+        priv->session_restored = 
+            gnutls_session_set_data (priv->gnutls_session,
+                                     entry->data.data,
+                                     entry->data.size) >= 0;
+    }
+
+    G_UNLOCK (session_cache);
+}
+
+static void
+gnutls_channel_write_early_data (LmSecureChannel *channel,
+                                 const gchar     *buf,
+                                 gssize           count)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+
+    if (count < 0) {
+        count = strlen (buf);
+    }
+
+    if (priv->is_encrypted || priv->handshaking) {
+        /* Too late for early data, send it as regular data */
+        gsize written;
+
+        lm_channel_write (LM_CHANNEL (channel), buf, count, &written, NULL);
+        return;
+    }
+
+    g_byte_array_append (priv->early_data, (const guint8 *) buf, count);
+}
+
+static LmSecureChannelHandshakeResult
+gnutls_channel_run_handshake (LmGnuTLSChannel *channel, const gchar *host)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+    int                  ret;
+    gboolean             early_data_sent = FALSE;
+
+    if (priv->early_data_enabled && priv->session_restored &&
+        priv->early_data->len > 0 &&
+        priv->early_data->len <= gnutls_record_get_max_early_data_size (priv->gnutls_session)) {
+        /* Goes out together with the ClientHello */
+        early_data_sent = 
+            gnutls_record_send_early_data (priv->gnutls_session,
+                                           priv->early_data->data,
+                                           priv->early_data->len) >= 0;
+    }
+
+    do {
+        ret = gnutls_handshake (priv->gnutls_session);
+    } while (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED);
+
+    if (ret < 0) {
+        g_warning ("TLS handshake failed: %s", gnutls_strerror (ret));
+        return LM_SECURE_CHANNEL_HANDSHAKE_FAILED;
+    }
+
+    if (!priv->server_mode &&
+        !gnutls_channel_verify_certificate (channel, host)) {
+        return LM_SECURE_CHANNEL_HANDSHAKE_AUTH_FAILED;
+    }
+
+    if (priv->early_data->len == 0) {
+        return LM_SECURE_CHANNEL_HANDSHAKE_OK;
+    }
+
+    if (early_data_sent &&
+        gnutls_session_get_flags (priv->gnutls_session) & GNUTLS_SFLAGS_EARLY_DATA) {
+        g_byte_array_set_size (priv->early_data, 0);
+        return LM_SECURE_CHANNEL_HANDSHAKE_EARLY_DATA_ACCEPTED;
+    }
+
+    /* Left in early_data and resent once the channel is encrypted */
+    return LM_SECURE_CHANNEL_HANDSHAKE_EARLY_DATA_REJECTED;
+}
+
+static void
+gnutls_channel_handshake_finished (LmGnuTLSChannel                *channel,
+                                   LmSecureChannelHandshakeResult  result)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+
+    g_print ("HANDSHAKE\n");
+
+    if (result != LM_SECURE_CHANNEL_HANDSHAKE_OK &&
+        result != LM_SECURE_CHANNEL_HANDSHAKE_EARLY_DATA_ACCEPTED &&
+        result != LM_SECURE_CHANNEL_HANDSHAKE_EARLY_DATA_REJECTED) {
+        /* Nothing was established, close won't have a session to end */
+        gnutls_deinit (priv->gnutls_session);
+        g_byte_array_set_size (priv->early_data, 0);
+        g_byte_array_set_size (priv->pending_writes, 0);
+        g_byte_array_set_size (priv->handshake_in, 0);
+        g_byte_array_set_size (priv->handshake_out, 0);
+
+        g_signal_emit_by_name (channel, "handshake-result", result);
+        return;
+    }
+
+    g_object_get (channel,
+                  "dynamic-record-sizing", &priv->dynamic_records, NULL);
+    priv->record_size      = RECORD_SIZE_SMALL;
+    priv->bytes_since_idle = 0;
+    priv->last_write_time  = g_get_monotonic_time ();
+
+    priv->is_encrypted = TRUE;
+
+    if (result == LM_SECURE_CHANNEL_HANDSHAKE_EARLY_DATA_REJECTED) {
+        gsize written;
+
+        gnutls_channel_write (LM_CHANNEL (channel),
+                              (const gchar *) priv->early_data->data,
+                              priv->early_data->len, &written, NULL);
+    }
+    g_byte_array_set_size (priv->early_data, 0);
+
+    gnutls_channel_store_session (channel);
+
+    if (priv->pending_writes->len > 0) {
+        gsize written;
+
+        gnutls_channel_write (LM_CHANNEL (channel),
+                              (const gchar *) priv->pending_writes->data,
+                              priv->pending_writes->len, &written, NULL);
+    }
+    g_byte_array_set_size (priv->pending_writes, 0);
+
+    g_signal_emit_by_name (channel, "handshake-result", result);
+}
+
+/* Hands the records queued by the worker to the inner channel, whatever it
+ * doesn't take now is retried when it turns writeable.
+ */
+static void
+gnutls_channel_flush_handshake_out (LmGnuTLSChannel *channel)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+    GByteArray          *out;
+    gsize                written;
+
+    g_mutex_lock (&priv->io_mutex);
+    out = priv->handshake_out;
+    priv->handshake_out = g_byte_array_new ();
+    priv->flush_queued = FALSE;
+    g_mutex_unlock (&priv->io_mutex);
+
+    while (out->len > 0) {
+        if (lm_channel_write (lm_channel_get_inner (LM_CHANNEL (channel)),
+                              (const gchar *) out->data, out->len,
+                              &written, NULL) != G_IO_STATUS_NORMAL ||
+            written == 0) {
+            break;
+        }
+
+        g_byte_array_remove_range (out, 0, written);
+    }
+
+    if (out->len > 0) {
+        g_mutex_lock (&priv->io_mutex);
+        g_byte_array_prepend (priv->handshake_out, out->data, out->len);
+        g_mutex_unlock (&priv->io_mutex);
+    }
+
+    g_byte_array_free (out, TRUE);
+}
+
+static gboolean
+gnutls_channel_flush_cb (LmGnuTLSChannel *channel)
+{
+    gnutls_channel_flush_handshake_out (channel);
+
+    /* Reference taken by gnutls_channel_queue_push */
+    g_object_unref (channel);
+
+    return FALSE;
+}
+
+static gboolean
+gnutls_channel_handshake_done_cb (LmGnuTLSChannel *channel)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+    LmChannel           *inner = lm_channel_get_inner (LM_CHANNEL (channel));
+
+    g_signal_handler_disconnect (inner, priv->inner_readable_id);
+    g_signal_handler_disconnect (inner, priv->inner_writeable_id);
+    g_signal_handler_disconnect (inner, priv->inner_closed_id);
+    priv->inner_readable_id  = 0;
+    priv->inner_writeable_id = 0;
+    priv->inner_closed_id    = 0;
+
+    g_object_unref (priv->handshake_reactor);
+    priv->handshake_reactor = NULL;
+
+    /* The worker is done, the queues are only drained from here on */
+    priv->worker_io   = FALSE;
+    priv->handshaking = FALSE;
+
+    gnutls_channel_flush_handshake_out (channel);
+
+    gnutls_channel_handshake_finished (channel, priv->handshake_result);
+
+    if (priv->is_encrypted && priv->handshake_in->len > 0) {
+        /* Records that arrived right behind the handshake */
+        g_signal_emit_by_name (channel, "readable");
+    }
+
+    /* Reference taken when the handshake was pushed to the pool */
+    g_object_unref (channel);
+
+    return FALSE;
+}
+
+static void
+gnutls_channel_handshake_worker (LmGnuTLSChannel *channel,
+                                 gpointer         user_data)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+
+    priv->handshake_result = 
+        gnutls_channel_run_handshake (channel, priv->handshake_host);
+
+    /* Hand the result back to the thread running the channel's reactor */
+    lm_reactor_add_defer (priv->handshake_reactor,
+                          (GSourceFunc) gnutls_channel_handshake_done_cb,
+                          channel);
+}
+
+static void
+gnutls_channel_inner_readable_cb (LmChannel       *inner,
+                                  LmGnuTLSChannel *channel)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+    gchar                buf[RECORD_SIZE_LARGE];
+    gsize                bytes_read;
+    GIOStatus            status;
+
+    /* Drain the socket so that it stops reporting readable */
+    do {
+        status = lm_channel_read (inner, buf, sizeof (buf), &bytes_read, NULL);
+
+        g_mutex_lock (&priv->io_mutex);
+        if (status == G_IO_STATUS_NORMAL) {
+            g_byte_array_append (priv->handshake_in,
+                                 (const guint8 *) buf, bytes_read);
+        } else if (status != G_IO_STATUS_AGAIN) {
+            priv->handshake_in_closed = TRUE;
+        }
+        g_cond_signal (&priv->io_cond);
+        g_mutex_unlock (&priv->io_mutex);
+    } while (status == G_IO_STATUS_NORMAL && bytes_read > 0);
+}
+
+static void
+gnutls_channel_inner_writeable_cb (LmChannel       *inner,
+                                   LmGnuTLSChannel *channel)
+{
+    gnutls_channel_flush_handshake_out (channel);
+}
+
+static void
+gnutls_channel_inner_closed_cb (LmChannel            *inner,
+                                LmChannelCloseReason  reason,
+                                LmGnuTLSChannel      *channel)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+
+    g_mutex_lock (&priv->io_mutex);
+    priv->handshake_in_closed = TRUE;
+    g_cond_signal (&priv->io_cond);
+    g_mutex_unlock (&priv->io_mutex);
+}
+
+/* Transport for the worker, blocks until the loop has queued data */
+static ssize_t
+gnutls_channel_queue_pull (LmGnuTLSChannel *channel,
+                           void            *buf,
+                           size_t           count)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+    ssize_t              ret_val;
+
+    g_mutex_lock (&priv->io_mutex);
+
+    while (priv->worker_io && priv->handshake_in->len == 0 &&
+           !priv->handshake_in_closed && !priv->handshake_cancelled) {
+        g_cond_wait (&priv->io_cond, &priv->io_mutex);
+    }
+
+    if (priv->handshake_cancelled) {
+        gnutls_transport_set_errno (priv->gnutls_session, EIO);
+        ret_val = -1;
+    } else if (priv->handshake_in->len > 0) {
+        ret_val = MIN (count, priv->handshake_in->len);
+        memcpy (buf, priv->handshake_in->data, ret_val);
+        g_byte_array_remove_range (priv->handshake_in, 0, ret_val);
+    } else if (priv->handshake_in_closed) {
+        ret_val = 0;
+    } else {
+        gnutls_transport_set_errno (priv->gnutls_session, EAGAIN);
+        ret_val = -1;
+    }
+
+    g_mutex_unlock (&priv->io_mutex);
+
+    return ret_val;
+}
+
+static ssize_t
+gnutls_channel_queue_push (LmGnuTLSChannel *channel,
+                           const void      *buf,
+                           size_t           count)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+
+    g_mutex_lock (&priv->io_mutex);
+
+    if (priv->handshake_cancelled) {
+        g_mutex_unlock (&priv->io_mutex);
+        gnutls_transport_set_errno (priv->gnutls_session, EIO);
+        return -1;
+    }
+
+    g_byte_array_append (priv->handshake_out, buf, count);
+
+    if (!priv->flush_queued) {
+        priv->flush_queued = TRUE;
+        lm_reactor_add_defer (priv->handshake_reactor,
+                              (GSourceFunc) gnutls_channel_flush_cb,
+                              g_object_ref (channel));
+    }
+
+    g_mutex_unlock (&priv->io_mutex);
+
+    return count;
+}
+
+static GThreadPool *
+gnutls_channel_get_handshake_pool (void)
+{
+    G_LOCK (handshake_pool);
+
+    if (!handshake_pool) {
+        handshake_pool = 
+            g_thread_pool_new ((GFunc) gnutls_channel_handshake_worker,
+                               NULL,
+                               HANDSHAKE_POOL_MAX_THREADS,
+                               FALSE,
+                               NULL);
+    }
+
+    G_UNLOCK (handshake_pool);
+
+    return handshake_pool;
+}
+
+static void
+gnutls_channel_set_priority (LmGnuTLSChannel *channel)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+    gchar               *priority;
+    const gchar         *err_pos = NULL;
+
+    g_object_get (channel, "priority", &priority, NULL);
+
+    if (priority && strcmp (priority, LM_SECURE_CHANNEL_PRIORITY_AUTO) == 0) {
+        g_free (priority);
+        priority = g_strdup (lm_misc_cpu_has_aes () ?
+                             PRIORITY_AES_FIRST : PRIORITY_CHACHA_FIRST);
+    }
+
+    if (!priority ||
+        gnutls_priority_set_direct (priv->gnutls_session,
+                                    priority, &err_pos) < 0) {
+        if (priority && err_pos) {
+            g_warning ("Invalid TLS priority string at '%s', using default",
+                       err_pos);
+        } else if (priority) {
+            g_warning ("Invalid TLS priority string '%s', using default",
+                       priority);
+        }
+        gnutls_set_default_priority (priv->gnutls_session);
+    }
+
+    g_free (priority);
+}
+
+static gboolean
+gnutls_channel_set_server_credentials (const gchar *cert_file,
+                                       const gchar *key_file)
+{
+    gnutls_certificate_credentials_t xcred;
+    int                              ret;
+
+    g_return_val_if_fail (cert_file != NULL, FALSE);
+    g_return_val_if_fail (key_file != NULL, FALSE);
+
+    gnutls_certificate_allocate_credentials (&xcred);
+
+    ret = gnutls_certificate_set_x509_key_file (xcred, cert_file, key_file,
+                                                GNUTLS_X509_FMT_PEM);
+    if (ret < 0) {
+        g_warning ("Failed to load server certificate '%s': %s",
+                   cert_file, gnutls_strerror (ret));
+        gnutls_certificate_free_credentials (xcred);
+        return FALSE;
+    }
+
+    G_LOCK (server_creds);
+
+    if (server_xcred) {
+        /* Sessions still reference the old credentials, keep them */
+        g_warning ("Server credentials already loaded, not replacing them");
+        G_UNLOCK (server_creds);
+        gnutls_certificate_free_credentials (xcred);
+        return FALSE;
+    }
+
+    server_xcred = xcred;
+
+    G_UNLOCK (server_creds);
+
+    return TRUE;
+}
+
+#if defined (HAVE_LINUX_TLS_H) && defined (TCP_ULP)
+
+/* Moves the record protection of one direction of the session into the
+ * kernel, the same way GnuTLS does it when built with kernel TLS.
+ */
+static gboolean
+gnutls_channel_set_ktls_keys (gnutls_session_t session,
+                              int              fd,
+                              gboolean         read)
+{
+    union {
+        struct tls12_crypto_info_aes_gcm_128       aes_128;
+        struct tls12_crypto_info_aes_gcm_256       aes_256;
+        struct tls12_crypto_info_chacha20_poly1305 chacha;
+    } info;
+    gnutls_protocol_t  version;
+    gnutls_datum_t     iv;
+    gnutls_datum_t     key;
+    guchar             seq[8];
+    guchar            *info_iv, *info_salt, *info_key, *info_seq;
+    gsize              iv_size, salt_size, key_size;
+    socklen_t          info_len;
+    int                ret;
+
+    if (gnutls_record_get_state (session, read, NULL, &iv, &key, seq) < 0) {
+        return FALSE;
+    }
+
+    memset (&info, 0, sizeof (info));
+
+    switch (gnutls_cipher_get (session)) {
+        case GNUTLS_CIPHER_AES_128_GCM:
+            info.aes_128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+            info_iv   = info.aes_128.iv;
+            info_salt = info.aes_128.salt;
+            info_key  = info.aes_128.key;
+            info_seq  = info.aes_128.rec_seq;
+            iv_size   = TLS_CIPHER_AES_GCM_128_IV_SIZE;
+            salt_size = TLS_CIPHER_AES_GCM_128_SALT_SIZE;
+            key_size  = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+            info_len  = sizeof (info.aes_128);
+            break;
+        case GNUTLS_CIPHER_AES_256_GCM:
+            info.aes_256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+            info_iv   = info.aes_256.iv;
+            info_salt = info.aes_256.salt;
+            info_key  = info.aes_256.key;
+            info_seq  = info.aes_256.rec_seq;
+            iv_size   = TLS_CIPHER_AES_GCM_256_IV_SIZE;
+            salt_size = TLS_CIPHER_AES_GCM_256_SALT_SIZE;
+            key_size  = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+            info_len  = sizeof (info.aes_256);
+            break;
+        case GNUTLS_CIPHER_CHACHA20_POLY1305:
+            info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+            info_iv   = info.chacha.iv;
+            info_salt = NULL;
+            info_key  = info.chacha.key;
+            info_seq  = info.chacha.rec_seq;
+            iv_size   = TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE;
+            salt_size = 0;
+            key_size  = TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE;
+            info_len  = sizeof (info.chacha);
+            break;
+        default:
+            g_warning ("Only AEAD cipher suites can be handed to the kernel");
+            return FALSE;
+    }
+
+    version = gnutls_protocol_get_version (session);
+    info.aes_128.info.version = 
+        version == GNUTLS_TLS1_3 ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+
+    if (key.size != key_size || iv.size < salt_size) {
+        return FALSE;
+    }
+
+    if (salt_size > 0 && version != GNUTLS_TLS1_3) {
+        /* TLS 1.2 GCM, the explicit part of the nonce is the sequence */
+        memcpy (info_salt, iv.data, salt_size);
+        memcpy (info_iv, seq, iv_size);
+    } else if (salt_size > 0) {
+        if (iv.size != salt_size + iv_size) {
+            return FALSE;
+        }
+        memcpy (info_salt, iv.data, salt_size);
+        memcpy (info_iv, iv.data + salt_size, iv_size);
+    } else {
+        if (iv.size != iv_size) {
+            return FALSE;
+        }
+        memcpy (info_iv, iv.data, iv_size);
+    }
+
+    memcpy (info_key, key.data, key_size);
+    memcpy (info_seq, seq, sizeof (seq));
+
+    ret = setsockopt (fd, SOL_TLS, read ? TLS_RX : TLS_TX, &info, info_len);
+
+    memset (&info, 0, sizeof (info));
+
+    if (ret < 0) {
+        g_warning ("Failed to set kernel TLS keys: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+gnutls_channel_enable_ktls (gnutls_session_t session, int fd)
+{
+    gnutls_protocol_t version = gnutls_protocol_get_version (session);
+
+    if (version != GNUTLS_TLS1_2 && version != GNUTLS_TLS1_3) {
+        g_warning ("Only TLS 1.2 and 1.3 sessions can be handed to the kernel");
+        return FALSE;
+    }
+
+    if (setsockopt (fd, SOL_TCP, TCP_ULP, "tls", sizeof ("tls")) < 0) {
+        g_warning ("Kernel TLS not available: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    return gnutls_channel_set_ktls_keys (session, fd, FALSE) &&
+        gnutls_channel_set_ktls_keys (session, fd, TRUE);
+}
+
+#else /* HAVE_LINUX_TLS_H && TCP_ULP */
+
+static gboolean
+gnutls_channel_enable_ktls (gnutls_session_t session, int fd)
+{
+    g_warning ("Kernel TLS not supported on this platform");
+
+    return FALSE;
+}
+
+#endif /* HAVE_LINUX_TLS_H && TCP_ULP */
+
+int
+lm_gnutls_channel_export_session (LmGnuTLSChannel *channel)
+{
+    LmGnuTLSChannelPriv *priv;
+    LmChannel           *inner;
+    int                  fd;
+
+    g_return_val_if_fail (LM_IS_GNUTLS_CHANNEL (channel), -1);
+
+    priv  = GET_PRIV (channel);
+    inner = lm_channel_get_inner (LM_CHANNEL (channel));
+
+    if (!LM_IS_SOCKET (inner)) {
+        g_warning ("Only channels directly on an LmSocket can be exported");
+        return -1;
+    }
+
+    if (!priv->is_encrypted || priv->handshaking ||
+        priv->pending_writes->len > 0 || priv->handshake_in->len > 0 ||
+        priv->handshake_out->len > 0) {
+        g_warning ("Only established and idle sessions can be exported");
+        return -1;
+    }
+
+    if (!priv->kernel_tls &&
+        gnutls_record_check_pending (priv->gnutls_session) > 0) {
+        g_warning ("Session has unread data, not exporting");
+        return -1;
+    }
+
+    fd = lm_socket_steal_fd (LM_SOCKET (inner));
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (!priv->kernel_tls) {
+        gboolean enabled;
+
+        enabled = gnutls_channel_enable_ktls (priv->gnutls_session, fd);
+
+        /* The session now belongs to the kernel or is lost, tear ours
+         * down without sending close_notify.
+         */
+        gnutls_deinit (priv->gnutls_session);
+
+        if (!enabled) {
+            close (fd);
+            fd = -1;
+        }
+    }
+
+    priv->kernel_tls   = FALSE;
+    priv->is_encrypted = FALSE;
+
+    return fd;
+}
+
+gboolean
+lm_gnutls_channel_import_session (LmGnuTLSChannel *channel)
+{
+    LmGnuTLSChannelPriv *priv;
+
+    g_return_val_if_fail (LM_IS_GNUTLS_CHANNEL (channel), FALSE);
+
+    priv = GET_PRIV (channel);
+
+    if (priv->is_encrypted || priv->handshaking) {
+        g_warning ("Channel already has a TLS session");
+        return FALSE;
+    }
+
+    priv->kernel_tls   = TRUE;
+    priv->is_encrypted = TRUE;
+
+    return TRUE;
+}
+
+/* Called with the server_creds lock held */
+static void
+gnutls_channel_ensure_ticket_key (void)
+{
+    if (ticket_key.data) {
+        return;
+    }
+
+    if (gnutls_session_ticket_key_generate (&ticket_key) < 0) {
+        g_warning ("Failed to generate session ticket key");
+        ticket_key.data = NULL;
+    }
+}
+
+static gboolean
+gnutls_channel_setup_server (LmGnuTLSChannel *channel)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+    gboolean             ret = TRUE;
+
+    G_LOCK (server_creds);
+
+    if (!server_xcred) {
+        g_warning ("Server mode channel without server credentials, see lm_secure_channel_set_server_credentials");
+        ret = FALSE;
+    } else {
+        gnutls_credentials_set (priv->gnutls_session,
+                                GNUTLS_CRD_CERTIFICATE,
+                                server_xcred);
+        gnutls_certificate_server_set_request (priv->gnutls_session,
+                                               GNUTLS_CERT_IGNORE);
+
+        gnutls_channel_ensure_ticket_key ();
+        if (ticket_key.data) {
+            gnutls_session_ticket_enable_server (priv->gnutls_session,
+                                                 &ticket_key);
+            /* Also sets how often the derived ticket keys rotate */
+            gnutls_db_set_cache_expiration (priv->gnutls_session,
+                                            TICKET_KEY_LIFETIME_SEC);
+        }
+    }
+
+    G_UNLOCK (server_creds);
+
+    return ret;
+}
+
+static void
+gnutls_channel_start_handshake (LmSecureChannel *channel, 
+                                const gchar     *host)
+{
+    LmGnuTLSChannelPriv            *priv = GET_PRIV (channel);
+    LmSecureChannelHandshakeResult  result;
+    gboolean                        threaded;
+    guint                           init_flags = GNUTLS_CLIENT;
+    
+    const int cert_type_priority[] =
+        { GNUTLS_CRT_X509, GNUTLS_CRT_OPENPGP, 0 };
+    const int compression_priority[] =
+    { GNUTLS_COMP_DEFLATE, GNUTLS_COMP_NULL, 0 };
+
+    g_free (priv->handshake_host);
+    priv->handshake_host = g_strdup (host);
+
+    g_object_get (channel, 
+                  "server-mode", &priv->server_mode,
+                  "early-data", &priv->early_data_enabled,
+                  "false-start", &priv->false_start,
+                  NULL);
+
+    if (priv->server_mode) {
+        /* Client side only features */
+        init_flags = GNUTLS_SERVER;
+        priv->early_data_enabled = FALSE;
+        priv->false_start        = FALSE;
+    }
+
+    if (priv->early_data_enabled) {
+        init_flags |= GNUTLS_ENABLE_EARLY_DATA;
+    }
+
+    if (priv->false_start) {
+        /* gnutls_handshake returns once our Finished has been sent, the
+         * peer's Finished is processed with the first received record.
+         */
+        init_flags |= GNUTLS_ENABLE_FALSE_START;
+    }
+
+    gnutls_init (&priv->gnutls_session, init_flags);
+    gnutls_channel_set_priority (LM_GNUTLS_CHANNEL (channel));
+    gnutls_certificate_type_set_priority (priv->gnutls_session,
+                                          cert_type_priority);
+    gnutls_compression_set_priority (priv->gnutls_session,
+                                     compression_priority);
+
+    if (!priv->server_mode) {
+        gnutls_credentials_set (priv->gnutls_session,
+                                GNUTLS_CRD_CERTIFICATE,
+                                priv->gnutls_xcred);
+    } else if (!gnutls_channel_setup_server (LM_GNUTLS_CHANNEL (channel))) {
+        gnutls_deinit (priv->gnutls_session);
+        g_signal_emit_by_name (channel, "handshake-result",
+                               LM_SECURE_CHANNEL_HANDSHAKE_FAILED);
+        return;
+    }
+
+    gnutls_transport_set_ptr (priv->gnutls_session,
+                              (gnutls_transport_ptr_t)(glong) channel);
+
+    gnutls_transport_set_push_function (priv->gnutls_session,
+                                        (gnutls_push_func) gnutls_channel_push_func);
+    gnutls_transport_set_pull_function (priv->gnutls_session,
+                                        (gnutls_pull_func) gnutls_channel_pull_func);
+
+    gnutls_channel_restore_session (LM_GNUTLS_CHANNEL (channel));
+
+    g_object_get (channel, "threaded-handshake", &threaded, NULL);
+
+    if (threaded) {
+        LmChannel *inner = lm_channel_get_inner (LM_CHANNEL (channel));
+
+        priv->handshaking = TRUE;
+        priv->worker_io   = TRUE;
+
+        priv->handshake_reactor = 
+            g_object_ref (lm_channel_get_reactor (LM_CHANNEL (channel)));
+
+        g_byte_array_set_size (priv->handshake_in, 0);
+        g_byte_array_set_size (priv->handshake_out, 0);
+        priv->handshake_in_closed = FALSE;
+        priv->handshake_cancelled = FALSE;
+        priv->flush_queued        = FALSE;
+
+        priv->inner_readable_id = 
+            g_signal_connect (inner, "readable",
+                              G_CALLBACK (gnutls_channel_inner_readable_cb),
+                              channel);
+        priv->inner_writeable_id = 
+            g_signal_connect (inner, "writeable",
+                              G_CALLBACK (gnutls_channel_inner_writeable_cb),
+                              channel);
+        priv->inner_closed_id = 
+            g_signal_connect (inner, "closed",
+                              G_CALLBACK (gnutls_channel_inner_closed_cb),
+                              channel);
+
+        g_thread_pool_push (gnutls_channel_get_handshake_pool (),
+                            g_object_ref (channel), NULL);
+        return;
+    }
+
+    result = gnutls_channel_run_handshake (LM_GNUTLS_CHANNEL (channel), host);
+    gnutls_channel_handshake_finished (LM_GNUTLS_CHANNEL (channel), result);
+}
+
+static ssize_t
+gnutls_channel_pull_func (LmGnuTLSChannel *channel,
+                          void            *buf,
+                          size_t           count)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+    GIOStatus            status;
+    gsize                bytes_read;
+    ssize_t              ret_val;
+
+    if (priv->worker_io || priv->handshake_in->len > 0) {
+        /* In the worker, or what arrived behind the handshake */
+        return gnutls_channel_queue_pull (channel, buf, count);
+    }
+
+    status = lm_channel_read (lm_channel_get_inner (LM_CHANNEL (channel)), 
+                              buf, count, &bytes_read, NULL);
+
+    /* errno should be set by underlying LmSocket so no need to reset it here */
+    switch (status) {
+        case G_IO_STATUS_NORMAL:
+            ret_val = bytes_read;
+            break;
+
+        case G_IO_STATUS_EOF:
+            ret_val = 0;
+            break;
+        case G_IO_STATUS_AGAIN:
+        case G_IO_STATUS_ERROR:
+            ret_val = -1;
+            break;
+    } 
+
+    return ret_val;
+}
+
+static ssize_t 
+gnutls_channel_push_func (LmGnuTLSChannel *channel,
+                          const void      *buf,
+                          size_t           count)
+{
+    LmGnuTLSChannelPriv *priv = GET_PRIV (channel);
+    GIOStatus            status;
+    gsize                bytes_written;
+    ssize_t              ret_val;
+
+    if (priv->worker_io) {
+        return gnutls_channel_queue_push (channel, buf, count);
+    }
+
+    if (priv->handshake_out->len > 0) {
+        /* Keep the records in order, the handshake's go first */
+        gnutls_channel_flush_handshake_out (channel);
+
+        if (priv->handshake_out->len > 0) {
+            gnutls_transport_set_errno (priv->gnutls_session, EAGAIN);
+            return -1;
+        }
+    }
 
     status = lm_channel_write (lm_channel_get_inner (LM_CHANNEL (channel)),
                                buf, count, &bytes_written, NULL);
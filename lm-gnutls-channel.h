@@ -53,7 +53,21 @@ struct LmGnuTLSChannelClass {
     void  (*cancel)        (LmGnuTLSChannel     *gnutls_channel);
 };
 
-GType   lm_gnutls_channel_get_type  (void);
+GType    lm_gnutls_channel_get_type               (void);
+
+/* Hands an established session over to another process. The record keys
+ * are moved into the kernel (kernel TLS) on the socket under the channel,
+ * which is detached and returned so it can be passed on over a UNIX
+ * socket. Export when all received data has been read, the channel can't
+ * be used afterwards and a failed export loses the connection. Only AEAD
+ * cipher suites are supported. Returns -1 on failure.
+ */
+int      lm_gnutls_channel_export_session         (LmGnuTLSChannel  *channel);
+/* Continues an exported session on a channel put on top of
+ * lm_socket_new_from_fd(). Post-handshake messages such as KeyUpdate
+ * can't be handled and end the connection.
+ */
+gboolean lm_gnutls_channel_import_session         (LmGnuTLSChannel  *channel);
 
 G_END_DECLS
 
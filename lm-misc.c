@@ -22,6 +22,13 @@
 
 #include <string.h>
 
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
 #include "lm-misc.h"
 
 static void
@@ -104,3 +111,35 @@ lm_misc_io_condition_to_str  (GIOCondition condition)
     return buf;
 }
 
+static gpointer
+misc_detect_cpu_aes (gpointer data)
+{
+    gboolean has_aes = FALSE;
+
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+
+    /* AES-NI and PCLMULQDQ are both needed for fast AES-GCM */
+    if (__get_cpuid (1, &eax, &ebx, &ecx, &edx)) {
+        has_aes = (ecx & bit_AES) && (ecx & bit_PCLMUL);
+    }
+#elif defined(__aarch64__) && defined(__linux__)
+    unsigned long hwcap = getauxval (AT_HWCAP);
+
+    has_aes = (hwcap & HWCAP_AES) && (hwcap & HWCAP_PMULL);
+#endif
+
+    return GINT_TO_POINTER (has_aes);
+}
+
+/* Whether the CPU has instructions for accelerating AES-GCM */
+gboolean
+lm_misc_cpu_has_aes (void)
+{
+    static GOnce detect_once = G_ONCE_INIT;
+
+    g_once (&detect_once, misc_detect_cpu_aes, NULL);
+
+    return GPOINTER_TO_INT (detect_once.retval);
+}
+
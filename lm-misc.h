@@ -38,6 +38,8 @@ GSource *          lm_misc_add_timeout          (GMainContext *context,
 
 const char *       lm_misc_io_condition_to_str  (GIOCondition    condition);
 
+gboolean           lm_misc_cpu_has_aes          (void);
+
 
 #endif /* __LM_MISC_H__ */
 
@@ -0,0 +1,113 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include "lm-reactor.h"
+
+G_DEFINE_ABSTRACT_TYPE (LmReactor, lm_reactor, G_TYPE_OBJECT)
+
+static void
+lm_reactor_class_init (LmReactorClass *class)
+{
+}
+
+static void
+lm_reactor_init (LmReactor *reactor)
+{
+}
+
+LmReactorSource *
+lm_reactor_add_fd (LmReactor       *reactor,
+                   int              fd,
+                   GIOCondition     condition,
+                   LmReactorFdFunc  func,
+                   gpointer         user_data)
+{
+    g_return_val_if_fail (LM_IS_REACTOR (reactor), NULL);
+    g_return_val_if_fail (func != NULL, NULL);
+
+    if (!LM_REACTOR_GET_CLASS(reactor)->add_fd) {
+        g_assert_not_reached ();
+    }
+
+    return LM_REACTOR_GET_CLASS(reactor)->add_fd (reactor, fd, condition,
+                                                  func, user_data);
+}
+
+void
+lm_reactor_modify_fd (LmReactor       *reactor,
+                      LmReactorSource *source,
+                      GIOCondition     condition)
+{
+    g_return_if_fail (LM_IS_REACTOR (reactor));
+    g_return_if_fail (source != NULL);
+
+    if (!LM_REACTOR_GET_CLASS(reactor)->modify_fd) {
+        g_assert_not_reached ();
+    }
+
+    LM_REACTOR_GET_CLASS(reactor)->modify_fd (reactor, source, condition);
+}
+
+LmReactorSource *
+lm_reactor_add_timeout (LmReactor   *reactor,
+                        guint        interval,
+                        GSourceFunc  func,
+                        gpointer     user_data)
+{
+    g_return_val_if_fail (LM_IS_REACTOR (reactor), NULL);
+    g_return_val_if_fail (func != NULL, NULL);
+
+    if (!LM_REACTOR_GET_CLASS(reactor)->add_timeout) {
+        g_assert_not_reached ();
+    }
+
+    return LM_REACTOR_GET_CLASS(reactor)->add_timeout (reactor, interval,
+                                                       func, user_data);
+}
+
+LmReactorSource *
+lm_reactor_add_defer (LmReactor   *reactor,
+                      GSourceFunc  func,
+                      gpointer     user_data)
+{
+    g_return_val_if_fail (LM_IS_REACTOR (reactor), NULL);
+    g_return_val_if_fail (func != NULL, NULL);
+
+    if (!LM_REACTOR_GET_CLASS(reactor)->add_defer) {
+        g_assert_not_reached ();
+    }
+
+    return LM_REACTOR_GET_CLASS(reactor)->add_defer (reactor, func, user_data);
+}
+
+void
+lm_reactor_remove (LmReactor *reactor, LmReactorSource *source)
+{
+    g_return_if_fail (LM_IS_REACTOR (reactor));
+    g_return_if_fail (source != NULL);
+
+    if (!LM_REACTOR_GET_CLASS(reactor)->remove) {
+        g_assert_not_reached ();
+    }
+
+    LM_REACTOR_GET_CLASS(reactor)->remove (reactor, source);
+}
@@ -0,0 +1,106 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_REACTOR_H__
+#define __LM_REACTOR_H__
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define LM_TYPE_REACTOR            (lm_reactor_get_type ())
+#define LM_REACTOR(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), LM_TYPE_REACTOR, LmReactor))
+#define LM_REACTOR_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), LM_TYPE_REACTOR, LmReactorClass))
+#define LM_IS_REACTOR(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), LM_TYPE_REACTOR))
+#define LM_IS_REACTOR_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), LM_TYPE_REACTOR))
+#define LM_REACTOR_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), LM_TYPE_REACTOR, LmReactorClass))
+
+/* The event loop a channel runs on. LmGMainReactor runs on a GMainContext
+ * and is used unless a channel is given another one, see test-reactor.c
+ * for a reactor driven by a loop of its own.
+ *
+ * Callbacks return FALSE to remove their source, which is invalid after
+ * that just like after lm_reactor_remove(). Only add_defer may be called
+ * from other threads, it is how results are handed back to the loop.
+ */
+typedef struct LmReactor       LmReactor;
+typedef struct LmReactorClass  LmReactorClass;
+
+/* Defined by each implementation */
+typedef struct LmReactorSource LmReactorSource;
+
+typedef gboolean (*LmReactorFdFunc) (LmReactor    *reactor,
+                                     int           fd,
+                                     GIOCondition  condition,
+                                     gpointer      user_data);
+
+struct LmReactor {
+    GObject parent;
+};
+
+struct LmReactorClass {
+    GObjectClass parent_class;
+
+    /* <vtable> */
+    LmReactorSource * (*add_fd)      (LmReactor       *reactor,
+                                      int              fd,
+                                      GIOCondition     condition,
+                                      LmReactorFdFunc  func,
+                                      gpointer         user_data);
+    void              (*modify_fd)   (LmReactor       *reactor,
+                                      LmReactorSource *source,
+                                      GIOCondition     condition);
+    LmReactorSource * (*add_timeout) (LmReactor       *reactor,
+                                      guint            interval,
+                                      GSourceFunc      func,
+                                      gpointer         user_data);
+    LmReactorSource * (*add_defer)   (LmReactor       *reactor,
+                                      GSourceFunc      func,
+                                      gpointer         user_data);
+    void              (*remove)      (LmReactor       *reactor,
+                                      LmReactorSource *source);
+};
+
+GType             lm_reactor_get_type    (void);
+
+/* Calls func whenever fd is ready for any of condition */
+LmReactorSource * lm_reactor_add_fd      (LmReactor       *reactor,
+                                          int              fd,
+                                          GIOCondition     condition,
+                                          LmReactorFdFunc  func,
+                                          gpointer         user_data);
+void              lm_reactor_modify_fd   (LmReactor       *reactor,
+                                          LmReactorSource *source,
+                                          GIOCondition     condition);
+/* Interval in milliseconds */
+LmReactorSource * lm_reactor_add_timeout (LmReactor       *reactor,
+                                          guint            interval,
+                                          GSourceFunc      func,
+                                          gpointer         user_data);
+/* Calls func from the loop as soon as possible */
+LmReactorSource * lm_reactor_add_defer   (LmReactor       *reactor,
+                                          GSourceFunc      func,
+                                          gpointer         user_data);
+void              lm_reactor_remove      (LmReactor       *reactor,
+                                          LmReactorSource *source);
+
+G_END_DECLS
+
+#endif /* __LM_REACTOR_H__ */
@@ -21,11 +21,16 @@
 #include <config.h>
 
 #include <resolv.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "lm-blocking-resolver.h"
+#include "lm-cached-resolver.h"
+#include "lm-threaded-resolver.h"
 #include "lm-asyncns-resolver.h"
+#include "lm-static-resolver.h"
 #include "lm-marshal.h"
+#include "lm-misc.h"
 #include "lm-resolver.h"
 
 #define HAVE_ASYNCNS 1
@@ -38,9 +43,29 @@
 
 #define GET_PRIV(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), LM_TYPE_RESOLVER, LmResolverPriv))
 
+/* Lookups still running at the 95th percentile of recent lookup times
+ * are sent once more, until enough were seen a fixed delay is used.
+ */
+#define LATENCY_SAMPLES     128
+#define LATENCY_MIN_SAMPLES 20
+#define LATENCY_RECOMPUTE   8
+#define HEDGE_DEFAULT_DELAY 1000
+#define HEDGE_MIN_DELAY     20
+#define HEDGE_MAX_DELAY     5000
+
 typedef struct LmResolverPriv LmResolverPriv;
 struct LmResolverPriv {
     GMainContext *context;
+    gboolean      incremental;
+
+    /* Seconds the results may be kept, 0 if unknown */
+    guint         ttl;
+
+    LmResolverError error;
+
+    /* Backend lookups counted in the metrics */
+    gboolean      is_srv;
+    gint64        start_time;
 };
 
 static void     resolver_finalize            (GObject           *object);
@@ -57,16 +82,57 @@ G_DEFINE_ABSTRACT_TYPE (LmResolver, lm_resolver, G_TYPE_OBJECT)
 
 enum {
     PROP_0,
-    PROP_CONTEXT
+    PROP_CONTEXT,
+    PROP_INCREMENTAL
 };
 
 enum {
     FINISHED,
+    RESULTS_ADDED,
     LAST_SIGNAL
 };
 
 static guint signals[LAST_SIGNAL] = { 0 };
 
+static GType default_type = G_TYPE_INVALID;
+
+typedef struct {
+    LmResolverBatch *batch;
+    LmResolver      *resolver;
+    gchar           *name;
+    gboolean         finished;
+} BatchItem;
+
+struct LmResolverBatch {
+    BatchItem                 *items;
+    guint                      n_items;
+    guint                      n_pending;
+    gboolean                   cancelled;
+    GSource                   *done_source;
+
+    LmResolverBatchResultFunc  result_func;
+    LmResolverBatchDoneFunc    done_func;
+    gpointer                   user_data;
+};
+
+G_LOCK_DEFINE_STATIC (latency);
+static guint    latency_samples[LATENCY_SAMPLES];
+static guint    latency_next;
+static guint    latency_count;
+static guint    hedge_delay = HEDGE_DEFAULT_DELAY;
+static gboolean hedging = TRUE;
+
+/* Also under the latency lock */
+static LmResolverMetrics metrics;
+
+static const guint latency_limits[LM_RESOLVER_LATENCY_BUCKETS - 1] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 5000
+};
+
+static const gchar *error_names[LM_RESOLVER_N_ERRORS] = {
+    "none", "not-found", "no-data", "temporary", "timeout", "other"
+};
+
 static void
 lm_resolver_class_init (LmResolverClass *class)
 {
@@ -82,6 +148,14 @@ lm_resolver_class_init (LmResolverClass *class)
                                                            "Context",
                                                            "GMainContext powering this resolver",
                                                            G_PARAM_READWRITE));
+
+    g_object_class_install_property (object_class,
+                                     PROP_INCREMENTAL,
+                                     g_param_spec_boolean ("incremental",
+                                                           "Incremental",
+                                                           "Report IPv6 and IPv4 addresses as each arrives",
+                                                           FALSE,
+                                                           G_PARAM_READWRITE));
     
     signals[FINISHED] =
         g_signal_new ("finished",
@@ -93,6 +167,16 @@ lm_resolver_class_init (LmResolverClass *class)
                       G_TYPE_NONE,
                       2, G_TYPE_INT, LM_TYPE_SOCKET_ADDRESS);
 
+    signals[RESULTS_ADDED] =
+        g_signal_new ("results-added",
+                      LM_TYPE_RESOLVER,
+                      G_SIGNAL_RUN_LAST,
+                      0,
+                      NULL, NULL,
+                      _lm_marshal_VOID__BOXED,
+                      G_TYPE_NONE,
+                      1, LM_TYPE_SOCKET_ADDRESS);
+
     g_type_class_add_private (object_class, sizeof (LmResolverPriv));
 }
 
@@ -133,6 +217,9 @@ resolver_get_property (GObject    *object,
         case PROP_CONTEXT:
             g_value_set_pointer (value, priv->context);
             break;
+        case PROP_INCREMENTAL:
+            g_value_set_boolean (value, priv->incremental);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
             break;
@@ -157,6 +244,9 @@ resolver_set_property (GObject      *object,
                 priv->context = g_object_ref (context);
             }
             break;
+        case PROP_INCREMENTAL:
+            priv->incremental = g_value_get_boolean (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
             break;
@@ -164,36 +254,226 @@ resolver_set_property (GObject      *object,
 }
 
 static LmResolver *
-resolver_create (GMainContext *context)
+resolver_create (GMainContext *context, gboolean incremental)
 {
     GType type;
 
+    if (default_type != G_TYPE_INVALID) {
+        type = default_type;
+    } else {
 #ifdef HAVE_ASYNCNS
-    type = LM_TYPE_ASYNCNS_RESOLVER;
+        type = LM_TYPE_ASYNCNS_RESOLVER;
 #else /* HAVE_ASYNCNS */
-    type = LM_TYPE_BLOCKING_RESOLVER;
+        type = LM_TYPE_THREADED_RESOLVER;
 #endif /* HAVE_ASYNCNS */
+    }
 
-    return g_object_new (type, "context", context, NULL);
+    return g_object_new (type, 
+                         "context", context, 
+                         "incremental", incremental,
+                         NULL);
 }
 
-LmResolver *
-lm_resolver_lookup_host (GMainContext     *context,
-                         LmSocketAddress  *sa)
+/* Called with the latency lock held */
+static LmResolverTypeMetrics *
+resolver_get_type_metrics (gboolean is_srv)
+{
+    return is_srv ? &metrics.srv : &metrics.host;
+}
+
+static void
+resolver_count_hit (gboolean is_srv, gboolean pinned)
+{
+    LmResolverTypeMetrics *m;
+
+    G_LOCK (latency);
+
+    m = resolver_get_type_metrics (is_srv);
+    m->lookups++;
+    if (pinned) {
+        m->pinned++;
+    } else {
+        m->cache_hits++;
+    }
+
+    G_UNLOCK (latency);
+}
+
+static guint
+resolver_get_latency_bucket (guint ms)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (latency_limits); i++) {
+        if (ms <= latency_limits[i]) {
+            return i;
+        }
+    }
+
+    return LM_RESOLVER_LATENCY_BUCKETS - 1;
+}
+
+static void
+resolver_tracked_finished_cb (LmResolver       *resolver,
+                              LmResolverResult  result,
+                              LmSocketAddress  *sa,
+                              gpointer          user_data)
+{
+    LmResolverPriv        *priv = GET_PRIV (resolver);
+    LmResolverTypeMetrics *m;
+    guint                  ms;
+
+    ms = (guint) MIN ((g_get_monotonic_time () - priv->start_time) / 1000,
+                      G_MAXUINT);
+
+    G_LOCK (latency);
+
+    m = resolver_get_type_metrics (priv->is_srv);
+
+    if (metrics.in_flight > 0) {
+        metrics.in_flight--;
+    }
+
+    if (result == LM_RESOLVER_RESULT_CANCELLED) {
+        m->cancelled++;
+    } else {
+        if (result == LM_RESOLVER_RESULT_OK) {
+            m->succeeded++;
+        } else {
+            m->failed++;
+            m->errors[priv->error ? priv->error : LM_RESOLVER_ERROR_OTHER]++;
+        }
+
+        m->latency[resolver_get_latency_bucket (ms)]++;
+        m->latency_total += ms;
+    }
+
+    G_UNLOCK (latency);
+}
+
+/* Counts a backend lookup about to start */
+static void
+resolver_track (LmResolver *resolver, gboolean is_srv, gboolean refresh)
+{
+    LmResolverPriv        *priv = GET_PRIV (resolver);
+    LmResolverTypeMetrics *m;
+
+    priv->is_srv     = is_srv;
+    priv->start_time = g_get_monotonic_time ();
+
+    G_LOCK (latency);
+
+    m = resolver_get_type_metrics (is_srv);
+    if (refresh) {
+        m->refreshes++;
+    } else {
+        m->lookups++;
+    }
+    metrics.in_flight++;
+
+    G_UNLOCK (latency);
+
+    g_signal_connect (resolver, "finished",
+                      G_CALLBACK (resolver_tracked_finished_cb), NULL);
+}
+
+/* finished_cb, if set, is connected before the lookup starts since a
+ * backend may finish right away. Pinned hosts finish before this
+ * returns and NULL is returned for them.
+ */
+static LmResolver *
+resolver_lookup_host (GMainContext    *context,
+                      LmSocketAddress *sa,
+                      gboolean         incremental,
+                      GCallback        finished_cb,
+                      gpointer         user_data)
 {
     LmResolver *resolver;
 
-    resolver = resolver_create (context);
+    /* Pinned hosts, finished_cb is connected there */
+    if (_lm_static_resolver_lookup_host (context, sa, finished_cb, 
+                                         user_data, &resolver)) {
+        resolver_count_hit (FALSE, TRUE);
+        return resolver;
+    }
+
+    resolver = _lm_cached_resolver_lookup_host (context, sa);
+    if (resolver) {
+        resolver_count_hit (FALSE, FALSE);
+        if (finished_cb) {
+            g_signal_connect (resolver, "finished", finished_cb, user_data);
+        }
+        return resolver;
+    }
+
+    resolver = resolver_create (context, incremental);
 
     if (!LM_RESOLVER_GET_CLASS(resolver)->lookup_host) {
         g_assert_not_reached ();
     }
 
+    _lm_cached_resolver_watch (resolver, context, 
+                               lm_socket_address_get_host (sa), FALSE);
+    resolver_track (resolver, FALSE, FALSE);
+
+    if (finished_cb) {
+        g_signal_connect (resolver, "finished", finished_cb, user_data);
+    }
+
     LM_RESOLVER_GET_CLASS(resolver)->lookup_host (resolver, sa);
     
     return resolver;
 }
 
+static LmResolver *
+resolver_lookup_srv (GMainContext *context,
+                     const gchar  *srv_str,
+                     GCallback     finished_cb,
+                     gpointer      user_data)
+{
+    LmResolver *resolver;
+
+    resolver = _lm_cached_resolver_lookup_srv (context, srv_str);
+    if (resolver) {
+        resolver_count_hit (TRUE, FALSE);
+        if (finished_cb) {
+            g_signal_connect (resolver, "finished", finished_cb, user_data);
+        }
+        return resolver;
+    }
+
+    resolver = resolver_create (context, FALSE);
+
+    if (!LM_RESOLVER_GET_CLASS(resolver)->lookup_srv) {
+        g_assert_not_reached ();
+    }
+
+    _lm_cached_resolver_watch (resolver, context, srv_str, TRUE);
+    resolver_track (resolver, TRUE, FALSE);
+
+    if (finished_cb) {
+        g_signal_connect (resolver, "finished", finished_cb, user_data);
+    }
+    
+    LM_RESOLVER_GET_CLASS(resolver)->lookup_srv (resolver, srv_str);
+
+    return resolver;
+}
+
+LmResolver *
+lm_resolver_lookup_host (GMainContext     *context,
+                         LmSocketAddress  *sa)
+{
+    return resolver_lookup_host (context, sa, FALSE, NULL, NULL);
+}
+
+LmResolver *
+lm_resolver_lookup_host_incremental (GMainContext    *context,
+                                     LmSocketAddress *sa)
+{
+    return resolver_lookup_host (context, sa, TRUE, NULL, NULL);
+}
+
 static gchar *
 resolver_create_srv_string (const gchar *domain, 
                             const gchar *service,
@@ -217,15 +497,9 @@ lm_resolver_lookup_service (GMainContext  *context,
     g_return_val_if_fail (domain != NULL, FALSE);
     g_return_val_if_fail (srv != NULL, FALSE);
 
-    resolver = resolver_create (context);
-
-    if (!LM_RESOLVER_GET_CLASS(resolver)->lookup_srv) {
-        g_assert_not_reached ();
-    }
-
     srv_str = resolver_create_srv_string (domain, srv, "tcp");
-    
-    LM_RESOLVER_GET_CLASS(resolver)->lookup_srv (resolver, srv_str);
+
+    resolver = resolver_lookup_srv (context, srv_str, NULL, NULL);
     
     g_free (srv_str);
    
@@ -244,12 +518,527 @@ lm_resolver_cancel (LmResolver *resolver)
     return LM_RESOLVER_GET_CLASS(resolver)->cancel (resolver);
 }
 
+LmResolverError
+lm_resolver_get_error (LmResolver *resolver)
+{
+    g_return_val_if_fail (LM_IS_RESOLVER (resolver), LM_RESOLVER_ERROR_NONE);
+
+    return GET_PRIV (resolver)->error;
+}
+
+static void
+resolver_batch_done (LmResolverBatch *batch)
+{
+    guint i;
+
+    if (batch->done_func) {
+        batch->done_func (batch, batch->user_data);
+    }
+
+    for (i = 0; i < batch->n_items; i++) {
+        g_free (batch->items[i].name);
+    }
+
+    g_free (batch->items);
+    g_free (batch);
+}
+
+static gboolean
+resolver_batch_done_cb (LmResolverBatch *batch)
+{
+    batch->done_source = NULL;
+
+    resolver_batch_done (batch);
+
+    return FALSE;
+}
+
+static void
+resolver_batch_item_done (BatchItem        *item,
+                          LmResolverResult  result,
+                          LmSocketAddress  *sa)
+{
+    LmResolverBatch *batch = item->batch;
+
+    item->resolver = NULL;
+    item->finished = TRUE;
+
+    if (batch->result_func) {
+        batch->result_func (batch, item->name, result, sa, batch->user_data);
+    }
+
+    if (--batch->n_pending == 0) {
+        resolver_batch_done (batch);
+    }
+}
+
+static void
+resolver_batch_finished_cb (LmResolver       *resolver,
+                            LmResolverResult  result,
+                            LmSocketAddress  *sa,
+                            BatchItem        *item)
+{
+    resolver_batch_item_done (item, result, sa);
+}
+
+static void
+resolver_batch_start (GMainContext *context, BatchItem *item, guint port)
+{
+    LmResolver *resolver;
+
+    if (item->name[0] == '_') {
+        resolver = resolver_lookup_srv (context, item->name,
+                                        G_CALLBACK (resolver_batch_finished_cb),
+                                        item);
+    } else {
+        LmSocketAddress *sa = lm_socket_address_new (item->name, port);
+
+        resolver = resolver_lookup_host (context, sa, FALSE,
+                                         G_CALLBACK (resolver_batch_finished_cb),
+                                         item);
+        lm_socket_address_unref (sa);
+    }
+
+    if (!item->finished) {
+        item->resolver = resolver;
+    }
+}
+
+LmResolverBatch *
+lm_resolver_lookup_many (GMainContext              *context,
+                         const gchar              **names,
+                         guint                      port,
+                         LmResolverBatchResultFunc  result_func,
+                         LmResolverBatchDoneFunc    done_func,
+                         gpointer                   user_data)
+{
+    LmResolverBatch *batch;
+    guint            i;
+
+    g_return_val_if_fail (names != NULL, NULL);
+
+    batch = g_new0 (LmResolverBatch, 1);
+    batch->n_items     = g_strv_length ((gchar **) names);
+    batch->items       = g_new0 (BatchItem, batch->n_items);
+    batch->result_func = result_func;
+    batch->done_func   = done_func;
+    batch->user_data   = user_data;
+
+    /* One more while starting so that lookups finishing right away
+     * can't complete the batch under us.
+     */
+    batch->n_pending = batch->n_items + 1;
+
+    for (i = 0; i < batch->n_items; i++) {
+        batch->items[i].batch = batch;
+        batch->items[i].name  = g_strdup (names[i]);
+    }
+
+    for (i = 0; i < batch->n_items && !batch->cancelled; i++) {
+        resolver_batch_start (context, &batch->items[i], port);
+    }
+
+    for (; i < batch->n_items; i++) {
+        resolver_batch_item_done (&batch->items[i], 
+                                  LM_RESOLVER_RESULT_CANCELLED, NULL);
+    }
+
+    if (--batch->n_pending == 0) {
+        /* The caller gets the batch before it is done */
+        batch->done_source = 
+            lm_misc_add_idle (context, 
+                              (GSourceFunc) resolver_batch_done_cb,
+                              batch);
+    }
+
+    return batch;
+}
+
+void
+lm_resolver_batch_cancel (LmResolverBatch *batch)
+{
+    guint i;
+
+    g_return_if_fail (batch != NULL);
+
+    if (batch->done_source) {
+        g_source_destroy (batch->done_source);
+        batch->done_source = NULL;
+        resolver_batch_done (batch);
+        return;
+    }
+
+    batch->cancelled = TRUE;
+
+    /* Held until all lookups are cancelled */
+    batch->n_pending++;
+
+    for (i = 0; i < batch->n_items; i++) {
+        if (batch->items[i].resolver) {
+            lm_resolver_cancel (batch->items[i].resolver);
+        }
+    }
+
+    if (--batch->n_pending == 0) {
+        resolver_batch_done (batch);
+    }
+}
+
+void
+lm_resolver_set_default_type (GType type)
+{
+    g_return_if_fail (type == G_TYPE_INVALID ||
+                      g_type_is_a (type, LM_TYPE_RESOLVER));
+
+    default_type = type;
+}
+
 void 
 lm_resolver_freeaddrinfo (struct addrinfo *addr)
 {
     freeaddrinfo (addr);
 }
 
+void
+lm_resolver_set_hedging (gboolean enabled)
+{
+    G_LOCK (latency);
+    hedging = enabled;
+    G_UNLOCK (latency);
+}
+
+void
+lm_resolver_get_metrics (LmResolverMetrics *m)
+{
+    g_return_if_fail (m != NULL);
+
+    G_LOCK (latency);
+    *m = metrics;
+    G_UNLOCK (latency);
+}
+
+void
+lm_resolver_reset_metrics (void)
+{
+    guint in_flight;
+
+    G_LOCK (latency);
+
+    /* Lookups still running are counted down when they finish */
+    in_flight = metrics.in_flight;
+    memset (&metrics, 0, sizeof (metrics));
+    metrics.in_flight = in_flight;
+
+    G_UNLOCK (latency);
+}
+
+static void
+resolver_dump_type_metrics (GString                     *str,
+                            const gchar                 *type,
+                            const LmResolverTypeMetrics *m)
+{
+    guint64 finished;
+    guint64 cacheable;
+    guint   i;
+
+    cacheable = m->lookups - m->pinned;
+    finished  = m->succeeded + m->failed;
+
+    g_string_append_printf (str,
+                            "%s: %" G_GUINT64_FORMAT " lookups, "
+                            "%" G_GUINT64_FORMAT " cache hits (%.1f%%), "
+                            "%" G_GUINT64_FORMAT " pinned, "
+                            "%" G_GUINT64_FORMAT " refreshes\n",
+                            type, m->lookups, m->cache_hits,
+                            cacheable ? 100.0 * m->cache_hits / cacheable : 0,
+                            m->pinned, m->refreshes);
+
+    g_string_append_printf (str,
+                            "  backend: %" G_GUINT64_FORMAT " succeeded, "
+                            "%" G_GUINT64_FORMAT " failed, "
+                            "%" G_GUINT64_FORMAT " cancelled, "
+                            "mean %" G_GUINT64_FORMAT " ms\n",
+                            m->succeeded, m->failed, m->cancelled,
+                            finished ? m->latency_total / finished : 0);
+
+    if (m->failed > 0) {
+        g_string_append (str, "  errors:");
+        for (i = LM_RESOLVER_ERROR_NONE + 1; i < LM_RESOLVER_N_ERRORS; i++) {
+            if (m->errors[i] > 0) {
+                g_string_append_printf (str, " %s %" G_GUINT64_FORMAT,
+                                        error_names[i], m->errors[i]);
+            }
+        }
+        g_string_append_c (str, '\n');
+    }
+
+    g_string_append (str, "  latency:");
+    for (i = 0; i < LM_RESOLVER_LATENCY_BUCKETS - 1; i++) {
+        g_string_append_printf (str, " <=%ums %" G_GUINT64_FORMAT,
+                                latency_limits[i], m->latency[i]);
+    }
+    g_string_append_printf (str, " >%ums %" G_GUINT64_FORMAT "\n",
+                            latency_limits[i - 1], m->latency[i]);
+}
+
+gchar *
+lm_resolver_dump_metrics (void)
+{
+    LmResolverMetrics  m;
+    GString           *str;
+
+    lm_resolver_get_metrics (&m);
+
+    str = g_string_new (NULL);
+
+    resolver_dump_type_metrics (str, "host", &m.host);
+    resolver_dump_type_metrics (str, "srv", &m.srv);
+
+    g_string_append_printf (str, 
+                            "%u in flight, %" G_GUINT64_FORMAT " hedged\n",
+                            m.in_flight, m.hedged);
+
+    return g_string_free (str, FALSE);
+}
+
+const gchar *
+lm_resolver_error_to_string (LmResolverError error)
+{
+    g_return_val_if_fail (error < LM_RESOLVER_N_ERRORS, NULL);
+
+    return error_names[error];
+}
+
+static int
+resolver_compare_latency (const void *a, const void *b)
+{
+    guint la = *(const guint *) a;
+    guint lb = *(const guint *) b;
+
+    return la < lb ? -1 : la > lb;
+}
+
+/* Called with the latency lock held */
+static void
+resolver_update_hedge_delay (void)
+{
+    guint sorted[LATENCY_SAMPLES];
+    guint n = MIN (latency_count, LATENCY_SAMPLES);
+
+    if (n < LATENCY_MIN_SAMPLES) {
+        return;
+    }
+
+    memcpy (sorted, latency_samples, n * sizeof (guint));
+    qsort (sorted, n, sizeof (guint), resolver_compare_latency);
+
+    hedge_delay = CLAMP (sorted[n * 95 / 100], 
+                         HEDGE_MIN_DELAY, HEDGE_MAX_DELAY);
+}
+
+guint
+_lm_resolver_get_hedge_delay (void)
+{
+    guint delay;
+
+    G_LOCK (latency);
+    delay = hedging ? hedge_delay : 0;
+    G_UNLOCK (latency);
+
+    return delay;
+}
+
+void
+_lm_resolver_record_latency (gint64 usec, gboolean hedged)
+{
+    G_LOCK (latency);
+
+    latency_samples[latency_next] = (guint) MIN (usec / 1000, G_MAXUINT);
+    latency_next = (latency_next + 1) % LATENCY_SAMPLES;
+    latency_count++;
+
+    if (hedged) {
+        metrics.hedged++;
+    }
+
+    if (latency_count % LATENCY_RECOMPUTE == 0) {
+        resolver_update_hedge_delay ();
+    }
+
+    G_UNLOCK (latency);
+}
+
+LmResolver *
+_lm_resolver_lookup_uncached (GMainContext *context,
+                              const gchar  *name,
+                              gboolean      is_srv,
+                              GCallback     finished_cb,
+                              gpointer      user_data)
+{
+    LmResolver      *resolver;
+    LmSocketAddress *sa;
+
+    resolver = resolver_create (context, FALSE);
+
+    resolver_track (resolver, is_srv, TRUE);
+    g_signal_connect (resolver, "finished", finished_cb, user_data);
+
+    if (is_srv) {
+        LM_RESOLVER_GET_CLASS(resolver)->lookup_srv (resolver, name);
+    } else {
+        sa = lm_socket_address_new (name, 0);
+        LM_RESOLVER_GET_CLASS(resolver)->lookup_host (resolver, sa);
+        lm_socket_address_unref (sa);
+    }
+
+    return resolver;
+}
+
+void
+_lm_resolver_set_ttl (LmResolver *resolver, guint ttl)
+{
+    LmResolverPriv *priv = GET_PRIV (resolver);
+
+    if (priv->ttl == 0 || ttl < priv->ttl) {
+        priv->ttl = ttl;
+    }
+}
+
+guint
+_lm_resolver_get_ttl (LmResolver *resolver)
+{
+    return GET_PRIV (resolver)->ttl;
+}
+
+gboolean
+_lm_resolver_get_incremental (LmResolver *resolver)
+{
+    return GET_PRIV (resolver)->incremental;
+}
+
+void
+_lm_resolver_set_error (LmResolver *resolver, LmResolverError error)
+{
+    GET_PRIV (resolver)->error = error;
+}
+
+LmResolverError
+_lm_resolver_error_from_gai (int err)
+{
+    switch (err) {
+        case 0:
+            return LM_RESOLVER_ERROR_NONE;
+        case EAI_NONAME:
+            return LM_RESOLVER_ERROR_NOT_FOUND;
+#ifdef EAI_NODATA
+        case EAI_NODATA:
+            return LM_RESOLVER_ERROR_NO_DATA;
+#endif
+#ifdef EAI_ADDRFAMILY
+        case EAI_ADDRFAMILY:
+            return LM_RESOLVER_ERROR_NO_DATA;
+#endif
+        case EAI_AGAIN:
+            return LM_RESOLVER_ERROR_TEMPORARY;
+        default:
+            return LM_RESOLVER_ERROR_OTHER;
+    }
+}
+
+LmResolverError
+_lm_resolver_error_from_herrno (int err)
+{
+    switch (err) {
+        case HOST_NOT_FOUND:
+            return LM_RESOLVER_ERROR_NOT_FOUND;
+        case NO_DATA:
+            return LM_RESOLVER_ERROR_NO_DATA;
+        case TRY_AGAIN:
+            return LM_RESOLVER_ERROR_TEMPORARY;
+        default:
+            return LM_RESOLVER_ERROR_OTHER;
+    }
+}
+
+void
+_lm_resolver_add_results (LmResolver      *resolver,
+                          LmSocketAddress *sa,
+                          struct addrinfo *ai)
+{
+    lm_socket_address_append_results (sa, ai);
+
+    g_signal_emit (resolver, signals[RESULTS_ADDED], 0, sa);
+}
+
+/* Also turns results the system allocated into ones of our own */
+struct addrinfo *
+_lm_resolver_copy_addrinfo (const struct addrinfo *ans)
+{
+    struct addrinfo        *list = NULL;
+    struct addrinfo       **tail = &list;
+    const struct addrinfo  *ai;
+
+    for (ai = ans; ai; ai = ai->ai_next) {
+        const void *addr;
+
+        if (ai->ai_family == AF_INET6) {
+            addr = &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr;
+        } 
+        else if (ai->ai_family == AF_INET) {
+            addr = &((struct sockaddr_in *) ai->ai_addr)->sin_addr;
+        } else {
+            continue;
+        }
+
+        *tail = _lm_resolver_new_addrinfo (ai->ai_family, addr);
+        tail = &(*tail)->ai_next;
+    }
+
+    return list;
+}
+
+struct addrinfo *
+_lm_resolver_new_addrinfo (int family, const void *addr)
+{
+    struct addrinfo *ai;
+    socklen_t        addr_len;
+
+    if (family == AF_INET6) {
+        addr_len = sizeof (struct sockaddr_in6);
+    } else {
+        addr_len = sizeof (struct sockaddr_in);
+    }
+
+#ifdef HAVE_ASYNCNS
+    /* asyncns_freeaddrinfo frees the address separately */
+    ai = calloc (1, sizeof (struct addrinfo));
+    ai->ai_addr = calloc (1, addr_len);
+#else /* HAVE_ASYNCNS */
+    /* Laid out like the system getaddrinfo for freeaddrinfo */
+    ai = calloc (1, sizeof (struct addrinfo) + sizeof (struct sockaddr_storage));
+    ai->ai_addr = (struct sockaddr *) (ai + 1);
+#endif /* HAVE_ASYNCNS */
+
+    ai->ai_family   = family;
+    ai->ai_socktype = SOCK_STREAM;
+    ai->ai_protocol = IPPROTO_TCP;
+    ai->ai_addrlen  = addr_len;
+
+    if (family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ai->ai_addr;
+
+        sin6->sin6_family = AF_INET6;
+        memcpy (&sin6->sin6_addr, addr, sizeof (sin6->sin6_addr));
+    } else {
+        struct sockaddr_in *sin = (struct sockaddr_in *) ai->ai_addr;
+
+        sin->sin_family = AF_INET;
+        memcpy (&sin->sin_addr, addr, sizeof (sin->sin_addr));
+    }
+
+    return ai;
+}
+
 gboolean
 _lm_resolver_parse_srv_response (unsigned char  *srv, 
                                  int             srv_len, 
@@ -58,6 +58,55 @@ typedef enum {
     LM_RESOLVER_RESULT_CANCELLED
 } LmResolverResult;
 
+/* Why a lookup failed */
+typedef enum {
+    LM_RESOLVER_ERROR_NONE,
+    LM_RESOLVER_ERROR_NOT_FOUND,   /* The name doesn't exist */
+    LM_RESOLVER_ERROR_NO_DATA,     /* It does but has no such records */
+    LM_RESOLVER_ERROR_TEMPORARY,   /* Server failure, worth trying again */
+    LM_RESOLVER_ERROR_TIMEOUT,
+    LM_RESOLVER_ERROR_OTHER,
+    LM_RESOLVER_N_ERRORS
+} LmResolverError;
+
+/* Upper bounds of the latency buckets are 1, 2, 5, 10, 20, 50, 100, 200,
+ * 500, 1000 and 5000 ms, the last bucket holds everything slower.
+ */
+#define LM_RESOLVER_LATENCY_BUCKETS 12
+
+typedef struct {
+    guint64 lookups;        /* All lookups, including cache hits */
+    guint64 cache_hits;
+    guint64 pinned;         /* Answered by LmStaticResolver */
+    guint64 refreshes;      /* Started by the cache itself */
+
+    /* Lookups that went to a backend */
+    guint64 succeeded;
+    guint64 failed;
+    guint64 cancelled;
+    guint64 errors[LM_RESOLVER_N_ERRORS];
+    guint64 latency[LM_RESOLVER_LATENCY_BUCKETS];
+    guint64 latency_total;  /* Milliseconds */
+} LmResolverTypeMetrics;
+
+typedef struct {
+    LmResolverTypeMetrics host;
+    LmResolverTypeMetrics srv;
+    guint                 in_flight;
+    guint64               hedged;
+} LmResolverMetrics;
+
+/* Lookups of many names at once, see lm_resolver_lookup_many() */
+typedef struct LmResolverBatch LmResolverBatch;
+
+typedef void (*LmResolverBatchResultFunc) (LmResolverBatch  *batch,
+                                           const gchar      *name,
+                                           LmResolverResult  result,
+                                           LmSocketAddress  *sa,
+                                           gpointer          user_data);
+typedef void (*LmResolverBatchDoneFunc)   (LmResolverBatch  *batch,
+                                           gpointer          user_data);
+
 #define LM_RESOLVER_SRV_XMPP_CLIENT "xmpp-client"
 #define LM_RESOLVER_SRV_XMPP_SERVER "xmpp-server"
 
@@ -65,13 +114,106 @@ GType          lm_resolver_get_type          (void);
 
 LmResolver *   lm_resolver_lookup_host       (GMainContext     *context,
                                               LmSocketAddress  *sa);
+/* Looks up IPv6 and IPv4 addresses separately, each set is added to sa
+ * and announced with "results-added" as soon as it arrives. "finished"
+ * follows once both are done.
+ */
+LmResolver *   lm_resolver_lookup_host_incremental (GMainContext    *context,
+                                                    LmSocketAddress *sa);
 LmResolver *   lm_resolver_lookup_service    (GMainContext     *context,
                                               const gchar      *domain,
                                               const gchar      *srv);
 void           lm_resolver_cancel            (LmResolver       *resolver);
+/* Set once a lookup failed */
+LmResolverError lm_resolver_get_error        (LmResolver       *resolver);
+
+/* Looks up a NULL terminated array of names. Names starting with an
+ * underscore, like "_xmpp-client._tcp.example.com", are SRV lookups,
+ * the rest are hosts and get port. result_func is called as each name
+ * is done and done_func once all are, the batch is freed after that.
+ * Cached and pinned names are reported before this returns, done_func
+ * always runs from the main loop.
+ * The lookups share the worker pool and cache of the context.
+ * Cancelling reports the remaining names as cancelled.
+ */
+LmResolverBatch *
+lm_resolver_lookup_many                      (GMainContext              *context,
+                                              const gchar              **names,
+                                              guint                      port,
+                                              LmResolverBatchResultFunc  result_func,
+                                              LmResolverBatchDoneFunc    done_func,
+                                              gpointer                   user_data);
+void           lm_resolver_batch_cancel      (LmResolverBatch  *batch);
+
+/* Backend used for new lookups, G_TYPE_INVALID for the built in default */
+void           lm_resolver_set_default_type  (GType             type);
 
 void           lm_resolver_freeaddrinfo      (struct addrinfo *addr);
 
+/* Lookups slower than most others are sent a second time and the first
+ * answer wins. Enabled by default, the hedged count of the metrics tells
+ * how many lookups needed a second query.
+ */
+void           lm_resolver_set_hedging       (gboolean          enabled);
+
+/* Counters of all lookups in the process since the start or the last
+ * reset. Latencies are those of finished backend lookups.
+ */
+void           lm_resolver_get_metrics       (LmResolverMetrics *metrics);
+void           lm_resolver_reset_metrics     (void);
+/* Human readable form of the metrics, free with g_free() */
+gchar *        lm_resolver_dump_metrics      (void);
+const gchar *  lm_resolver_error_to_string   (LmResolverError    error);
+
+/* For backends, "incremental" lookups report addresses through
+ * _lm_resolver_add_results() instead of setting them at the end.
+ */
+gboolean       _lm_resolver_get_incremental  (LmResolver       *resolver);
+
+/* For backends, to be called before "finished" is emitted with
+ * LM_RESOLVER_RESULT_FAILED. The helpers map getaddrinfo() errors and
+ * h_errno.
+ */
+void           _lm_resolver_set_error        (LmResolver       *resolver,
+                                              LmResolverError   error);
+LmResolverError _lm_resolver_error_from_gai  (int               err);
+LmResolverError _lm_resolver_error_from_herrno (int             err);
+
+/* Backends that know how long the records live report it, the lowest
+ * TTL counts. 0 if unknown.
+ */
+void           _lm_resolver_set_ttl          (LmResolver       *resolver,
+                                              guint             ttl);
+guint          _lm_resolver_get_ttl          (LmResolver       *resolver);
+
+/* Starts a backend lookup past the cache, finished_cb is connected to
+ * "finished" before it starts.
+ */
+LmResolver *   _lm_resolver_lookup_uncached  (GMainContext     *context,
+                                              const gchar      *name,
+                                              gboolean          is_srv,
+                                              GCallback         finished_cb,
+                                              gpointer          user_data);
+void           _lm_resolver_add_results      (LmResolver       *resolver,
+                                              LmSocketAddress  *sa,
+                                              struct addrinfo  *ai);
+
+/* For backends, the delay in milliseconds before a lookup is hedged, 0
+ * if hedging is off. Finished lookups report how long they took.
+ */
+guint          _lm_resolver_get_hedge_delay  (void);
+void           _lm_resolver_record_latency   (gint64            usec,
+                                              gboolean          hedged);
+
+/* For backends that build results themselves, to be freed with
+ * lm_resolver_freeaddrinfo().
+ */
+struct addrinfo *
+_lm_resolver_new_addrinfo                    (int              family,
+                                              const void      *addr);
+struct addrinfo *
+_lm_resolver_copy_addrinfo                   (const struct addrinfo *ans);
+
 gboolean       _lm_resolver_parse_srv_response (unsigned char  *srv, 
                                                 int             srv_len, 
                                                 gchar         **out_server, 
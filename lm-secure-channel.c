@@ -31,8 +31,17 @@ typedef struct LmSecureChannelPriv LmSecureChannelPriv;
 struct LmSecureChannelPriv {
     gchar    *expected_fingerprint;
     gchar    *fingerprint;
+    gchar   **pins;
+    gchar    *priority;
+
+    gboolean  server_mode;
+    gboolean  dynamic_record_sizing;
+    gboolean  threaded_handshake;
+    gboolean  early_data;
+    gboolean  false_start;
 };
 
+static GType      secure_channel_get_backend_type (void);
 static void       secure_channel_finalize     (GObject           *object);
 static void       secure_channel_get_property (GObject           *object,
                                                guint              param_id,
@@ -48,7 +57,14 @@ G_DEFINE_ABSTRACT_TYPE (LmSecureChannel, lm_secure_channel, LM_TYPE_CHANNEL)
 enum {
     PROP_0,
     PROP_FINGERPRINT,
-    PROP_EXPECTED_FINGERPRINT
+    PROP_EXPECTED_FINGERPRINT,
+    PROP_PINS,
+    PROP_PRIORITY,
+    PROP_SERVER_MODE,
+    PROP_DYNAMIC_RECORD_SIZING,
+    PROP_THREADED_HANDSHAKE,
+    PROP_EARLY_DATA,
+    PROP_FALSE_START
 };
 
 enum {
@@ -84,6 +100,57 @@ lm_secure_channel_class_init (LmSecureChannelClass *class)
 
     g_object_class_install_property (object_class, 
                                      PROP_EXPECTED_FINGERPRINT, pspec);
+
+    pspec = g_param_spec_boxed ("pins",
+                                "Pins",
+                                "Base64 SHA-256 digests of accepted subject public keys",
+                                G_TYPE_STRV,
+                                G_PARAM_READWRITE);
+    g_object_class_install_property (object_class, PROP_PINS, pspec);
+
+    pspec = g_param_spec_string ("priority",
+                                 "Priority",
+                                 "Cipher suite priority string, or \"auto\" to match the CPU",
+                                 NULL,
+                                 G_PARAM_READWRITE);
+    g_object_class_install_property (object_class, PROP_PRIORITY, pspec);
+
+    pspec = g_param_spec_boolean ("server-mode",
+                                  "Server mode",
+                                  "Act as the TLS server using the shared server credentials",
+                                  FALSE,
+                                  G_PARAM_READWRITE);
+    g_object_class_install_property (object_class, PROP_SERVER_MODE, pspec);
+
+    pspec = g_param_spec_boolean ("dynamic-record-sizing",
+                                  "Dynamic record sizing",
+                                  "Use small records after connect or idle and ramp up during bulk transfers",
+                                  TRUE,
+                                  G_PARAM_READWRITE);
+    g_object_class_install_property (object_class,
+                                     PROP_DYNAMIC_RECORD_SIZING, pspec);
+
+    pspec = g_param_spec_boolean ("threaded-handshake",
+                                  "Threaded handshake",
+                                  "Run the handshake and certificate verification in a worker thread",
+                                  FALSE,
+                                  G_PARAM_READWRITE);
+    g_object_class_install_property (object_class,
+                                     PROP_THREADED_HANDSHAKE, pspec);
+
+    pspec = g_param_spec_boolean ("early-data",
+                                  "Early data",
+                                  "Send queued replay safe data as 0-RTT early data on resumed sessions",
+                                  FALSE,
+                                  G_PARAM_READWRITE);
+    g_object_class_install_property (object_class, PROP_EARLY_DATA, pspec);
+
+    pspec = g_param_spec_boolean ("false-start",
+                                  "False start",
+                                  "Send application data before the peer's Finished message (TLS 1.2)",
+                                  FALSE,
+                                  G_PARAM_READWRITE);
+    g_object_class_install_property (object_class, PROP_FALSE_START, pspec);
    
     signals[HANDSHAKE_RESULT] = 
         g_signal_new ("handshake-result",
@@ -104,6 +171,8 @@ lm_secure_channel_init (LmSecureChannel *secure_channel)
     LmSecureChannelPriv *priv;
 
     priv = GET_PRIV (secure_channel);
+
+    priv->dynamic_record_sizing = TRUE;
 }
 
 static void
@@ -113,6 +182,11 @@ secure_channel_finalize (GObject *object)
 
     priv = GET_PRIV (object);
 
+    g_free (priv->expected_fingerprint);
+    g_free (priv->fingerprint);
+    g_strfreev (priv->pins);
+    g_free (priv->priority);
+
     (G_OBJECT_CLASS (lm_secure_channel_parent_class)->finalize) (object);
 }
 
@@ -133,6 +207,27 @@ secure_channel_get_property (GObject    *object,
         case PROP_EXPECTED_FINGERPRINT:
             g_value_set_string (value, priv->expected_fingerprint);
             break;
+        case PROP_PINS:
+            g_value_set_boxed (value, priv->pins);
+            break;
+        case PROP_PRIORITY:
+            g_value_set_string (value, priv->priority);
+            break;
+        case PROP_SERVER_MODE:
+            g_value_set_boolean (value, priv->server_mode);
+            break;
+        case PROP_DYNAMIC_RECORD_SIZING:
+            g_value_set_boolean (value, priv->dynamic_record_sizing);
+            break;
+        case PROP_THREADED_HANDSHAKE:
+            g_value_set_boolean (value, priv->threaded_handshake);
+            break;
+        case PROP_EARLY_DATA:
+            g_value_set_boolean (value, priv->early_data);
+            break;
+        case PROP_FALSE_START:
+            g_value_set_boolean (value, priv->false_start);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
             break;
@@ -158,19 +253,49 @@ secure_channel_set_property (GObject      *object,
             g_free (priv->expected_fingerprint);
             priv->expected_fingerprint = g_value_dup_string (value);
             break;
+        case PROP_PINS:
+            g_strfreev (priv->pins);
+            priv->pins = g_value_dup_boxed (value);
+            break;
+        case PROP_PRIORITY:
+            g_free (priv->priority);
+            priv->priority = g_value_dup_string (value);
+            break;
+        case PROP_SERVER_MODE:
+            priv->server_mode = g_value_get_boolean (value);
+            break;
+        case PROP_DYNAMIC_RECORD_SIZING:
+            priv->dynamic_record_sizing = g_value_get_boolean (value);
+            break;
+        case PROP_THREADED_HANDSHAKE:
+            priv->threaded_handshake = g_value_get_boolean (value);
+            break;
+        case PROP_EARLY_DATA:
+            priv->early_data = g_value_get_boolean (value);
+            break;
+        case PROP_FALSE_START:
+            priv->false_start = g_value_get_boolean (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
             break;
     };
 }
 
+/* The implementation created by lm_secure_channel_new */
+static GType
+secure_channel_get_backend_type (void)
+{
+    return LM_TYPE_GNUTLS_CHANNEL;
+}
+
 LmChannel *
 lm_secure_channel_new (GMainContext *context, LmChannel *inner_channel)
 {
     LmChannel           *channel;
     LmSecureChannelPriv *priv;
 
-    channel = g_object_new (LM_TYPE_GNUTLS_CHANNEL, NULL);
+    channel = g_object_new (secure_channel_get_backend_type (), NULL);
     priv    = GET_PRIV (channel);
 
     lm_channel_set_inner (channel, inner_channel);
@@ -202,4 +327,46 @@ lm_secure_channel_start_handshake (LmSecureChannel *channel, const gchar *host)
     LM_SECURE_CHANNEL_GET_CLASS(channel)->start_handshake (channel, host);
 }
 
+void
+lm_secure_channel_write_early_data (LmSecureChannel *channel,
+                                    const gchar     *buf,
+                                    gssize           count)
+{
+    g_return_if_fail (LM_IS_SECURE_CHANNEL (channel));
+    g_return_if_fail (buf != NULL);
+
+    if (!LM_SECURE_CHANNEL_GET_CLASS(channel)->write_early_data) {
+        g_assert_not_reached ();
+    }
+
+    LM_SECURE_CHANNEL_GET_CLASS(channel)->write_early_data (channel, buf, count);
+}
+
+gboolean
+lm_secure_channel_set_server_credentials (const gchar *cert_file,
+                                          const gchar *key_file)
+{
+    LmSecureChannelClass *klass;
+    gboolean              ret;
+
+    klass = g_type_class_ref (secure_channel_get_backend_type ());
+
+    if (!klass->set_server_credentials) {
+        g_assert_not_reached ();
+    }
+
+    ret = klass->set_server_credentials (cert_file, key_file);
+
+    g_type_class_unref (klass);
+
+    return ret;
+}
+
+void
+lm_secure_channel_set_pins (LmSecureChannel *channel, const gchar **pins)
+{
+    g_return_if_fail (LM_IS_SECURE_CHANNEL (channel));
+
+    g_object_set (channel, "pins", pins, NULL);
+}
 
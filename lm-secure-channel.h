@@ -61,6 +61,21 @@ typedef enum {
 	LM_SSL_RESPONSE_STOP
 } LmSSLResponse;
 
+/* Reported through the "handshake-result" signal */
+typedef enum {
+	LM_SECURE_CHANNEL_HANDSHAKE_OK,
+	LM_SECURE_CHANNEL_HANDSHAKE_FAILED,
+	LM_SECURE_CHANNEL_HANDSHAKE_AUTH_FAILED,
+	/* Successful handshakes where early data had been queued */
+	LM_SECURE_CHANNEL_HANDSHAKE_EARLY_DATA_ACCEPTED,
+	LM_SECURE_CHANNEL_HANDSHAKE_EARLY_DATA_REJECTED
+} LmSecureChannelHandshakeResult;
+
+/* Value for the "priority" property that picks AES-GCM or ChaCha20-Poly1305
+ * first depending on whether the CPU accelerates AES.
+ */
+#define LM_SECURE_CHANNEL_PRIORITY_AUTO "auto"
+
 typedef struct LmSecureChannel      LmSecureChannel;
 typedef struct LmSecureChannelClass LmSecureChannelClass;
 
@@ -75,6 +90,12 @@ struct LmSecureChannelClass {
     gboolean    (*is_encrypted)      (LmSecureChannel  *channel);
     void        (*start_handshake)   (LmSecureChannel  *channel,
                                       const gchar      *host);
+    void        (*write_early_data)  (LmSecureChannel  *channel,
+                                      const gchar      *buf,
+                                      gssize            count);
+    /* Shared by all channels of the class */
+    gboolean    (*set_server_credentials) (const gchar *cert_file,
+                                           const gchar *key_file);
 
     GIOStatus   (*secure_read)       (LmChannel        *channel,
                                       gchar            *buf,
@@ -106,6 +127,27 @@ void          lm_secure_channel_start_handshake (LmSecureChannel *channel,
 
 const gchar * lm_secure_channel_get_fingerprint (LmSecureChannel *channel);
 
+/* Pins are base64 encoded SHA-256 digests of a SubjectPublicKeyInfo in the
+ * server's chain, optionally prefixed with "sha256/". A matching pin skips
+ * CA validation, the hostname and validity period are still checked.
+ */
+void          lm_secure_channel_set_pins        (LmSecureChannel  *channel,
+                                                 const gchar     **pins);
+
+/* Queue replay safe data to be sent as TLS 1.3 0-RTT early data when the
+ * "early-data" property is set and the session to the host can be resumed.
+ * Rejected early data is resent after the handshake.
+ */
+void          lm_secure_channel_write_early_data (LmSecureChannel *channel,
+                                                  const gchar     *buf,
+                                                  gssize           count);
+
+/* Loads the certificate and key used by all channels with "server-mode"
+ * set. Can only be done once per process.
+ */
+gboolean      lm_secure_channel_set_server_credentials (const gchar *cert_file,
+                                                        const gchar *key_file);
+
 G_END_DECLS
 
 #endif /* __LM_SECURE_CHANNEL_H__ */
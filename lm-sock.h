@@ -46,6 +46,7 @@ typedef SOCKET LmSocketHandle;
 #define _LM_SOCK_EISCONN     EISCONN
 #define _LM_SOCK_EINVAL      EINVAL
 #define _LM_SOCK_VALID(S)    ((S) >= 0)
+#define _LM_SOCK_INVALID     -1
 
 #else  /* G_OS_WIN32 */
 
@@ -74,6 +75,7 @@ typedef SOCKET LmSocketHandle;
 #define _LM_SOCK_EISCONN     WSAEISCONN
 #define _LM_SOCK_EINVAL      WSAEINVAL
 #define _LM_SOCK_VALID(S)    ((S) != INVALID_SOCKET)
+#define _LM_SOCK_INVALID     INVALID_SOCKET
 
 #endif /* G_OS_WIN32 */
 
@@ -9,15 +9,25 @@
 #include <netinet/in.h>
 #endif
 
+#include <string.h>
+
+#include "lm-destination-history.h"
 #include "lm-resolver.h"
 #include "lm-socket-address.h"
 
+/* Addresses that were never connected to count as this slow, so that a
+ * consistently slow address loses against an untried one.
+ */
+#define UNTRIED_RTT (300 * 1000)
+/* Microseconds, round trip times this close count as equal */
+#define RTT_BUCKET  (20 * 1000)
+
 struct LmSocketAddress {
     gchar               *hostname;
     guint                port;
 
-    /* Add result iterator here */
-    struct addrinfo     *results;
+    /* LmSocketAddressEntry */
+    GArray              *results;
     LmSocketAddressIter *results_iter;
 
     guint                ref_count;
@@ -25,9 +35,22 @@ struct LmSocketAddress {
 
 struct LmSocketAddressIter {
     LmSocketAddress *sa;
-    struct addrinfo *current;
+
+    /* Indices into the results in the order they are tried */
+    GArray          *order;
+    guint            next;
 };
 
+typedef struct {
+    guint   index;
+    gdouble penalty;
+    gint64  rtt;
+    gint    precedence;
+    gint    scope;
+} SortKey;
+
+static void socket_address_iter_reset_order (LmSocketAddressIter *iter);
+
 GType
 lm_socket_address_get_type (void)
 {
@@ -75,7 +98,21 @@ lm_socket_address_get_port (LmSocketAddress *sa)
 gboolean 
 lm_socket_address_is_resolved (LmSocketAddress *sa)
 {
-    return (sa->results != NULL);
+    return (sa->results != NULL && sa->results->len > 0);
+}
+
+guint
+lm_socket_address_get_n_results (LmSocketAddress *sa)
+{
+    return sa->results ? sa->results->len : 0;
+}
+
+LmSocketAddressEntry *
+lm_socket_address_get_result (LmSocketAddress *sa, guint index)
+{
+    g_return_val_if_fail (index < lm_socket_address_get_n_results (sa), NULL);
+
+    return &g_array_index (sa->results, LmSocketAddressEntry, index);
 }
 
 LmSocketAddressIter *
@@ -84,10 +121,10 @@ lm_socket_address_get_result_iter (LmSocketAddress *sa)
     if (!sa->results_iter) {
         sa->results_iter = g_slice_new0 (LmSocketAddressIter);
         sa->results_iter->sa = sa;
-        sa->results_iter->current = sa->results;
+        sa->results_iter->order = g_array_new (FALSE, FALSE, sizeof (guint));
     } else {
-        /* Just reset it */
-        sa->results_iter->current = sa->results;
+        /* Just reset it, the history might have changed since */
+        lm_socket_address_iter_reset (sa->results_iter);
     }
 
     return sa->results_iter;
@@ -113,50 +150,338 @@ lm_socket_address_unref (LmSocketAddress *sa)
     if (sa->ref_count == 0) {
         g_free (sa->hostname);
         if (sa->results) {
-            lm_resolver_freeaddrinfo (sa->results);
+            g_array_free (sa->results, TRUE);
+        }
+
+        if (sa->results_iter) {
+            g_array_free (sa->results_iter->order, TRUE);
+            g_slice_free (LmSocketAddressIter, sa->results_iter);
         }
 
         g_slice_free (LmSocketAddress, sa);
     }
 }
 
+LmSocketAddress *
+lm_socket_address_copy (LmSocketAddress *sa)
+{
+    LmSocketAddress *copy;
+
+    copy = lm_socket_address_new (sa->hostname, sa->port);
+    lm_socket_address_copy_results (copy, sa);
+
+    return copy;
+}
+
+void
+lm_socket_address_record_connect (LmSocketAddress *sa,
+                                  guint            index,
+                                  gint64           rtt)
+{
+    LmSocketAddressEntry *entry;
+
+    entry = lm_socket_address_get_result (sa, index);
+    g_return_if_fail (entry != NULL);
+
+    entry->rtt      = rtt;
+    entry->failures = 0;
+
+    _lm_destination_history_record_connect ((struct sockaddr *) &entry->addr,
+                                            rtt);
+}
+
+void
+lm_socket_address_record_failure (LmSocketAddress *sa, guint index)
+{
+    LmSocketAddressEntry *entry;
+
+    entry = lm_socket_address_get_result (sa, index);
+    g_return_if_fail (entry != NULL);
+
+    entry->failures++;
+    entry->last_failure = g_get_monotonic_time ();
+
+    _lm_destination_history_record_failure ((struct sockaddr *) &entry->addr);
+}
+
+static void
+socket_address_set_port (LmSocketAddress *sa, LmSocketAddressEntry *entry)
+{
+    if (entry->family == AF_INET6) {
+        ((struct sockaddr_in6 *) &entry->addr)->sin6_port = htons (sa->port);
+    } else {
+        ((struct sockaddr_in *) &entry->addr)->sin_port = htons (sa->port);
+    }
+}
+
 void
 lm_socket_address_set_results (LmSocketAddress *sa, struct addrinfo *ai)
+{
+    g_return_if_fail (sa != NULL);
+
+    if (sa->results) {
+        g_array_set_size (sa->results, 0);
+    }
+
+    if (sa->results_iter) {
+        socket_address_iter_reset_order (sa->results_iter);
+    }
+
+    lm_socket_address_append_results (sa, ai);
+}
+
+void
+lm_socket_address_append_results (LmSocketAddress *sa, struct addrinfo *ai)
 {
     struct addrinfo *addr;
 
     g_return_if_fail (sa != NULL);
 
-    sa->results = ai;
+    if (!sa->results) {
+        sa->results = g_array_new (FALSE, FALSE, sizeof (LmSocketAddressEntry));
+    }
+
+    for (addr = ai; addr; addr = addr->ai_next) {
+        LmSocketAddressEntry entry;
+
+        if ((addr->ai_family != AF_INET && addr->ai_family != AF_INET6) ||
+            addr->ai_addrlen > sizeof (entry.addr)) {
+            continue;
+        }
+
+        memset (&entry, 0, sizeof (entry));
+        memcpy (&entry.addr, addr->ai_addr, addr->ai_addrlen);
+        entry.addr_len = addr->ai_addrlen;
+        entry.family   = addr->ai_family;
+
+        /* Set the lower level port on all results */
+        socket_address_set_port (sa, &entry);
+
+        g_array_append_val (sa->results, entry);
+    }
+
+    if (ai) {
+        lm_resolver_freeaddrinfo (ai);
+    }
+}
+
+void
+lm_socket_address_copy_results (LmSocketAddress *sa, LmSocketAddress *src)
+{
+    guint i;
+
+    g_return_if_fail (sa != NULL);
+    g_return_if_fail (src != NULL);
+
+    if (!sa->results) {
+        sa->results = g_array_new (FALSE, FALSE, sizeof (LmSocketAddressEntry));
+    }
+
+    g_array_set_size (sa->results, 0);
 
-    /* Set the lower level sockaddr_in port on all results */
-    addr = ai;
-    while (addr) {
-        int port;
-        port = htons (sa->port);
-        ((struct sockaddr_in *) addr->ai_addr)->sin_port = port;
+    if (sa->results_iter) {
+        socket_address_iter_reset_order (sa->results_iter);
+    }
 
-        addr = addr->ai_next;
+    if (!src->results) {
+        return;
+    }
+
+    g_array_append_vals (sa->results, src->results->data, src->results->len);
+
+    /* The port is per LmSocketAddress */
+    for (i = 0; i < sa->results->len; i++) {
+        socket_address_set_port (sa, 
+                                 &g_array_index (sa->results, 
+                                                 LmSocketAddressEntry, i));
     }
 }
 
 /* -- LmSocketAddressIter: Results iterator -- */
-struct addrinfo *
+
+/* Precedence and scope of the destination address as in the policy table
+ * of RFC 6724. Only the destination rules that don't need the source
+ * address are applied, getaddrinfo() does the rest for the results it
+ * returns.
+ */
+static void
+socket_address_get_policy (LmSocketAddressEntry *entry,
+                           gint                 *precedence,
+                           gint                 *scope)
+{
+    const guint8 *b;
+
+    if (entry->family == AF_INET) {
+        b = (const guint8 *) &((struct sockaddr_in *) &entry->addr)->sin_addr;
+        *precedence = 35;
+    } else {
+        b = ((struct sockaddr_in6 *) &entry->addr)->sin6_addr.s6_addr;
+
+        if (IN6_IS_ADDR_LOOPBACK ((struct in6_addr *) b)) {
+            *precedence = 50;
+            *scope      = 2;
+            return;
+        }
+
+        if (IN6_IS_ADDR_V4MAPPED ((struct in6_addr *) b)) {
+            b += 12;
+            *precedence = 35;
+        } else {
+            if (b[0] == 0x20 && b[1] == 0x02) {
+                *precedence = 30;           /* 6to4 */
+            }
+            else if (b[0] == 0x20 && b[1] == 0x01 && b[2] == 0 && b[3] == 0) {
+                *precedence = 5;            /* Teredo */
+            }
+            else if ((b[0] & 0xfe) == 0xfc) {
+                *precedence = 3;            /* ULA */
+            }
+            else if (IN6_IS_ADDR_V4COMPAT ((struct in6_addr *) b) ||
+                     IN6_IS_ADDR_SITELOCAL ((struct in6_addr *) b) ||
+                     (b[0] == 0x3f && b[1] == 0xfe)) {
+                *precedence = 1;
+            } else {
+                *precedence = 40;
+            }
+
+            if (IN6_IS_ADDR_MULTICAST ((struct in6_addr *) b)) {
+                *scope = b[1] & 0x0f;
+            }
+            else if (IN6_IS_ADDR_LINKLOCAL ((struct in6_addr *) b)) {
+                *scope = 2;
+            }
+            else if (IN6_IS_ADDR_SITELOCAL ((struct in6_addr *) b)) {
+                *scope = 5;
+            } else {
+                *scope = 14;
+            }
+
+            return;
+        }
+    }
+
+    /* Loopback and link-local IPv4 have link-local scope */
+    if (b[0] == 127 || (b[0] == 169 && b[1] == 254)) {
+        *scope = 2;
+    } else {
+        *scope = 14;
+    }
+}
+
+/* Recent failures go last, then the clearly faster address from the
+ * history comes first and RFC 6724 decides between the rest.
+ */
+static gint
+socket_address_sort_key_compare (const SortKey *a, const SortKey *b)
+{
+    gint64 a_bucket = a->rtt / RTT_BUCKET;
+    gint64 b_bucket = b->rtt / RTT_BUCKET;
+
+    if (a->penalty != b->penalty) {
+        return a->penalty < b->penalty ? -1 : 1;
+    }
+
+    if (a_bucket != b_bucket) {
+        return a_bucket < b_bucket ? -1 : 1;
+    }
+
+    if (a->precedence != b->precedence) {
+        return b->precedence - a->precedence;
+    }
+
+    if (a->scope != b->scope) {
+        return a->scope - b->scope;
+    }
+
+    /* Otherwise leave them in the order they were resolved */
+    return (gint) a->index - (gint) b->index;
+}
+
+static void
+socket_address_iter_reset_order (LmSocketAddressIter *iter)
+{
+    g_array_set_size (iter->order, 0);
+    iter->next = 0;
+}
+
+/* Adds new results to the order and sorts the ones not tried yet, the
+ * history changes as earlier addresses fail so this is done every step.
+ */
+static void
+socket_address_iter_update_order (LmSocketAddressIter *iter)
+{
+    guint    n_results;
+    guint    n_left;
+    guint    i;
+    SortKey *keys;
+
+    n_results = lm_socket_address_get_n_results (iter->sa);
+
+    for (i = iter->order->len; i < n_results; i++) {
+        g_array_append_val (iter->order, i);
+    }
+
+    n_left = iter->order->len - iter->next;
+    if (n_left < 2) {
+        return;
+    }
+
+    keys = g_new (SortKey, n_left);
+
+    for (i = 0; i < n_left; i++) {
+        LmSocketAddressEntry *entry;
+        SortKey              *key = &keys[i];
+
+        key->index = g_array_index (iter->order, guint, iter->next + i);
+        entry = lm_socket_address_get_result (iter->sa, key->index);
+
+        _lm_destination_history_get ((struct sockaddr *) &entry->addr,
+                                     &key->rtt, &key->penalty);
+        if (key->rtt == 0) {
+            key->rtt = UNTRIED_RTT;
+        }
+
+        socket_address_get_policy (entry, &key->precedence, &key->scope);
+    }
+
+    g_qsort_with_data (keys, n_left, sizeof (SortKey),
+                       (GCompareDataFunc) socket_address_sort_key_compare,
+                       NULL);
+
+    for (i = 0; i < n_left; i++) {
+        g_array_index (iter->order, guint, iter->next + i) = keys[i].index;
+    }
+
+    g_free (keys);
+}
+
+LmSocketAddressEntry *
 lm_socket_address_iter_get_next (LmSocketAddressIter *iter)
 {
-    struct addrinfo *current = iter->current;
-   
-    if (iter->current) {
-        iter->current = iter->current->ai_next;
+    guint index;
+
+    /* Results appended after the iterator ran out are picked up too */
+    socket_address_iter_update_order (iter);
+
+    if (iter->next >= iter->order->len) {
+        return NULL;
     }
 
-    return current;
+    index = g_array_index (iter->order, guint, iter->next++);
+   
+    return lm_socket_address_get_result (iter->sa, index);
+}
+
+guint
+lm_socket_address_iter_get_index (LmSocketAddressIter *iter)
+{
+    g_return_val_if_fail (iter->next > 0, 0);
+
+    return g_array_index (iter->order, guint, iter->next - 1);
 }
 
 void
 lm_socket_address_iter_reset (LmSocketAddressIter *iter)
 {
-    iter->current = iter->sa->results;
+    socket_address_iter_reset_order (iter);
 }
-
-
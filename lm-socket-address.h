@@ -6,6 +6,8 @@
 #define __LM_SOCKET_ADDRESS_H__
 
 #include <glib-object.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 #include <netdb.h>
 
 G_BEGIN_DECLS
@@ -15,16 +17,40 @@ G_BEGIN_DECLS
 typedef struct LmSocketAddress     LmSocketAddress;
 typedef struct LmSocketAddressIter LmSocketAddressIter;
 
+/* One resolved address, with the port already set. Results are stored
+ * one after the other.
+ */
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+    gint                    family;
+
+    /* Connect history, 0 if none */
+    gint64                  rtt;          /* Microseconds */
+    guint                   failures;
+    gint64                  last_failure; /* g_get_monotonic_time () */
+} LmSocketAddressEntry;
+
 GType             lm_socket_address_get_type (void);
 LmSocketAddress * lm_socket_address_new      (const gchar     *hostname,
                                               guint            port);
+/* A new address with its own copy of the results */
+LmSocketAddress * lm_socket_address_copy     (LmSocketAddress *sa);
 
 const gchar *     lm_socket_address_get_host (LmSocketAddress *sa);
 guint             lm_socket_address_get_port (LmSocketAddress *sa);
 
 gboolean          lm_socket_address_is_resolved (LmSocketAddress *sa);
 
-/* The returned iterator is owned by the LmSocketAddress */
+guint             lm_socket_address_get_n_results (LmSocketAddress *sa);
+/* Valid until results are added */
+LmSocketAddressEntry *
+lm_socket_address_get_result                 (LmSocketAddress *sa,
+                                              guint            index);
+
+/* The returned iterator is owned by the LmSocketAddress. It returns the
+ * results in the order they should be tried, see lm-destination-history.h.
+ */
 LmSocketAddressIter *
 lm_socket_address_get_result_iter            (LmSocketAddress *sa);
 
@@ -32,16 +58,34 @@ lm_socket_address_get_result_iter            (LmSocketAddress *sa);
 LmSocketAddress * lm_socket_address_ref      (LmSocketAddress *sa);
 void              lm_socket_address_unref    (LmSocketAddress *sa);
 
-/* Only to be used by the resolver */
+/* Connect outcomes of the result at index */
+void              lm_socket_address_record_connect (LmSocketAddress *sa,
+                                                    guint            index,
+                                                    gint64           rtt);
+void              lm_socket_address_record_failure (LmSocketAddress *sa,
+                                                    guint            index);
+
+/* Only to be used by the resolver, the addresses are copied and ai is
+ * freed.
+ */
 void              lm_socket_address_set_results (LmSocketAddress *sa,
                                                  struct addrinfo *ai);
+/* Adds ai after the current results, an iterator that already ran out
+ * continues with them.
+ */
+void              lm_socket_address_append_results (LmSocketAddress *sa,
+                                                    struct addrinfo *ai);
+/* Replaces the results of sa with those of src */
+void              lm_socket_address_copy_results   (LmSocketAddress *sa,
+                                                    LmSocketAddress *src);
 
 /* Result iterator */
-struct addrinfo * lm_socket_address_iter_get_next (LmSocketAddressIter *iter);
-void              lm_socket_address_iter_reset    (LmSocketAddressIter *iter);
+LmSocketAddressEntry * 
+lm_socket_address_iter_get_next              (LmSocketAddressIter *iter);
+/* Index of the result last returned by get_next */
+guint             lm_socket_address_iter_get_index (LmSocketAddressIter *iter);
+void              lm_socket_address_iter_reset     (LmSocketAddressIter *iter);
 
 G_END_DECLS
 
 #endif /* __LM_SOCKET_ADDRESS_H__ */
-
-
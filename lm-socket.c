@@ -32,19 +32,22 @@
 #endif /* G_OS_WIN32 */
 
 #include "lm-channel.h"
+#include "lm-gmain-reactor.h"
 #include "lm-marshal.h"
-#include "lm-misc.h"
 #include "lm-resolver.h"
+#include "lm-static-resolver.h"
 #include "lm-sock.h"
 #include "lm-socket.h"
+#include "lm-threaded-resolver.h"
+#include "lm-uring.h"
 
 #define GET_PRIV(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), LM_TYPE_SOCKET, LmSocketPriv))
 
 typedef struct {
-    GSource *in_watch;
-    GSource *out_watch;
-    GSource *err_watch;
-    GSource *hup_watch;
+    LmReactorSource *in_watch;
+    LmReactorSource *out_watch;
+    LmReactorSource *err_watch;
+    LmReactorSource *hup_watch;
 } IOWatches;
 
 typedef struct LmSocketPriv LmSocketPriv;
@@ -54,6 +57,10 @@ struct LmSocketPriv {
     LmSocketHandle       handle;
     GIOChannel          *io_channel;
     IOWatches            watches;
+    /* G_IO_OUT is only asked for while a write is pending */
+    gboolean             watching_out;
+    /* Replaces io_channel and the watches on the io_uring backend */
+    LmUringSocket       *uring_socket;
 
     gboolean             connected;
 
@@ -62,6 +69,9 @@ struct LmSocketPriv {
 
     /* Connect */
     LmSocketAddressIter *sa_iter;
+    gboolean             attempting;
+    guint                attempt_index;
+    gint64               attempt_start;
 };
 
 static void      socket_finalize            (GObject           *object);
@@ -84,26 +94,45 @@ static GIOStatus socket_write               (LmChannel         *channel,
                                              gsize             *written_len,
                                              GError           **error);
 static void      socket_close               (LmChannel         *channel);
+static void      socket_watch_out           (LmSocket          *socket,
+                                             gboolean           enabled);
 static void      
 socket_attempt_connect_next                 (LmSocket          *socket);
 static gboolean  socket_attempt_connect     (LmSocket          *socket,
-                                             struct addrinfo   *addr);
-static gboolean  socket_in_cb               (GIOChannel        *source,
+                                             LmSocketAddressEntry *entry);
+static gboolean  socket_in_cb               (LmReactor         *reactor,
+                                             int                fd,
                                              GIOCondition       condition,
                                              LmSocket          *socket);
-static gboolean  socket_out_cb              (GIOChannel        *source,
+static gboolean  socket_out_cb              (LmReactor         *reactor,
+                                             int                fd,
                                              GIOCondition       condition,
                                              LmSocket          *socket);
-static gboolean  socket_err_cb              (GIOChannel        *source,
+static gboolean  socket_err_cb              (LmReactor         *reactor,
+                                             int                fd,
                                              GIOCondition       condition,
                                              LmSocket          *socket);
-static gboolean  socket_hup_cb              (GIOChannel        *source,
+static gboolean  socket_hup_cb              (LmReactor         *reactor,
+                                             int                fd,
                                              GIOCondition       condition,
                                              LmSocket          *socket);
+static void      
+socket_add_connected_watches                (LmSocket          *socket);
 static void      socket_reset               (LmSocket          *socket);
+static void      socket_stop_resolver       (LmSocket          *socket);
 static void      
 socket_emit_disconnected_and_cleanup        (LmSocket             *socket,
                                              LmChannelCloseReason  reason);
+static void      socket_uring_connected     (LmUringSocket     *us,
+                                             int                result,
+                                             gpointer           user_data);
+static void      socket_uring_readable      (LmUringSocket     *us,
+                                             gpointer           user_data);
+static void      socket_uring_writeable     (LmUringSocket     *us,
+                                             gpointer           user_data);
+static void      socket_uring_closed        (LmUringSocket     *us,
+                                             int                error,
+                                             gpointer           user_data);
 
 G_DEFINE_TYPE (LmSocket, lm_socket, LM_TYPE_CHANNEL)
 
@@ -119,6 +148,16 @@ enum {
 
 static guint signals[LAST_SIGNAL] = { 0 };
 
+/* An LmSocketBackend, accessed atomically */
+static gint default_backend = LM_SOCKET_BACKEND_POLL;
+
+static const LmUringSocketFuncs uring_funcs = {
+    socket_uring_connected,
+    socket_uring_readable,
+    socket_uring_writeable,
+    socket_uring_closed
+};
+
 static void
 lm_socket_class_init (LmSocketClass *class)
 {
@@ -162,6 +201,7 @@ lm_socket_init (LmSocket *socket)
     priv = GET_PRIV (socket);
 
     priv->connected = FALSE;
+    priv->handle    = _LM_SOCK_INVALID;
 }
 
 static void
@@ -171,6 +211,8 @@ socket_finalize (GObject *object)
 
     priv = GET_PRIV (object);
 
+    socket_stop_resolver (LM_SOCKET (object));
+
     if (priv->sa) {
         lm_socket_address_unref (priv->sa);
     }
@@ -235,6 +277,11 @@ socket_read (LmChannel *channel,
 
     priv = GET_PRIV (channel);
 
+    if (priv->uring_socket) {
+        return _lm_uring_socket_read (priv->uring_socket,
+                                      buf, len, read_len, error);
+    }
+
     if (!priv->io_channel) {
         return G_IO_STATUS_EOF;
     }
@@ -251,15 +298,37 @@ socket_write (LmChannel    *channel,
               GError      **error)
 {
     LmSocketPriv *priv;
+    GIOStatus     status;
+    gsize         written = 0;
 
     priv = GET_PRIV (channel);
 
+    if (len < 0) {
+        len = strlen (buf);
+    }
+
+    if (priv->uring_socket) {
+        return _lm_uring_socket_write (priv->uring_socket,
+                                       buf, len, written_len, error);
+    }
+
     if (!priv->io_channel) {
         return G_IO_STATUS_EOF;
     }
 
-    return g_io_channel_write_chars (priv->io_channel,
-                                     buf, len, written_len, error);
+    status = g_io_channel_write_chars (priv->io_channel,
+                                       buf, len, &written, error);
+    if (written_len) {
+        *written_len = written;
+    }
+
+    /* "writeable" tells when the rest can go */
+    if (status == G_IO_STATUS_AGAIN ||
+        (status == G_IO_STATUS_NORMAL && written < (gsize) len)) {
+        socket_watch_out (LM_SOCKET (channel), TRUE);
+    }
+
+    return status;
 }
 
 static void
@@ -284,10 +353,11 @@ socket_emit_connect_result (LmSocket *socket, LmSocketConnectResult result)
 }
 
 static void
-socket_disconnect_watch (GSource **watch) 
+socket_disconnect_watch (LmSocket *socket, LmReactorSource **watch) 
 {
     if (*watch) {
-        g_source_destroy (*watch);
+        lm_reactor_remove (lm_channel_get_reactor (LM_CHANNEL (socket)), 
+                           *watch);
         *watch = NULL;
     }
 }
@@ -297,10 +367,62 @@ socket_disconnect_io_watches (LmSocket *socket)
 {
     LmSocketPriv *priv = GET_PRIV (socket);
 
-    socket_disconnect_watch (&priv->watches.in_watch);
-    socket_disconnect_watch (&priv->watches.out_watch);
-    socket_disconnect_watch (&priv->watches.err_watch);
-    socket_disconnect_watch (&priv->watches.hup_watch);
+    socket_disconnect_watch (socket, &priv->watches.in_watch);
+    socket_disconnect_watch (socket, &priv->watches.out_watch);
+    socket_disconnect_watch (socket, &priv->watches.err_watch);
+    socket_disconnect_watch (socket, &priv->watches.hup_watch);
+}
+
+/* A connected socket is writable nearly all the time, polling for it
+ * would wake the loop on every iteration.
+ */
+static void
+socket_watch_out (LmSocket *socket, gboolean enabled)
+{
+    LmSocketPriv *priv = GET_PRIV (socket);
+    LmReactor    *reactor = lm_channel_get_reactor (LM_CHANNEL (socket));
+
+    if (!priv->watches.out_watch) {
+        if (enabled && _LM_SOCK_VALID (priv->handle)) {
+            priv->watches.out_watch = 
+                lm_reactor_add_fd (reactor,
+                                   priv->handle,
+                                   G_IO_OUT,
+                                   (LmReactorFdFunc) socket_out_cb,
+                                   socket);
+            priv->watching_out = TRUE;
+        }
+        return;
+    }
+
+    if (priv->watching_out != enabled) {
+        lm_reactor_modify_fd (reactor, priv->watches.out_watch,
+                              enabled ? G_IO_OUT : 0);
+        priv->watching_out = enabled;
+    }
+}
+
+/* Closes the socket of a failed connect attempt */
+static void
+socket_close_attempt (LmSocket *socket)
+{
+    LmSocketPriv *priv = GET_PRIV (socket);
+
+    socket_disconnect_io_watches (socket);
+
+    if (priv->io_channel) {
+        g_io_channel_unref (priv->io_channel);
+        priv->io_channel = NULL;
+    }
+
+    if (priv->uring_socket) {
+        /* Owns the handle */
+        _lm_uring_socket_close (priv->uring_socket);
+        priv->uring_socket = NULL;
+    } else if (_LM_SOCK_VALID (priv->handle)) {
+        _lm_sock_close (priv->handle);
+    }
+    priv->handle = _LM_SOCK_INVALID;
 }
 
 static void
@@ -318,8 +440,13 @@ socket_reset (LmSocket *socket)
         priv->io_channel = NULL;
     }
 
-    _lm_sock_close (priv->handle);
-    priv->handle = 0;
+    if (priv->uring_socket) {
+        _lm_uring_socket_close (priv->uring_socket);
+        priv->uring_socket = NULL;
+    } else if (_LM_SOCK_VALID (priv->handle)) {
+        _lm_sock_close (priv->handle);
+    }
+    priv->handle = _LM_SOCK_INVALID;
 }
 
 static void
@@ -337,9 +464,19 @@ socket_resolver_finished_cb (LmResolver       *resolver,
                              LmSocketAddress  *address,
                              LmSocket         *socket)
 {
-    if (result != LM_RESOLVER_RESULT_OK) {
-        g_warning ("Failed to lookup host: %s\n",
-                   lm_socket_address_get_host (address));
+    LmSocketPriv *priv = GET_PRIV (socket);
+
+    priv->resolver = NULL;
+
+    /* An attempt on the early addresses is still running */
+    if (priv->connected || priv->attempting) {
+        return;
+    }
+
+    if (result != LM_RESOLVER_RESULT_OK && !priv->sa_iter) {
+        g_warning ("Failed to lookup host: %s (%s)\n",
+                   lm_socket_address_get_host (address),
+                   lm_resolver_error_to_string (lm_resolver_get_error (resolver)));
 
         socket_emit_connect_result (socket, 
                                     LM_SOCKET_CONNECT_FAILED_DNS);
@@ -350,26 +487,69 @@ socket_resolver_finished_cb (LmResolver       *resolver,
     socket_attempt_connect_next (socket);
 }
 
+/* One address family is in, start connecting while the other is looked up */
+static void
+socket_resolver_results_added_cb (LmResolver      *resolver,
+                                  LmSocketAddress *address,
+                                  LmSocket        *socket)
+{
+    LmSocketPriv *priv = GET_PRIV (socket);
+
+    if (!priv->connected && !priv->attempting) {
+        socket_attempt_connect_next (socket);
+    }
+}
+
+static void
+socket_stop_resolver (LmSocket *socket)
+{
+    LmSocketPriv *priv = GET_PRIV (socket);
+    LmResolver   *resolver = priv->resolver;
+
+    if (!resolver) {
+        return;
+    }
+
+    priv->resolver = NULL;
+
+    g_signal_handlers_disconnect_by_func (resolver, 
+                                          socket_resolver_finished_cb,
+                                          socket);
+    g_signal_handlers_disconnect_by_func (resolver,
+                                          socket_resolver_results_added_cb,
+                                          socket);
+    lm_resolver_cancel (resolver);
+}
+
 static void
 socket_attempt_connect_next (LmSocket *socket)
 {
-    LmSocketPriv    *priv = GET_PRIV (socket);
-    struct addrinfo *addr;
+    LmSocketPriv         *priv = GET_PRIV (socket);
+    LmSocketAddressEntry *entry;
+
+    priv->attempting = FALSE;
 
     if (!priv->sa_iter) {
         priv->sa_iter = lm_socket_address_get_result_iter (priv->sa);
     }
 
     while (TRUE) {
-        addr = lm_socket_address_iter_get_next (priv->sa_iter);
-        if (!addr) {
+        entry = lm_socket_address_iter_get_next (priv->sa_iter);
+        if (!entry && priv->resolver) {
+            /* More addresses may still come in */
+            break;
+        }
+
+        if (!entry) {
             g_warning ("Failed to connect, phase 0");
             socket_emit_connect_result (socket, 
                                         LM_SOCKET_CONNECT_FAILED_TRIED_ALL);
             break;
         }
 
-        if (!socket_attempt_connect (socket, addr)) {
+        priv->attempt_index = lm_socket_address_iter_get_index (priv->sa_iter);
+
+        if (!socket_attempt_connect (socket, entry)) {
             g_warning ("Failed to connect, trying next, %s", G_STRFUNC);
             /* Try next */
         } else {
@@ -377,61 +557,101 @@ socket_attempt_connect_next (LmSocket *socket)
              * next step will be socket_connect_cb that will be triggered by
              * either G_IO_OUT or G_IO_ERR.
              */
+            priv->attempting = TRUE;
             break;
         }
     }
 }
 
+/* The connect is submitted to the ring, socket_uring_connected is called
+ * with the result.
+ */
 static gboolean
-socket_attempt_connect (LmSocket *lm_socket, struct addrinfo *addr)
+socket_attempt_connect_uring (LmSocket             *socket,
+                              LmUring              *uring,
+                              LmSocketAddressEntry *entry)
+{
+    LmSocketPriv *priv = GET_PRIV (socket);
+
+    priv->uring_socket = 
+        _lm_uring_socket_new (uring, 
+                              lm_channel_get_arena (LM_CHANNEL (socket)),
+                              priv->handle, &uring_funcs, socket);
+    priv->attempt_start = g_get_monotonic_time ();
+
+    if (!_lm_uring_socket_connect (priv->uring_socket, 
+                                   (struct sockaddr *) &entry->addr,
+                                   entry->addr_len)) {
+        g_warning ("Failed to connect, phase 2");
+        lm_socket_address_record_failure (priv->sa, priv->attempt_index);
+        socket_close_attempt (socket);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+socket_attempt_connect (LmSocket *lm_socket, LmSocketAddressEntry *entry)
 {
     LmSocketPriv *priv;
     int           res;
-    GMainContext *context;
+    LmReactor    *reactor;
 
     priv = GET_PRIV (lm_socket);
 
-    priv->handle = (LmSocketHandle)socket (addr->ai_family, 
-                                           addr->ai_socktype, 
-                                           addr->ai_protocol);
+    priv->handle = (LmSocketHandle)socket (entry->family, SOCK_STREAM, 0);
 
     if (!_LM_SOCK_VALID (priv->handle)) {
         g_warning ("Failed to connect, phase 1");
         return FALSE;
     }
 
+    _lm_sock_set_blocking (priv->handle, FALSE);
+
+    reactor = lm_channel_get_reactor (LM_CHANNEL (lm_socket));
+
+    if (g_atomic_int_get (&default_backend) == LM_SOCKET_BACKEND_IO_URING) {
+        LmUring *uring = _lm_uring_get (reactor);
+
+        /* Falls back to poll if io_uring can't be used */
+        if (uring) {
+            return socket_attempt_connect_uring (lm_socket, uring, entry);
+        }
+    }
+
     priv->io_channel = g_io_channel_unix_new (priv->handle);
 
     g_io_channel_set_encoding (priv->io_channel, NULL, NULL);
     g_io_channel_set_buffered (priv->io_channel, FALSE);
 
-    _lm_sock_set_blocking (priv->handle, FALSE);
-
-    g_object_get (lm_socket, "context", &context, NULL);
-
     /* Check for OUT and ERR events as they will define when the asynchronous 
      * connect is done 
      */
-    priv->watches.out_watch = lm_misc_add_io_watch (context,
-                                                    priv->io_channel,
-                                                    G_IO_OUT,
-                                                    (GIOFunc) socket_out_cb,
-                                                    lm_socket);
-
-    priv->watches.err_watch = lm_misc_add_io_watch (context,
-                                                    priv->io_channel,
-                                                    G_IO_ERR,
-                                                    (GIOFunc) socket_err_cb,
-                                                    lm_socket);
-
-    res = connect (priv->handle, addr->ai_addr, (int)addr->ai_addrlen);
+    priv->watches.out_watch = lm_reactor_add_fd (reactor,
+                                                 priv->handle,
+                                                 G_IO_OUT,
+                                                 (LmReactorFdFunc) socket_out_cb,
+                                                 lm_socket);
+    priv->watching_out = TRUE;
+
+    priv->watches.err_watch = lm_reactor_add_fd (reactor,
+                                                 priv->handle,
+                                                 G_IO_ERR,
+                                                 (LmReactorFdFunc) socket_err_cb,
+                                                 lm_socket);
+
+    priv->attempt_start = g_get_monotonic_time ();
+
+    res = connect (priv->handle, 
+                   (struct sockaddr *) &entry->addr, (int)entry->addr_len);
     if (res < 0) {
         int err;
         err = _lm_sock_get_last_error ();
         if (!_lm_sock_is_blocking_error (err)) {
             g_warning ("Failed to connect, phase 2 (lm-old-socket.c:662)");
-            _lm_sock_close (priv->handle);
-            priv->handle = 0;
+            lm_socket_address_record_failure (priv->sa, priv->attempt_index);
+            socket_close_attempt (lm_socket);
             return FALSE;
         }
     }
@@ -440,8 +660,62 @@ socket_attempt_connect (LmSocket *lm_socket, struct addrinfo *addr)
     return TRUE;
 }
 
+static void
+socket_add_connected_watches (LmSocket *socket)
+{
+    LmSocketPriv *priv = GET_PRIV (socket);
+    LmReactor    *reactor;
+
+    reactor = lm_channel_get_reactor (LM_CHANNEL (socket));
+
+    priv->watches.in_watch = 
+        lm_reactor_add_fd (reactor,
+                           priv->handle,
+                           G_IO_IN,
+                           (LmReactorFdFunc) socket_in_cb,
+                           socket);
+
+    priv->watches.hup_watch =
+        lm_reactor_add_fd (reactor,
+                           priv->handle,
+                           G_IO_HUP,
+                           (LmReactorFdFunc) socket_hup_cb,
+                           socket);
+}
+
+static void
+socket_connect_succeeded (LmSocket *socket)
+{
+    LmSocketPriv *priv = GET_PRIV (socket);
+
+    priv->connected = TRUE;
+    priv->attempting = FALSE;
+
+    lm_socket_address_record_connect (priv->sa, priv->attempt_index,
+                                      g_get_monotonic_time () - 
+                                      priv->attempt_start);
+
+    /* The remaining addresses aren't needed anymore */
+    socket_stop_resolver (socket);
+
+    socket_emit_connect_result (socket, LM_SOCKET_CONNECT_OK);
+}
+
+static void
+socket_connect_failed (LmSocket *socket)
+{
+    LmSocketPriv *priv = GET_PRIV (socket);
+
+    g_warning ("Connection failed, trying next\n");
+    lm_socket_address_record_failure (priv->sa, priv->attempt_index);
+
+    socket_close_attempt (socket);
+    socket_attempt_connect_next (socket);
+}
+
 static gboolean
-socket_in_cb (GIOChannel   *source,
+socket_in_cb (LmReactor    *reactor,
+              int           fd,
               GIOCondition  condition,
               LmSocket     *socket)
 {
@@ -451,43 +725,51 @@ socket_in_cb (GIOChannel   *source,
 }
 
 static gboolean
-socket_out_cb (GIOChannel   *source,
+socket_out_cb (LmReactor    *reactor,
+               int           fd,
                GIOCondition  condition,
                LmSocket     *socket)
 {
     LmSocketPriv *priv = GET_PRIV (socket);
 
-    if (priv->connected) {
-        g_signal_emit_by_name (socket, "writeable");
-    } else {
-        GMainContext *context;
+    socklen_t     len;
+    int           err;
 
-        g_object_get (socket, "context", &context, NULL);
+    if (priv->connected) {
+        if (!(condition & G_IO_OUT)) {
+            return TRUE;
+        }
 
-        /* Sucessful connect */
-        priv->watches.in_watch = 
-            lm_misc_add_io_watch (context,
-                                  priv->io_channel,
-                                  G_IO_IN,
-                                  (GIOFunc) socket_in_cb,
-                                  socket);
+        /* Until a write comes up short again */
+        socket_watch_out (socket, FALSE);
+        g_signal_emit_by_name (socket, "writeable");
+        return TRUE;
+    }
 
-        priv->watches.hup_watch =
-            lm_misc_add_io_watch (context,
-                                  priv->io_channel,
-                                  G_IO_HUP,
-                                  (GIOFunc) socket_hup_cb,
-                                  socket);
+    /* A refused connect is writable too */
+    len = sizeof (err);
+    _lm_sock_get_error (priv->handle, &err, &len);
+    if (err != 0) {
+        if (_lm_sock_is_blocking_error (err)) {
+            return TRUE;
+        }
 
-        priv->connected = TRUE;
-        socket_emit_connect_result (socket, LM_SOCKET_CONNECT_OK);
+        /* Removes this watch too */
+        socket_connect_failed (socket);
+        return FALSE;
     }
 
+    /* Sucessful connect */
+    socket_watch_out (socket, FALSE);
+    socket_add_connected_watches (socket);
+    socket_connect_succeeded (socket);
+
     return TRUE;
 }
 
 static gboolean
-socket_err_cb (GIOChannel   *source,
+socket_err_cb (LmReactor    *reactor,
+               int           fd,
                GIOCondition  condition,
                LmSocket     *socket)
 {
@@ -500,8 +782,8 @@ socket_err_cb (GIOChannel   *source,
         len = sizeof (err);
         _lm_sock_get_error (priv->handle, &err, &len);
         if (!_lm_sock_is_blocking_error (err)) {
-            g_warning ("Connection failed, trying next\n");
-            socket_attempt_connect_next (socket);
+            /* Removes this watch too */
+            socket_connect_failed (socket);
             return FALSE;
         }
     } else {
@@ -514,7 +796,8 @@ socket_err_cb (GIOChannel   *source,
 }
 
 static gboolean
-socket_hup_cb (GIOChannel   *source,
+socket_hup_cb (LmReactor    *reactor,
+               int           fd,
                GIOCondition  condition,
                LmSocket     *socket)
 {
@@ -523,6 +806,40 @@ socket_hup_cb (GIOChannel   *source,
     return FALSE;
 }
 
+static void
+socket_uring_connected (LmUringSocket *us, int result, gpointer user_data)
+{
+    LmSocket *socket = LM_SOCKET (user_data);
+
+    if (result < 0) {
+        socket_connect_failed (socket);
+        return;
+    }
+
+    _lm_uring_socket_start (us);
+    socket_connect_succeeded (socket);
+}
+
+static void
+socket_uring_readable (LmUringSocket *us, gpointer user_data)
+{
+    g_signal_emit_by_name (user_data, "readable");
+}
+
+static void
+socket_uring_writeable (LmUringSocket *us, gpointer user_data)
+{
+    g_signal_emit_by_name (user_data, "writeable");
+}
+
+static void
+socket_uring_closed (LmUringSocket *us, int error, gpointer user_data)
+{
+    socket_emit_disconnected_and_cleanup (LM_SOCKET (user_data),
+                                          error ? LM_CHANNEL_CLOSE_IO_ERROR :
+                                          LM_CHANNEL_CLOSE_HUP);
+}
+
 /* -- Public API -- */
 LmChannel * 
 lm_socket_new (GMainContext *context, LmSocketAddress *address)
@@ -536,6 +853,17 @@ lm_socket_new (GMainContext *context, LmSocketAddress *address)
     return socket;
 }
 
+LmChannel *
+lm_socket_new_with_reactor (LmReactor *reactor, LmSocketAddress *address)
+{
+    g_return_val_if_fail (LM_IS_REACTOR (reactor), NULL);
+
+    return g_object_new (LM_TYPE_SOCKET,
+                         "reactor", reactor,
+                         "address", address,
+                         NULL);
+}
+
 void
 lm_socket_connect (LmSocket *socket)
 {
@@ -543,17 +871,122 @@ lm_socket_connect (LmSocket *socket)
 
     priv = GET_PRIV (socket);
 
-    if (!lm_socket_address_is_resolved (priv->sa)) {
-        GMainContext *context;
+    /* Pinned hosts connect right away */
+    if (!lm_socket_address_is_resolved (priv->sa) &&
+        !lm_static_resolver_resolve (priv->sa)) {
+        LmReactor *reactor = lm_channel_get_reactor (LM_CHANNEL (socket));
 
-        g_object_get (socket, "context", &context, NULL);
+        if (LM_IS_GMAIN_REACTOR (reactor)) {
+            GMainContext *context;
+
+            g_object_get (socket, "context", &context, NULL);
+
+            priv->resolver = 
+                lm_resolver_lookup_host_incremental (context, priv->sa);
+        } else {
+            /* Nothing iterates a GMainContext on a foreign loop */
+            priv->resolver = 
+                _lm_threaded_resolver_lookup_host (reactor, priv->sa);
+        }
 
-        priv->resolver = lm_resolver_lookup_host (context, priv->sa);
         g_signal_connect (priv->resolver, "finished", 
                           G_CALLBACK (socket_resolver_finished_cb),
                           socket);
+        g_signal_connect (priv->resolver, "results-added",
+                          G_CALLBACK (socket_resolver_results_added_cb),
+                          socket);
     } else {
         socket_attempt_connect_next (socket);
     }
 }
 
+/* Wraps an already connected socket, e.g. one received from another
+ * process.
+ */
+LmChannel *
+lm_socket_new_from_fd (GMainContext    *context,
+                       LmSocketAddress *address,
+                       int              fd)
+{
+    LmChannel    *socket;
+    LmSocketPriv *priv;
+
+    socket = lm_socket_new (context, address);
+    priv = GET_PRIV (socket);
+
+    priv->handle = (LmSocketHandle) fd;
+    priv->io_channel = g_io_channel_unix_new (priv->handle);
+
+    g_io_channel_set_encoding (priv->io_channel, NULL, NULL);
+    g_io_channel_set_buffered (priv->io_channel, FALSE);
+
+    _lm_sock_set_blocking (priv->handle, FALSE);
+
+    priv->watches.err_watch = 
+        lm_reactor_add_fd (lm_channel_get_reactor (socket),
+                           priv->handle,
+                           G_IO_ERR,
+                           (LmReactorFdFunc) socket_err_cb,
+                           socket);
+    socket_add_connected_watches (LM_SOCKET (socket));
+
+    priv->connected = TRUE;
+
+    return socket;
+}
+
+/* Only read when a connection attempt starts, may be set from any thread */
+void
+lm_socket_set_default_backend (LmSocketBackend backend)
+{
+    g_atomic_int_set (&default_backend, backend);
+}
+
+/* IO_URING only once connected on the ring, also when it was the default
+ * but the ring couldn't be set up.
+ */
+LmSocketBackend
+lm_socket_get_backend (LmSocket *socket)
+{
+    LmSocketPriv *priv;
+
+    g_return_val_if_fail (LM_IS_SOCKET (socket), LM_SOCKET_BACKEND_POLL);
+
+    priv = GET_PRIV (socket);
+
+    return priv->uring_socket ? 
+        LM_SOCKET_BACKEND_IO_URING : LM_SOCKET_BACKEND_POLL;
+}
+
+/* Detaches the connected socket without closing it, the socket is
+ * disconnected afterwards. Returns -1 if not connected.
+ */
+int
+lm_socket_steal_fd (LmSocket *socket)
+{
+    LmSocketPriv *priv;
+    int           fd;
+
+    priv = GET_PRIV (socket);
+
+    if (!priv->connected) {
+        return -1;
+    }
+
+    /* Data may be waiting in the ring */
+    if (priv->uring_socket) {
+        g_warning ("Can't steal the fd of a socket on io_uring");
+        return -1;
+    }
+
+    fd = (int) priv->handle;
+
+    socket_disconnect_io_watches (socket);
+    g_io_channel_unref (priv->io_channel);
+    priv->io_channel = NULL;
+
+    priv->handle = _LM_SOCK_INVALID;
+    priv->connected = FALSE;
+
+    return fd;
+}
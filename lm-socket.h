@@ -52,12 +52,38 @@ typedef enum {
     LM_SOCKET_CONNECT_FAILED_TRIED_ALL,
 } LmSocketConnectResult;
 
+/* How connected sockets do their I/O. With IO_URING connects, reads and
+ * writes are submitted to a ring shared by the sockets on a reactor,
+ * sockets fall back to POLL where the kernel doesn't support it.
+ */
+typedef enum {
+    LM_SOCKET_BACKEND_POLL,
+    LM_SOCKET_BACKEND_IO_URING
+} LmSocketBackend;
+
 GType       lm_socket_get_type       (void);
 
 LmChannel * lm_socket_new            (GMainContext    *context,
                                       LmSocketAddress *address);
+/* Runs the socket on reactor instead of a GMainContext. Host lookups
+ * run on the threaded resolver's pool and finish through a reactor
+ * defer, they skip the resolver cache.
+ */
+LmChannel * lm_socket_new_with_reactor (LmReactor       *reactor,
+                                        LmSocketAddress *address);
 void        lm_socket_connect        (LmSocket        *socket);
 
+/* Process handoff, see lm_gnutls_channel_export_session() */
+LmChannel * lm_socket_new_from_fd    (GMainContext    *context,
+                                      LmSocketAddress *address,
+                                      int              fd);
+int         lm_socket_steal_fd       (LmSocket        *socket);
+
+/* Used by sockets connecting after the call, POLL by default */
+void        lm_socket_set_default_backend (LmSocketBackend  backend);
+/* The backend of the current connection */
+LmSocketBackend lm_socket_get_backend     (LmSocket        *socket);
+
 G_END_DECLS
 
 #endif /* __LM_SOCKET_H__ */
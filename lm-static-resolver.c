@@ -0,0 +1,309 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Answers lookups of pinned hosts from an in-memory map, filled through
+ * lm_static_resolver_add_host() or from a hosts file. Lookups of other
+ * hosts fall through to the cache and the backends.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "lm-misc.h"
+
+#include "lm-static-resolver.h"
+
+#define GET_PRIV(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), LM_TYPE_STATIC_RESOLVER, LmStaticResolverPriv))
+
+typedef struct LmStaticResolverPriv LmStaticResolverPriv;
+struct LmStaticResolverPriv {
+    LmSocketAddress *sa;
+    GSource         *idle_source;
+};
+
+static void     static_resolver_finalize (GObject          *object);
+static void     static_resolver_cancel   (LmResolver       *resolver);
+
+/* Lower cased host name to its addresses */
+G_LOCK_DEFINE_STATIC (hosts);
+static GHashTable *hosts;
+
+G_DEFINE_TYPE (LmStaticResolver, lm_static_resolver, LM_TYPE_RESOLVER)
+
+static void
+lm_static_resolver_class_init (LmStaticResolverClass *class)
+{
+    GObjectClass    *object_class   = G_OBJECT_CLASS (class);
+    LmResolverClass *resolver_class = LM_RESOLVER_CLASS (class);
+
+    object_class->finalize = static_resolver_finalize;
+
+    resolver_class->cancel = static_resolver_cancel;
+
+    g_type_class_add_private (object_class, sizeof (LmStaticResolverPriv));
+}
+
+static void
+lm_static_resolver_init (LmStaticResolver *static_resolver)
+{
+    LmStaticResolverPriv *priv;
+
+    priv = GET_PRIV (static_resolver);
+}
+
+static void
+static_resolver_cleanup (LmResolver *resolver)
+{
+    LmStaticResolverPriv *priv = GET_PRIV (resolver);
+
+    if (priv->idle_source) {
+        g_source_destroy (priv->idle_source);
+        priv->idle_source = NULL;
+    }
+
+    if (priv->sa) {
+        lm_socket_address_unref (priv->sa);
+        priv->sa = NULL;
+    }
+}
+
+static void
+static_resolver_finalize (GObject *object)
+{
+    static_resolver_cleanup (LM_RESOLVER (object));
+
+    (G_OBJECT_CLASS (lm_static_resolver_parent_class)->finalize) (object);
+}
+
+static void
+static_resolver_finished (LmResolver *resolver, LmResolverResult result)
+{
+    LmStaticResolverPriv *priv = GET_PRIV (resolver);
+
+    g_signal_emit_by_name (resolver, "finished", result, priv->sa);
+
+    static_resolver_cleanup (resolver);
+
+    /* The initial reference is owned by LmResolver itself */
+    g_object_unref (resolver);
+}
+
+static gboolean
+static_resolver_idle_cb (LmResolver *resolver)
+{
+    LmStaticResolverPriv *priv = GET_PRIV (resolver);
+
+    priv->idle_source = NULL;
+
+    static_resolver_finished (resolver, LM_RESOLVER_RESULT_OK);
+
+    return FALSE;
+}
+
+static void
+static_resolver_cancel (LmResolver *resolver)
+{
+    g_return_if_fail (LM_IS_STATIC_RESOLVER (resolver));
+
+    static_resolver_finished (resolver, LM_RESOLVER_RESULT_CANCELLED);
+}
+
+/* -- Host map -- */
+
+gboolean
+lm_static_resolver_add_host (const gchar *host, const gchar *address)
+{
+    guchar           addr[16];
+    int              family;
+    struct addrinfo *ai;
+    struct addrinfo *list;
+    gchar           *key;
+
+    g_return_val_if_fail (host != NULL, FALSE);
+    g_return_val_if_fail (address != NULL, FALSE);
+
+    if (inet_pton (AF_INET, address, addr) == 1) {
+        family = AF_INET;
+    } else if (inet_pton (AF_INET6, address, addr) == 1) {
+        family = AF_INET6;
+    } else {
+        g_warning ("Invalid address for %s: %s", host, address);
+        return FALSE;
+    }
+
+    ai  = _lm_resolver_new_addrinfo (family, addr);
+    key = g_ascii_strdown (host, -1);
+
+    G_LOCK (hosts);
+
+    if (!hosts) {
+        hosts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                       (GDestroyNotify) lm_resolver_freeaddrinfo);
+    }
+
+    list = g_hash_table_lookup (hosts, key);
+    if (list) {
+        while (list->ai_next) {
+            list = list->ai_next;
+        }
+        list->ai_next = ai;
+        g_free (key);
+    } else {
+        g_hash_table_insert (hosts, key, ai);
+    }
+
+    G_UNLOCK (hosts);
+
+    return TRUE;
+}
+
+gboolean
+lm_static_resolver_load_hosts (const gchar *path)
+{
+    gchar   *contents;
+    gchar  **lines;
+    GError  *error = NULL;
+    guint    i;
+
+    g_return_val_if_fail (path != NULL, FALSE);
+
+    if (!g_file_get_contents (path, &contents, NULL, &error)) {
+        g_warning ("Failed to read '%s': %s", path, error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+
+    lines = g_strsplit (contents, "\n", -1);
+    g_free (contents);
+
+    /* address name [alias ...] # comment */
+    for (i = 0; lines[i]; i++) {
+        gchar  *comment;
+        gchar **fields;
+        gchar  *address = NULL;
+        guint   j;
+
+        comment = strchr (lines[i], '#');
+        if (comment) {
+            *comment = '\0';
+        }
+
+        fields = g_strsplit_set (lines[i], " \t\r", -1);
+
+        for (j = 0; fields[j]; j++) {
+            if (*fields[j] == '\0') {
+                continue;
+            }
+
+            if (!address) {
+                address = fields[j];
+            } else if (!lm_static_resolver_add_host (fields[j], address)) {
+                break;
+            }
+        }
+
+        g_strfreev (fields);
+    }
+
+    g_strfreev (lines);
+
+    return TRUE;
+}
+
+void
+lm_static_resolver_clear (void)
+{
+    G_LOCK (hosts);
+    if (hosts) {
+        g_hash_table_remove_all (hosts);
+    }
+    G_UNLOCK (hosts);
+}
+
+gboolean
+lm_static_resolver_resolve (LmSocketAddress *sa)
+{
+    struct addrinfo *results = NULL;
+    gchar           *key;
+
+    g_return_val_if_fail (sa != NULL, FALSE);
+
+    G_LOCK (hosts);
+
+    if (hosts && g_hash_table_size (hosts) > 0) {
+        key = g_ascii_strdown (lm_socket_address_get_host (sa), -1);
+        results = _lm_resolver_copy_addrinfo (g_hash_table_lookup (hosts, 
+                                                                   key));
+        g_free (key);
+    }
+
+    G_UNLOCK (hosts);
+
+    if (!results) {
+        return FALSE;
+    }
+
+    lm_socket_address_set_results (sa, results);
+
+    return TRUE;
+}
+
+gboolean
+_lm_static_resolver_lookup_host (GMainContext    *context,
+                                 LmSocketAddress *sa,
+                                 GCallback        finished_cb,
+                                 gpointer         user_data,
+                                 LmResolver     **resolver)
+{
+    LmStaticResolverPriv *priv;
+
+    *resolver = NULL;
+
+    if (!lm_static_resolver_resolve (sa)) {
+        return FALSE;
+    }
+
+    *resolver = g_object_new (LM_TYPE_STATIC_RESOLVER, 
+                              "context", context, 
+                              NULL);
+
+    priv = GET_PRIV (*resolver);
+    priv->sa = lm_socket_address_ref (sa);
+
+    if (finished_cb) {
+        g_signal_connect (*resolver, "finished", finished_cb, user_data);
+        /* Drops the only reference */
+        static_resolver_finished (*resolver, LM_RESOLVER_RESULT_OK);
+        *resolver = NULL;
+    } else {
+        priv->idle_source = 
+            lm_misc_add_idle (context,
+                              (GSourceFunc) static_resolver_idle_cb,
+                              *resolver);
+    }
+
+    return TRUE;
+}
+
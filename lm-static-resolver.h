@@ -0,0 +1,77 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_STATIC_RESOLVER_H__
+#define __LM_STATIC_RESOLVER_H__
+
+#include <glib-object.h>
+
+#include "lm-resolver.h" 
+
+G_BEGIN_DECLS
+
+#define LM_TYPE_STATIC_RESOLVER            (lm_static_resolver_get_type ())
+#define LM_STATIC_RESOLVER(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), LM_TYPE_STATIC_RESOLVER, LmStaticResolver))
+#define LM_STATIC_RESOLVER_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), LM_TYPE_STATIC_RESOLVER, LmStaticResolverClass))
+#define LM_IS_STATIC_RESOLVER(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), LM_TYPE_STATIC_RESOLVER))
+#define LM_IS_STATIC_RESOLVER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), LM_TYPE_STATIC_RESOLVER))
+#define LM_STATIC_RESOLVER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), LM_TYPE_STATIC_RESOLVER, LmStaticResolverClass))
+
+typedef struct LmStaticResolver      LmStaticResolver;
+typedef struct LmStaticResolverClass LmStaticResolverClass;
+
+struct LmStaticResolver {
+    LmResolver parent;
+};
+
+struct LmStaticResolverClass {
+    LmResolverClass parent_class;
+};
+
+GType      lm_static_resolver_get_type    (void);
+
+/* Pins host to an IPv4 or IPv6 address, may be called more than once
+ * per host. Pinned hosts are answered from memory before the cache and
+ * the backends are asked, other hosts are looked up as usual.
+ */
+gboolean   lm_static_resolver_add_host    (const gchar     *host,
+                                           const gchar     *address);
+
+/* Adds the entries of a file in /etc/hosts format */
+gboolean   lm_static_resolver_load_hosts  (const gchar     *path);
+void       lm_static_resolver_clear       (void);
+
+/* Sets the results of sa right away if its host is pinned */
+gboolean   lm_static_resolver_resolve     (LmSocketAddress *sa);
+
+/* Used by LmResolver, FALSE if the host isn't pinned. With finished_cb
+ * it is connected and the lookup finishes before this returns, resolver
+ * is set to NULL then. Otherwise resolver is set and "finished" comes
+ * from an idle callback as with other backends.
+ */
+gboolean   _lm_static_resolver_lookup_host (GMainContext    *context,
+                                            LmSocketAddress *sa,
+                                            GCallback        finished_cb,
+                                            gpointer         user_data,
+                                            LmResolver     **resolver);
+
+G_END_DECLS
+
+#endif /* __LM_STATIC_RESOLVER_H__ */
@@ -0,0 +1,404 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Runs getaddrinfo() and res_query() on a shared, bounded GThreadPool so
+ * that lookups never block the main loop. Results are delivered on the
+ * context of the resolver.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+/* Needed on Mac OS X */
+#if HAVE_ARPA_NAMESER_COMPAT_H
+#include <arpa/nameser_compat.h>
+#endif
+
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include "lm-marshal.h"
+#include "lm-misc.h"
+
+#include "lm-threaded-resolver.h"
+
+#define SRV_LEN             8192
+#define DEFAULT_MAX_THREADS 4
+
+#define GET_PRIV(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), LM_TYPE_THREADED_RESOLVER, LmThreadedResolverPriv))
+
+/* A lookup handed to the pool. The worker only touches the job, the
+ * resolver is used again once the job is back on the resolver context.
+ */
+typedef struct {
+    LmThreadedResolver *resolver;
+    GMainContext       *context;
+    /* Delivers the result instead of context when set */
+    LmReactor          *reactor;
+
+    gchar              *host;
+    gchar              *srv;
+
+    volatile gint       cancelled;
+
+    LmResolverResult    result;
+    LmResolverError     error;
+    struct addrinfo    *ans;
+    gchar              *new_server;
+    guint               new_port;
+} ThreadedJob;
+
+typedef struct LmThreadedResolverPriv LmThreadedResolverPriv;
+struct LmThreadedResolverPriv {
+    ThreadedJob     *job;
+    LmReactor       *reactor;
+
+    LmSocketAddress *sa;
+};
+
+static void     threaded_resolver_finalize    (GObject          *object);
+static void     threaded_resolver_lookup_host (LmResolver       *resolver,
+                                               LmSocketAddress  *sa);
+static void     threaded_resolver_lookup_srv  (LmResolver       *resolver,
+                                               const gchar      *srv);
+static void     threaded_resolver_cancel      (LmResolver       *resolver);
+
+G_LOCK_DEFINE_STATIC (pool);
+static GThreadPool *pool;
+static guint        max_threads = DEFAULT_MAX_THREADS;
+
+G_DEFINE_TYPE (LmThreadedResolver, lm_threaded_resolver, LM_TYPE_RESOLVER)
+
+static void
+lm_threaded_resolver_class_init (LmThreadedResolverClass *class)
+{
+    GObjectClass    *object_class   = G_OBJECT_CLASS (class);
+    LmResolverClass *resolver_class = LM_RESOLVER_CLASS (class);
+
+    object_class->finalize = threaded_resolver_finalize;
+
+    resolver_class->lookup_host = threaded_resolver_lookup_host;
+    resolver_class->lookup_srv  = threaded_resolver_lookup_srv;
+    resolver_class->cancel      = threaded_resolver_cancel;
+    
+    g_type_class_add_private (object_class, 
+                              sizeof (LmThreadedResolverPriv));
+}
+
+static void
+lm_threaded_resolver_init (LmThreadedResolver *threaded_resolver)
+{
+    LmThreadedResolverPriv *priv;
+
+    priv = GET_PRIV (threaded_resolver);
+}
+
+static void
+threaded_resolver_finalize (GObject *object)
+{
+    LmThreadedResolverPriv *priv;
+
+    priv = GET_PRIV (object);
+
+    if (priv->sa) {
+        lm_socket_address_unref (priv->sa);
+    }
+
+    if (priv->reactor) {
+        g_object_unref (priv->reactor);
+    }
+
+    (G_OBJECT_CLASS (lm_threaded_resolver_parent_class)->finalize) (object);
+}
+
+static void
+threaded_job_free (ThreadedJob *job)
+{
+    if (job->ans) {
+        lm_resolver_freeaddrinfo (job->ans);
+    }
+
+    if (job->reactor) {
+        g_object_unref (job->reactor);
+    }
+
+    g_object_unref (job->resolver);
+    g_free (job->host);
+    g_free (job->srv);
+    g_free (job->new_server);
+    g_free (job);
+}
+
+static void
+threaded_job_lookup_host (ThreadedJob *job)
+{
+    struct addrinfo  req;
+    struct addrinfo *ans = NULL;
+    int              err;
+
+    memset (&req, 0, sizeof(req));
+    req.ai_family   = AF_UNSPEC;
+    req.ai_socktype = SOCK_STREAM;
+    req.ai_protocol = IPPROTO_TCP;
+
+    err = getaddrinfo (job->host, NULL, &req, &ans);
+    if (err == 0 && ans) {
+        /* Can't be freed by asyncns_freeaddrinfo() as it is */
+        job->ans = _lm_resolver_copy_addrinfo (ans);
+    }
+
+    if (ans) {
+        freeaddrinfo (ans);
+    }
+
+    if (!job->ans) {
+        g_warning ("Error while looking up '%s': %d\n", job->host, err);
+        job->result = LM_RESOLVER_RESULT_FAILED;
+        job->error  = _lm_resolver_error_from_gai (err);
+    } else {
+        job->result = LM_RESOLVER_RESULT_OK;
+    }
+}
+
+static void
+threaded_job_lookup_srv (ThreadedJob *job)
+{
+    unsigned char srv_ans[SRV_LEN];
+    int           len;
+
+    /* The resolver state is per thread */
+    res_init ();
+
+    len = res_query (job->srv, C_IN, T_SRV, srv_ans, SRV_LEN);
+
+    if (len <= 0 ||
+        !_lm_resolver_parse_srv_response (srv_ans, len,
+                                          &job->new_server, &job->new_port)) {
+        g_print ("Error while parsing srv response in %s\n", 
+                 G_STRFUNC);
+        job->result = LM_RESOLVER_RESULT_FAILED;
+        job->error  = len <= 0 ? _lm_resolver_error_from_herrno (h_errno) :
+            LM_RESOLVER_ERROR_NO_DATA;
+    } else {
+        job->result = LM_RESOLVER_RESULT_OK;
+    }
+}
+
+static void
+threaded_resolver_finished (LmThreadedResolver *resolver, 
+                            LmResolverResult    result)
+{
+    LmThreadedResolverPriv *priv = GET_PRIV (resolver);
+
+    priv->job = NULL;
+
+    g_signal_emit_by_name (resolver, "finished", result, priv->sa);
+
+    /* The resolver itself owns the initial reference */
+    g_object_unref (resolver);
+}
+
+/* Back on the resolver context or reactor */
+static gboolean
+threaded_resolver_job_done (ThreadedJob *job)
+{
+    LmThreadedResolverPriv *priv;
+
+    if (g_atomic_int_get (&job->cancelled)) {
+        /* Already reported as cancelled */
+        threaded_job_free (job);
+        return FALSE;
+    }
+
+    priv = GET_PRIV (job->resolver);
+
+    if (job->result == LM_RESOLVER_RESULT_OK) {
+        if (job->srv) {
+            priv->sa = lm_socket_address_new (job->new_server, job->new_port);
+        } else {
+            lm_socket_address_set_results (priv->sa, job->ans);
+            job->ans = NULL;
+        }
+    } else {
+        _lm_resolver_set_error (LM_RESOLVER (job->resolver), job->error);
+    }
+
+    threaded_resolver_finished (job->resolver, job->result);
+
+    threaded_job_free (job);
+
+    return FALSE;
+}
+
+static void
+threaded_resolver_job_return (ThreadedJob *job)
+{
+    if (job->reactor) {
+        lm_reactor_add_defer (job->reactor,
+                              (GSourceFunc) threaded_resolver_job_done,
+                              job);
+    } else {
+        lm_misc_add_idle (job->context, 
+                          (GSourceFunc) threaded_resolver_job_done,
+                          job);
+    }
+}
+
+static void
+threaded_resolver_run (ThreadedJob *job, gpointer user_data)
+{
+    /* Skip lookups cancelled while waiting in the queue */
+    if (!g_atomic_int_get (&job->cancelled)) {
+        if (job->srv) {
+            threaded_job_lookup_srv (job);
+        } else {
+            threaded_job_lookup_host (job);
+        }
+    }
+
+    threaded_resolver_job_return (job);
+}
+
+static void
+threaded_resolver_push (LmThreadedResolver *resolver, 
+                        const gchar        *host,
+                        const gchar        *srv)
+{
+    LmThreadedResolverPriv *priv = GET_PRIV (resolver);
+    ThreadedJob            *job;
+    GError                 *error = NULL;
+
+    job = g_new0 (ThreadedJob, 1);
+    job->resolver = g_object_ref (resolver);
+    job->host     = g_strdup (host);
+    job->srv      = g_strdup (srv);
+
+    g_object_get (resolver, "context", &job->context, NULL);
+    if (priv->reactor) {
+        job->reactor = g_object_ref (priv->reactor);
+    }
+
+    priv->job = job;
+
+    G_LOCK (pool);
+    if (!pool) {
+        pool = g_thread_pool_new ((GFunc) threaded_resolver_run, NULL,
+                                  max_threads, FALSE, &error);
+    }
+    if (pool) {
+        g_thread_pool_push (pool, job, &error);
+    }
+    G_UNLOCK (pool);
+
+    if (error) {
+        g_warning ("Failed to queue lookup: %s\n", error->message);
+        g_error_free (error);
+
+        /* Report the failure from the context like any other result */
+        job->result = LM_RESOLVER_RESULT_FAILED;
+        threaded_resolver_job_return (job);
+    }
+}
+
+static void
+threaded_resolver_lookup_host (LmResolver *resolver, LmSocketAddress *sa)
+{
+    LmThreadedResolverPriv *priv;
+
+    g_return_if_fail (LM_IS_THREADED_RESOLVER (resolver));
+    g_return_if_fail (sa != NULL);
+
+    priv = GET_PRIV (resolver);
+
+    priv->sa = lm_socket_address_ref (sa);
+
+    threaded_resolver_push (LM_THREADED_RESOLVER (resolver),
+                            lm_socket_address_get_host (sa), NULL);
+}
+
+static void
+threaded_resolver_lookup_srv (LmResolver   *resolver,
+                              const gchar  *srv)
+{
+    g_return_if_fail (LM_IS_THREADED_RESOLVER (resolver));
+    g_return_if_fail (srv != NULL);
+
+    threaded_resolver_push (LM_THREADED_RESOLVER (resolver), NULL, srv);
+}
+
+static void
+threaded_resolver_cancel (LmResolver *resolver)
+{
+    LmThreadedResolverPriv *priv;
+
+    g_return_if_fail (LM_IS_THREADED_RESOLVER (resolver));
+
+    priv = GET_PRIV (resolver);
+
+    if (!priv->job) {
+        return;
+    }
+
+    /* A running getaddrinfo() can't be interrupted, its result is
+     * dropped when the job comes back.
+     */
+    g_atomic_int_set (&priv->job->cancelled, TRUE);
+
+    threaded_resolver_finished (LM_THREADED_RESOLVER (resolver),
+                                LM_RESOLVER_RESULT_CANCELLED);
+}
+
+LmResolver *
+_lm_threaded_resolver_lookup_host (LmReactor *reactor, LmSocketAddress *sa)
+{
+    LmResolver             *resolver;
+    LmThreadedResolverPriv *priv;
+
+    g_return_val_if_fail (LM_IS_REACTOR (reactor), NULL);
+    g_return_val_if_fail (sa != NULL, NULL);
+
+    resolver = g_object_new (LM_TYPE_THREADED_RESOLVER, NULL);
+
+    priv = GET_PRIV (resolver);
+    priv->reactor = g_object_ref (reactor);
+
+    threaded_resolver_lookup_host (resolver, sa);
+
+    return resolver;
+}
+
+void
+lm_threaded_resolver_set_max_threads (guint threads)
+{
+    g_return_if_fail (threads > 0);
+
+    G_LOCK (pool);
+    max_threads = threads;
+    if (pool) {
+        g_thread_pool_set_max_threads (pool, max_threads, NULL);
+    }
+    G_UNLOCK (pool);
+}
@@ -0,0 +1,64 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_THREADED_RESOLVER_H__
+#define __LM_THREADED_RESOLVER_H__
+
+#include <glib-object.h>
+
+#include "lm-reactor.h"
+#include "lm-resolver.h" 
+
+G_BEGIN_DECLS
+
+#define LM_TYPE_THREADED_RESOLVER            (lm_threaded_resolver_get_type ())
+#define LM_THREADED_RESOLVER(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), LM_TYPE_THREADED_RESOLVER, LmThreadedResolver))
+#define LM_THREADED_RESOLVER_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), LM_TYPE_THREADED_RESOLVER, LmThreadedResolverClass))
+#define LM_IS_THREADED_RESOLVER(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), LM_TYPE_THREADED_RESOLVER))
+#define LM_IS_THREADED_RESOLVER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), LM_TYPE_THREADED_RESOLVER))
+#define LM_THREADED_RESOLVER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), LM_TYPE_THREADED_RESOLVER, LmThreadedResolverClass))
+
+typedef struct LmThreadedResolver      LmThreadedResolver;
+typedef struct LmThreadedResolverClass LmThreadedResolverClass;
+
+struct LmThreadedResolver {
+    LmResolver parent;
+};
+
+struct LmThreadedResolverClass {
+    LmResolverClass parent_class;
+};
+
+GType    lm_threaded_resolver_get_type        (void);
+
+/* Number of lookups run at the same time by the shared thread pool,
+ * further lookups are queued. Defaults to 4.
+ */
+void     lm_threaded_resolver_set_max_threads (guint max_threads);
+
+/* For channels on a reactor other than a GMainContext. "finished" is
+ * emitted from a defer on reactor, the resolver cache is not used.
+ */
+LmResolver * _lm_threaded_resolver_lookup_host (LmReactor       *reactor,
+                                                LmSocketAddress *sa);
+
+G_END_DECLS
+
+#endif /* __LM_THREADED_RESOLVER_H__ */
@@ -0,0 +1,62 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Compiles a PEM CA bundle into a trust store that LmGnuTLSChannel can map
+ * instead of parsing the bundle in every process.
+ *
+ * Usage: lm-trust-store-compile <ca-bundle.pem> <trust-store>
+ */
+
+#include <glib.h>
+#include <gnutls/gnutls.h>
+
+#include "lm-trust-store.h"
+
+int
+main (int argc, char **argv)
+{
+    LmTrustStore *store;
+
+    if (argc != 3) {
+        g_printerr ("Usage: %s <ca-bundle.pem> <trust-store>\n", argv[0]);
+        return 1;
+    }
+
+    gnutls_global_init ();
+
+    if (!lm_trust_store_compile (argv[1], argv[2])) {
+        return 1;
+    }
+
+    store = lm_trust_store_open (argv[2]);
+    if (!store) {
+        return 1;
+    }
+
+    g_print ("Wrote %u certificates to %s\n",
+             lm_trust_store_get_size (store), argv[2]);
+
+    lm_trust_store_unref (store);
+    gnutls_global_deinit ();
+
+    return 0;
+}
+
@@ -0,0 +1,330 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lm-trust-store.h"
+
+/* File layout, all integers little endian:
+ *
+ *   header     magic, number of certificates
+ *   index      one entry per certificate, sorted by subject hash
+ *   blobs      the DER encoded certificates
+ */
+#define TRUST_STORE_MAGIC "LMTRUST1"
+
+typedef struct {
+    gchar   magic[8];
+    guint32 n_certs;
+    guint32 reserved;
+} TrustStoreHeader;
+
+typedef struct {
+    guint32 subject_hash;
+    guint32 offset;
+    guint32 length;
+} TrustStoreEntry;
+
+struct LmTrustStore {
+    GMappedFile           *file;
+    const TrustStoreEntry *index;
+    guint                  n_certs;
+
+    gint                   ref_count;
+};
+
+static guint32
+trust_store_hash_dn (const gnutls_datum_t *dn)
+{
+    guint32 hash = 2166136261U;
+    guint   i;
+
+    /* FNV-1a */
+    for (i = 0; i < dn->size; i++) {
+        hash ^= dn->data[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+LmTrustStore *
+lm_trust_store_open (const gchar *filename)
+{
+    LmTrustStore           *store;
+    GMappedFile            *file;
+    const TrustStoreHeader *header;
+    const gchar            *contents;
+    gsize                   length;
+    guint                   n_certs;
+    guint                   i;
+
+    file = g_mapped_file_new (filename, FALSE, NULL);
+    if (!file) {
+        return NULL;
+    }
+
+    contents = g_mapped_file_get_contents (file);
+    length   = g_mapped_file_get_length (file);
+    header   = (const TrustStoreHeader *) contents;
+
+    if (length < sizeof (TrustStoreHeader) ||
+        memcmp (header->magic, TRUST_STORE_MAGIC, sizeof (header->magic)) != 0) {
+        g_warning ("'%s' is not a trust store", filename);
+        g_mapped_file_unref (file);
+        return NULL;
+    }
+
+    n_certs = GUINT32_FROM_LE (header->n_certs);
+    if (n_certs > (length - sizeof (TrustStoreHeader)) / sizeof (TrustStoreEntry)) {
+        g_warning ("Truncated trust store '%s'", filename);
+        g_mapped_file_unref (file);
+        return NULL;
+    }
+
+    store = g_slice_new0 (LmTrustStore);
+    store->file    = file;
+    store->index   = (const TrustStoreEntry *) (contents + sizeof (TrustStoreHeader));
+    store->n_certs = n_certs;
+    store->ref_count = 1;
+
+    for (i = 0; i < n_certs; i++) {
+        guint32 offset = GUINT32_FROM_LE (store->index[i].offset);
+        guint32 size   = GUINT32_FROM_LE (store->index[i].length);
+
+        if (offset > length || size > length - offset) {
+            g_warning ("Truncated trust store '%s'", filename);
+            lm_trust_store_unref (store);
+            return NULL;
+        }
+    }
+
+    return store;
+}
+
+LmTrustStore *
+lm_trust_store_ref (LmTrustStore *store)
+{
+    g_atomic_int_inc (&store->ref_count);
+
+    return store;
+}
+
+void
+lm_trust_store_unref (LmTrustStore *store)
+{
+    if (!g_atomic_int_dec_and_test (&store->ref_count)) {
+        return;
+    }
+
+    g_mapped_file_unref (store->file);
+
+    g_slice_free (LmTrustStore, store);
+}
+
+guint
+lm_trust_store_get_size (LmTrustStore *store)
+{
+    return store->n_certs;
+}
+
+static gnutls_x509_crt_t
+trust_store_parse_cert (LmTrustStore *store, guint i)
+{
+    gnutls_x509_crt_t cert;
+    gnutls_datum_t    der;
+
+    der.data = (guchar *) g_mapped_file_get_contents (store->file) +
+        GUINT32_FROM_LE (store->index[i].offset);
+    der.size = GUINT32_FROM_LE (store->index[i].length);
+
+    if (gnutls_x509_crt_init (&cert) != 0) {
+        return NULL;
+    }
+
+    if (gnutls_x509_crt_import (cert, &der, GNUTLS_X509_FMT_DER) != 0) {
+        gnutls_x509_crt_deinit (cert);
+        return NULL;
+    }
+
+    return cert;
+}
+
+gboolean
+lm_trust_store_add_issuers (LmTrustStore             *store,
+                            gnutls_x509_trust_list_t  list,
+                            gnutls_x509_crt_t         cert)
+{
+    gnutls_datum_t issuer;
+    guint32        hash;
+    guint          low, high;
+    gboolean       found = FALSE;
+
+    if (gnutls_x509_crt_get_raw_issuer_dn (cert, &issuer) != 0) {
+        return FALSE;
+    }
+
+    hash = trust_store_hash_dn (&issuer);
+    gnutls_free (issuer.data);
+
+    /* Find the first entry with a matching hash */
+    low  = 0;
+    high = store->n_certs;
+    while (low < high) {
+        guint mid = low + (high - low) / 2;
+
+        if (GUINT32_FROM_LE (store->index[mid].subject_hash) < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    for (; low < store->n_certs; low++) {
+        gnutls_x509_crt_t ca;
+
+        if (GUINT32_FROM_LE (store->index[low].subject_hash) != hash) {
+            break;
+        }
+
+        /* Hash collisions are sorted out by the chain verification */
+        ca = trust_store_parse_cert (store, low);
+        if (!ca) {
+            continue;
+        }
+
+        if (gnutls_x509_trust_list_add_cas (list, &ca, 1, 0) == 1) {
+            found = TRUE;
+        } else {
+            gnutls_x509_crt_deinit (ca);
+        }
+    }
+
+    return found;
+}
+
+static gint
+trust_store_entry_compare (gconstpointer a, gconstpointer b)
+{
+    const TrustStoreEntry *entry_a = a;
+    const TrustStoreEntry *entry_b = b;
+
+    if (entry_a->subject_hash < entry_b->subject_hash) {
+        return -1;
+    }
+
+    return entry_a->subject_hash > entry_b->subject_hash;
+}
+
+gboolean
+lm_trust_store_compile (const gchar *pem_file, const gchar *filename)
+{
+    gnutls_x509_crt_t *certs;
+    unsigned int       n_certs;
+    gnutls_datum_t     pem;
+    gchar             *contents;
+    gsize              length;
+    TrustStoreHeader   header;
+    TrustStoreEntry   *index;
+    GByteArray        *blobs;
+    GByteArray        *out;
+    GError            *error = NULL;
+    gboolean           ret;
+    guint              i;
+    int                rc;
+
+    if (!g_file_get_contents (pem_file, &contents, &length, &error)) {
+        g_warning ("Failed to read '%s': %s", pem_file, error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+
+    pem.data = (guchar *) contents;
+    pem.size = length;
+
+    rc = gnutls_x509_crt_list_import2 (&certs, &n_certs, &pem,
+                                       GNUTLS_X509_FMT_PEM, 0);
+    g_free (contents);
+
+    if (rc < 0) {
+        g_warning ("Failed to parse '%s': %s", pem_file, gnutls_strerror (rc));
+        return FALSE;
+    }
+
+    index = g_new0 (TrustStoreEntry, n_certs);
+    blobs = g_byte_array_new ();
+
+    for (i = 0; i < n_certs; i++) {
+        gnutls_datum_t subject;
+        gnutls_datum_t der;
+
+        if (gnutls_x509_crt_get_raw_dn (certs[i], &subject) == 0) {
+            index[i].subject_hash = trust_store_hash_dn (&subject);
+            gnutls_free (subject.data);
+        }
+
+        if (gnutls_x509_crt_export2 (certs[i], GNUTLS_X509_FMT_DER, &der) == 0) {
+            index[i].offset = blobs->len;
+            index[i].length = der.size;
+            g_byte_array_append (blobs, der.data, der.size);
+            gnutls_free (der.data);
+        }
+
+        gnutls_x509_crt_deinit (certs[i]);
+    }
+    gnutls_free (certs);
+
+    qsort (index, n_certs, sizeof (TrustStoreEntry), trust_store_entry_compare);
+
+    /* Blob offsets are relative to the start of the file */
+    for (i = 0; i < n_certs; i++) {
+        guint32 offset = index[i].offset + sizeof (TrustStoreHeader) +
+            n_certs * sizeof (TrustStoreEntry);
+
+        index[i].subject_hash = GUINT32_TO_LE (index[i].subject_hash);
+        index[i].offset       = GUINT32_TO_LE (offset);
+        index[i].length       = GUINT32_TO_LE (index[i].length);
+    }
+
+    memcpy (header.magic, TRUST_STORE_MAGIC, sizeof (header.magic));
+    header.n_certs  = GUINT32_TO_LE (n_certs);
+    header.reserved = 0;
+
+    out = g_byte_array_new ();
+    g_byte_array_append (out, (guint8 *) &header, sizeof (header));
+    g_byte_array_append (out, (guint8 *) index, n_certs * sizeof (TrustStoreEntry));
+    g_byte_array_append (out, blobs->data, blobs->len);
+
+    ret = g_file_set_contents (filename, (gchar *) out->data, out->len, &error);
+    if (!ret) {
+        g_warning ("Failed to write '%s': %s", filename, error->message);
+        g_error_free (error);
+    }
+
+    g_byte_array_free (out, TRUE);
+    g_byte_array_free (blobs, TRUE);
+    g_free (index);
+
+    return ret;
+}
+
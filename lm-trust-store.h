@@ -0,0 +1,57 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_TRUST_STORE_H__
+#define __LM_TRUST_STORE_H__
+
+#include <glib.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+
+G_BEGIN_DECLS
+
+/* A precompiled set of trusted CA certificates. The file holds the DER
+ * encoded certificates indexed by subject and is mapped read-only, a
+ * certificate is only parsed when it is needed to verify a chain.
+ */
+typedef struct LmTrustStore LmTrustStore;
+
+LmTrustStore * lm_trust_store_open        (const gchar              *filename);
+LmTrustStore * lm_trust_store_ref         (LmTrustStore             *store);
+void           lm_trust_store_unref       (LmTrustStore             *store);
+
+guint          lm_trust_store_get_size    (LmTrustStore             *store);
+
+/* Adds the certificates whose subject matches the issuer of cert to list.
+ * They are parsed for each call and owned by the list, so nothing is shared
+ * between threads. Free the list with gnutls_x509_trust_list_deinit (list, 1).
+ */
+gboolean       lm_trust_store_add_issuers (LmTrustStore             *store,
+                                           gnutls_x509_trust_list_t  list,
+                                           gnutls_x509_crt_t         cert);
+
+/* Used by lm-trust-store-compile */
+gboolean       lm_trust_store_compile     (const gchar              *pem_file,
+                                           const gchar              *filename);
+
+G_END_DECLS
+
+#endif /* __LM_TRUST_STORE_H__ */
+
@@ -0,0 +1,1183 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lm-gmain-reactor.h"
+#include "lm-uring.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+/* Multishot recv and provided buffer rings came in Linux 6.0 and 5.19 */
+#ifdef IORING_RECV_MULTISHOT
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES         256
+#define URING_RECV_GROUP      0
+#define URING_RECV_BUFS       256     /* Power of two */
+#define URING_RECV_BUF_SIZE   4096
+#define URING_SEND_BUFS       128
+#define URING_SEND_BUF_SIZE   8192
+/* Send buffers one socket may hold */
+#define URING_SEND_PER_SOCKET 8
+
+/* Kept in the low bits of the user_data of each operation */
+enum {
+    OP_CONNECT = 1,
+    OP_RECV,
+    OP_SEND,
+    OP_CANCEL
+};
+#define OP_MASK 7
+
+struct LmUring {
+    LmReactor               *reactor;
+    int                      fd;
+
+    /* Both rings share one mapping */
+    gpointer                 ring;
+    gsize                    ring_size;
+
+    guint32                 *sq_head;
+    guint32                 *sq_tail;
+    guint32                  sq_mask;
+    guint32                  sq_entries;
+    guint32                 *sq_array;
+    struct io_uring_sqe     *sqes;
+    guint32                  sq_local_tail;
+    guint                    to_submit;
+
+    /* Operations the kernel hasn't completed yet */
+    guint                    n_inflight;
+
+    guint32                 *cq_head;
+    guint32                 *cq_tail;
+    guint32                  cq_mask;
+    struct io_uring_cqe     *cqes;
+
+    LmReactorSource         *watch;
+    LmReactorSource         *flush_source;
+
+    /* Provided to the kernel for recv */
+    struct io_uring_buf_ring *recv_ring;
+    guchar                  *recv_bufs;
+    guint16                  recv_tail;
+    gboolean                 no_multishot;
+    /* LmUringSocket waiting for recv buffers to come back */
+    GList                   *starved;
+
+    /* Registered as fixed buffer 0 */
+    guchar                  *send_bufs;
+    guint16                  send_free[URING_SEND_BUFS];
+    guint                    n_send_free;
+    /* LmUringSocket that got G_IO_STATUS_AGAIN with nothing queued, they
+     * get "writeable" when buffers are freed by the others
+     */
+    GList                   *send_waiting;
+    LmReactorSource         *wake_source;
+
+    /* Closed LmUringSocket with operations left */
+    GList                   *closing;
+};
+
+typedef struct {
+    guint16 bid;
+    guint16 offset;
+    guint16 len;
+} RecvChunk;
+
+typedef struct {
+    guint16 index;
+    guint16 offset;
+    guint16 len;
+} SendChunk;
+
+struct LmUringSocket {
+    LmUring                  *uring;
+    LmArena                  *arena;
+    int                       fd;
+
+    const LmUringSocketFuncs *funcs;
+    gpointer                  user_data;
+    gboolean                  closed;
+
+    /* Operations in flight, plus one while calling out */
+    guint                     n_pending;
+
+    struct sockaddr_storage   addr;
+    gboolean                  connecting;
+
+    gboolean                  receiving;
+    gboolean                  starved;
+    GQueue                    recv_queue;
+    gboolean                  eof;
+    int                       error;
+
+    /* The head is in flight while sending */
+    GQueue                    send_queue;
+    gboolean                  sending;
+    gboolean                  send_waiting;
+
+    LmReactorSource          *dispatch_source;
+};
+
+G_LOCK_DEFINE_STATIC (uring);
+static gboolean    uring_unavailable = FALSE;
+/* GMainContext to LmUring */
+static GHashTable *context_rings;
+
+static void uring_socket_arm_recv (LmUringSocket *us);
+static void uring_socket_maybe_free (LmUringSocket *us);
+
+static int
+uring_setup (guint entries, struct io_uring_params *params)
+{
+    return (int) syscall (__NR_io_uring_setup, entries, params);
+}
+
+static int
+uring_enter (int fd, guint to_submit, guint min_complete, guint flags)
+{
+    return (int) syscall (__NR_io_uring_enter, fd, to_submit, min_complete,
+                          flags, NULL, 0);
+}
+
+static int
+uring_register (int fd, guint opcode, gpointer arg, guint nr_args)
+{
+    return (int) syscall (__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+uring_flush (LmUring *uring)
+{
+    int res;
+
+    if (uring->flush_source) {
+        lm_reactor_remove (uring->reactor, uring->flush_source);
+        uring->flush_source = NULL;
+    }
+
+    if (uring->to_submit == 0) {
+        return;
+    }
+
+    __atomic_store_n (uring->sq_tail, uring->sq_local_tail, __ATOMIC_RELEASE);
+
+    res = uring_enter (uring->fd, uring->to_submit, 0, 0);
+    if (res < 0) {
+        g_warning ("Failed to submit to io_uring: %s", g_strerror (errno));
+        return;
+    }
+
+    uring->to_submit -= MIN ((guint) res, uring->to_submit);
+}
+
+static gboolean
+uring_flush_cb (LmUring *uring)
+{
+    uring->flush_source = NULL;
+
+    uring_flush (uring);
+
+    return FALSE;
+}
+
+/* Everything queued in one loop iteration goes in with one syscall. us is
+ * NULL for operations whose completion is ignored.
+ */
+static struct io_uring_sqe *
+uring_get_sqe (LmUring *uring, LmUringSocket *us, guint op)
+{
+    struct io_uring_sqe *sqe;
+    guint32              head;
+    guint32              index;
+
+    head = __atomic_load_n (uring->sq_head, __ATOMIC_ACQUIRE);
+    if (uring->sq_local_tail - head >= uring->sq_entries) {
+        uring_flush (uring);
+
+        head = __atomic_load_n (uring->sq_head, __ATOMIC_ACQUIRE);
+        if (uring->sq_local_tail - head >= uring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    index = uring->sq_local_tail & uring->sq_mask;
+    sqe = &uring->sqes[index];
+    memset (sqe, 0, sizeof (struct io_uring_sqe));
+    sqe->user_data = (guint64) (gsize) us | op;
+
+    uring->sq_array[index] = index;
+    uring->sq_local_tail++;
+    uring->to_submit++;
+
+    if (us) {
+        us->n_pending++;
+        uring->n_inflight++;
+    }
+
+    if (!uring->flush_source) {
+        uring->flush_source = lm_reactor_add_defer (uring->reactor,
+                                                    (GSourceFunc) uring_flush_cb,
+                                                    uring);
+    }
+
+    return sqe;
+}
+
+static void
+uring_recycle (LmUring *uring, guint16 bid)
+{
+    struct io_uring_buf *buf;
+    GList               *starved;
+    GList               *l;
+
+    buf = &uring->recv_ring->bufs[uring->recv_tail & (URING_RECV_BUFS - 1)];
+    buf->addr = (guint64) (gsize) (uring->recv_bufs + bid * URING_RECV_BUF_SIZE);
+    buf->len  = URING_RECV_BUF_SIZE;
+    buf->bid  = bid;
+
+    uring->recv_tail++;
+    __atomic_store_n (&uring->recv_ring->tail, uring->recv_tail,
+                      __ATOMIC_RELEASE);
+
+    starved = uring->starved;
+    uring->starved = NULL;
+
+    for (l = starved; l; l = l->next) {
+        LmUringSocket *us = l->data;
+
+        us->starved = FALSE;
+        uring_socket_arm_recv (us);
+    }
+
+    g_list_free (starved);
+}
+
+static gboolean
+uring_wake_senders_cb (LmUring *uring)
+{
+    GList *l;
+
+    uring->wake_source = NULL;
+
+    /* A callback may close any of them or start waiting again */
+    while ((l = uring->send_waiting) && uring->n_send_free > 0) {
+        LmUringSocket *us = l->data;
+
+        uring->send_waiting = g_list_delete_link (uring->send_waiting, l);
+        us->send_waiting = FALSE;
+
+        us->n_pending++;
+        us->funcs->writeable (us, us->user_data);
+        us->n_pending--;
+
+        uring_socket_maybe_free (us);
+    }
+
+    return FALSE;
+}
+
+static void
+uring_release_send_buf (LmUring *uring, guint16 index)
+{
+    uring->send_free[uring->n_send_free++] = index;
+
+    if (uring->send_waiting && !uring->wake_source) {
+        uring->wake_source = 
+            lm_reactor_add_defer (uring->reactor,
+                                  (GSourceFunc) uring_wake_senders_cb,
+                                  uring);
+    }
+}
+
+static void
+uring_socket_free (LmUringSocket *us)
+{
+    LmUring   *uring = us->uring;
+    LmArena   *arena = us->arena;
+    RecvChunk *recv_chunk;
+    SendChunk *send_chunk;
+
+    while ((recv_chunk = g_queue_pop_head (&us->recv_queue))) {
+        if (uring->recv_ring) {
+            uring_recycle (uring, recv_chunk->bid);
+        }
+        lm_arena_free (us->arena, sizeof (RecvChunk), recv_chunk);
+    }
+
+    while ((send_chunk = g_queue_pop_head (&us->send_queue))) {
+        uring_release_send_buf (uring, send_chunk->index);
+        lm_arena_free (us->arena, sizeof (SendChunk), send_chunk);
+    }
+
+    uring->closing = g_list_remove (uring->closing, us);
+
+    close (us->fd);
+
+    lm_arena_free (arena, sizeof (LmUringSocket), us);
+    if (arena) {
+        lm_arena_unref (arena);
+    }
+}
+
+static void
+uring_socket_maybe_free (LmUringSocket *us)
+{
+    if (us->closed && us->n_pending == 0) {
+        uring_socket_free (us);
+    }
+}
+
+static gboolean
+uring_socket_dispatch_cb (LmUringSocket *us)
+{
+    us->dispatch_source = NULL;
+    us->n_pending++;
+
+    if (!g_queue_is_empty (&us->recv_queue)) {
+        us->funcs->readable (us, us->user_data);
+    }
+    else if (us->eof || us->error) {
+        us->funcs->closed (us, us->error, us->user_data);
+    }
+
+    us->n_pending--;
+
+    /* Level triggered like a poll watch, again until it's all read */
+    if (!us->closed && !us->dispatch_source &&
+        (!g_queue_is_empty (&us->recv_queue) || us->eof || us->error)) {
+        us->dispatch_source =
+            lm_reactor_add_defer (us->uring->reactor,
+                                  (GSourceFunc) uring_socket_dispatch_cb, us);
+    }
+
+    uring_socket_maybe_free (us);
+
+    return FALSE;
+}
+
+static void
+uring_socket_schedule_dispatch (LmUringSocket *us)
+{
+    if (us->closed || us->dispatch_source) {
+        return;
+    }
+
+    us->dispatch_source = 
+        lm_reactor_add_defer (us->uring->reactor,
+                              (GSourceFunc) uring_socket_dispatch_cb, us);
+}
+
+static void
+uring_socket_fail (LmUringSocket *us, int error)
+{
+    if (!us->error) {
+        us->error = error;
+    }
+
+    uring_socket_schedule_dispatch (us);
+}
+
+static void
+uring_socket_arm_recv (LmUringSocket *us)
+{
+    struct io_uring_sqe *sqe;
+
+    if (us->receiving || us->starved || us->closed || us->eof || us->error) {
+        return;
+    }
+
+    sqe = uring_get_sqe (us->uring, us, OP_RECV);
+    if (!sqe) {
+        uring_socket_fail (us, EBUSY);
+        return;
+    }
+
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = us->fd;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_RECV_GROUP;
+    if (!us->uring->no_multishot) {
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+    }
+
+    us->receiving = TRUE;
+}
+
+static void
+uring_socket_send_next (LmUringSocket *us)
+{
+    struct io_uring_sqe *sqe;
+    SendChunk           *chunk;
+
+    chunk = g_queue_peek_head (&us->send_queue);
+    if (!chunk || us->sending) {
+        return;
+    }
+
+    sqe = uring_get_sqe (us->uring, us, OP_SEND);
+    if (!sqe) {
+        uring_socket_fail (us, EBUSY);
+        return;
+    }
+
+    sqe->opcode    = IORING_OP_WRITE_FIXED;
+    sqe->fd        = us->fd;
+    sqe->addr      = (guint64) (gsize) (us->uring->send_bufs + 
+                                        chunk->index * URING_SEND_BUF_SIZE +
+                                        chunk->offset);
+    sqe->len       = chunk->len;
+    sqe->buf_index = 0;
+
+    us->sending = TRUE;
+}
+
+static void
+uring_socket_drop_sends (LmUringSocket *us)
+{
+    LmUring   *uring = us->uring;
+    SendChunk *chunk;
+
+    while ((chunk = g_queue_pop_head (&us->send_queue))) {
+        uring_release_send_buf (uring, chunk->index);
+        lm_arena_free (us->arena, sizeof (SendChunk), chunk);
+    }
+}
+
+static void
+uring_handle_recv (LmUring *uring, LmUringSocket *us, struct io_uring_cqe *cqe)
+{
+    gboolean more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        guint16 bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (cqe->res > 0 && !us->closed) {
+            RecvChunk *chunk = lm_arena_alloc (us->arena, sizeof (RecvChunk));
+
+            chunk->bid    = bid;
+            chunk->offset = 0;
+            chunk->len    = (guint16) cqe->res;
+            g_queue_push_tail (&us->recv_queue, chunk);
+        } else {
+            uring_recycle (uring, bid);
+        }
+    }
+
+    if (!more) {
+        us->n_pending--;
+        us->receiving = FALSE;
+    }
+
+    if (us->closed) {
+        return;
+    }
+
+    if (cqe->res > 0) {
+        uring_socket_schedule_dispatch (us);
+    }
+    else if (cqe->res == 0) {
+        us->eof = TRUE;
+        uring_socket_schedule_dispatch (us);
+    }
+    else if (cqe->res == -ENOBUFS) {
+        /* Rearmed when a buffer is recycled */
+        us->starved = TRUE;
+        uring->starved = g_list_prepend (uring->starved, us);
+        return;
+    }
+    else if (cqe->res == -EINVAL && !uring->no_multishot) {
+        /* Kernels before 6.0 take IORING_RECV_MULTISHOT as invalid */
+        uring->no_multishot = TRUE;
+    } else {
+        uring_socket_fail (us, -cqe->res);
+    }
+
+    if (!us->receiving) {
+        uring_socket_arm_recv (us);
+    }
+}
+
+static void
+uring_handle_send (LmUring *uring, LmUringSocket *us, struct io_uring_cqe *cqe)
+{
+    SendChunk *chunk;
+
+    us->n_pending--;
+    us->sending = FALSE;
+
+    chunk = g_queue_peek_head (&us->send_queue);
+
+    if (cqe->res <= 0) {
+        uring_socket_drop_sends (us);
+        uring_socket_fail (us, cqe->res < 0 ? -cqe->res : EPIPE);
+        return;
+    }
+
+    if (cqe->res < chunk->len) {
+        chunk->offset += cqe->res;
+        chunk->len    -= cqe->res;
+    } else {
+        g_queue_pop_head (&us->send_queue);
+        uring_release_send_buf (uring, chunk->index);
+        lm_arena_free (us->arena, sizeof (SendChunk), chunk);
+    }
+
+    uring_socket_send_next (us);
+
+    if (!us->closed) {
+        us->funcs->writeable (us, us->user_data);
+    }
+}
+
+static gboolean
+uring_cq_cb (LmReactor    *reactor,
+             int           fd,
+             GIOCondition  condition,
+             LmUring      *uring)
+{
+    guint32 head;
+    guint32 tail;
+
+    head = *uring->cq_head;
+    tail = __atomic_load_n (uring->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe  cqe;
+        LmUringSocket       *us;
+
+        cqe = uring->cqes[head & uring->cq_mask];
+        head++;
+        __atomic_store_n (uring->cq_head, head, __ATOMIC_RELEASE);
+
+        us = (LmUringSocket *) (gsize) (cqe.user_data & ~(guint64) OP_MASK);
+        if (!us) {
+            continue;
+        }
+
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            uring->n_inflight--;
+        }
+
+        us->n_pending++;
+
+        switch (cqe.user_data & OP_MASK) {
+            case OP_CONNECT:
+                us->n_pending--;
+                us->connecting = FALSE;
+                if (!us->closed) {
+                    us->funcs->connected (us, cqe.res, us->user_data);
+                }
+                break;
+            case OP_RECV:
+                uring_handle_recv (uring, us, &cqe);
+                break;
+            case OP_SEND:
+                uring_handle_send (uring, us, &cqe);
+                break;
+            case OP_CANCEL:
+                us->n_pending--;
+                break;
+        }
+
+        us->n_pending--;
+        uring_socket_maybe_free (us);
+
+        if (head == tail) {
+            tail = __atomic_load_n (uring->cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    /* Rearms and follow-up sends go in right away */
+    uring_flush (uring);
+
+    return TRUE;
+}
+
+/* The kernel may still use the buffers of operations in flight, so they
+ * are cancelled and waited for before anything is unmapped.
+ */
+static void
+uring_drain (LmUring *uring)
+{
+    struct io_uring_sqe *sqe;
+
+    if (uring->n_inflight == 0) {
+        return;
+    }
+
+    sqe = uring_get_sqe (uring, NULL, OP_CANCEL);
+    if (sqe) {
+        sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+        sqe->fd           = -1;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    }
+
+    uring_flush (uring);
+
+    while (uring->n_inflight > 0) {
+        guint32 head;
+        guint32 tail;
+
+        if (uring_enter (uring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+            errno != EINTR) {
+            g_warning ("Failed to wait for io_uring: %s", g_strerror (errno));
+            return;
+        }
+
+        head = *uring->cq_head;
+        tail = __atomic_load_n (uring->cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+
+            if ((cqe->user_data & ~(guint64) OP_MASK) &&
+                !(cqe->flags & IORING_CQE_F_MORE)) {
+                uring->n_inflight--;
+            }
+        }
+
+        __atomic_store_n (uring->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+static void
+uring_free (LmUring *uring)
+{
+    GList *closing;
+    GList *l;
+
+    if (uring->watch) {
+        lm_reactor_remove (uring->reactor, uring->watch);
+    }
+
+    uring_drain (uring);
+
+    if (uring->flush_source) {
+        lm_reactor_remove (uring->reactor, uring->flush_source);
+    }
+    if (uring->wake_source) {
+        lm_reactor_remove (uring->reactor, uring->wake_source);
+    }
+    g_list_free (uring->send_waiting);
+    uring->send_waiting = NULL;
+
+    if (uring->fd >= 0) {
+        close (uring->fd);
+    }
+
+    if (uring->recv_ring) {
+        munmap (uring->recv_ring, URING_RECV_BUFS * sizeof (struct io_uring_buf));
+        uring->recv_ring = NULL;
+    }
+
+    closing = uring->closing;
+    uring->closing = NULL;
+    for (l = closing; l; l = l->next) {
+        uring_socket_free (l->data);
+    }
+    g_list_free (closing);
+
+    if (uring->ring) {
+        munmap (uring->ring, uring->ring_size);
+    }
+    if (uring->sqes) {
+        munmap (uring->sqes, uring->sq_entries * sizeof (struct io_uring_sqe));
+    }
+    if (uring->send_bufs) {
+        munmap (uring->send_bufs, URING_SEND_BUFS * URING_SEND_BUF_SIZE);
+    }
+
+    g_list_free (uring->starved);
+    g_free (uring->recv_bufs);
+    g_free (uring);
+}
+
+static gpointer
+uring_map (int fd, gsize size, off_t offset)
+{
+    gpointer mem;
+
+    if (fd < 0) {
+        mem = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+        mem = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, offset);
+    }
+
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+static gboolean
+uring_setup_buffers (LmUring *uring)
+{
+    struct io_uring_buf_reg reg;
+    struct iovec            iov;
+    guint                   i;
+
+    uring->send_bufs = uring_map (-1, URING_SEND_BUFS * URING_SEND_BUF_SIZE, 0);
+    if (!uring->send_bufs) {
+        return FALSE;
+    }
+
+    iov.iov_base = uring->send_bufs;
+    iov.iov_len  = URING_SEND_BUFS * URING_SEND_BUF_SIZE;
+    if (uring_register (uring->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+        return FALSE;
+    }
+
+    for (i = 0; i < URING_SEND_BUFS; i++) {
+        uring->send_free[uring->n_send_free++] = URING_SEND_BUFS - 1 - i;
+    }
+
+    /* Has to be page aligned */
+    uring->recv_ring = uring_map (-1, URING_RECV_BUFS * sizeof (struct io_uring_buf), 0);
+    if (!uring->recv_ring) {
+        return FALSE;
+    }
+
+    memset (&reg, 0, sizeof (reg));
+    reg.ring_addr    = (guint64) (gsize) uring->recv_ring;
+    reg.ring_entries = URING_RECV_BUFS;
+    reg.bgid         = URING_RECV_GROUP;
+    if (uring_register (uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap (uring->recv_ring, URING_RECV_BUFS * sizeof (struct io_uring_buf));
+        uring->recv_ring = NULL;
+        return FALSE;
+    }
+
+    uring->recv_bufs = g_malloc (URING_RECV_BUFS * URING_RECV_BUF_SIZE);
+    for (i = 0; i < URING_RECV_BUFS; i++) {
+        uring_recycle (uring, (guint16) i);
+    }
+
+    return TRUE;
+}
+
+static LmUring *
+uring_new (LmReactor *reactor)
+{
+    LmUring                *uring;
+    struct io_uring_params  params;
+    guchar                 *ring;
+
+    uring = g_new0 (LmUring, 1);
+    uring->reactor = reactor;
+
+    memset (&params, 0, sizeof (params));
+    uring->fd = uring_setup (URING_ENTRIES, &params);
+    if (uring->fd < 0) {
+        g_free (uring);
+        return NULL;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_NODROP)) {
+        uring_free (uring);
+        return NULL;
+    }
+
+    uring->ring_size = MAX (params.sq_off.array + 
+                            params.sq_entries * sizeof (guint32),
+                            params.cq_off.cqes + 
+                            params.cq_entries * sizeof (struct io_uring_cqe));
+    uring->ring = uring_map (uring->fd, uring->ring_size, IORING_OFF_SQ_RING);
+    uring->sq_entries = params.sq_entries;
+    uring->sqes = uring_map (uring->fd,
+                             params.sq_entries * sizeof (struct io_uring_sqe),
+                             IORING_OFF_SQES);
+    if (!uring->ring || !uring->sqes) {
+        uring_free (uring);
+        return NULL;
+    }
+
+    ring = uring->ring;
+    uring->sq_head  = (guint32 *) (ring + params.sq_off.head);
+    uring->sq_tail  = (guint32 *) (ring + params.sq_off.tail);
+    uring->sq_mask  = *(guint32 *) (ring + params.sq_off.ring_mask);
+    uring->sq_array = (guint32 *) (ring + params.sq_off.array);
+    uring->sq_local_tail = *uring->sq_tail;
+
+    uring->cq_head = (guint32 *) (ring + params.cq_off.head);
+    uring->cq_tail = (guint32 *) (ring + params.cq_off.tail);
+    uring->cq_mask = *(guint32 *) (ring + params.cq_off.ring_mask);
+    uring->cqes    = (struct io_uring_cqe *) (ring + params.cq_off.cqes);
+
+    if (!uring_setup_buffers (uring)) {
+        uring_free (uring);
+        return NULL;
+    }
+
+    uring->watch = lm_reactor_add_fd (reactor, uring->fd, G_IO_IN,
+                                      (LmReactorFdFunc) uring_cq_cb, uring);
+
+    return uring;
+}
+
+LmUring *
+_lm_uring_get (LmReactor *reactor)
+{
+    LmUring      *uring;
+    GMainContext *context = NULL;
+    gboolean      per_context;
+
+    g_return_val_if_fail (LM_IS_REACTOR (reactor), NULL);
+
+    /* Every channel gets a GMain reactor of its own, so those share a ring
+     * per context instead, which is kept for the life of the process.
+     */
+    per_context = LM_IS_GMAIN_REACTOR (reactor);
+
+    G_LOCK (uring);
+
+    if (per_context) {
+        g_object_get (reactor, "context", &context, NULL);
+
+        if (!context_rings) {
+            context_rings = g_hash_table_new (g_direct_hash, g_direct_equal);
+        }
+        uring = g_hash_table_lookup (context_rings, context);
+    } else {
+        uring = g_object_get_data (G_OBJECT (reactor), "lm-uring");
+    }
+
+    if (uring || uring_unavailable) {
+        G_UNLOCK (uring);
+        return uring;
+    }
+
+    if (per_context) {
+        reactor = lm_gmain_reactor_new (context);
+    }
+
+    uring = uring_new (reactor);
+
+    if (!uring) {
+        g_warning ("io_uring is not available, using poll");
+        uring_unavailable = TRUE;
+
+        if (per_context) {
+            g_object_unref (reactor);
+        }
+    }
+    else if (per_context) {
+        g_hash_table_insert (context_rings, context, uring);
+    } else {
+        g_object_set_data_full (G_OBJECT (reactor), "lm-uring", uring,
+                                (GDestroyNotify) uring_free);
+    }
+
+    G_UNLOCK (uring);
+
+    return uring;
+}
+
+LmUringSocket *
+_lm_uring_socket_new (LmUring                  *uring,
+                      LmArena                  *arena,
+                      int                       fd,
+                      const LmUringSocketFuncs *funcs,
+                      gpointer                  user_data)
+{
+    LmUringSocket *us;
+
+    us = lm_arena_alloc0 (arena, sizeof (LmUringSocket));
+    us->uring     = uring;
+    us->arena     = arena ? lm_arena_ref (arena) : NULL;
+    us->fd        = fd;
+    us->funcs     = funcs;
+    us->user_data = user_data;
+
+    g_queue_init (&us->recv_queue);
+    g_queue_init (&us->send_queue);
+
+    return us;
+}
+
+gboolean
+_lm_uring_socket_connect (LmUringSocket         *us,
+                          const struct sockaddr *addr,
+                          socklen_t              len)
+{
+    struct io_uring_sqe *sqe;
+
+    g_return_val_if_fail (len <= sizeof (us->addr), FALSE);
+
+    /* Has to stay around until the kernel picks it up */
+    memcpy (&us->addr, addr, len);
+
+    sqe = uring_get_sqe (us->uring, us, OP_CONNECT);
+    if (!sqe) {
+        return FALSE;
+    }
+
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd     = us->fd;
+    sqe->addr   = (guint64) (gsize) &us->addr;
+    sqe->off    = len;
+
+    us->connecting = TRUE;
+
+    return TRUE;
+}
+
+void
+_lm_uring_socket_start (LmUringSocket *us)
+{
+    uring_socket_arm_recv (us);
+}
+
+GIOStatus
+_lm_uring_socket_read (LmUringSocket  *us,
+                       gchar          *buf,
+                       gsize           len,
+                       gsize          *read_len,
+                       GError        **error)
+{
+    LmUring   *uring = us->uring;
+    RecvChunk *chunk;
+    gsize      n_read = 0;
+
+    while (n_read < len && (chunk = g_queue_peek_head (&us->recv_queue))) {
+        gsize n = MIN (len - n_read, chunk->len);
+
+        memcpy (buf + n_read, 
+                uring->recv_bufs + chunk->bid * URING_RECV_BUF_SIZE + 
+                chunk->offset,
+                n);
+
+        n_read        += n;
+        chunk->offset += n;
+        chunk->len    -= n;
+
+        if (chunk->len == 0) {
+            g_queue_pop_head (&us->recv_queue);
+            uring_recycle (uring, chunk->bid);
+            lm_arena_free (us->arena, sizeof (RecvChunk), chunk);
+        }
+    }
+
+    if (read_len) {
+        *read_len = n_read;
+    }
+
+    if (n_read > 0) {
+        return G_IO_STATUS_NORMAL;
+    }
+
+    if (us->error) {
+        g_set_error (error, G_IO_CHANNEL_ERROR,
+                     g_io_channel_error_from_errno (us->error),
+                     "%s", g_strerror (us->error));
+        return G_IO_STATUS_ERROR;
+    }
+
+    return us->eof ? G_IO_STATUS_EOF : G_IO_STATUS_AGAIN;
+}
+
+GIOStatus
+_lm_uring_socket_write (LmUringSocket  *us,
+                        const gchar    *buf,
+                        gsize           len,
+                        gsize          *written_len,
+                        GError        **error)
+{
+    LmUring   *uring = us->uring;
+    SendChunk *chunk;
+    gsize      written = 0;
+
+    if (us->error) {
+        g_set_error (error, G_IO_CHANNEL_ERROR,
+                     g_io_channel_error_from_errno (us->error),
+                     "%s", g_strerror (us->error));
+        return G_IO_STATUS_ERROR;
+    }
+
+    /* Small writes are gathered in the last buffer while one is sent */
+    chunk = g_queue_peek_tail (&us->send_queue);
+    if (chunk && !(us->sending && g_queue_get_length (&us->send_queue) == 1)) {
+        gsize end = chunk->offset + chunk->len;
+        gsize n   = MIN (len, URING_SEND_BUF_SIZE - end);
+
+        memcpy (uring->send_bufs + chunk->index * URING_SEND_BUF_SIZE + end,
+                buf, n);
+        chunk->len += n;
+        written    += n;
+    }
+
+    while (written < len && uring->n_send_free > 0 &&
+           g_queue_get_length (&us->send_queue) < URING_SEND_PER_SOCKET) {
+        chunk = lm_arena_alloc (us->arena, sizeof (SendChunk));
+        chunk->index  = uring->send_free[--uring->n_send_free];
+        chunk->offset = 0;
+        chunk->len    = MIN (len - written, URING_SEND_BUF_SIZE);
+
+        memcpy (uring->send_bufs + chunk->index * URING_SEND_BUF_SIZE,
+                buf + written, chunk->len);
+        g_queue_push_tail (&us->send_queue, chunk);
+
+        written += chunk->len;
+    }
+
+    uring_socket_send_next (us);
+
+    /* No send of its own will finish to say when to try again */
+    if (written < len && g_queue_is_empty (&us->send_queue) && 
+        !us->send_waiting) {
+        us->send_waiting = TRUE;
+        uring->send_waiting = g_list_append (uring->send_waiting, us);
+    }
+
+    if (written_len) {
+        *written_len = written;
+    }
+
+    return written > 0 || len == 0 ? G_IO_STATUS_NORMAL : G_IO_STATUS_AGAIN;
+}
+
+static void
+uring_socket_cancel (LmUringSocket *us, guint op)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe (us->uring, us, OP_CANCEL);
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd     = -1;
+        sqe->addr   = (guint64) (gsize) us | op;
+    }
+}
+
+void
+_lm_uring_socket_close (LmUringSocket *us)
+{
+    LmUring   *uring = us->uring;
+    RecvChunk *chunk;
+
+    if (us->closed) {
+        return;
+    }
+
+    us->closed = TRUE;
+    us->funcs  = NULL;
+
+    if (us->dispatch_source) {
+        lm_reactor_remove (uring->reactor, us->dispatch_source);
+        us->dispatch_source = NULL;
+    }
+
+    if (us->starved) {
+        uring->starved = g_list_remove (uring->starved, us);
+        us->starved = FALSE;
+    }
+
+    if (us->send_waiting) {
+        uring->send_waiting = g_list_remove (uring->send_waiting, us);
+        us->send_waiting = FALSE;
+    }
+
+    while ((chunk = g_queue_pop_head (&us->recv_queue))) {
+        uring_recycle (uring, chunk->bid);
+        lm_arena_free (us->arena, sizeof (RecvChunk), chunk);
+    }
+
+    if (us->connecting) {
+        uring_socket_cancel (us, OP_CONNECT);
+    }
+    if (us->receiving) {
+        uring_socket_cancel (us, OP_RECV);
+    }
+
+    uring->closing = g_list_prepend (uring->closing, us);
+
+    uring_socket_maybe_free (us);
+}
+
+#else /* IORING_RECV_MULTISHOT */
+
+LmUring *
+_lm_uring_get (LmReactor *reactor)
+{
+    return NULL;
+}
+
+LmUringSocket *
+_lm_uring_socket_new (LmUring                  *uring,
+                      LmArena                  *arena,
+                      int                       fd,
+                      const LmUringSocketFuncs *funcs,
+                      gpointer                  user_data)
+{
+    g_return_val_if_reached (NULL);
+}
+
+gboolean
+_lm_uring_socket_connect (LmUringSocket         *us,
+                          const struct sockaddr *addr,
+                          socklen_t              len)
+{
+    g_return_val_if_reached (FALSE);
+}
+
+void
+_lm_uring_socket_start (LmUringSocket *us)
+{
+    g_return_if_reached ();
+}
+
+GIOStatus
+_lm_uring_socket_read (LmUringSocket  *us,
+                       gchar          *buf,
+                       gsize           len,
+                       gsize          *read_len,
+                       GError        **error)
+{
+    g_return_val_if_reached (G_IO_STATUS_ERROR);
+}
+
+GIOStatus
+_lm_uring_socket_write (LmUringSocket  *us,
+                        const gchar    *buf,
+                        gsize           len,
+                        gsize          *written_len,
+                        GError        **error)
+{
+    g_return_val_if_reached (G_IO_STATUS_ERROR);
+}
+
+void
+_lm_uring_socket_close (LmUringSocket *us)
+{
+    g_return_if_reached ();
+}
+
+#endif /* IORING_RECV_MULTISHOT */
@@ -0,0 +1,94 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_URING_H__
+#define __LM_URING_H__
+
+#include <glib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "lm-arena.h"
+#include "lm-reactor.h"
+
+G_BEGIN_DECLS
+
+/* Completion based socket I/O on io_uring, used by LmSocket with
+ * LM_SOCKET_BACKEND_IO_URING. All sockets on a reactor share one ring,
+ * which is reaped when its fd turns readable so it works on any reactor.
+ *
+ * Incoming data lands in a ring of buffers provided to the kernel and is
+ * read from there, writes are copied to registered buffers and sent in
+ * order. Submissions are batched until the reactor gets back to its loop.
+ */
+
+typedef struct LmUring       LmUring;
+typedef struct LmUringSocket LmUringSocket;
+
+typedef struct {
+    /* result is 0 or a negative errno */
+    void (*connected) (LmUringSocket *us, int result, gpointer user_data);
+    /* Called from the loop for as long as data is waiting */
+    void (*readable)  (LmUringSocket *us, gpointer user_data);
+    /* A send finished, or buffers were freed after G_IO_STATUS_AGAIN */
+    void (*writeable) (LmUringSocket *us, gpointer user_data);
+    /* All data is read and the peer closed, error is 0 or an errno */
+    void (*closed)    (LmUringSocket *us, int error, gpointer user_data);
+} LmUringSocketFuncs;
+
+/* Returns the ring of reactor, setting it up on first use. NULL if the
+ * kernel lacks io_uring or a feature used here.
+ */
+LmUring *       _lm_uring_get            (LmReactor                *reactor);
+
+/* Takes over fd, it is closed once no operations are left on it. The
+ * socket state is allocated from arena, which may be NULL.
+ */
+LmUringSocket * _lm_uring_socket_new     (LmUring                  *uring,
+                                          LmArena                  *arena,
+                                          int                       fd,
+                                          const LmUringSocketFuncs *funcs,
+                                          gpointer                  user_data);
+gboolean        _lm_uring_socket_connect (LmUringSocket            *us,
+                                          const struct sockaddr    *addr,
+                                          socklen_t                 len);
+/* Starts receiving, once connected */
+void            _lm_uring_socket_start   (LmUringSocket            *us);
+GIOStatus       _lm_uring_socket_read    (LmUringSocket            *us,
+                                          gchar                    *buf,
+                                          gsize                     len,
+                                          gsize                    *read_len,
+                                          GError                  **error);
+/* Queues buf, returns G_IO_STATUS_AGAIN while the send buffers are full.
+ * The buffers are shared by all sockets of the ring.
+ */
+GIOStatus       _lm_uring_socket_write   (LmUringSocket            *us,
+                                          const gchar              *buf,
+                                          gsize                     len,
+                                          gsize                    *written_len,
+                                          GError                  **error);
+/* No callbacks are made after this. Queued data is still sent before
+ * the fd is closed.
+ */
+void            _lm_uring_socket_close   (LmUringSocket            *us);
+
+G_END_DECLS
+
+#endif /* __LM_URING_H__ */
@@ -63,6 +63,10 @@ socket_connected (LmSocket              *socket,
     if (res != LM_SOCKET_CONNECT_OK) {
         g_print ("Failed to connect\n");
         g_main_loop_quit (loop);
+    } else {
+        g_print ("Using %s\n", 
+                 lm_socket_get_backend (socket) == LM_SOCKET_BACKEND_IO_URING ?
+                 "io_uring" : "poll");
     }
 }
 
@@ -92,9 +96,18 @@ main (int argc, char **argv)
 {
     LmSocketAddress *sa;
     LmChannel       *channel;
+    LmArena         *arena;
+    gchar           *stats;
 
     g_type_init ();
 
+    /* -u runs the socket on io_uring */
+    if (argc > 1 && strcmp (argv[1], "-u") == 0) {
+        lm_socket_set_default_backend (LM_SOCKET_BACKEND_IO_URING);
+        argc--;
+        argv++;
+    }
+
     if (argc < 3) {
         g_print ("Give a host and port\n");
         return 1;
@@ -107,7 +120,13 @@ main (int argc, char **argv)
 
     sa = lm_socket_address_new (host, port);
 
-    channel = lm_socket_new (NULL, sa);
+    /* Only io_uring allocates from the arena, with poll the stats are 0 */
+    arena = lm_arena_new ();
+    channel = g_object_new (LM_TYPE_SOCKET,
+                            "address", sa,
+                            "arena", arena,
+                            NULL);
+    lm_arena_unref (arena);
 
     g_signal_connect (channel, "connect-result", 
                       G_CALLBACK (socket_connected),
@@ -132,6 +151,10 @@ main (int argc, char **argv)
 
     lm_socket_address_unref (sa);
 
+    stats = lm_arena_dump_stats ();
+    g_print ("%s", stats);
+    g_free (stats);
+
     return 0;
 }
 
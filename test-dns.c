@@ -0,0 +1,335 @@
+/*
+ * Copyright (C) 2008 Imendio AB
+ */
+
+/*
+ * Resolves names with LmDnsResolver. Without a nameserver argument a
+ * stand-in DNS server is started on 127.0.0.1:5353 that answers every A,
+ * AAAA and SRV question with localhost. Names starting with "tc." get a
+ * truncated UDP answer so that the TCP fallback is used.
+ *
+ * Pinned hosts from a file in /etc/hosts format are answered from memory
+ * without asking any server.
+ *
+ * Usage: test-dns [-H hosts] [-s nameserver] name [_service._tcp.domain ...]
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+
+#include "lm-dns-resolver.h"
+#include "lm-resolver.h"
+#include "lm-static-resolver.h"
+
+#define STAND_IN_ADDRESS "127.0.0.1"
+#define STAND_IN_PORT    5353
+
+static GMainLoop *loop;
+static guint      pending;
+
+static gsize
+stand_in_answer (const guchar *query, gsize len, guchar *buf, gboolean udp)
+{
+    const guchar *pos = query + HFIXEDSZ;
+    guint         type;
+    gsize         qlen;
+    guchar       *rr;
+
+    /* Skip the question name */
+    while (pos < query + len && *pos) {
+        pos += *pos + 1;
+    }
+    if (pos + 1 + QFIXEDSZ > query + len) {
+        return 0;
+    }
+    pos++;
+    type = (pos[0] << 8) | pos[1];
+    pos += QFIXEDSZ;
+    qlen = pos - query;
+
+    memcpy (buf, query, qlen);
+    buf[2] = 0x81;  /* Response, recursion desired */
+    buf[3] = 0x80;  /* Recursion available, no error */
+    buf[7] = 1;     /* One answer */
+
+    if (udp && query[HFIXEDSZ + 1] == 't' && query[HFIXEDSZ + 2] == 'c' &&
+        query[HFIXEDSZ] == 2) {
+        buf[2] |= 0x02;
+        buf[7] = 0;
+        return qlen;
+    }
+
+    rr = buf + qlen;
+    rr[0] = 0xc0;   /* Name pointer to the question */
+    rr[1] = HFIXEDSZ;
+    rr[2] = type >> 8;
+    rr[3] = type & 0xff;
+    rr[4] = 0;
+    rr[5] = C_IN;
+    rr[6] = rr[7] = rr[8] = 0;
+    rr[9] = 60;     /* TTL */
+    rr += 12;
+
+    if (type == T_A) {
+        inet_pton (AF_INET, "127.0.0.1", rr);
+        rr[-1] = 4;
+    } else if (type == T_AAAA) {
+        inet_pton (AF_INET6, "::1", rr);
+        rr[-1] = 16;
+    } else if (type == T_SRV) {
+        static const guchar srv[] = {
+            0, 10, 0, 0, 0x14, 0x66,   /* Priority, weight, port 5222 */
+            9, 'l', 'o', 'c', 'a', 'l', 'h', 'o', 's', 't', 0
+        };
+
+        memcpy (rr, srv, sizeof (srv));
+        rr[-1] = sizeof (srv);
+    } else {
+        buf[7] = 0;
+        return qlen;
+    }
+    rr[-2] = 0;
+
+    return (rr + rr[-1]) - buf;
+}
+
+static gboolean
+stand_in_udp_cb (GIOChannel *source, GIOCondition condition, gpointer data)
+{
+    int                fd = g_io_channel_unix_get_fd (source);
+    guchar             query[512];
+    guchar             answer[512];
+    struct sockaddr_in from;
+    socklen_t          from_len = sizeof (from);
+    gssize             len;
+    gsize              answer_len;
+
+    len = recvfrom (fd, query, sizeof (query), 0,
+                    (struct sockaddr *) &from, &from_len);
+    if (len < HFIXEDSZ) {
+        return TRUE;
+    }
+
+    answer_len = stand_in_answer (query, len, answer, TRUE);
+    if (answer_len > 0) {
+        g_print ("Stand-in: UDP question%s\n",
+                 answer[2] & 0x02 ? ", truncating" : "");
+        sendto (fd, answer, answer_len, 0, (struct sockaddr *) &from, from_len);
+    }
+
+    return TRUE;
+}
+
+static gboolean
+stand_in_tcp_cb (GIOChannel *source, GIOCondition condition, gpointer data)
+{
+    int    fd;
+    guchar query[514];
+    guchar answer[514];
+    gsize  answer_len;
+    gssize len;
+
+    fd = accept (g_io_channel_unix_get_fd (source), NULL, NULL);
+    if (fd < 0) {
+        return TRUE;
+    }
+
+    /* Good enough for a test, the client sends it all at once */
+    len = read (fd, query, sizeof (query));
+    if (len > 2 + HFIXEDSZ) {
+        answer_len = stand_in_answer (query + 2, len - 2, answer + 2, FALSE);
+        answer[0] = answer_len >> 8;
+        answer[1] = answer_len & 0xff;
+        g_print ("Stand-in: TCP question\n");
+        write (fd, answer, answer_len + 2);
+    }
+
+    close (fd);
+
+    return TRUE;
+}
+
+static void
+stand_in_start (void)
+{
+    struct sockaddr_in addr;
+    GIOChannel        *channel;
+    int                udp_fd;
+    int                tcp_fd;
+    int                on = 1;
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons (STAND_IN_PORT);
+    inet_pton (AF_INET, STAND_IN_ADDRESS, &addr.sin_addr);
+
+    udp_fd = socket (AF_INET, SOCK_DGRAM, 0);
+    tcp_fd = socket (AF_INET, SOCK_STREAM, 0);
+    setsockopt (tcp_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+
+    if (bind (udp_fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+        bind (tcp_fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+        listen (tcp_fd, 5) < 0) {
+        g_print ("Failed to start the stand-in server\n");
+        exit (1);
+    }
+
+    channel = g_io_channel_unix_new (udp_fd);
+    g_io_add_watch (channel, G_IO_IN, stand_in_udp_cb, NULL);
+
+    channel = g_io_channel_unix_new (tcp_fd);
+    g_io_add_watch (channel, G_IO_IN, stand_in_tcp_cb, NULL);
+}
+
+static void
+print_result (const gchar      *name,
+              LmResolverResult  result,
+              LmSocketAddress  *sa)
+{
+    if (result != LM_RESOLVER_RESULT_OK) {
+        g_print ("%s: failed (%d)\n", name, result);
+    } else if (!lm_socket_address_is_resolved (sa)) {
+        g_print ("%s: %s port %d\n", name,
+                 lm_socket_address_get_host (sa),
+                 lm_socket_address_get_port (sa));
+    } else {
+        LmSocketAddressIter  *iter;
+        LmSocketAddressEntry *entry;
+
+        iter = lm_socket_address_get_result_iter (sa);
+        while ((entry = lm_socket_address_iter_get_next (iter))) {
+            gchar  buf[INET6_ADDRSTRLEN];
+            void  *addr;
+
+            if (entry->family == AF_INET6) {
+                addr = &((struct sockaddr_in6 *) &entry->addr)->sin6_addr;
+            } else {
+                addr = &((struct sockaddr_in *) &entry->addr)->sin_addr;
+            }
+
+            g_print ("%s: %s\n", name,
+                     inet_ntop (entry->family, addr, buf, sizeof (buf)));
+        }
+    }
+}
+
+static void
+resolver_finished_cb (LmResolver       *resolver,
+                      LmResolverResult  result,
+                      LmSocketAddress  *sa,
+                      gpointer          user_data)
+{
+    print_result (user_data, result, sa);
+
+    if (--pending == 0) {
+        g_main_loop_quit (loop);
+    }
+}
+
+static void
+batch_result_cb (LmResolverBatch  *batch,
+                 const gchar      *name,
+                 LmResolverResult  result,
+                 LmSocketAddress  *sa,
+                 gpointer          user_data)
+{
+    print_result (name, result, sa);
+}
+
+static void
+batch_done_cb (LmResolverBatch *batch, gpointer user_data)
+{
+    g_main_loop_quit (loop);
+}
+
+int
+main (int argc, char **argv)
+{
+    const gchar *servers[] = { STAND_IN_ADDRESS ":5353", NULL };
+    int          i = 1;
+    gboolean     batch = FALSE;
+    gchar       *metrics;
+
+    g_type_init ();
+
+    if (argc > 2 && strcmp (argv[1], "-H") == 0) {
+        if (!lm_static_resolver_load_hosts (argv[2])) {
+            return 1;
+        }
+        i = 3;
+    }
+
+    if (argc > i && strcmp (argv[i], "-b") == 0) {
+        /* Resolve all names with lm_resolver_lookup_many() */
+        batch = TRUE;
+        i++;
+    }
+
+    if (argc > i + 1 && strcmp (argv[i], "-s") == 0) {
+        servers[0] = argv[i + 1];
+        i += 2;
+    } else {
+        stand_in_start ();
+    }
+
+    if (i >= argc) {
+        g_print ("Give one or more names to resolve\n");
+        return 1;
+    }
+
+    lm_dns_resolver_set_nameservers (servers);
+    lm_resolver_set_default_type (LM_TYPE_DNS_RESOLVER);
+
+    loop = g_main_loop_new (NULL, FALSE);
+
+    if (batch) {
+        /* argv is NULL terminated */
+        lm_resolver_lookup_many (NULL, (const gchar **) argv + i, 5222,
+                                 batch_result_cb, batch_done_cb, NULL);
+    } else {
+        for (; i < argc; i++) {
+            LmResolver *resolver;
+
+            if (argv[i][0] == '_') {
+                /* _service._tcp.domain */
+                gchar **parts = g_strsplit (argv[i], ".", 3);
+
+                if (!parts[1] || !parts[2]) {
+                    g_strfreev (parts);
+                    continue;
+                }
+                resolver = lm_resolver_lookup_service (NULL, parts[2], 
+                                                       parts[0] + 1);
+                g_strfreev (parts);
+            } else {
+                LmSocketAddress *sa = lm_socket_address_new (argv[i], 5222);
+
+                resolver = lm_resolver_lookup_host (NULL, sa);
+                lm_socket_address_unref (sa);
+            }
+
+            g_signal_connect (resolver, "finished",
+                              G_CALLBACK (resolver_finished_cb), argv[i]);
+            pending++;
+        }
+
+        if (pending == 0) {
+            return 1;
+        }
+    }
+
+    g_main_loop_run (loop);
+
+    metrics = lm_resolver_dump_metrics ();
+    g_print ("%s", metrics);
+    g_free (metrics);
+
+    return 0;
+}
+
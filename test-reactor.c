@@ -0,0 +1,377 @@
+/*
+ * Copyright (C) 2008 Imendio AB
+ */
+
+/*
+ * Runs LmSocket on an event loop of its own instead of a GMainContext,
+ * as an example of how to plug the channel stack into an existing loop.
+ * The loop is a plain poll() loop, an adapter for libev or libevent
+ * looks the same with ev_io/ev_timer/ev_async in place of the lists.
+ *
+ * Nothing iterates a GMainContext here, the host lookup finishes
+ * through a defer on the reactor.
+ *
+ * Usage: test-reactor host port
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "lm-channel.h"
+#include "lm-reactor.h"
+#include "lm-socket.h"
+
+#define MESSAGE     "Hey there! Whazzup?"
+
+/* -- LmPollReactor -- */
+
+#define LM_TYPE_POLL_REACTOR (lm_poll_reactor_get_type ())
+
+typedef struct {
+    LmReactor parent;
+
+    /* LmReactorSource, added to the end */
+    GList    *sources;
+    gboolean  running;
+
+    /* Wakes up poll() when another thread defers */
+    int       wakeup[2];
+} LmPollReactor;
+
+typedef struct {
+    LmReactorClass parent_class;
+} LmPollReactorClass;
+
+typedef enum {
+    SOURCE_FD,
+    SOURCE_TIMEOUT,
+    SOURCE_DEFER
+} SourceType;
+
+struct LmReactorSource {
+    SourceType       type;
+    gboolean         removed;
+
+    int              fd;
+    GIOCondition     condition;
+    LmReactorFdFunc  fd_func;
+
+    guint            interval;
+    gint64           expires;
+    GSourceFunc      func;
+
+    gpointer         user_data;
+};
+
+G_DEFINE_TYPE (LmPollReactor, lm_poll_reactor, LM_TYPE_REACTOR)
+
+/* Deferring is the only call allowed from other threads */
+G_LOCK_DEFINE_STATIC (sources);
+
+static LmReactorSource *
+poll_reactor_add (LmReactor *reactor, SourceType type, gpointer user_data)
+{
+    LmPollReactor   *poll_reactor = (LmPollReactor *) reactor;
+    LmReactorSource *source;
+
+    source = g_new0 (LmReactorSource, 1);
+    source->type      = type;
+    source->user_data = user_data;
+
+    G_LOCK (sources);
+    poll_reactor->sources = g_list_append (poll_reactor->sources, source);
+    G_UNLOCK (sources);
+
+    return source;
+}
+
+static LmReactorSource *
+poll_reactor_add_fd (LmReactor       *reactor,
+                     int              fd,
+                     GIOCondition     condition,
+                     LmReactorFdFunc  func,
+                     gpointer         user_data)
+{
+    LmReactorSource *source;
+
+    source = poll_reactor_add (reactor, SOURCE_FD, user_data);
+    source->fd        = fd;
+    source->condition = condition;
+    source->fd_func   = func;
+
+    return source;
+}
+
+static void
+poll_reactor_modify_fd (LmReactor       *reactor,
+                        LmReactorSource *source,
+                        GIOCondition     condition)
+{
+    source->condition = condition;
+}
+
+static LmReactorSource *
+poll_reactor_add_timeout (LmReactor   *reactor,
+                          guint        interval,
+                          GSourceFunc  func,
+                          gpointer     user_data)
+{
+    LmReactorSource *source;
+
+    source = poll_reactor_add (reactor, SOURCE_TIMEOUT, user_data);
+    source->interval = interval;
+    source->expires  = g_get_monotonic_time () + interval * 1000;
+    source->func     = func;
+
+    return source;
+}
+
+static LmReactorSource *
+poll_reactor_add_defer (LmReactor   *reactor,
+                        GSourceFunc  func,
+                        gpointer     user_data)
+{
+    LmReactorSource *source;
+
+    source = poll_reactor_add (reactor, SOURCE_DEFER, user_data);
+    source->func = func;
+
+    write (((LmPollReactor *) reactor)->wakeup[1], "", 1);
+
+    return source;
+}
+
+static void
+poll_reactor_remove (LmReactor *reactor, LmReactorSource *source)
+{
+    /* Freed after the current dispatch */
+    source->removed = TRUE;
+}
+
+static void
+lm_poll_reactor_class_init (LmPollReactorClass *class)
+{
+    LmReactorClass *reactor_class = LM_REACTOR_CLASS (class);
+
+    reactor_class->add_fd      = poll_reactor_add_fd;
+    reactor_class->modify_fd   = poll_reactor_modify_fd;
+    reactor_class->add_timeout = poll_reactor_add_timeout;
+    reactor_class->add_defer   = poll_reactor_add_defer;
+    reactor_class->remove      = poll_reactor_remove;
+}
+
+static void
+lm_poll_reactor_init (LmPollReactor *reactor)
+{
+    if (pipe (reactor->wakeup) < 0) {
+        g_error ("Failed to create the wakeup pipe");
+    }
+
+    fcntl (reactor->wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl (reactor->wakeup[1], F_SETFL, O_NONBLOCK);
+}
+
+static short
+poll_reactor_events (GIOCondition condition)
+{
+    return ((condition & G_IO_IN) ? POLLIN : 0) |
+        ((condition & G_IO_OUT) ? POLLOUT : 0) |
+        ((condition & G_IO_PRI) ? POLLPRI : 0);
+}
+
+static GIOCondition
+poll_reactor_condition (short revents)
+{
+    return ((revents & POLLIN) ? G_IO_IN : 0) |
+        ((revents & POLLOUT) ? G_IO_OUT : 0) |
+        ((revents & POLLPRI) ? G_IO_PRI : 0) |
+        ((revents & POLLERR) ? G_IO_ERR : 0) |
+        ((revents & POLLHUP) ? G_IO_HUP : 0) |
+        ((revents & POLLNVAL) ? G_IO_NVAL : 0);
+}
+
+/* Runs one iteration, sources added while dispatching wait for the next */
+static void
+poll_reactor_iterate (LmPollReactor *reactor)
+{
+    GList           *sources;
+    GList           *l;
+    struct pollfd   *fds;
+    guint            n_fds = 1;
+    gint64           now;
+    gint64           timeout = -1;
+    char             buf[64];
+
+    G_LOCK (sources);
+    sources = g_list_copy (reactor->sources);
+    G_UNLOCK (sources);
+
+    fds = g_new0 (struct pollfd, g_list_length (sources) + 1);
+    fds[0].fd     = reactor->wakeup[0];
+    fds[0].events = POLLIN;
+
+    now = g_get_monotonic_time ();
+
+    for (l = sources; l; l = l->next) {
+        LmReactorSource *source = l->data;
+
+        if (source->type == SOURCE_FD) {
+            fds[n_fds].fd     = source->fd;
+            fds[n_fds].events = poll_reactor_events (source->condition);
+            n_fds++;
+        }
+        else if (source->type == SOURCE_DEFER) {
+            timeout = 0;
+        }
+        else if (timeout != 0) {
+            gint64 left = MAX (source->expires - now, 0) / 1000;
+
+            timeout = timeout < 0 ? left : MIN (timeout, left);
+        }
+    }
+
+    poll (fds, n_fds, (int) timeout);
+
+    while (read (reactor->wakeup[0], buf, sizeof (buf)) > 0) {
+        /* Drain */
+    }
+
+    now = g_get_monotonic_time ();
+    n_fds = 1;
+
+    for (l = sources; l; l = l->next) {
+        LmReactorSource *source = l->data;
+        gboolean         keep = TRUE;
+
+        if (source->type == SOURCE_FD) {
+            GIOCondition condition;
+
+            condition = poll_reactor_condition (fds[n_fds++].revents);
+
+            /* Errors and hangups are always reported */
+            condition &= source->condition | G_IO_ERR | G_IO_HUP | G_IO_NVAL;
+            if (condition && !source->removed) {
+                keep = source->fd_func (LM_REACTOR (reactor), source->fd,
+                                        condition, source->user_data);
+            }
+        }
+        else if (source->type == SOURCE_DEFER) {
+            if (!source->removed) {
+                keep = source->func (source->user_data);
+            }
+        }
+        else if (source->expires <= now && !source->removed) {
+            keep = source->func (source->user_data);
+            source->expires = now + source->interval * 1000;
+        }
+
+        if (!keep) {
+            source->removed = TRUE;
+        }
+    }
+
+    g_free (fds);
+
+    G_LOCK (sources);
+    for (l = sources; l; l = l->next) {
+        LmReactorSource *source = l->data;
+
+        if (source->removed) {
+            reactor->sources = g_list_remove (reactor->sources, source);
+            g_free (source);
+        }
+    }
+    G_UNLOCK (sources);
+
+    g_list_free (sources);
+}
+
+/* -- The test -- */
+
+static void
+channel_opened (LmChannel *channel)
+{
+    lm_channel_write (channel, MESSAGE, (gssize) strlen (MESSAGE), NULL, NULL);
+}
+
+static void
+channel_readable (LmChannel *channel)
+{
+    char  buf[1024];
+    gsize read_len = 0;
+
+    lm_channel_read (channel, buf, sizeof (buf) - 1, &read_len, NULL);
+    buf[read_len] = '\0';
+
+    g_print ("Read: %s\n", buf);
+
+    lm_channel_close (channel);
+}
+
+static void
+socket_connected (LmSocket              *socket,
+                  LmSocketConnectResult  res,
+                  LmPollReactor         *reactor)
+{
+    g_print ("Connect callback: %d\n", res);
+
+    if (res != LM_SOCKET_CONNECT_OK) {
+        reactor->running = FALSE;
+    }
+}
+
+static void
+channel_closed (LmChannel            *channel,
+                LmChannelCloseReason  reason,
+                LmPollReactor        *reactor)
+{
+    g_print ("Closed: %d\n", reason);
+
+    reactor->running = FALSE;
+}
+
+int
+main (int argc, char **argv)
+{
+    LmPollReactor   *reactor;
+    LmSocketAddress *sa;
+    LmChannel       *channel;
+
+    g_type_init ();
+
+    if (argc < 3) {
+        g_print ("Give a host and port\n");
+        return 1;
+    }
+
+    reactor = g_object_new (LM_TYPE_POLL_REACTOR, NULL);
+
+    sa = lm_socket_address_new (argv[1], atoi (argv[2]));
+    channel = lm_socket_new_with_reactor (LM_REACTOR (reactor), sa);
+
+    g_signal_connect (channel, "connect-result",
+                      G_CALLBACK (socket_connected), reactor);
+    g_signal_connect (channel, "opened",
+                      G_CALLBACK (channel_opened), NULL);
+    g_signal_connect (channel, "readable",
+                      G_CALLBACK (channel_readable), NULL);
+    g_signal_connect (channel, "closed",
+                      G_CALLBACK (channel_closed), reactor);
+
+    reactor->running = TRUE;
+    lm_socket_connect (LM_SOCKET (channel));
+
+    while (reactor->running) {
+        poll_reactor_iterate (reactor);
+    }
+
+    g_object_unref (channel);
+    lm_socket_address_unref (sa);
+    g_object_unref (reactor);
+
+    return 0;
+}